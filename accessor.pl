@@ -83,6 +83,11 @@ struct libspectrum_snap {
 
   libspectrum_byte *pages[ SNAPSHOT_RAM_PAGES ];
 
+  /* Caller-owned memory for the first ram_arena_pages RAM pages, which
+     the readers that support it use rather than allocating pages */
+  libspectrum_byte *ram_arena;
+  size_t ram_arena_pages;
+
   /* Data from .slt files */
 
   libspectrum_byte *slt[ SNAPSHOT_SLT_PAGES ];	/* Level data */
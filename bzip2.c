@@ -50,6 +50,7 @@ libspectrum_bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
     if( error != BZ_OK ) {
       libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			       "error decompressing bzip data" );
+      libspectrum_free( *outptr );
       return LIBSPECTRUM_ERROR_LOGIC;
     }
 
@@ -111,16 +112,30 @@ libspectrum_bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
 	  return LIBSPECTRUM_ERROR_LOGIC;
 	}
 	*outlength = stream.total_out_lo32;
-	*outptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
+	if( *outlength != length )
+	  *outptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
 	return LIBSPECTRUM_ERROR_NONE;
 
-      case BZ_OK:		/* More output space required */
+      case BZ_OK:		/* More output space may be required */
 
-	length += bzlength;
-	ptr = libspectrum_renew( libspectrum_byte, *outptr, length );
+	if( stream.avail_out ) {
+	  if( stream.avail_in ) break;
+
+	  /* Out of input without reaching the end of the stream */
+	  libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+				   "bzip2_inflate: truncated bzip2 data" );
+	  BZ2_bzDecompressEnd( &stream );
+	  libspectrum_free( *outptr );
+	  return LIBSPECTRUM_ERROR_CORRUPT;
+	}
+
+	/* bzip2 files don't record their inflated length, so double the
+	   space each time to keep the number of reallocations down */
+	ptr = libspectrum_renew( libspectrum_byte, *outptr, 2 * length );
 	*outptr = ptr;
-	stream.next_out = (char*)*outptr + stream.total_out_lo32;
-	stream.avail_out += bzlength;
+	stream.next_out = (char*)*outptr + length;
+	stream.avail_out = length;
+	length *= 2;
 	break;
 
       default:
@@ -33,10 +33,12 @@ static const char * const csw_signature = "Compressed Square Wave\x1a";
 
 libspectrum_error
 libspectrum_csw_read( libspectrum_tape *tape,
-		      const libspectrum_byte *buffer, size_t length )
+		      const libspectrum_byte *buffer, size_t length,
+		      int stream_data )
 {
   libspectrum_tape_block *block = NULL;
   libspectrum_tape_rle_pulse_block *csw_block;
+  libspectrum_error error;
 
   int compressed;
 
@@ -51,10 +53,7 @@ libspectrum_csw_read( libspectrum_tape *tape,
   }
 
   /* Claim memory for the block */
-  block = libspectrum_new( libspectrum_tape_block, 1 );
-
-  /* Set the block type */
-  block->type = LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE;
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE );
   csw_block = &block->types.rle_pulse;
 
   buffer += signature_length;
@@ -95,6 +94,7 @@ libspectrum_csw_read( libspectrum_tape *tape,
     return LIBSPECTRUM_ERROR_SIGNATURE;
   }
 
+  csw_block->sample_rate = csw_block->scale;
   if (csw_block->scale)
     csw_block->scale = 3500000 / csw_block->scale; /* approximate CPU speed */
 
@@ -106,28 +106,11 @@ libspectrum_csw_read( libspectrum_tape *tape,
 
   if( !length ) goto csw_empty;
 
-  if( compressed ) {
-    /* Compressed data... */
-#ifdef HAVE_ZLIB_H
-    libspectrum_error error;
-
-    csw_block->data = NULL;
-    csw_block->length = 0;
-    error = libspectrum_zlib_inflate( buffer, length, &csw_block->data,
-                                      &csw_block->length );
-    if( error != LIBSPECTRUM_ERROR_NONE ) return error;
-#else
-    libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
-                             "zlib not available to decompress gzipped file" );
-    return LIBSPECTRUM_ERROR_UNKNOWN;
-#endif
-  } else {
-    /* Claim memory for the data (it's one big lump) */
-    csw_block->length = length;
-    csw_block->data = libspectrum_new( libspectrum_byte, length );
-
-    /* Copy the data across */
-    memcpy( csw_block->data, buffer, length );
+  error = libspectrum_csw_read_data( block, buffer, length, compressed + 1,
+                                     stream_data );
+  if( error != LIBSPECTRUM_ERROR_NONE ) {
+    libspectrum_tape_block_free( block );
+    return error;
   }
 
   libspectrum_tape_append_block( tape, block );
@@ -155,6 +138,140 @@ libspectrum_csw_read( libspectrum_tape *tape,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Set the data of an RLE pulse block from CSW data with compression type
+   `compression' (1 for RLE, 2 for Z-RLE) */
+libspectrum_error
+libspectrum_csw_read_data( libspectrum_tape_block *block,
+                           const libspectrum_byte *buffer, size_t length,
+                           int compression, int stream_data )
+{
+  libspectrum_tape_rle_pulse_block *csw_block = &block->types.rle_pulse;
+#ifdef HAVE_ZLIB_H
+  libspectrum_error error;
+#endif
+
+  csw_block->data = NULL;
+  csw_block->length = 0;
+
+  switch( compression ) {
+
+  case 1:
+    /* Claim memory for the data (it's one big lump) */
+    csw_block->length = length;
+    csw_block->data = libspectrum_new( libspectrum_byte, length );
+
+    /* Copy the data across */
+    memcpy( csw_block->data, buffer, length );
+
+    return LIBSPECTRUM_ERROR_NONE;
+
+  case 2:
+    /* Compressed data... */
+#ifdef HAVE_ZLIB_H
+    if( stream_data ) {
+      /* Inflate the data only as it is played */
+      return libspectrum_zlib_window_alloc( &csw_block->window, buffer,
+                                            length );
+    }
+
+    error = libspectrum_zlib_inflate( buffer, length, &csw_block->data,
+                                      &csw_block->length );
+    if( error ) {
+      /* The data has already gone */
+      csw_block->data = NULL;
+      csw_block->length = 0;
+    }
+    return error;
+#else
+    libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
+                             "zlib not available to decompress gzipped file" );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+#endif
+
+  default:
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "%s: unknown compression type %d", __func__,
+                             compression );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+}
+
+/* Count the pulses in some RLE data, carrying over from one piece to the
+   next the number of bytes left of a long pulse */
+static libspectrum_dword
+count_pulses( const libspectrum_byte *data, size_t length, size_t *skip )
+{
+  libspectrum_dword pulses = 0;
+  size_t i = *skip;
+
+  while( i < length ) {
+    pulses++;
+    i += data[i] ? 1 : 5;
+  }
+
+  *skip = i - length;
+  return pulses;
+}
+
+#ifdef HAVE_ZLIB_H
+static libspectrum_error
+write_to_buffer( const libspectrum_byte *data, size_t length, void *context )
+{
+  libspectrum_buffer_write( context, data, length );
+  return LIBSPECTRUM_ERROR_NONE;
+}
+#endif
+
+/* Write the data of an RLE pulse block as CSW data, returning its
+   compression type and the number of pulses in it */
+libspectrum_error
+libspectrum_csw_write_data( libspectrum_buffer *buffer, int *compression,
+                            libspectrum_dword *pulses,
+                            libspectrum_tape_block *block, int flags )
+{
+  libspectrum_tape_rle_pulse_block *rle = &block->types.rle_pulse;
+  const libspectrum_byte *data;
+  size_t offset = 0, available, skip = 0;
+  libspectrum_error error;
+#ifdef HAVE_ZLIB_H
+  libspectrum_zlib_deflater *deflater;
+
+  error = libspectrum_zlib_deflater_alloc( &deflater, flags, write_to_buffer,
+                                           buffer );
+  if( error ) return error;
+  *compression = 2;
+#else
+  *compression = 1;
+#endif
+
+  *pulses = 0;
+
+  while( 1 ) {
+    error = libspectrum_tape_rle_pulse_data( &data, &available, rle, offset,
+                                             1 );
+    if( error || !available ) break;
+
+    *pulses += count_pulses( data, available, &skip );
+
+#ifdef HAVE_ZLIB_H
+    error = libspectrum_zlib_deflater_write( deflater, data, available, 0 );
+    if( error ) break;
+#else
+    libspectrum_buffer_write( buffer, data, available );
+#endif
+
+    offset += available;
+  }
+
+#ifdef HAVE_ZLIB_H
+  if( !error )
+    error = libspectrum_zlib_deflater_write( deflater, NULL, 0, 1 );
+  libspectrum_zlib_deflater_free( deflater );
+#endif
+
+  return error;
+}
+
 static libspectrum_dword
 find_sample_rate( libspectrum_tape *tape )
 {
@@ -225,10 +342,99 @@ find_sample_rate( libspectrum_tape *tape )
   return sample_rate;
 }
 
+/* How much RLE data to collect before compressing it */
+#define CSW_CHUNK_SIZE 0x4000
+
+/* Where the total number of pulses goes in the header */
+#define CSW_PULSES_OFFSET 0x1d
+
+typedef struct csw_writer {
+
+  libspectrum_write_fn sink;	/* Where the file goes */
+  void *context;
+  size_t offset;		/* How much of the file has been written */
+
+  libspectrum_byte chunk[ CSW_CHUNK_SIZE ]; /* RLE data not yet written */
+  size_t chunk_length;
+  libspectrum_dword body_length; /* How much RLE data there's been */
+
+  int flags;			/* How to compress it */
+
+#ifdef HAVE_ZLIB_H
+  libspectrum_zlib_deflater *deflater; /* NULL until there's some data */
+#endif
+
+} csw_writer;
+
 static libspectrum_error
-csw_write_body( libspectrum_buffer *buffer, libspectrum_tape *tape,
-                libspectrum_dword sample_rate,
-                size_t* body_uncompressed_length )
+csw_output( const libspectrum_byte *data, size_t length, void *context )
+{
+  csw_writer *writer = context;
+  libspectrum_error error;
+
+  error = writer->sink( data, length, writer->offset, writer->context );
+  if( error ) return error;
+
+  writer->offset += length;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Write out the RLE data collected so far */
+static libspectrum_error
+csw_flush( csw_writer *writer, int finish )
+{
+  libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
+
+#ifdef HAVE_ZLIB_H
+  if( !writer->deflater ) {
+    if( !writer->chunk_length ) return LIBSPECTRUM_ERROR_NONE;
+    error = libspectrum_zlib_deflater_alloc( &writer->deflater,
+                                             writer->flags, csw_output,
+                                             writer );
+    if( error ) return error;
+  }
+
+  error = libspectrum_zlib_deflater_write( writer->deflater, writer->chunk,
+                                           writer->chunk_length, finish );
+#else
+  if( writer->chunk_length )
+    error = csw_output( writer->chunk, writer->chunk_length, writer );
+#endif
+
+  writer->chunk_length = 0;
+
+  return error;
+}
+
+static libspectrum_error
+csw_write_pulse( csw_writer *writer, libspectrum_dword pulse_length )
+{
+  libspectrum_byte *ptr;
+  libspectrum_error error;
+
+  if( writer->chunk_length + 5 > CSW_CHUNK_SIZE ) {
+    error = csw_flush( writer, 0 );
+    if( error ) return error;
+  }
+
+  ptr = writer->chunk + writer->chunk_length;
+
+  if( pulse_length <= 0xff ) {
+    *ptr++ = pulse_length;
+  } else {
+    *ptr++ = 0;
+    libspectrum_write_dword( &ptr, pulse_length );
+  }
+
+  writer->body_length += ptr - ( writer->chunk + writer->chunk_length );
+  writer->chunk_length = ptr - writer->chunk;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static libspectrum_error
+csw_write_body( csw_writer *writer, libspectrum_tape *tape,
+                libspectrum_dword sample_rate )
 {
   libspectrum_error error;
   int flags = 0;
@@ -256,91 +462,141 @@ csw_write_body( libspectrum_buffer *buffer, libspectrum_tape *tape,
       balance_tstates = balance_tstates % scale;
 
       if( pulse_length ) {
-        if( pulse_length <= 0xff ) {
-          libspectrum_buffer_write_byte( buffer, pulse_length );
-        } else {
-          libspectrum_buffer_write_byte( buffer, 0 );
-          libspectrum_buffer_write_dword( buffer, pulse_length );
-        }
+        error = csw_write_pulse( writer, pulse_length );
+        if( error ) return error;
       }
     }
   }
 
-  /* Write the length in */
-  *body_uncompressed_length = libspectrum_buffer_get_data_size( buffer );
-
-  /* compression type */
-#ifdef HAVE_ZLIB_H
-  if( *body_uncompressed_length ) {
-    libspectrum_byte *compressed_data = NULL;
-    size_t compressed_length;
-
-    error = libspectrum_zlib_compress( libspectrum_buffer_get_data( buffer ),
-                                       libspectrum_buffer_get_data_size( buffer ),
-                                       &compressed_data, &compressed_length );
-    if( error ) return error;
-
-    libspectrum_buffer_clear( buffer );
-    libspectrum_buffer_write( buffer, compressed_data, compressed_length );
-    libspectrum_free( compressed_data );
-  }
-#endif
-
-  return LIBSPECTRUM_ERROR_NONE;
+  return csw_flush( writer, 1 );
 }
 
-libspectrum_error
-libspectrum_csw_write( libspectrum_buffer *new_buffer, libspectrum_tape *tape )
+static void
+csw_write_header( libspectrum_buffer *buffer, libspectrum_dword sample_rate )
 {
-  libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
-  libspectrum_dword sample_rate;
   size_t i;
 
-  libspectrum_buffer* body_buffer = libspectrum_buffer_alloc();
-  size_t body_uncompressed_length = 0;
-
-  sample_rate = find_sample_rate( tape );
-
-  error =
-    csw_write_body( body_buffer, tape, sample_rate, &body_uncompressed_length );
-  if( error != LIBSPECTRUM_ERROR_NONE ) goto exit;
-
   /* First, write the .csw signature and the rest of the header */
-  libspectrum_buffer_write( new_buffer, csw_signature, strlen( csw_signature ) );
+  libspectrum_buffer_write( buffer, csw_signature, strlen( csw_signature ) );
 
-  libspectrum_buffer_write_byte( new_buffer, 2 ); /* Major version number */
-  libspectrum_buffer_write_byte( new_buffer, 0 ); /* Minor version number */
+  libspectrum_buffer_write_byte( buffer, 2 ); /* Major version number */
+  libspectrum_buffer_write_byte( buffer, 0 ); /* Minor version number */
 
   /* sample rate */
-  libspectrum_buffer_write_dword( new_buffer, sample_rate );
+  libspectrum_buffer_write_dword( buffer, sample_rate );
 
-  /* Store where the total number of pulses (after decompression) will
-     be written, and skip over those bytes */
-  libspectrum_buffer_write_dword( new_buffer, body_uncompressed_length );
+  /* The total number of pulses (after decompression) is filled in once
+     we know it */
+  libspectrum_buffer_write_dword( buffer, 0 );
 
   /* compression type */
 #ifdef HAVE_ZLIB_H
-  libspectrum_buffer_write_byte( new_buffer, 2 ); /* Z-RLE */
+  libspectrum_buffer_write_byte( buffer, 2 ); /* Z-RLE */
 #else
-  libspectrum_buffer_write_byte( new_buffer, 1 ); /* RLE */
+  libspectrum_buffer_write_byte( buffer, 1 ); /* RLE */
 #endif
 
   /* flags */
-  libspectrum_buffer_write_byte( new_buffer, 0 );		/* No flags */
+  libspectrum_buffer_write_byte( buffer, 0 );		/* No flags */
 
   /* header extension length in bytes */
-  libspectrum_buffer_write_byte( new_buffer, 0 );		/* No header extension */
+  libspectrum_buffer_write_byte( buffer, 0 );		/* No header extension */
 
   /* encoding application description */
   /* No creator for now */
   for( i = 0; i < 16; i++ ) {
-    libspectrum_buffer_write_byte( new_buffer, 0 );
+    libspectrum_buffer_write_byte( buffer, 0 );
   }
 
   /* header extension data is zero so on to the data */
-  libspectrum_buffer_write_buffer( new_buffer, body_buffer );
+}
+
+static libspectrum_error
+write_csw( libspectrum_write_fn sink, void *context, libspectrum_tape *tape,
+           int flags )
+{
+  libspectrum_error error;
+  libspectrum_dword sample_rate;
+  libspectrum_buffer *header;
+  libspectrum_byte pulses[4], *ptr = pulses;
+  csw_writer *writer;
+
+  sample_rate = find_sample_rate( tape );
+
+  writer = libspectrum_new( csw_writer, 1 );
+  writer->sink = sink;
+  writer->context = context;
+  writer->offset = 0;
+  writer->chunk_length = 0;
+  writer->body_length = 0;
+  writer->flags = flags;
+#ifdef HAVE_ZLIB_H
+  writer->deflater = NULL;
+#endif
+
+  header = libspectrum_buffer_alloc();
+  csw_write_header( header, sample_rate );
+  error = csw_output( libspectrum_buffer_get_data( header ),
+                      libspectrum_buffer_get_data_size( header ), writer );
+  libspectrum_buffer_free( header );
+  if( error ) goto exit;
+
+  error = csw_write_body( writer, tape, sample_rate );
+  if( error ) goto exit;
+
+  /* Go back and fill in the header */
+  libspectrum_write_dword( &ptr, writer->body_length );
+  error = sink( pulses, sizeof( pulses ), CSW_PULSES_OFFSET, context );
 
-exit:
-  libspectrum_buffer_free( body_buffer );
+ exit:
+#ifdef HAVE_ZLIB_H
+  if( writer->deflater ) libspectrum_zlib_deflater_free( writer->deflater );
+#endif
+  libspectrum_free( writer );
   return error;
 }
+
+/* A sink which puts the file into a libspectrum_buffer after whatever is
+   already there */
+typedef struct csw_buffer_sink {
+
+  libspectrum_buffer *buffer;
+  size_t start;
+
+} csw_buffer_sink;
+
+static libspectrum_error
+csw_write_to_buffer( const libspectrum_byte *data, size_t length,
+                     size_t offset, void *context )
+{
+  csw_buffer_sink *sink = context;
+  size_t end = libspectrum_buffer_get_data_size( sink->buffer );
+
+  if( sink->start + offset == end ) {
+    libspectrum_buffer_write( sink->buffer, data, length );
+  } else {
+    memcpy( libspectrum_buffer_get_data( sink->buffer ) + sink->start + offset,
+            data, length );
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_tape_write_csw( libspectrum_write_fn sink, void *context,
+                            libspectrum_tape *tape, int flags )
+{
+  return write_csw( sink, context, tape, flags );
+}
+
+libspectrum_error
+libspectrum_csw_write( libspectrum_buffer *new_buffer, libspectrum_tape *tape,
+                       int flags )
+{
+  csw_buffer_sink sink;
+
+  sink.buffer = new_buffer;
+  sink.start = libspectrum_buffer_get_data_size( new_buffer );
+
+  return write_csw( csw_write_to_buffer, &sink, tape, flags );
+}
@@ -110,6 +110,21 @@ libspectrum_error
 libspectrum_print_error( libspectrum_error error, const char *format, ... )
      GCC_PRINTF( 2, 3 );
 
+/* Run independent jobs with the user-provided executor, if any; the
+   executor is read once into a runner, which is then used for all of an
+   operation's jobs */
+typedef struct libspectrum_job_runner {
+  libspectrum_executor_fn executor;
+  void *context;
+} libspectrum_job_runner;
+
+void libspectrum_job_runner_get( libspectrum_job_runner *runner );
+void libspectrum_run_jobs( const libspectrum_job_runner *runner,
+                           libspectrum_job_fn job, void *context,
+                           size_t count );
+int libspectrum_jobs_in_parallel( const libspectrum_job_runner *runner,
+                                  size_t count );
+
 /* Acquire more memory for a buffer */
 void libspectrum_make_room( libspectrum_byte **dest, size_t requested,
 			    libspectrum_byte **ptr, size_t *allocated );
@@ -128,6 +143,10 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
 			     const unsigned char *old_buffer,
 			     size_t old_length, const char *old_filename );
 
+/* No deflate stream expands by more than this factor, so a longer claimed
+   inflated length can't be true */
+#define LIBSPECTRUM_DEFLATE_MAX_RATIO 1032
+
 libspectrum_error
 libspectrum_gzip_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 			  libspectrum_byte **outptr, size_t *outlength );
@@ -144,17 +163,91 @@ libspectrum_error
 libspectrum_zip_blind_read( const libspectrum_byte *zipptr, size_t ziplength,
                             libspectrum_byte **outptr, size_t *outlength );
 
+/* zlib compressed data which is inflated only as it is needed */
+typedef struct libspectrum_zlib_window libspectrum_zlib_window;
+
+libspectrum_error
+libspectrum_zlib_window_alloc( libspectrum_zlib_window **window,
+                               const libspectrum_byte *data, size_t length );
+
+void
+libspectrum_zlib_window_free( libspectrum_zlib_window *window );
+
+libspectrum_error
+libspectrum_zlib_window_get( const libspectrum_byte **data, size_t *available,
+                             libspectrum_zlib_window *window, size_t offset,
+                             size_t wanted );
+
+/* While peeking, data past what's already inflated is read ahead
+   separately, so the data being played isn't thrown away */
+void
+libspectrum_zlib_window_set_peeking( libspectrum_zlib_window *window,
+                                     int peeking );
+
+/* zlib state which can be reused for many blocks of data, rather than
+   being set up afresh for each; `flags' gives the compression profile,
+   and `raw' selects deflate data with no zlib header or checksum */
+typedef struct libspectrum_zlib_codec libspectrum_zlib_codec;
+
+libspectrum_zlib_codec*
+libspectrum_zlib_codec_alloc( int flags, int raw );
+
+void
+libspectrum_zlib_codec_free( libspectrum_zlib_codec *codec );
+
+libspectrum_error
+libspectrum_zlib_codec_inflate( libspectrum_zlib_codec *codec,
+                                const libspectrum_byte *gzptr,
+                                size_t gzlength, libspectrum_byte **outptr,
+                                size_t *outlength );
+
+libspectrum_error
+libspectrum_zlib_codec_inflate_into( libspectrum_zlib_codec *codec,
+                                     const libspectrum_byte *gzptr,
+                                     size_t gzlength,
+                                     libspectrum_byte *outptr,
+                                     size_t *outlength );
+
+libspectrum_error
+libspectrum_zlib_codec_deflate( libspectrum_zlib_codec *codec,
+                                const libspectrum_byte *data, size_t length,
+                                libspectrum_byte **gzptr, size_t *gzlength );
+
+/* zlib compression of data which arrives a little at a time */
+typedef struct libspectrum_zlib_deflater libspectrum_zlib_deflater;
+
+typedef libspectrum_error
+(*libspectrum_zlib_output)( const libspectrum_byte *data, size_t length,
+                            void *context );
+
+libspectrum_error
+libspectrum_zlib_deflater_alloc( libspectrum_zlib_deflater **deflater,
+                                 int flags, libspectrum_zlib_output output,
+                                 void *context );
+
+void
+libspectrum_zlib_deflater_free( libspectrum_zlib_deflater *deflater );
+
+libspectrum_error
+libspectrum_zlib_deflater_write( libspectrum_zlib_deflater *deflater,
+                                 const libspectrum_byte *data, size_t length,
+                                 int finish );
+
 /* The TZX file signature */
 
 extern const char * const libspectrum_tzx_signature;
 
+/* The ID of the TZX CSW recording block, which becomes an RLE pulse
+   block */
+#define LIBSPECTRUM_TZX_CSW_RECORDING 0x18
+
 /* Convert a 48K memory dump into separate RAM pages */
 
 libspectrum_error libspectrum_split_to_48k_pages( libspectrum_snap *snap,
 				    const libspectrum_byte* data );
 
 /* Sizes of some of the arrays in the snap structure */
-#define SNAPSHOT_RAM_PAGES 16
+#define SNAPSHOT_RAM_PAGES 64
 #define SNAPSHOT_SLT_PAGES 256
 #define SNAPSHOT_ZXATASP_PAGES 32
 #define SNAPSHOT_ZXCF_PAGES 64
@@ -167,6 +260,13 @@ libspectrum_error libspectrum_split_to_48k_pages( libspectrum_snap *snap,
 
 libspectrum_snap* libspectrum_snap_alloc_internal( void );
 
+/* RAM pages in memory provided by the caller */
+libspectrum_byte*
+libspectrum_snap_ram_arena_page( libspectrum_snap *snap, size_t page );
+int
+libspectrum_snap_ram_arena_owns( libspectrum_snap *snap,
+                                 const libspectrum_byte *ptr );
+
 libspectrum_error
 libspectrum_snap_write_buffer( libspectrum_buffer *buffer, int *out_flags,
                                libspectrum_snap *snap, libspectrum_id_t type,
@@ -225,11 +325,9 @@ libspectrum_error libspectrum_tape_block_read_symbol_table_parameters(
 
 libspectrum_error
 libspectrum_tape_block_read_symbol_table(
-  libspectrum_tape_generalised_data_symbol_table *table,
+  libspectrum_tape *tape, libspectrum_tape_generalised_data_symbol_table *table,
   const libspectrum_byte **ptr, size_t length );
 
-void libspectrum_init_bits_set( void );
-
 /* Format specific tape routines */
   
 libspectrum_error
@@ -242,10 +340,11 @@ internal_tap_write( libspectrum_buffer *buffer, libspectrum_tape *tape,
 
 libspectrum_error
 internal_tzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
-		   const size_t length );
+		   const size_t length, int borrow_data, int stream_data );
 
 libspectrum_error
-internal_tzx_write( libspectrum_buffer *buffer, libspectrum_tape *tape );
+internal_tzx_write( libspectrum_buffer *buffer, libspectrum_tape *tape,
+                    int flags );
 
 libspectrum_error
 internal_warajevo_read( libspectrum_tape *tape,
@@ -257,27 +356,93 @@ libspectrum_z80em_read( libspectrum_tape *tape,
 
 libspectrum_error
 libspectrum_csw_read( libspectrum_tape *tape,
-                      const libspectrum_byte *buffer, size_t length );
+                      const libspectrum_byte *buffer, size_t length,
+                      int stream_data );
 
 libspectrum_error
-libspectrum_csw_write( libspectrum_buffer *buffer, libspectrum_tape *tape );
+libspectrum_csw_write( libspectrum_buffer *buffer, libspectrum_tape *tape,
+                       int flags );
 
 libspectrum_error
-libspectrum_wav_read( libspectrum_tape *tape, const char *filename );
+libspectrum_csw_read_data( libspectrum_tape_block *block,
+                           const libspectrum_byte *buffer, size_t length,
+                           int compression, int stream_data );
+
+libspectrum_error
+libspectrum_csw_write_data( libspectrum_buffer *buffer, int *compression,
+                            libspectrum_dword *pulses,
+                            libspectrum_tape_block *block, int flags );
+
+libspectrum_error
+libspectrum_wav_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
+                      size_t length, const char *filename );
 
 libspectrum_error
 internal_pzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
-                   const size_t length );
+                   const size_t length, int borrow_data );
+
+/* Mark the data of `block' as borrowed from the buffer it was read from,
+   so it isn't freed along with the block */
+void
+libspectrum_tape_block_set_borrowed( libspectrum_tape_block *block,
+                                     int borrowed );
+
+/* Allocate memory for blocks which will be added to `tape'. If the tape
+   is being read with LIBSPECTRUM_FLAG_TAPE_ARENA, the memory comes from
+   the tape's arena and is only released when the tape is cleared;
+   otherwise (or if `tape' is NULL) it comes from the heap as usual */
+void*
+libspectrum_tape_arena_malloc_n( libspectrum_tape *tape, size_t nmemb,
+                                 size_t size );
+
+#define libspectrum_tape_arena_new( tape, type, count ) \
+  ( ( type * ) libspectrum_tape_arena_malloc_n( (tape), (count), \
+                                                sizeof( type ) ) )
+
+/* Free memory from libspectrum_tape_arena_malloc_n(); a no-op for memory
+   in the arena */
+void
+libspectrum_tape_arena_free( libspectrum_tape *tape, void *ptr );
+
+/* Does `ptr' point into the arena of `tape'? */
+int
+libspectrum_tape_arena_owns( libspectrum_tape *tape, const void *ptr );
+
+/* Is `tape' being read into its arena? */
+int
+libspectrum_tape_using_arena( libspectrum_tape *tape );
+
+/* Allocate a block which will be added to `tape' */
+libspectrum_tape_block*
+libspectrum_tape_arena_block_alloc( libspectrum_tape *tape,
+                                    libspectrum_tape_type type );
+
+/* Note whether a complete block from an arena has any members from the
+   heap, which must then be freed with it */
+void
+libspectrum_tape_block_check_arena( libspectrum_tape_block *block );
 
 libspectrum_tape_block*
 libspectrum_tape_block_internal_init(
                                 libspectrum_tape_block_state *iterator,
                                 libspectrum_tape *tape );
 
+size_t
+libspectrum_tape_iterator_position( libspectrum_tape *tape,
+                                    libspectrum_tape_iterator iterator );
+
 libspectrum_error
 libspectrum_tape_get_next_edge_internal( libspectrum_dword *tstates, int *flags,
                                          libspectrum_tape *tape,
                                          libspectrum_tape_block_state *it );
+
+libspectrum_error
+libspectrum_tape_get_next_edges_internal( libspectrum_dword *tstates,
+                                          int *flags, size_t max,
+                                          size_t *count,
+                                          libspectrum_tape *tape,
+                                          libspectrum_tape_block_state *it );
+
 /* Disk routines */
 
 typedef struct libspectrum_hdf_header {
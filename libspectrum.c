@@ -112,8 +112,6 @@ libspectrum_init( void )
 
 #endif				/* #ifdef HAVE_GCRYPT_H */
 
-  libspectrum_init_bits_set();
-
   return LIBSPECTRUM_ERROR_NONE;
 }
 
@@ -202,6 +200,57 @@ libspectrum_default_error_function( libspectrum_error error,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* The compression profiles which can be given to the zlib-based writers */
+const int LIBSPECTRUM_FLAG_COMPRESS_FASTEST = 1 << 8;
+const int LIBSPECTRUM_FLAG_COMPRESS_DEFAULT = 1 << 9;
+const int LIBSPECTRUM_FLAG_COMPRESS_RLE     = 1 << 10;
+
+/* The executor used to run independent jobs, and its context */
+static libspectrum_executor_fn executor = NULL;
+static void *executor_context = NULL;
+
+void
+libspectrum_set_executor( libspectrum_executor_fn new_executor,
+                          void *context )
+{
+  executor = new_executor;
+  executor_context = context;
+}
+
+/* Get the executor to use for one operation; reading it just once means
+   all of the operation's jobs see the same one */
+void
+libspectrum_job_runner_get( libspectrum_job_runner *runner )
+{
+  runner->executor = executor;
+  runner->context = executor_context;
+}
+
+/* Run `count' independent jobs, in parallel if the caller has given us
+   an executor which can do that */
+void
+libspectrum_run_jobs( const libspectrum_job_runner *runner,
+                      libspectrum_job_fn job, void *context, size_t count )
+{
+  size_t i;
+
+  if( libspectrum_jobs_in_parallel( runner, count ) ) {
+    runner->executor( job, context, count, runner->context );
+    return;
+  }
+
+  for( i = 0; i < count; i++ ) job( context, i );
+}
+
+/* Would libspectrum_run_jobs() run `count' jobs in parallel? If not,
+   they can share state which isn't thread-safe */
+int
+libspectrum_jobs_in_parallel( const libspectrum_job_runner *runner,
+                              size_t count )
+{
+  return runner->executor && count > 1;
+}
+
 /* Get the name of a specific joystick type */
 const char *
 libspectrum_joystick_name( libspectrum_joystick type )
@@ -547,7 +596,7 @@ libspectrum_identify_file_raw( libspectrum_id_t *type, const char *filename,
       { LIBSPECTRUM_ID_TAPE_Z80EM,    "raw", 1, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0Raw tape sample",  0, 64, 0 },
       { LIBSPECTRUM_ID_TAPE_CSW,      "csw", 2, "Compressed Square Wave\x1a",  0, 23, 4 },
 
-      { LIBSPECTRUM_ID_TAPE_WAV,      "wav", 3, NULL,		    0, 0, 0 },
+      { LIBSPECTRUM_ID_TAPE_WAV,      "wav", 3, "WAVE",		    8, 4, 4 },
 
       { LIBSPECTRUM_ID_DISK_MGT,      "mgt", 3, NULL,		    0, 0, 0 },
       { LIBSPECTRUM_ID_DISK_IMG,      "img", 3, NULL,		    0, 0, 0 },
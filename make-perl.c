@@ -328,8 +328,15 @@ int main(void)
   printf( "libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,\n" );
   printf( "			  libspectrum_byte **outptr, size_t *outlength );\n\n" );
   printf( "WIN32_DLL libspectrum_error\n" );
+  printf( "libspectrum_zlib_inflate_into( const libspectrum_byte *gzptr, size_t gzlength,\n" );
+  printf( "			       libspectrum_byte *outptr, size_t *outlength );\n\n" );
+  printf( "WIN32_DLL libspectrum_error\n" );
   printf( "libspectrum_zlib_compress( const libspectrum_byte *data, size_t length,\n" );
   printf( "			   libspectrum_byte **gzptr, size_t *gzlength );\n\n" );
+  printf( "WIN32_DLL libspectrum_error\n" );
+  printf( "libspectrum_zlib_compress2( const libspectrum_byte *data, size_t length,\n" );
+  printf( "			    libspectrum_byte **gzptr, size_t *gzlength,\n" );
+  printf( "			    int flags );\n\n" );
 
 #endif				/* #ifdef HAVE_ZLIB_H */
 
@@ -338,8 +345,11 @@ int main(void)
   printf( "#define	LIBSPECTRUM_SUPPORTS_BZ2_COMPRESSION	(1)\n\n" );
 #endif				/* #ifdef HAVE_LIBBZ2 */
 
+  printf( "\n/* we support PCM wav files */\n" );
+  printf( "#define	LIBSPECTRUM_SUPPORTS_WAV	(1)\n\n" );
+
 #ifdef HAVE_LIB_AUDIOFILE
-  printf( "\n/* we support wav files */\n" );
+  printf( "\n/* we support other wav files */\n" );
   printf( "#define	LIBSPECTRUM_SUPPORTS_AUDIOFILE	(1)\n\n" );
 #endif				/* #ifdef HAVE_LIB_AUDIOFILE */
 
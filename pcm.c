@@ -0,0 +1,257 @@
+/* pcm.c: Routines for rendering tapes to PCM audio
+   Copyright (c) 2026 The libspectrum developers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <config.h>
+#include <string.h>
+
+#include "internals.h"
+#include "tape_block.h"
+
+/* The clock which tape edge lengths are measured against */
+#define TAPE_CLOCK 3500000
+
+/* How many samples to render at once when writing a WAV file */
+#define WAV_CHUNK_SAMPLES 4096
+
+struct libspectrum_tape_pcm {
+
+  libspectrum_tape *tape;
+  libspectrum_tape_block_state it; /* Our own position on the tape */
+
+  libspectrum_dword sample_rate;
+  int bits;			/* 8 or 16 */
+
+  int level;			/* The current output level */
+
+  /* Time until the pending edge, in units of 1 / ( TAPE_CLOCK *
+     sample_rate ) seconds; may be negative as the edge can fall between
+     samples */
+  libspectrum_signed_qword edge_time;
+
+  int pending;			/* Is there an edge waiting to happen? */
+  int pending_flags;		/* The flags for that edge */
+
+  int ended;			/* Have we reached the end of the tape? */
+
+};
+
+libspectrum_tape_pcm*
+libspectrum_tape_pcm_alloc( libspectrum_tape *tape,
+                            libspectrum_dword sample_rate, int bits )
+{
+  libspectrum_tape_pcm *pcm;
+
+  if( !sample_rate || ( bits != 8 && bits != 16 ) ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                             "%s: unsupported format %lu Hz, %d bits",
+                             __func__, (unsigned long)sample_rate, bits );
+    return NULL;
+  }
+
+  pcm = libspectrum_new( libspectrum_tape_pcm, 1 );
+
+  pcm->tape = tape;
+  pcm->sample_rate = sample_rate;
+  pcm->bits = bits;
+  pcm->level = 0;
+  pcm->edge_time = 0;
+  pcm->pending = 0;
+  pcm->pending_flags = 0;
+  pcm->ended = !libspectrum_tape_block_internal_init( &(pcm->it), tape );
+
+  return pcm;
+}
+
+void
+libspectrum_tape_pcm_free( libspectrum_tape_pcm *pcm )
+{
+  libspectrum_free( pcm );
+}
+
+/* Write `count' samples at the current level */
+static libspectrum_byte*
+fill_samples( libspectrum_byte *buffer, size_t count,
+              libspectrum_tape_pcm *pcm )
+{
+  size_t i;
+
+  if( pcm->bits == 8 ) {
+    memset( buffer, pcm->level ? 0xff : 0x00, count );
+    return buffer + count;
+  }
+
+  /* 16-bit samples are signed and little-endian */
+  if( pcm->level ) {
+    for( i = 0; i < count; i++ ) {
+      buffer[ 2 * i ] = 0xff; buffer[ 2 * i + 1 ] = 0x7f;
+    }
+  } else {
+    for( i = 0; i < count; i++ ) {
+      buffer[ 2 * i ] = 0x00; buffer[ 2 * i + 1 ] = 0x80;
+    }
+  }
+
+  return buffer + 2 * count;
+}
+
+/* Make the pending edge happen and get the next one from the tape */
+static libspectrum_error
+next_edge( libspectrum_tape_pcm *pcm )
+{
+  libspectrum_dword tstates;
+  int flags;
+  libspectrum_error error;
+
+  if( pcm->pending ) {
+
+    flags = pcm->pending_flags;
+
+    if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW ) {
+      pcm->level = 0;
+    } else if( flags & LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH ) {
+      pcm->level = 1;
+    } else if( !( flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE ) ) {
+      pcm->level = !pcm->level;
+    }
+
+    pcm->pending = 0;
+
+    if( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) {
+      pcm->ended = 1;
+      return LIBSPECTRUM_ERROR_NONE;
+    }
+  }
+
+  error = libspectrum_tape_get_next_edge_internal( &tstates, &flags,
+                                                   pcm->tape, &(pcm->it) );
+  if( error ) return error;
+
+  pcm->edge_time += (libspectrum_signed_qword)tstates * pcm->sample_rate;
+  pcm->pending = 1;
+  pcm->pending_flags = flags;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Render up to `samples' samples of the tape into `buffer'; fewer are
+   rendered only at the end of the tape */
+libspectrum_error
+libspectrum_tape_render_pcm( libspectrum_byte *buffer, size_t samples,
+                             size_t *rendered, libspectrum_tape_pcm *pcm )
+{
+  size_t done = 0;
+  libspectrum_error error;
+
+  while( done < samples && !pcm->ended ) {
+
+    if( pcm->edge_time > 0 ) {
+
+      /* Every sample taken before the edge is at the current level */
+      libspectrum_signed_qword count =
+        ( pcm->edge_time + TAPE_CLOCK - 1 ) / TAPE_CLOCK;
+      if( count > (libspectrum_signed_qword)( samples - done ) )
+        count = samples - done;
+
+      buffer = fill_samples( buffer, count, pcm );
+      done += count;
+      pcm->edge_time -= count * TAPE_CLOCK;
+
+    } else {
+
+      error = next_edge( pcm );
+      if( error ) { *rendered = done; return error; }
+
+    }
+  }
+
+  *rendered = done;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_tape_write_wav( libspectrum_byte **buffer, size_t *length,
+                            libspectrum_tape *tape,
+                            libspectrum_dword sample_rate, int bits )
+{
+  libspectrum_tape_pcm *pcm;
+  libspectrum_buffer *new_buffer, *data;
+  libspectrum_byte *ptr = *buffer, *samples;
+  size_t wanted, rendered, data_length;
+  libspectrum_qword tstates, remaining;
+  libspectrum_error error;
+
+  pcm = libspectrum_tape_pcm_alloc( tape, sample_rate, bits );
+  if( !pcm ) return LIBSPECTRUM_ERROR_INVALID;
+
+  /* A tape with a backwards jump never ends, so stop where the seek
+     index does */
+  error = libspectrum_tape_total_tstates( &tstates, tape );
+  if( error ) { libspectrum_tape_pcm_free( pcm ); return error; }
+  remaining = ( tstates * sample_rate + TAPE_CLOCK - 1 ) / TAPE_CLOCK;
+
+  /* Allow for uninitialised buffer on entry */
+  if( !*length ) *buffer = NULL;
+
+  samples = libspectrum_new( libspectrum_byte, WAV_CHUNK_SAMPLES * bits / 8 );
+  data = libspectrum_buffer_alloc();
+
+  do {
+    wanted = remaining < WAV_CHUNK_SAMPLES ? remaining : WAV_CHUNK_SAMPLES;
+    error = libspectrum_tape_render_pcm( samples, wanted, &rendered, pcm );
+    if( error ) goto exit;
+    libspectrum_buffer_write( data, samples, rendered * bits / 8 );
+    remaining -= rendered;
+  } while( rendered == wanted && remaining );
+
+  data_length = libspectrum_buffer_get_data_size( data );
+
+  new_buffer = libspectrum_buffer_alloc();
+
+  /* RIFF header */
+  libspectrum_buffer_write( new_buffer, "RIFF", 4 );
+  libspectrum_buffer_write_dword( new_buffer,
+                                  36 + data_length + data_length % 2 );
+  libspectrum_buffer_write( new_buffer, "WAVE", 4 );
+
+  /* Format chunk: mono PCM */
+  libspectrum_buffer_write( new_buffer, "fmt ", 4 );
+  libspectrum_buffer_write_dword( new_buffer, 16 );
+  libspectrum_buffer_write_word( new_buffer, 1 );
+  libspectrum_buffer_write_word( new_buffer, 1 );
+  libspectrum_buffer_write_dword( new_buffer, sample_rate );
+  libspectrum_buffer_write_dword( new_buffer, sample_rate * bits / 8 );
+  libspectrum_buffer_write_word( new_buffer, bits / 8 );
+  libspectrum_buffer_write_word( new_buffer, bits );
+
+  /* Data chunk */
+  libspectrum_buffer_write( new_buffer, "data", 4 );
+  libspectrum_buffer_write_dword( new_buffer, data_length );
+  libspectrum_buffer_write_buffer( new_buffer, data );
+  if( data_length % 2 ) libspectrum_buffer_write_byte( new_buffer, 0 );
+
+  libspectrum_buffer_append( buffer, length, &ptr, new_buffer );
+  libspectrum_buffer_free( new_buffer );
+
+ exit:
+  libspectrum_buffer_free( data );
+  libspectrum_free( samples );
+  libspectrum_tape_pcm_free( pcm );
+
+  return error;
+}
@@ -36,6 +36,9 @@ typedef struct pzx_context {
 
   libspectrum_word version;
 
+  int borrow_data;		/* Point blocks at the data in the file
+				   rather than copying it */
+
 } pzx_context;
 
 /* Constants etc for each block type */
@@ -91,8 +94,9 @@ typedef libspectrum_error (*read_block_fn)( libspectrum_tape *tape,
                                             pzx_context *ctx );
 
 static libspectrum_error
-pzx_read_data( const libspectrum_byte **ptr, const libspectrum_byte *end,
-	       size_t length, libspectrum_byte **data );
+pzx_read_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
+	       const libspectrum_byte *end, size_t length,
+	       libspectrum_byte **data, int borrow_data );
 
 static libspectrum_error
 pzx_read_string( const libspectrum_byte **ptr, const libspectrum_byte *end,
@@ -205,8 +209,9 @@ read_pzxt_block( libspectrum_tape *tape, const libspectrum_byte **buffer,
   }
 
   if( count ) {
-    libspectrum_tape_block* block =
-      libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ARCHIVE_INFO );
+    libspectrum_tape_block* block = libspectrum_tape_arena_block_alloc(
+      tape, LIBSPECTRUM_TAPE_BLOCK_ARCHIVE_INFO
+    );
 
     libspectrum_tape_block_set_count( block, count );
     libspectrum_tape_block_set_ids( block, ids );
@@ -270,25 +275,28 @@ read_data_block( libspectrum_tape *tape, const libspectrum_byte **buffer,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  error = pzx_read_data( buffer, block_end,
+  error = pzx_read_data( tape, buffer, block_end,
                          p0_count * sizeof( libspectrum_word ),
-                         (libspectrum_byte**)&p0_pulses );
+                         (libspectrum_byte**)&p0_pulses, 0 );
   if( error ) return error;
 
-  error = pzx_read_data( buffer, block_end,
+  error = pzx_read_data( tape, buffer, block_end,
                          p1_count * sizeof( libspectrum_word ),
-                         (libspectrum_byte**)&p1_pulses );
-  if( error ) { libspectrum_free( p0_pulses ); return error; }
+                         (libspectrum_byte**)&p1_pulses, 0 );
+  if( error ) { libspectrum_tape_arena_free( tape, p0_pulses ); return error; }
 
   /* And the actual data */
-  error = pzx_read_data( buffer, block_end, count_bytes, &data );
+  error = pzx_read_data( tape, buffer, block_end, count_bytes, &data,
+                         ctx->borrow_data );
   if( error ) {
-    libspectrum_free( p0_pulses );
-    libspectrum_free( p1_pulses );
+    libspectrum_tape_arena_free( tape, p0_pulses );
+    libspectrum_tape_arena_free( tape, p1_pulses );
     return error;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK
+  );
 
   libspectrum_tape_block_set_count( block, count );
   libspectrum_tape_block_set_tail_length( block, tail );
@@ -300,6 +308,7 @@ read_data_block( libspectrum_tape *tape, const libspectrum_byte **buffer,
   libspectrum_tape_block_set_data_length( block, count_bytes );
   libspectrum_tape_block_set_bits_in_last_byte( block, bits_in_last_byte );
   libspectrum_tape_block_set_data( block, data );
+  libspectrum_tape_block_set_borrowed( block, ctx->borrow_data );
 
   libspectrum_tape_append_block( tape, block );
 
@@ -385,7 +394,9 @@ read_puls_block( libspectrum_tape *tape, const libspectrum_byte **buffer,
       libspectrum_renew( libspectrum_dword, lengths_buffer, count );
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE
+  );
 
   libspectrum_tape_block_set_count( block, count );
   libspectrum_tape_block_set_pulse_lengths( block, lengths_buffer );
@@ -413,7 +424,8 @@ read_paus_block( libspectrum_tape *tape, const libspectrum_byte **buffer,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PAUSE );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_PAUSE );
 
   pause_tstates = libspectrum_read_dword( buffer );
   initial_level = !!(pause_tstates & 0x80000000);
@@ -438,11 +450,12 @@ read_brws_block( libspectrum_tape *tape, const libspectrum_byte **buffer,
   char *text;
   libspectrum_error error;
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_COMMENT );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_COMMENT );
 
   /* Get the actual comment */
   error = pzx_read_string( buffer, *buffer + data_length, &text );
-  if( error ) { libspectrum_free( block ); return error; }
+  if( error ) { libspectrum_tape_arena_free( tape, block ); return error; }
   libspectrum_tape_block_set_text( block, text );
 
   libspectrum_tape_append_block( tape, block );
@@ -467,10 +480,13 @@ read_stop_block( libspectrum_tape *tape, const libspectrum_byte **buffer,
   flags = libspectrum_read_word( buffer );
 
   if( flags == PZXF_STOP48 ) {
-    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_STOP48 );
+    block = libspectrum_tape_arena_block_alloc(
+      tape, LIBSPECTRUM_TAPE_BLOCK_STOP48
+    );
   } else {
     /* General stop is a 0 duration pause */
-    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PAUSE );
+    block =
+      libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_PAUSE );
     libspectrum_tape_block_set_pause( block, 0 );
   }
 
@@ -573,7 +589,7 @@ read_block( libspectrum_tape *tape, const libspectrum_byte **buffer,
 
 libspectrum_error
 internal_pzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
-                   size_t length )
+                   size_t length, int borrow_data )
 {
   libspectrum_error error;
   const libspectrum_byte *end = buffer + length;
@@ -597,6 +613,7 @@ internal_pzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
 
   ctx = libspectrum_new( pzx_context, 1 );
   ctx->version = 0;
+  ctx->borrow_data = borrow_data;
 
   while( buffer < end ) {
     error = read_block( tape, &buffer, end, ctx );
@@ -611,8 +628,9 @@ internal_pzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
 }
 
 static libspectrum_error
-pzx_read_data( const libspectrum_byte **ptr, const libspectrum_byte *end,
-	       size_t length, libspectrum_byte **data )
+pzx_read_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
+	       const libspectrum_byte *end, size_t length,
+	       libspectrum_byte **data, int borrow_data )
 {
   /* Have we got enough bytes left in buffer? */
   if( ( end - (*ptr) ) < (ptrdiff_t)(length) ) {
@@ -623,8 +641,11 @@ pzx_read_data( const libspectrum_byte **ptr, const libspectrum_byte *end,
 
   /* Allocate memory for the data; the check for *length is to avoid
      the implementation-defined behaviour of malloc( 0 ) */
-  if( length ) {
-    *data = libspectrum_new( libspectrum_byte, length );
+  if( length && borrow_data ) {
+    /* Just point at the data where it is */
+    *data = (libspectrum_byte*)*ptr; *ptr += length;
+  } else if( length ) {
+    *data = libspectrum_tape_arena_new( tape, libspectrum_byte, length );
     /* Copy the block data across, and move along */
     memcpy( *data, *ptr, length ); *ptr += length;
   } else {
@@ -0,0 +1,556 @@
+/* reconstruct.c: Routines for recovering data blocks from sampled tapes
+   Copyright (c) 2026 The libspectrum developers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <config.h>
+#include <string.h>
+
+#include "internals.h"
+#include "tape_block.h"
+
+/* The shortest run of similar pulses which we'll take as a pilot tone */
+#define MIN_PILOT_PULSES 256
+
+/* The fewest bits of data we'll make a block from */
+#define MIN_DATA_BITS 8
+
+/* How far apart two pulses can be and still be considered the same
+   length, as a percentage of the longer one; one sample's worth of
+   quantisation error is allowed on top of this */
+#define TOLERANCE_PERCENT 15
+
+/* The lengths of the pulses in a sampled block */
+typedef struct pulse_list {
+  libspectrum_dword *pulses;
+  size_t count, allocated;
+} pulse_list;
+
+/* A pilot tone, sync pulses and data found amongst the pulses */
+typedef struct found_block {
+
+  size_t start, end;		/* The pulses it covers */
+
+  libspectrum_dword pilot_length; size_t pilot_pulses;
+  libspectrum_dword sync1_length, sync2_length;
+  libspectrum_dword bit0_length, bit1_length;
+  libspectrum_dword pause_tstates;
+
+  libspectrum_byte *data; size_t bits;
+
+} found_block;
+
+static int
+similar( libspectrum_dword a, libspectrum_dword b, libspectrum_dword sample )
+{
+  libspectrum_dword difference = a > b ? a - b : b - a;
+  libspectrum_qword longer = a > b ? a : b;
+
+  return difference <= sample + longer * TOLERANCE_PERCENT / 100;
+}
+
+static void
+add_pulse( pulse_list *list, libspectrum_dword length )
+{
+  if( list->count == list->allocated ) {
+    list->allocated = list->allocated ? 2 * list->allocated : 1024;
+    list->pulses = libspectrum_renew( libspectrum_dword, list->pulses,
+                                      list->allocated );
+  }
+
+  list->pulses[ list->count++ ] = length;
+}
+
+/* Get the block at `position' on the tape and an iterator pointing to it */
+static libspectrum_tape_block*
+block_at( libspectrum_tape *tape, size_t position,
+          libspectrum_tape_iterator *iterator )
+{
+  libspectrum_tape_block *block;
+
+  for( block = libspectrum_tape_iterator_init( iterator, tape );
+       block && position;
+       block = libspectrum_tape_iterator_next( iterator ), position-- )
+    ;
+
+  return block;
+}
+
+/* Play the block at `position' and store the time between each pair of
+   edges in `list'. Time with no edge counts towards the next pulse; if
+   the block ends in such time or stops the tape, `list' is left empty as
+   its pulses can't be reproduced by the blocks we make */
+static libspectrum_error
+get_pulses( pulse_list *list, libspectrum_tape *tape, size_t position )
+{
+  libspectrum_tape_block_state it;
+  libspectrum_tape_iterator iterator;
+  libspectrum_dword tstates, pending = 0;
+  int flags;
+  libspectrum_error error;
+
+  list->count = 0;
+
+  it.current_block = position;
+  it.loop_block = 0;
+  it.loop_count = 0;
+  it.index_entry = LIBSPECTRUM_TAPE_INDEX_UNKNOWN;
+
+  error = libspectrum_tape_block_init( block_at( tape, position, &iterator ),
+                                       &it );
+  if( error ) return error;
+
+  do {
+
+    error = libspectrum_tape_get_next_edge_internal( &tstates, &flags, tape,
+                                                     &it );
+    if( error ) return error;
+
+    if( ( flags & LIBSPECTRUM_TAPE_FLAGS_STOP48 ) ||
+        ( ( flags & LIBSPECTRUM_TAPE_FLAGS_STOP ) &&
+          !( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) ) ) {
+      list->count = 0;
+      return LIBSPECTRUM_ERROR_NONE;
+    }
+
+    pending += tstates;
+    if( flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE ) continue;
+
+    add_pulse( list, pending );
+    pending = 0;
+
+  } while( !( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) );
+
+  if( pending ) list->count = 0;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Look for a pilot tone starting at pulse `start', followed by two sync
+   pulses and some data. Returns non-zero if one was found; either way,
+   `next' is set to the first pulse worth looking at afterwards */
+static int
+find_block( found_block *found, const libspectrum_dword *pulses, size_t count,
+            size_t start, libspectrum_dword sample, size_t *next )
+{
+  libspectrum_qword sum, sums[2];
+  libspectrum_dword pilot, lo, hi, threshold;
+  size_t i, j, b, bits, counts[2];
+  int single = -1;
+
+  /* The pilot: a long run of pulses all about the same length */
+  sum = pulses[ start ];
+  for( i = start + 1;
+       i < count && similar( pulses[i], sum / ( i - start ), sample );
+       i++ )
+    sum += pulses[i];
+
+  *next = i;
+  if( i - start < MIN_PILOT_PULSES ) return 0;
+  pilot = sum / ( i - start );
+
+  /* Two sync pulses, each shorter than the pilot pulses */
+  if( count - i < 2 + 2 * MIN_DATA_BITS ||
+      pulses[i] >= pilot || pulses[ i + 1 ] >= pilot )
+    return 0;
+
+  /* The data: pulses of at most two lengths, so find the range of lengths
+     before anything wildly different turns up */
+  lo = hi = pulses[ i + 2 ];
+  for( j = i + 3; j < count; j++ ) {
+    libspectrum_qword length = pulses[j];
+    if( length > 3 * (libspectrum_qword)lo ||
+        3 * length < hi ) break;
+    if( pulses[j] < lo ) lo = pulses[j];
+    if( pulses[j] > hi ) hi = pulses[j];
+  }
+
+  /* If all the pulses are about the same length, decide whether they're
+     all zeros or all ones by comparing them with the sync pulses */
+  threshold = lo + ( hi - lo ) / 2;
+  if( 2 * (libspectrum_qword)hi < 3 * (libspectrum_qword)lo ) {
+    libspectrum_qword sync = (libspectrum_qword)pulses[i] + pulses[ i + 1 ];
+    single = 4 * (libspectrum_qword)lo > 3 * sync;
+  }
+
+  /* Each bit is a pair of equal pulses */
+  sums[0] = sums[1] = 0; counts[0] = counts[1] = 0;
+  for( bits = 0; i + 3 + 2 * bits < j; bits++ ) {
+    libspectrum_dword first = pulses[ i + 2 + 2 * bits ],
+      second = pulses[ i + 3 + 2 * bits ];
+    int bit = single >= 0 ? single : first > threshold;
+
+    if( ( single < 0 && ( second > threshold ) != bit ) ||
+        !similar( first, second, sample ) )
+      break;
+
+    sums[ bit ] += (libspectrum_qword)first + second;
+    counts[ bit ] += 2;
+  }
+
+  *next = i;
+  if( bits < MIN_DATA_BITS ) return 0;
+
+  found->start = start;
+  found->pilot_length = pilot;
+  found->pilot_pulses = i - start;
+  found->sync1_length = pulses[i];
+  found->sync2_length = pulses[ i + 1 ];
+
+  found->bit0_length = counts[0] ? sums[0] / counts[0] : 0;
+  found->bit1_length = counts[1] ? sums[1] / counts[1] : 0;
+  if( !counts[0] ) found->bit0_length = found->bit1_length / 2;
+  if( !counts[1] ) found->bit1_length = 2 * found->bit0_length;
+
+  found->bits = bits;
+  found->data = libspectrum_new0( libspectrum_byte,
+                                  libspectrum_bits_to_bytes( bits ) );
+  for( b = 0; b < bits; b++ ) {
+    libspectrum_dword first = pulses[ i + 2 + 2 * b ];
+    if( single >= 0 ? single : first > threshold )
+      found->data[ b / 8 ] |= 0x80 >> ( b % 8 );
+  }
+
+  /* Anything much longer than a bit straight afterwards is the pause */
+  found->end = i + 2 + 2 * bits;
+  found->pause_tstates = 0;
+  if( found->end < count &&
+      pulses[ found->end ] / 2 > found->bit1_length ) {
+    found->pause_tstates = pulses[ found->end ];
+    found->end++;
+  }
+
+  *next = found->end;
+  return 1;
+}
+
+/* Does the found block look like it was written by the ROM? */
+static int
+rom_timings( const found_block *found, libspectrum_dword sample )
+{
+  return found->bits % 8 == 0 &&
+    similar( found->pilot_length, LIBSPECTRUM_TAPE_TIMING_PILOT, sample ) &&
+    similar( found->sync1_length, LIBSPECTRUM_TAPE_TIMING_SYNC1, sample ) &&
+    similar( found->sync2_length, LIBSPECTRUM_TAPE_TIMING_SYNC2, sample ) &&
+    similar( found->bit0_length, LIBSPECTRUM_TAPE_TIMING_DATA0, sample ) &&
+    similar( found->bit1_length, LIBSPECTRUM_TAPE_TIMING_DATA1, sample );
+}
+
+static libspectrum_tape_block*
+make_data_block( const found_block *found, int rom )
+{
+  libspectrum_tape_block *block;
+  size_t length = libspectrum_bits_to_bytes( found->bits );
+  libspectrum_byte *data;
+
+  data = libspectrum_new( libspectrum_byte, length );
+  memcpy( data, found->data, length );
+
+  if( rom ) {
+    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ROM );
+  } else {
+    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_TURBO );
+    libspectrum_tape_block_set_pilot_length( block, found->pilot_length );
+    libspectrum_tape_block_set_pilot_pulses( block, found->pilot_pulses );
+    libspectrum_tape_block_set_sync1_length( block, found->sync1_length );
+    libspectrum_tape_block_set_sync2_length( block, found->sync2_length );
+    libspectrum_tape_block_set_bit0_length( block, found->bit0_length );
+    libspectrum_tape_block_set_bit1_length( block, found->bit1_length );
+    libspectrum_tape_block_set_bits_in_last_byte(
+      block, found->bits % 8 ? found->bits % 8 : 8
+    );
+  }
+
+  libspectrum_tape_block_set_data_length( block, length );
+  libspectrum_tape_block_set_data( block, data );
+  libspectrum_set_pause_tstates( block, found->pause_tstates );
+
+  return block;
+}
+
+/* Make an RLE pulse block holding `count' pulses in units of `scale'
+   tstates */
+static libspectrum_tape_block*
+make_samples_block( const libspectrum_dword *pulses, size_t count,
+                    libspectrum_dword scale )
+{
+  libspectrum_tape_block *block;
+  libspectrum_byte *data, *ptr;
+  size_t i;
+
+  data = ptr = libspectrum_new( libspectrum_byte, 5 * count );
+
+  for( i = 0; i < count; i++ ) {
+    libspectrum_dword samples =
+      ( (libspectrum_qword)pulses[i] + scale / 2 ) / scale;
+    if( samples && samples <= 0xff ) {
+      *ptr++ = samples;
+    } else {
+      *ptr++ = 0;
+      libspectrum_write_dword( &ptr, samples );
+    }
+  }
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE );
+  libspectrum_tape_block_set_scale( block, scale );
+  libspectrum_tape_block_set_data_length( block, ptr - data );
+  libspectrum_tape_block_set_data( block, data );
+
+  return block;
+}
+
+/* Insert `block' at `position' and check it plays back as `pulses';
+   if not, remove it again */
+static libspectrum_error
+insert_checked( libspectrum_tape *tape, libspectrum_tape_block *block,
+                size_t position, const libspectrum_dword *pulses,
+                size_t count, libspectrum_dword sample, int *inserted )
+{
+  pulse_list played = { NULL, 0, 0 };
+  libspectrum_tape_iterator iterator;
+  size_t i;
+  libspectrum_error error;
+
+  error = libspectrum_tape_insert_block( tape, block, position );
+  if( error ) { libspectrum_tape_block_free( block ); return error; }
+
+  error = get_pulses( &played, tape, position );
+
+  *inserted = !error && played.count == count;
+  for( i = 0; *inserted && i < count; i++ )
+    if( !similar( played.pulses[i], pulses[i], sample ) ) *inserted = 0;
+
+  libspectrum_free( played.pulses );
+
+  if( !*inserted ) {
+    block_at( tape, position, &iterator );
+    libspectrum_tape_remove_block( tape, iterator );
+  }
+
+  return error;
+}
+
+/* Replace the sampled block at `position' with data blocks wherever
+   possible. `added' is set to the number of blocks it became, and
+   `changed' to non-zero if it was replaced */
+static libspectrum_error
+reconstruct_block( libspectrum_tape *tape, size_t position, size_t *added,
+                   int *changed )
+{
+  pulse_list list = { NULL, 0, 0 };
+  libspectrum_tape_iterator iterator;
+  libspectrum_tape_block *block;
+  libspectrum_dword sample;
+  size_t i, next, samples_start = 0, new_position = position;
+  int inserted, found_any = 0;
+  libspectrum_error error;
+
+  *added = 1;
+  *changed = 0;
+
+  block = block_at( tape, position, &iterator );
+  sample = libspectrum_tape_block_type( block ) ==
+           LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE ?
+           libspectrum_tape_block_scale( block ) :
+           libspectrum_tape_block_bit_length( block );
+  if( !sample ) return LIBSPECTRUM_ERROR_NONE;
+
+  error = get_pulses( &list, tape, position );
+  if( error ) goto exit;
+
+  for( i = 0; i < list.count; i = next ) {
+
+    found_block found;
+
+    if( !find_block( &found, list.pulses, list.count, i, sample, &next ) )
+      continue;
+
+    /* Try it as a ROM block, then as a turbo block */
+    inserted = 0;
+    if( rom_timings( &found, sample ) ) {
+      error = insert_checked( tape, make_data_block( &found, 1 ), new_position,
+                              list.pulses + found.start,
+                              found.end - found.start, sample, &inserted );
+    }
+    if( !error && !inserted ) {
+      error = insert_checked( tape, make_data_block( &found, 0 ), new_position,
+                              list.pulses + found.start,
+                              found.end - found.start, sample, &inserted );
+    }
+    libspectrum_free( found.data );
+    if( error ) goto exit;
+    if( !inserted ) continue;
+    new_position++;
+
+    /* Anything before the block stays as samples */
+    if( found.start > samples_start ) {
+      error = libspectrum_tape_insert_block(
+        tape,
+        make_samples_block( list.pulses + samples_start,
+                            found.start - samples_start, sample ),
+        new_position - 1
+      );
+      if( error ) goto exit;
+      new_position++;
+    }
+
+    samples_start = found.end;
+    found_any = 1;
+  }
+
+  if( !found_any ) goto exit;
+
+  if( samples_start < list.count ) {
+    error = libspectrum_tape_insert_block(
+      tape,
+      make_samples_block( list.pulses + samples_start,
+                          list.count - samples_start, sample ),
+      new_position
+    );
+    if( error ) goto exit;
+    new_position++;
+  }
+
+  /* The original block is now after everything we made from it */
+  block_at( tape, new_position, &iterator );
+  libspectrum_tape_remove_block( tape, iterator );
+
+  *added = new_position - position;
+  *changed = 1;
+
+ exit:
+  /* If we couldn't finish, take out the blocks we made, leaving the
+     original block where it was */
+  if( error ) {
+    for( i = position; i < new_position; i++ ) {
+      block_at( tape, position, &iterator );
+      libspectrum_tape_remove_block( tape, iterator );
+    }
+  }
+
+  libspectrum_free( list.pulses );
+  return error;
+}
+
+/* The offset from block `from' to block `from' + `offset' once each of
+   the original `count' blocks `i' has moved to `positions[i]' */
+static int
+new_offset( const size_t *positions, size_t count, size_t from, int offset )
+{
+  /* Leave jumps off the ends of the tape as they were */
+  if( offset < 0 ? (size_t)-offset > from : from + offset >= count )
+    return offset;
+
+  return offset < 0 ?
+         -(int)( positions[ from ] - positions[ from + offset ] ) :
+          (int)( positions[ from + offset ] - positions[ from ] );
+}
+
+/* Keep jump and select blocks pointing at the same blocks as before,
+   now original block `i' is at `positions[i]' */
+static void
+update_offsets( libspectrum_tape *tape, const size_t *positions,
+                size_t count )
+{
+  libspectrum_tape_iterator iterator;
+  libspectrum_tape_block *block;
+  size_t i = 0, j, position = 0;
+
+  for( block = libspectrum_tape_iterator_init( &iterator, tape );
+       block && i < count;
+       block = libspectrum_tape_iterator_next( &iterator ), position++ ) {
+
+    /* Blocks made from the samples can't be jumps */
+    if( position != positions[i] ) continue;
+
+    switch( block->type ) {
+
+    case LIBSPECTRUM_TAPE_BLOCK_JUMP:
+      block->types.jump.offset =
+        new_offset( positions, count, i, block->types.jump.offset );
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_SELECT:
+      for( j = 0; j < block->types.select.count; j++ )
+        block->types.select.offsets[j] =
+          new_offset( positions, count, i, block->types.select.offsets[j] );
+      break;
+
+    default:
+      break;
+
+    }
+
+    i++;
+  }
+}
+
+libspectrum_error
+libspectrum_tape_reconstruct( libspectrum_tape *tape )
+{
+  libspectrum_tape_iterator iterator;
+  libspectrum_tape_block *block;
+  size_t *positions, count = 0, i, position = 0, added;
+  int changed = 0, block_changed;
+  libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
+
+  for( block = libspectrum_tape_iterator_init( &iterator, tape );
+       block;
+       block = libspectrum_tape_iterator_next( &iterator ) )
+    count++;
+
+  /* Where each of the original blocks ends up */
+  positions = libspectrum_new( size_t, count + 1 );
+
+  for( i = 0; ( block = block_at( tape, position, &iterator ) ); i++ ) {
+
+    positions[i] = position;
+
+    switch( libspectrum_tape_block_type( block ) ) {
+
+    case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+    case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+      error = reconstruct_block( tape, position, &added, &block_changed );
+      changed |= block_changed;
+      break;
+
+    default:
+      added = 1;
+      break;
+
+    }
+
+    if( error ) break;
+    position += added;
+  }
+
+  /* After an error, the blocks from the one which failed on are as they
+     were */
+  for( ; i < count; i++ ) positions[i] = position++;
+
+  /* Jumps count blocks, so must take the new blocks into account; this
+     applies to blocks replaced before any error too */
+  if( changed ) update_offsets( tape, positions, count );
+  libspectrum_free( positions );
+
+  if( error ) return error;
+
+  /* The blocks have moved underneath the playback position */
+  if( changed ) return libspectrum_tape_nth_block( tape, 0 );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
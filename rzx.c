@@ -133,10 +133,11 @@ static libspectrum_error
 rzx_read_creator( const libspectrum_byte **ptr, const libspectrum_byte *end );
 static libspectrum_error
 rzx_read_snapshot( libspectrum_rzx *rzx, const libspectrum_byte **ptr,
-		   const libspectrum_byte *end );
+		   const libspectrum_byte *end, libspectrum_zlib_codec *codec );
 static libspectrum_error
 rzx_read_input( libspectrum_rzx *rzx,
-		const libspectrum_byte **ptr, const libspectrum_byte *end );
+		const libspectrum_byte **ptr, const libspectrum_byte *end,
+		libspectrum_zlib_codec *codec );
 static libspectrum_error
 rzx_read_frames( input_block_t *block, const libspectrum_byte **ptr,
 		 const libspectrum_byte *end );
@@ -155,10 +156,12 @@ rzx_write_creator( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 static libspectrum_error
 rzx_write_snapshot( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
                     libspectrum_snap *snap, libspectrum_id_t snap_format,
-                    libspectrum_creator *creator, int compress );
+                    libspectrum_creator *creator, int compress,
+                    libspectrum_zlib_codec *codec );
 static void
 rzx_write_input( input_block_t *block, libspectrum_buffer *buffer,
-                 libspectrum_buffer *block_data, int compress );
+                 libspectrum_buffer *block_data, int compress,
+                 libspectrum_zlib_codec *codec );
 static libspectrum_error
 rzx_write_signed_start( libspectrum_buffer *buffer,
                         libspectrum_buffer *block_data,
@@ -685,6 +688,7 @@ libspectrum_rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
   libspectrum_byte *new_buffer;
   libspectrum_id_t raw_type;
   libspectrum_class_t class;
+  libspectrum_zlib_codec *codec = NULL;
 
   /* Find out if this file needs decompression */
   new_buffer = NULL;
@@ -712,7 +716,11 @@ libspectrum_rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
 
   rzx->signed_start = ptr;
 
-  while( ptr < end ) {
+#ifdef HAVE_ZLIB_H
+  codec = libspectrum_zlib_codec_alloc( 0, 0 );
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+  while( ptr < end && !error ) {
 
     libspectrum_byte id;
 
@@ -722,42 +730,22 @@ libspectrum_rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
 
     case LIBSPECTRUM_RZX_CREATOR_BLOCK:
       error = rzx_read_creator( &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
-      }
       break;
       
     case LIBSPECTRUM_RZX_SNAPSHOT_BLOCK:
-      error = rzx_read_snapshot( rzx, &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
-      }
+      error = rzx_read_snapshot( rzx, &ptr, end, codec );
       break;
 
     case LIBSPECTRUM_RZX_INPUT_BLOCK:
-      error = rzx_read_input( rzx, &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
-      }
+      error = rzx_read_input( rzx, &ptr, end, codec );
       break;
 
     case LIBSPECTRUM_RZX_SIGN_START_BLOCK:
       error = rzx_read_sign_start( rzx, &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
-      }
       break;
 
     case LIBSPECTRUM_RZX_SIGN_END_BLOCK:
       error = rzx_read_sign_end( rzx, &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
-      }
       break;
 
     default:
@@ -765,13 +753,17 @@ libspectrum_rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
 	LIBSPECTRUM_ERROR_UNKNOWN,
         "libspectrum_rzx_read: unknown RZX block ID 0x%02x", id
       );
-      libspectrum_free( new_buffer );
-      return LIBSPECTRUM_ERROR_UNKNOWN;
+      error = LIBSPECTRUM_ERROR_UNKNOWN;
+      break;
     }
   }
 
+#ifdef HAVE_ZLIB_H
+  libspectrum_zlib_codec_free( codec );
+#endif				/* #ifdef HAVE_ZLIB_H */
+
   libspectrum_free( new_buffer );
-  return LIBSPECTRUM_ERROR_NONE;
+  return error;
 }
 
 static libspectrum_error
@@ -836,7 +828,7 @@ rzx_read_creator( const libspectrum_byte **ptr, const libspectrum_byte *end )
 
 static libspectrum_error
 rzx_read_snapshot( libspectrum_rzx *rzx, const libspectrum_byte **ptr,
-		   const libspectrum_byte *end )
+		   const libspectrum_byte *end, libspectrum_zlib_codec *codec )
 {
   rzx_block_t *block;
   libspectrum_snap *snap;
@@ -891,8 +883,21 @@ rzx_read_snapshot( libspectrum_rzx *rzx, const libspectrum_byte **ptr,
 
 #ifdef HAVE_ZLIB_H
 
-    error = libspectrum_zlib_inflate( (*ptr) + 8, blocklength - 17,
-				      &gzsnap, &uncompressed_length );
+    /* The block tells us how long the snap is, so we can allocate the
+       right space up front, provided the data could actually expand that
+       much */
+    if( snaplength / LIBSPECTRUM_DEFLATE_MAX_RATIO > blocklength - 17 ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_CORRUPT,
+        "rzx_read_snapshot: compressed snapshot too short"
+      );
+      return LIBSPECTRUM_ERROR_CORRUPT;
+    }
+
+    uncompressed_length = snaplength;
+    error = libspectrum_zlib_codec_inflate( codec, (*ptr) + 8,
+                                            blocklength - 17, &gzsnap,
+                                            &uncompressed_length );
     if( error != LIBSPECTRUM_ERROR_NONE ) return error;
 
     if( uncompressed_length != snaplength ) {
@@ -973,7 +978,8 @@ rzx_read_snapshot( libspectrum_rzx *rzx, const libspectrum_byte **ptr,
 
 static libspectrum_error
 rzx_read_input( libspectrum_rzx *rzx,
-		const libspectrum_byte **ptr, const libspectrum_byte *end )
+		const libspectrum_byte **ptr, const libspectrum_byte *end,
+		libspectrum_zlib_codec *codec )
 {
   size_t blocklength;
   libspectrum_dword flags; int compressed;
@@ -1027,7 +1033,8 @@ rzx_read_input( libspectrum_rzx *rzx,
       return LIBSPECTRUM_ERROR_CORRUPT;
     }
 
-    error = libspectrum_zlib_inflate( *ptr, blocklength, &data, &data_length );
+    error = libspectrum_zlib_codec_inflate( codec, *ptr, blocklength, &data,
+                                            &data_length );
     if( error != LIBSPECTRUM_ERROR_NONE ) {
       block_free( rzx_block );
       return error;
@@ -1252,6 +1259,7 @@ libspectrum_rzx_write( libspectrum_byte **buffer, size_t *length,
   libspectrum_byte *ptr = *buffer;
   libspectrum_buffer *new_buffer = libspectrum_buffer_alloc();
   libspectrum_buffer *block_data = libspectrum_buffer_alloc();
+  libspectrum_zlib_codec *codec = NULL;
 
   if( creator ) rzx_write_creator( new_buffer, block_data, creator );
 
@@ -1264,6 +1272,11 @@ libspectrum_rzx_write( libspectrum_byte **buffer, size_t *length,
     }
   }
 
+#ifdef HAVE_ZLIB_H
+  /* Every compressed block in the file shares one zlib state */
+  if( compress ) codec = libspectrum_zlib_codec_alloc( compress, 0 );
+#endif				/* #ifdef HAVE_ZLIB_H */
+
   for( list = rzx->blocks; list; list = list->next ) {
 
     rzx_block_t *block = list->data;
@@ -1273,8 +1286,11 @@ libspectrum_rzx_write( libspectrum_byte **buffer, size_t *length,
     case LIBSPECTRUM_RZX_SNAPSHOT_BLOCK:
       error = rzx_write_snapshot( new_buffer, block_data,
                                   block->types.snap.snap, snap_format, creator,
-                                  compress );
+                                  compress, codec );
       if( error != LIBSPECTRUM_ERROR_NONE ) {
+#ifdef HAVE_ZLIB_H
+        libspectrum_zlib_codec_free( codec );
+#endif				/* #ifdef HAVE_ZLIB_H */
         libspectrum_buffer_free( new_buffer );
         libspectrum_buffer_free( block_data );
         return error;
@@ -1286,7 +1302,7 @@ libspectrum_rzx_write( libspectrum_byte **buffer, size_t *length,
       snap_format = LIBSPECTRUM_ID_SNAPSHOT_SZX;
 
       rzx_write_input( &( block->types.input ), new_buffer, block_data,
-                       compress );
+                       compress, codec );
       break;
 
     case LIBSPECTRUM_RZX_CREATOR_BLOCK:
@@ -1297,6 +1313,10 @@ libspectrum_rzx_write( libspectrum_byte **buffer, size_t *length,
     }
   }
 
+#ifdef HAVE_ZLIB_H
+  libspectrum_zlib_codec_free( codec );
+#endif				/* #ifdef HAVE_ZLIB_H */
+
   if( key ) {
     error = rzx_write_signed_end( new_buffer, block_data, key );
     if( error != LIBSPECTRUM_ERROR_NONE ) {
@@ -1371,7 +1391,8 @@ rzx_write_creator( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 }
 
 static libspectrum_error
-rzx_compress( libspectrum_buffer *dest, libspectrum_buffer *src, int *compress )
+rzx_compress( libspectrum_buffer *dest, libspectrum_buffer *src, int *compress,
+              libspectrum_zlib_codec *codec )
 {
 #ifdef HAVE_ZLIB_H
   libspectrum_byte *out_data = libspectrum_buffer_get_data( src );
@@ -1386,8 +1407,8 @@ rzx_compress( libspectrum_buffer *dest, libspectrum_buffer *src, int *compress )
   }
 
 #ifdef HAVE_ZLIB_H
-  error = libspectrum_zlib_compress( out_data, out_length, &compressed_data,
-                                     &out_length );
+  error = libspectrum_zlib_codec_deflate( codec, out_data, out_length,
+                                          &compressed_data, &out_length );
   if( error != LIBSPECTRUM_ERROR_NONE || 
       out_length >= libspectrum_buffer_get_data_size( src ) ) {
     *compress = 0;
@@ -1418,32 +1439,41 @@ rzx_compress( libspectrum_buffer *dest, libspectrum_buffer *src, int *compress )
 static libspectrum_error
 rzx_write_snapshot( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
                     libspectrum_snap *snap, libspectrum_id_t snap_format,
-                    libspectrum_creator *creator, int compress )
+                    libspectrum_creator *creator, int compress,
+                    libspectrum_zlib_codec *codec )
 {
   libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
-  int flags, done;
+  int flags, done, in_flags;
   snapshot_string_t *type;
   libspectrum_buffer *snap_data = libspectrum_buffer_alloc();
   size_t uncompressed_data_size;
 
+  /* The snapshot is compressed as the rest of the file is */
+  in_flags = compress & ( LIBSPECTRUM_FLAG_COMPRESS_FASTEST |
+                          LIBSPECTRUM_FLAG_COMPRESS_DEFAULT |
+                          LIBSPECTRUM_FLAG_COMPRESS_RLE );
+
   if( snap_format == LIBSPECTRUM_ID_UNKNOWN ) {
     /* If not given a snap format, try using .z80. If that would result
        in major information loss, use .szx instead */
     snap_format = LIBSPECTRUM_ID_SNAPSHOT_Z80;
     error = libspectrum_snap_write_buffer( block_data, &flags, snap,
-                                           snap_format, creator, 0 );
+                                           snap_format, creator,
+                                           in_flags );
     if( error ) { goto cleanup; }
 
     if( flags & LIBSPECTRUM_FLAG_SNAPSHOT_MAJOR_INFO_LOSS ) {
       libspectrum_buffer_clear( block_data );
       snap_format = LIBSPECTRUM_ID_SNAPSHOT_SZX;
       error = libspectrum_snap_write_buffer( block_data, &flags, snap,
-                                             snap_format, creator, 0 );
+                                             snap_format, creator,
+                                             in_flags );
       if( error ) { goto cleanup; }
     }
   } else {
     error = libspectrum_snap_write_buffer( block_data, &flags, snap,
-                                           snap_format, creator, 0 );
+                                           snap_format, creator,
+                                           in_flags );
     if( error ) { goto cleanup; }
   }
 
@@ -1454,7 +1484,7 @@ rzx_write_snapshot( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
   }
 
   uncompressed_data_size = libspectrum_buffer_get_data_size( block_data );
-  rzx_compress( snap_data, block_data, &compress );
+  rzx_compress( snap_data, block_data, &compress, codec );
   libspectrum_buffer_clear( block_data );
 
   libspectrum_buffer_write_dword( block_data, compress ? 2 : 0 );
@@ -1491,7 +1521,8 @@ cleanup:
 
 static void
 rzx_write_input( input_block_t *block, libspectrum_buffer *buffer,
-                 libspectrum_buffer *block_data, int compress )
+                 libspectrum_buffer *block_data, int compress,
+                 libspectrum_zlib_codec *codec )
 {
   size_t i;
   libspectrum_buffer *frame_data = libspectrum_buffer_alloc();
@@ -1512,7 +1543,7 @@ rzx_write_input( input_block_t *block, libspectrum_buffer *buffer,
 
   }
 
-  rzx_compress( frame_data, block_data, &compress );
+  rzx_compress( frame_data, block_data, &compress, codec );
   libspectrum_buffer_clear( block_data );
 
   /* How many frames? */
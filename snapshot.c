@@ -81,6 +81,8 @@ libspectrum_snap_alloc( void )
 
   for( i = 0; i < SNAPSHOT_RAM_PAGES; i++ )
     libspectrum_snap_set_pages( snap, i, NULL );
+  libspectrum_snap_set_ram_arena( snap, NULL );
+  libspectrum_snap_set_ram_arena_pages( snap, 0 );
   for( i = 0; i < SNAPSHOT_SLT_PAGES; i++ ) {
     libspectrum_snap_set_slt( snap, i, NULL );
     libspectrum_snap_set_slt_length( snap, i, 0 );
@@ -291,6 +293,31 @@ libspectrum_snap_alloc( void )
   return snap;
 }
 
+/* Get where RAM page `page' should be read to in the caller's arena, or
+   NULL if the arena doesn't cover it */
+libspectrum_byte*
+libspectrum_snap_ram_arena_page( libspectrum_snap *snap, size_t page )
+{
+  libspectrum_byte *arena = libspectrum_snap_ram_arena( snap );
+
+  if( !arena || page >= libspectrum_snap_ram_arena_pages( snap ) ||
+      page >= SNAPSHOT_RAM_PAGES )
+    return NULL;
+
+  return arena + page * 0x4000;
+}
+
+/* Does `ptr' point into the caller's arena for `snap'? */
+int
+libspectrum_snap_ram_arena_owns( libspectrum_snap *snap,
+                                 const libspectrum_byte *ptr )
+{
+  const libspectrum_byte *arena = libspectrum_snap_ram_arena( snap );
+
+  return arena && ptr >= arena &&
+         ptr < arena + libspectrum_snap_ram_arena_pages( snap ) * 0x4000;
+}
+
 /* Free all memory used by a libspectrum_snap structure (destructor...) */
 libspectrum_error
 libspectrum_snap_free( libspectrum_snap *snap )
@@ -300,14 +327,20 @@ libspectrum_snap_free( libspectrum_snap *snap )
   for( i = 0; i < 4; i++ )
     libspectrum_free( libspectrum_snap_roms( snap, i ) );
 
-  for( i = 0; i < SNAPSHOT_RAM_PAGES; i++ )
-    libspectrum_free( libspectrum_snap_pages( snap, i ) );
+  for( i = 0; i < SNAPSHOT_RAM_PAGES; i++ ) {
+    libspectrum_byte *page = libspectrum_snap_pages( snap, i );
+    if( !libspectrum_snap_ram_arena_owns( snap, page ) )
+      libspectrum_free( page );
+  }
 
   for( i = 0; i < SNAPSHOT_SLT_PAGES; i++ )
     libspectrum_free( libspectrum_snap_slt( snap, i ) );
 
   libspectrum_free( libspectrum_snap_slt_screen( snap ) );
 
+  for( i = 0; i < SNAPSHOT_ZXATASP_PAGES; i++ )
+    libspectrum_free( libspectrum_snap_zxatasp_ram( snap, i ) );
+
   for( i = 0; i < SNAPSHOT_ZXCF_PAGES; i++ )
     libspectrum_free( libspectrum_snap_zxcf_ram( snap, i ) );
 
@@ -33,6 +33,8 @@ typedef struct szx_context {
 
   int swap_af;
 
+  libspectrum_zlib_codec *codec; /* Shared by all the compressed chunks */
+
 } szx_context;
 
 /* The machine numbers used in the .szx format */
@@ -237,11 +239,33 @@ static const libspectrum_byte ZXSTPALETTE_ENABLED = 1;
 
 #define ZXSTBID_ZXMMC "ZMMC"
 
+/* Set in the flags passed around while writing if we're compressing */
+#define SZX_COMPRESS ( 1 << 30 )
+
 static libspectrum_error
 read_chunk( libspectrum_snap *snap, libspectrum_word version,
 	    const libspectrum_byte **buffer, const libspectrum_byte *end,
             szx_context *ctx );
 
+/* A RAM page waiting to be compressed and written as a chunk */
+typedef struct szx_page {
+  const libspectrum_byte *data;
+  size_t data_length;
+  int page;
+  int extra_flags;
+
+  int compress;
+  libspectrum_zlib_codec *codec; /* NULL if the pages don't share one */
+  libspectrum_buffer *compressed;
+  int use_compression;
+} szx_page;
+
+/* Pages which can be compressed independently of each other */
+typedef struct szx_page_set {
+  szx_page *pages;
+  size_t count, allocated;
+} szx_page_set;
+
 typedef libspectrum_error (*read_chunk_fn)( libspectrum_snap *snap,
 					    libspectrum_word version,
 					    const libspectrum_byte **buffer,
@@ -275,12 +299,11 @@ static void
 write_ram_pages( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
                  libspectrum_snap *snap, int compress );
 static void
-write_ramp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress );
+add_ram_page( szx_page_set *set, const libspectrum_byte *data,
+              size_t data_length, int page, int extra_flags );
 static void
-write_ram_page( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                const char *id, const libspectrum_byte *data,
-                size_t data_length, int page, int compress, int extra_flags );
+write_page_set( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                const char *id, szx_page_set *set, int compress );
 static libspectrum_error
 write_rom_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
                  int *out_flags, libspectrum_snap *snap, int compress );
@@ -306,14 +329,14 @@ static void
 write_zxat_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
                   libspectrum_snap *snap );
 static void
-write_atrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-		  libspectrum_snap *snap, int page, int compress );
+write_atrp_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress );
 static void
 write_zxcf_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 		  libspectrum_snap *snap );
 static void
-write_cfrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress );
+write_cfrp_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress );
 static void
 write_side_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 		  libspectrum_snap *snap );
@@ -348,22 +371,20 @@ write_if2r_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 #endif				/* #ifdef HAVE_ZLIB_H */
 
 static void
-write_dock_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-		  libspectrum_snap *snap, int exrom_dock,
-                  const libspectrum_byte *data, int page, int writeable,
-                  int compress );
+write_dock_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress );
 static libspectrum_error
 write_dide_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
                   libspectrum_snap *snap, int compress );
 static void
-write_dirp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress );
+write_dirp_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress );
 static libspectrum_error
 write_dmmc_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
                   libspectrum_snap *snap, int compress );
 static void
-write_dmrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress );
+write_dmrp_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress );
 static void
 write_zxpr_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 		  int *out_flags, libspectrum_snap *snap );
@@ -378,15 +399,27 @@ write_chunk( libspectrum_buffer *buffer, const char *id,
 static int
 compress_data( libspectrum_buffer *dest, const libspectrum_byte *src_data,
                size_t src_data_length, int compress );
-
+static int
+compress_data_with_codec( libspectrum_buffer *dest,
+                          const libspectrum_byte *src_data,
+                          size_t src_data_length, int compress,
+                          libspectrum_zlib_codec *codec );
+
+/* Read a page of memory. If `arena_snap' is not NULL and its caller has
+   given it memory for this page, the page is read into that rather than
+   into newly allocated memory */
 static libspectrum_error
 read_ram_page( libspectrum_byte **data, size_t *page,
 	       const libspectrum_byte **buffer, size_t data_length,
-	       size_t uncompressed_length, libspectrum_word *flags )
+	       size_t uncompressed_length, libspectrum_word *flags,
+	       szx_context *ctx, libspectrum_snap *arena_snap )
 {
+  libspectrum_byte *dest;
+
 #ifdef HAVE_ZLIB_H
 
   libspectrum_error error;
+  size_t inflated_length;
 
 #endif			/* #ifdef HAVE_ZLIB_H */
 
@@ -401,13 +434,37 @@ read_ram_page( libspectrum_byte **data, size_t *page,
 
   *page = **buffer; (*buffer)++;
 
+  dest = arena_snap ? libspectrum_snap_ram_arena_page( arena_snap, *page ) :
+                      NULL;
+
   if( *flags & ZXSTRF_COMPRESSED ) {
 
 #ifdef HAVE_ZLIB_H
 
-    error = libspectrum_zlib_inflate( *buffer, data_length - 3, data,
-				      &uncompressed_length );
-    if( error ) return error;
+    inflated_length = uncompressed_length;
+
+    if( dest ) {
+      error = libspectrum_zlib_codec_inflate_into( ctx->codec, *buffer,
+                                                   data_length - 3, dest,
+                                                   &inflated_length );
+      if( error ) return error;
+      *data = dest;
+    } else {
+      error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                              data_length - 3, data,
+                                              &inflated_length );
+      if( error ) return error;
+    }
+
+    if( inflated_length != uncompressed_length ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_CORRUPT,
+        "%s:read_ram_page: page inflated to %lu bytes, not %lu", __FILE__,
+        (unsigned long)inflated_length, (unsigned long)uncompressed_length
+      );
+      if( !dest ) libspectrum_free( *data );
+      return LIBSPECTRUM_ERROR_CORRUPT;
+    }
 
     *buffer += data_length - 3;
 
@@ -431,7 +488,8 @@ read_ram_page( libspectrum_byte **data, size_t *page,
       return LIBSPECTRUM_ERROR_UNKNOWN;
     }
 
-    *data = libspectrum_new( libspectrum_byte, uncompressed_length );
+    *data = dest ? dest :
+                   libspectrum_new( libspectrum_byte, uncompressed_length );
     memcpy( *data, *buffer, uncompressed_length );
     *buffer += uncompressed_length;
 
@@ -444,14 +502,15 @@ static libspectrum_error
 read_atrp_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
   libspectrum_byte *data;
   size_t page;
   libspectrum_error error;
   libspectrum_word flags;
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x4000, &flags );
+  error = read_ram_page( &data, &page, buffer, data_length, 0x4000, &flags,
+                         ctx, NULL );
   if( error ) return error;
 
   if( page >= SNAPSHOT_ZXATASP_PAGES ) {
@@ -500,7 +559,7 @@ static libspectrum_error
 read_b128_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
 #ifdef HAVE_ZLIB_H
   libspectrum_error error;
@@ -541,8 +600,9 @@ read_b128_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 
       size_t uncompressed_length = 0;
 
-      error = libspectrum_zlib_inflate( *buffer, data_length - 10, &rom_data,
-					&uncompressed_length );
+      error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                              data_length - 10, &rom_data,
+                                              &uncompressed_length );
       if( error ) return error;
 
       if( uncompressed_length != expected_length ) {
@@ -665,7 +725,7 @@ static libspectrum_error
 read_opus_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
 #ifdef HAVE_ZLIB_H
   libspectrum_error error;
@@ -745,8 +805,9 @@ read_opus_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
       return LIBSPECTRUM_ERROR_UNKNOWN;
     }
 
-    error = libspectrum_zlib_inflate( *buffer, disc_ram_length, &ram_data,
-				      &uncompressed_length );
+    error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                            disc_ram_length, &ram_data,
+                                            &uncompressed_length );
     if( error ) return error;
 
     if( uncompressed_length != expected_length ) {
@@ -765,8 +826,9 @@ read_opus_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
     if( libspectrum_snap_opus_custom_rom( snap ) ) {
       uncompressed_length = 0;
 
-      error = libspectrum_zlib_inflate( *buffer, disc_rom_length, &rom_data,
-                                        &uncompressed_length );
+      error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                              disc_rom_length, &rom_data,
+                                              &uncompressed_length );
       if( error ) return error;
 
       expected_length = 0x2000;
@@ -860,7 +922,7 @@ static libspectrum_error
 read_plsd_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		  const libspectrum_byte **buffer,
 		  const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
 #ifdef HAVE_ZLIB_H
   libspectrum_error error;
@@ -936,8 +998,9 @@ read_plsd_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
       return LIBSPECTRUM_ERROR_UNKNOWN;
     }
 
-    error = libspectrum_zlib_inflate( *buffer, disc_ram_length, &ram_data,
-				      &uncompressed_length );
+    error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                            disc_ram_length, &ram_data,
+                                            &uncompressed_length );
     if( error ) return error;
 
     if( uncompressed_length != expected_length ) {
@@ -956,8 +1019,9 @@ read_plsd_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
     if( libspectrum_snap_plusd_custom_rom( snap ) ) {
       uncompressed_length = 0;
 
-      error = libspectrum_zlib_inflate( *buffer, disc_rom_length, &rom_data,
-                                        &uncompressed_length );
+      error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                              disc_rom_length, &rom_data,
+                                              &uncompressed_length );
       if( error ) return error;
 
       if( uncompressed_length != expected_length ) {
@@ -1044,14 +1108,15 @@ static libspectrum_error
 read_cfrp_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
   libspectrum_byte *data;
   size_t page;
   libspectrum_error error;
   libspectrum_word flags;
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x4000, &flags );
+  error = read_ram_page( &data, &page, buffer, data_length, 0x4000, &flags,
+                         ctx, NULL );
   if( error ) return error;
 
   if( page >= SNAPSHOT_ZXCF_PAGES ) {
@@ -1319,7 +1384,7 @@ static libspectrum_error
 read_ramp_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
   libspectrum_byte *data;
   size_t page;
@@ -1327,7 +1392,8 @@ read_ramp_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
   libspectrum_word flags;
 
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x4000, &flags );
+  error = read_ram_page( &data, &page, buffer, data_length, 0x4000, &flags,
+                         ctx, snap );
   if( error ) return error;
 
   if( page > 63 ) {
@@ -1537,7 +1603,7 @@ static libspectrum_error
 read_if1_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		const libspectrum_byte **buffer,
 		const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                szx_context *ctx GCC_UNUSED )
+                szx_context *ctx )
 {
   libspectrum_word flags;
   libspectrum_word expected_length;
@@ -1581,8 +1647,9 @@ read_if1_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
       size_t uncompressed_length = 0;
 
       libspectrum_error error =
-              libspectrum_zlib_inflate( *buffer, data_length - 40, &rom_data,
-                                        &uncompressed_length );
+              libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                              data_length - 40, &rom_data,
+                                              &uncompressed_length );
       if( error ) return error;
 
       if( uncompressed_length != expected_length ) {
@@ -1687,7 +1754,7 @@ static libspectrum_error
 read_rom_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		const libspectrum_byte **buffer,
 		const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
   libspectrum_word flags;
   libspectrum_dword expected_length;
@@ -1712,8 +1779,9 @@ read_rom_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
     size_t uncompressed_length = 0;
 
     libspectrum_error error =
-            libspectrum_zlib_inflate( *buffer, data_length - 6, &rom_data,
-                                      &uncompressed_length );
+            libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                            data_length - 6, &rom_data,
+                                            &uncompressed_length );
     if( error ) return error;
 
     if( uncompressed_length != expected_length ) {
@@ -1827,7 +1895,7 @@ static libspectrum_error
 read_if2r_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
 
 #ifdef HAVE_ZLIB_H
@@ -1851,8 +1919,8 @@ read_if2r_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 
   uncompressed_length = 0x4000;
 
-  error = libspectrum_zlib_inflate( *buffer, data_length - 4, &buffer2,
-                                    &uncompressed_length );
+  error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer, data_length - 4,
+                                          &buffer2, &uncompressed_length );
   if( error ) return error;
 
   *buffer += data_length - 4;
@@ -1880,7 +1948,7 @@ static libspectrum_error
 read_dock_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
   libspectrum_byte *data;
   size_t page;
@@ -1888,7 +1956,8 @@ read_dock_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
   libspectrum_word flags;
   libspectrum_byte writeable;
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x2000, &flags );
+  error = read_ram_page( &data, &page, buffer, data_length, 0x2000, &flags,
+                         ctx, NULL );
   if( error ) return error;
 
   if( page > 7 ) {
@@ -1916,7 +1985,7 @@ read_dock_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 
 static libspectrum_error
 read_divxxx_chunk( libspectrum_snap *snap, const libspectrum_byte **buffer,
-		   size_t data_length,
+		   size_t data_length, szx_context *ctx,
                    void (*set_active)( libspectrum_snap*, int ),
                    void (*set_eprom_writeprotect)( libspectrum_snap*, int ),
                    libspectrum_word eprom_writeprotect_flag,
@@ -1955,8 +2024,9 @@ read_divxxx_chunk( libspectrum_snap *snap, const libspectrum_byte **buffer,
 
     size_t uncompressed_length = 0;
 
-    error = libspectrum_zlib_inflate( *buffer, data_length - 4, &eprom_data,
-                                      &uncompressed_length );
+    error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                            data_length - 4, &eprom_data,
+                                            &uncompressed_length );
     if( error ) return error;
 
     if( uncompressed_length != expected_length ) {
@@ -2010,9 +2080,9 @@ static libspectrum_error
 read_dide_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
-  return read_divxxx_chunk( snap, buffer, data_length,
+  return read_divxxx_chunk( snap, buffer, data_length, ctx,
                             libspectrum_snap_set_divide_active,
                             libspectrum_snap_set_divide_eprom_writeprotect,
                             ZXSTDIVIDE_EPROM_WRITEPROTECT,
@@ -2028,9 +2098,9 @@ static libspectrum_error
 read_dmmc_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
-  return read_divxxx_chunk( snap, buffer, data_length,
+  return read_divxxx_chunk( snap, buffer, data_length, ctx,
                             libspectrum_snap_set_divmmc_active,
                             libspectrum_snap_set_divmmc_eprom_writeprotect,
                             ZXSTDIVMMC_EPROM_WRITEPROTECT,
@@ -2045,14 +2115,16 @@ read_dmmc_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 static libspectrum_error
 read_divxxx_ram_chunk( libspectrum_snap *snap, const libspectrum_byte **buffer,
                        size_t data_length, size_t page_count,
-                       void (*set_ram)( libspectrum_snap*, int, libspectrum_byte* ) )
+                       void (*set_ram)( libspectrum_snap*, int, libspectrum_byte* ),
+                       szx_context *ctx )
 {
   libspectrum_byte *data;
   size_t page;
   libspectrum_error error;
   libspectrum_word flags;
 
-  error = read_ram_page( &data, &page, buffer, data_length, 0x2000, &flags );
+  error = read_ram_page( &data, &page, buffer, data_length, 0x2000, &flags,
+                         ctx, NULL );
   if( error ) return error;
 
   if( page >= page_count ) {
@@ -2072,28 +2144,29 @@ static libspectrum_error
 read_dirp_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
   return read_divxxx_ram_chunk( snap, buffer, data_length,
                                 SNAPSHOT_DIVIDE_PAGES,
-                                libspectrum_snap_set_divide_ram );
+                                libspectrum_snap_set_divide_ram, ctx );
 }
 
 static libspectrum_error
 read_dmrp_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
   return read_divxxx_ram_chunk( snap, buffer, data_length,
                                 SNAPSHOT_DIVMMC_PAGES,
-                                libspectrum_snap_set_divmmc_ram );
+                                libspectrum_snap_set_divmmc_ram, ctx );
 }
 
 static libspectrum_error
 read_snet_memory( libspectrum_snap *snap, const libspectrum_byte **buffer,
   int compressed, size_t *data_remaining,
-  void (*setter)(libspectrum_snap*, int, libspectrum_byte*) )
+  void (*setter)(libspectrum_snap*, int, libspectrum_byte*),
+  szx_context *ctx )
 {
   size_t data_length;
   libspectrum_byte *data_out;
@@ -2122,8 +2195,9 @@ read_snet_memory( libspectrum_snap *snap, const libspectrum_byte **buffer,
     size_t uncompressed_length = 0;
     libspectrum_byte *uncompressed_data;
 
-    error = libspectrum_zlib_inflate( *buffer, data_length, &uncompressed_data,
-        &uncompressed_length );
+    error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer, data_length,
+                                            &uncompressed_data,
+                                            &uncompressed_length );
     if( error ) return error;
 
     *buffer += data_length;
@@ -2219,7 +2293,7 @@ static libspectrum_error
 read_snef_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
   libspectrum_byte flags;
   int flash_compressed;
@@ -2240,7 +2314,7 @@ read_snef_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
   data_remaining = data_length - 1;
 
   error = read_snet_memory( snap, buffer, flash_compressed, &data_remaining,
-    libspectrum_snap_set_spectranet_flash );
+    libspectrum_snap_set_spectranet_flash, ctx );
   if( error )
     return error;
 
@@ -2251,7 +2325,7 @@ static libspectrum_error
 read_sner_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
   libspectrum_byte flags;
   int ram_compressed;
@@ -2272,7 +2346,7 @@ read_sner_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
   data_remaining = data_length - 1;
 
   error = read_snet_memory( snap, buffer, ram_compressed, &data_remaining,
-    libspectrum_snap_set_spectranet_ram );
+    libspectrum_snap_set_spectranet_ram, ctx );
   if( error )
     return error;
 
@@ -2320,7 +2394,7 @@ static libspectrum_error
 read_mfce_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
                  const libspectrum_byte **buffer,
                  const libspectrum_byte *end GCC_UNUSED, size_t data_length,
-                 szx_context *ctx GCC_UNUSED )
+                 szx_context *ctx )
 {
 #ifdef HAVE_ZLIB_H
   libspectrum_error error;
@@ -2373,8 +2447,9 @@ read_mfce_chunk( libspectrum_snap *snap, libspectrum_word version GCC_UNUSED,
 
     size_t uncompressed_length = 0;
 
-    error = libspectrum_zlib_inflate( *buffer, disc_ram_length, &ram_data,
-                                      &uncompressed_length );
+    error = libspectrum_zlib_codec_inflate( ctx->codec, *buffer,
+                                            disc_ram_length, &ram_data,
+                                            &uncompressed_length );
     if( error ) return error;
 
     if( uncompressed_length != expected_ram_length ) {
@@ -2703,17 +2778,20 @@ libspectrum_szx_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
 
   ctx = libspectrum_new( szx_context, 1 );
   ctx->swap_af = 0;
+#ifdef HAVE_ZLIB_H
+  ctx->codec = libspectrum_zlib_codec_alloc( 0, 0 );
+#endif
 
-  while( buffer < end ) {
+  error = LIBSPECTRUM_ERROR_NONE;
+  while( buffer < end && !error ) {
     error = read_chunk( snap, version, &buffer, end, ctx );
-    if( error ) {
-      libspectrum_free( ctx );
-      return error;
-    }
   }
 
+#ifdef HAVE_ZLIB_H
+  libspectrum_zlib_codec_free( ctx->codec );
+#endif
   libspectrum_free( ctx );
-  return LIBSPECTRUM_ERROR_NONE;
+  return error;
 }
 
 libspectrum_error
@@ -2723,7 +2801,6 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
 {
   int capabilities, compress;
   libspectrum_error error;
-  size_t i;
   libspectrum_buffer *block_data;
 
   *out_flags = 0;
@@ -2743,7 +2820,10 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
   capabilities =
     libspectrum_machine_capabilities( libspectrum_snap_machine( snap ) );
 
-  compress = !( in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION );
+  /* `compress' is passed down to say whether to compress things and, if
+     so, how; SZX_COMPRESS keeps it non-zero whatever the flags */
+  compress = in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION ?
+             0 : in_flags | SZX_COMPRESS;
 
   error = write_file_header( buffer, out_flags, snap );
   if( error ) return error;
@@ -2786,18 +2866,12 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
 
   if( libspectrum_snap_zxatasp_active( snap ) ) {
     write_zxat_chunk( buffer, block_data, snap );
-
-    for( i = 0; i < libspectrum_snap_zxatasp_pages( snap ); i++ ) {
-      write_atrp_chunk( buffer, block_data, snap, i, compress );
-    }
+    write_atrp_chunks( buffer, block_data, snap, compress );
   }
 
   if( libspectrum_snap_zxcf_active( snap ) ) {
     write_zxcf_chunk( buffer, block_data, snap );
-
-    for( i = 0; i < libspectrum_snap_zxcf_pages( snap ); i++ ) {
-      write_cfrp_chunk( buffer, block_data, snap, i, compress );
-    }
+    write_cfrp_chunks( buffer, block_data, snap, compress );
   }
 
   if( libspectrum_snap_interface2_active( snap ) ) {
@@ -2814,20 +2888,7 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
   }
 
   if( libspectrum_snap_dock_active( snap ) ) {
-    for( i = 0; i < 8; i++ ) {
-      if( libspectrum_snap_exrom_cart( snap, i ) ) {
-        write_dock_chunk( buffer, block_data, snap, 0,
-                          libspectrum_snap_exrom_cart( snap, i ), i,
-                          libspectrum_snap_exrom_ram( snap, i ),
-                          compress );
-      }
-      if( libspectrum_snap_dock_cart( snap, i ) ) {
-        write_dock_chunk( buffer, block_data, snap, 1,
-                          libspectrum_snap_dock_cart( snap, i ), i,
-                          libspectrum_snap_dock_ram( snap, i ),
-                          compress );
-      }
-    }
+    write_dock_chunks( buffer, block_data, snap, compress );
   }
 
   if( libspectrum_snap_interface1_active( snap ) ) {
@@ -2873,9 +2934,7 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
       return error;
     }
 
-    for( i = 0; i < libspectrum_snap_divide_pages( snap ); i++ ) {
-      write_dirp_chunk( buffer, block_data, snap, i, compress );
-    }
+    write_dirp_chunks( buffer, block_data, snap, compress );
   }
 
   if( libspectrum_snap_divmmc_active( snap ) ) {
@@ -2885,9 +2944,7 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
       return error;
     }
 
-    for( i = 0; i < libspectrum_snap_divmmc_pages( snap ); i++ ) {
-      write_dmrp_chunk( buffer, block_data, snap, i, compress );
-    }
+    write_dmrp_chunks( buffer, block_data, snap, compress );
   }
 
   if( libspectrum_snap_spectranet_active( snap ) ) {
@@ -3313,42 +3370,50 @@ write_rom_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+static void
+add_ramp_page( szx_page_set *set, libspectrum_snap *snap, int page )
+{
+  add_ram_page( set, libspectrum_snap_pages( snap, page ), 0x4000, page,
+                0x00 );
+}
+
 static void
 write_ram_pages( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
                  libspectrum_snap *snap, int compress )
 {
   libspectrum_machine machine;
   int i, capabilities; 
+  szx_page_set set = { NULL, 0, 0 };
 
   machine = libspectrum_snap_machine( snap );
   capabilities = libspectrum_machine_capabilities( machine );
 
-  write_ramp_chunk( buffer, block_data, snap, 5, compress );
+  add_ramp_page( &set, snap, 5 );
 
   if( machine != LIBSPECTRUM_MACHINE_16 ) {
-    write_ramp_chunk( buffer, block_data, snap, 2, compress );
-    write_ramp_chunk( buffer, block_data, snap, 0, compress );
+    add_ramp_page( &set, snap, 2 );
+    add_ramp_page( &set, snap, 0 );
   }
 
   if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_128_MEMORY ) {
-    write_ramp_chunk( buffer, block_data, snap, 1, compress );
-    write_ramp_chunk( buffer, block_data, snap, 3, compress );
-    write_ramp_chunk( buffer, block_data, snap, 4, compress );
-    write_ramp_chunk( buffer, block_data, snap, 6, compress );
-    write_ramp_chunk( buffer, block_data, snap, 7, compress );
+    add_ramp_page( &set, snap, 1 );
+    add_ramp_page( &set, snap, 3 );
+    add_ramp_page( &set, snap, 4 );
+    add_ramp_page( &set, snap, 6 );
+    add_ramp_page( &set, snap, 7 );
 
     if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_SCORP_MEMORY ) {
       for( i = 8; i < 16; i++ ) {
-        write_ramp_chunk( buffer, block_data, snap, i, compress );
+        add_ramp_page( &set, snap, i );
       }
     } else if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_PENT512_MEMORY ) {
       for( i = 8; i < 32; i++ ) {
-        write_ramp_chunk( buffer, block_data, snap, i, compress );
+        add_ramp_page( &set, snap, i );
       }
 
       if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_PENT1024_MEMORY ) {
 	for( i = 32; i < 64; i++ ) {
-	  write_ramp_chunk( buffer, block_data, snap, i, compress );
+	  add_ramp_page( &set, snap, i );
 	}
       }
     }
@@ -3356,44 +3421,92 @@ write_ram_pages( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
   }
 
   if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_SE_MEMORY ) {
-    write_ramp_chunk( buffer, block_data, snap, 8, compress );
+    add_ramp_page( &set, snap, 8 );
   }
+
+  write_page_set( buffer, block_data, ZXSTBID_RAMPAGE, &set, compress );
 }
 
 static void
-write_ramp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress )
+add_ram_page( szx_page_set *set, const libspectrum_byte *data,
+              size_t data_length, int page, int extra_flags )
 {
-  const libspectrum_byte *data = libspectrum_snap_pages( snap, page );
+  szx_page *entry;
+
+  if( !data ) return;
 
-  write_ram_page( buffer, block_data, ZXSTBID_RAMPAGE, data, 0x4000, page,
-                  compress, 0x00 );
+  if( set->count == set->allocated ) {
+    set->allocated = set->allocated ? 2 * set->allocated : 16;
+    set->pages = libspectrum_renew( szx_page, set->pages, set->allocated );
+  }
+
+  entry = &( set->pages[ set->count++ ] );
+  entry->data = data;
+  entry->data_length = data_length;
+  entry->page = page;
+  entry->extra_flags = extra_flags;
 }
 
+/* Compress one page of a set; may be run on any thread */
 static void
-write_ram_page( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                const char *id, const libspectrum_byte *data,
-                size_t data_length, int page, int compress, int extra_flags )
+compress_page( void *context, size_t index )
 {
-  libspectrum_buffer *data_buffer;
-  int use_compression;
+  szx_page *entry = (szx_page*)context + index;
 
-  if( !data ) return;
+  entry->compressed = libspectrum_buffer_alloc();
+  entry->use_compression =
+    compress_data_with_codec( entry->compressed, entry->data,
+                              entry->data_length, entry->compress,
+                              entry->codec );
+}
 
-  data_buffer = libspectrum_buffer_alloc();
-  use_compression = compress_data( data_buffer, data, data_length, compress );
+/* Compress all the pages in `set' at once, then write them as `id'
+   chunks in the order they were added, and empty the set */
+static void
+write_page_set( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                const char *id, szx_page_set *set, int compress )
+{
+  libspectrum_zlib_codec *codec = NULL;
+  libspectrum_job_runner runner;
+  size_t i;
+
+  libspectrum_job_runner_get( &runner );
+
+#ifdef HAVE_ZLIB_H
+  /* Pages compressed one after another can all share one zlib state */
+  if( compress && !libspectrum_jobs_in_parallel( &runner, set->count ) )
+    codec = libspectrum_zlib_codec_alloc( compress, 0 );
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+  for( i = 0; i < set->count; i++ ) {
+    set->pages[i].compress = compress;
+    set->pages[i].codec = codec;
+  }
 
-  if( use_compression ) extra_flags |= ZXSTRF_COMPRESSED;
+  libspectrum_run_jobs( &runner, compress_page, set->pages, set->count );
 
-  libspectrum_buffer_write_word( block_data, extra_flags );
+  for( i = 0; i < set->count; i++ ) {
+    szx_page *entry = &( set->pages[i] );
 
-  libspectrum_buffer_write_byte( block_data, (libspectrum_byte)page );
+    int flags = entry->extra_flags;
 
-  libspectrum_buffer_write_buffer( block_data, data_buffer );
+    if( entry->use_compression ) flags |= ZXSTRF_COMPRESSED;
+    libspectrum_buffer_write_word( block_data, flags );
+    libspectrum_buffer_write_byte( block_data,
+                                   (libspectrum_byte)entry->page );
+    libspectrum_buffer_write_buffer( block_data, entry->compressed );
+    libspectrum_buffer_free( entry->compressed );
 
-  libspectrum_buffer_free( data_buffer );
+    write_chunk( buffer, id, block_data );
+  }
+
+#ifdef HAVE_ZLIB_H
+  libspectrum_zlib_codec_free( codec );
+#endif				/* #ifdef HAVE_ZLIB_H */
 
-  write_chunk( buffer, id, block_data );
+  libspectrum_free( set->pages );
+  set->pages = NULL;
+  set->count = set->allocated = 0;
 }
 
 static void
@@ -3474,6 +3587,17 @@ write_b128_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 static int
 compress_data( libspectrum_buffer *dest, const libspectrum_byte *src_data,
                size_t src_data_length, int compress )
+{
+  return compress_data_with_codec( dest, src_data, src_data_length, compress,
+                                   NULL );
+}
+
+/* As compress_data, but using `codec' (if not NULL) to do the work */
+static int
+compress_data_with_codec( libspectrum_buffer *dest,
+                          const libspectrum_byte *src_data,
+                          size_t src_data_length, int compress,
+                          libspectrum_zlib_codec *codec )
 {
   libspectrum_byte *compressed_data = NULL;
   int use_compression = 0;
@@ -3485,8 +3609,16 @@ compress_data( libspectrum_buffer *dest, const libspectrum_byte *src_data,
     libspectrum_error error;
     size_t compressed_length;
 
-    error = libspectrum_zlib_compress( src_data, src_data_length,
-				       &compressed_data, &compressed_length );
+    if( codec ) {
+      error = libspectrum_zlib_codec_deflate( codec, src_data,
+                                              src_data_length,
+                                              &compressed_data,
+                                              &compressed_length );
+    } else {
+      error = libspectrum_zlib_compress2( src_data, src_data_length,
+                                          &compressed_data,
+                                          &compressed_length, compress );
+    }
 
     if( error == LIBSPECTRUM_ERROR_NONE &&
         ( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
@@ -3753,13 +3885,24 @@ write_zxat_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 }
 
 static void
-write_atrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-		  libspectrum_snap *snap, int page, int compress )
+write_atrp_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress )
 {
-  const libspectrum_byte *data = libspectrum_snap_zxatasp_ram( snap, page );
+  szx_page_set set = { NULL, 0, 0 };
+  size_t i;
 
-  write_ram_page( buffer, block_data, ZXSTBID_ZXATASPRAMPAGE, data, 0x4000,
-                  page, compress, 0x00 );
+  /* The page count is written as given, but there is only memory for
+     SNAPSHOT_ZXATASP_PAGES pages */
+  for( i = 0;
+       i < libspectrum_snap_zxatasp_pages( snap ) &&
+         i < SNAPSHOT_ZXATASP_PAGES;
+       i++ ) {
+    add_ram_page( &set, libspectrum_snap_zxatasp_ram( snap, i ), 0x4000, i,
+                  0x00 );
+  }
+
+  write_page_set( buffer, block_data, ZXSTBID_ZXATASPRAMPAGE, &set,
+                  compress );
 }
 
 static void
@@ -3779,13 +3922,20 @@ write_zxcf_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 }
 
 static void
-write_cfrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress )
+write_cfrp_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress )
 {
-  const libspectrum_byte *data = libspectrum_snap_zxcf_ram( snap, page );
+  szx_page_set set = { NULL, 0, 0 };
+  size_t i;
 
-  write_ram_page( buffer, block_data, ZXSTBID_ZXCFRAMPAGE, data, 0x4000, page,
-                  compress, 0x00 );
+  for( i = 0;
+       i < libspectrum_snap_zxcf_pages( snap ) && i < SNAPSHOT_ZXCF_PAGES;
+       i++ ) {
+    add_ram_page( &set, libspectrum_snap_zxcf_ram( snap, i ), 0x4000, i,
+                  0x00 );
+  }
+
+  write_page_set( buffer, block_data, ZXSTBID_ZXCFRAMPAGE, &set, compress );
 }
 
 #ifdef HAVE_ZLIB_H
@@ -3818,18 +3968,22 @@ write_if2r_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
 #endif                         /* #ifdef HAVE_ZLIB_H */
 
 static void
-write_dock_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-		  libspectrum_snap *snap, int exrom_dock,
-                  const libspectrum_byte *data, int page, int writeable,
-                  int compress )
+write_dock_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress )
 {
-  libspectrum_byte extra_flags = 0;
+  szx_page_set set = { NULL, 0, 0 };
+  int i;
 
-  if( writeable  ) extra_flags |= ZXSTDOCKF_RAM;
-  if( exrom_dock ) extra_flags |= ZXSTDOCKF_EXROMDOCK;
+  for( i = 0; i < 8; i++ ) {
+    add_ram_page( &set, libspectrum_snap_exrom_cart( snap, i ), 0x2000, i,
+                  libspectrum_snap_exrom_ram( snap, i ) ? ZXSTDOCKF_RAM : 0 );
+    add_ram_page( &set, libspectrum_snap_dock_cart( snap, i ), 0x2000, i,
+                  ZXSTDOCKF_EXROMDOCK |
+                    ( libspectrum_snap_dock_ram( snap, i ) ?
+                      ZXSTDOCKF_RAM : 0 ) );
+  }
 
-  write_ram_page( buffer, block_data, ZXSTBID_DOCK, data, 0x2000, page,
-                  compress, extra_flags );
+  write_page_set( buffer, block_data, ZXSTBID_DOCK, &set, compress );
 }
 
 static void
@@ -3941,30 +4095,41 @@ write_dmmc_chunk( libspectrum_buffer *buffer, libspectrum_buffer *data,
 }
 
 static void
-write_divxxx_ram_chunk( libspectrum_buffer *buffer,
-                        libspectrum_buffer *block_data, libspectrum_snap *snap,
-                        int page, int compress,
-                        libspectrum_byte* (*get_data)( libspectrum_snap*, int ),
-                        const char *id )
+write_divxxx_ram_chunks( libspectrum_buffer *buffer,
+                         libspectrum_buffer *block_data,
+                         libspectrum_snap *snap, int compress,
+                         libspectrum_byte* (*get_data)( libspectrum_snap*,
+                                                        int ),
+                         size_t (*get_pages)( libspectrum_snap* ),
+                         size_t max_pages, const char *id )
 {
-  const libspectrum_byte *data = get_data( snap, page );
-  write_ram_page( buffer, block_data, id, data, 0x2000, page, compress, 0x00 );
+  szx_page_set set = { NULL, 0, 0 };
+  size_t i;
+
+  for( i = 0; i < get_pages( snap ) && i < max_pages; i++ )
+    add_ram_page( &set, get_data( snap, i ), 0x2000, i, 0x00 );
+
+  write_page_set( buffer, block_data, id, &set, compress );
 }
 
 static void
-write_dirp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress )
+write_dirp_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress )
 {
-  write_divxxx_ram_chunk( buffer, block_data, snap, page, compress,
-                          libspectrum_snap_divide_ram, ZXSTBID_DIVIDERAMPAGE );
+  write_divxxx_ram_chunks( buffer, block_data, snap, compress,
+                           libspectrum_snap_divide_ram,
+                           libspectrum_snap_divide_pages,
+                           SNAPSHOT_DIVIDE_PAGES, ZXSTBID_DIVIDERAMPAGE );
 }
 
 static void
-write_dmrp_chunk( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                  libspectrum_snap *snap, int page, int compress )
+write_dmrp_chunks( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                   libspectrum_snap *snap, int compress )
 {
-  write_divxxx_ram_chunk( buffer, block_data, snap, page, compress,
-                          libspectrum_snap_divmmc_ram, ZXSTBID_DIVMMCRAMPAGE );
+  write_divxxx_ram_chunks( buffer, block_data, snap, compress,
+                           libspectrum_snap_divmmc_ram,
+                           libspectrum_snap_divmmc_pages,
+                           SNAPSHOT_DIVMMC_PAGES, ZXSTBID_DIVMMCRAMPAGE );
 }
 
 static void
@@ -70,7 +70,8 @@ internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
       return LIBSPECTRUM_ERROR_CORRUPT;
     }
 
-    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ROM );
+    block =
+      libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_ROM );
 
     /* Get the length, and move along the buffer */
     data_length = ptr[0] + ptr[1] * 0x100;
@@ -88,8 +89,8 @@ internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
 
     /* Have we got enough bytes left in buffer? */
     if( end - ptr < (ptrdiff_t)buf_length ) {
+      libspectrum_tape_arena_free( tape, block );
       libspectrum_tape_clear( tape );
-      libspectrum_free( block );
       libspectrum_print_error(
         LIBSPECTRUM_ERROR_CORRUPT,
         "libspectrum_tap_read: not enough data in buffer"
@@ -98,7 +99,7 @@ internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
     }
 
     /* Allocate memory for the data */
-    data = libspectrum_new( libspectrum_byte, data_length );
+    data = libspectrum_tape_arena_new( tape, libspectrum_byte, data_length );
     libspectrum_tape_block_set_data( block, data );
 
     /* Copy the block data across */
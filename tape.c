@@ -23,24 +23,98 @@
 
 #include <config.h>
 
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "internals.h"
 #include "tape_block.h"
 
+/* One block as it is played, in the order it is played */
+typedef struct tape_index_entry {
+
+  size_t position;		/* Position of the block on the tape */
+
+  /* The loop state when the block is started */
+  size_t loop_block;
+  size_t loop_count;
+
+  libspectrum_qword start;	/* tstates from the start of the tape */
+
+} tape_index_entry;
+
+/* The state of a block at regular intervals through it */
+typedef struct tape_checkpoint {
+
+  libspectrum_qword tstates;	/* tstates from the start of the block */
+  libspectrum_tape_block_state state;
+
+} tape_checkpoint;
+
+typedef struct tape_block_checkpoints {
+
+  int done;			/* Have the checkpoints been found yet? */
+  size_t count;
+  tape_checkpoint *checkpoints;
+
+} tape_block_checkpoints;
+
+/* Used to find the block being played at any given time */
+typedef struct tape_index {
+
+  size_t count;
+  tape_index_entry *entries;
+
+  libspectrum_qword length;	/* Total tstates covered by the index */
+
+  /* For each block on the tape, the first entry which plays it (or
+   `count' if it is never played), and its checkpoints */
+  size_t block_count;
+  size_t *first_entry;
+  tape_block_checkpoints *blocks;
+
+} tape_index;
+
+/* A chunk of memory in a tape's arena; the memory handed out follows the
+   header, aligned as for any type */
+typedef struct tape_arena_chunk {
+
+  struct tape_arena_chunk *next;
+  size_t size, used;
+
+} tape_arena_chunk;
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_ROUND( n ) \
+  ( ( (n) + ARENA_ALIGNMENT - 1 ) & ~(size_t)( ARENA_ALIGNMENT - 1 ) )
+#define ARENA_HEADER ARENA_ROUND( sizeof( tape_arena_chunk ) )
+
+/* The first chunk is this big; each one after that is twice the size of
+   the one before up to the maximum, so a tape needs few chunks */
+#define ARENA_CHUNK_MIN 0x10000
+#define ARENA_CHUNK_MAX 0x400000
+
 /* The tape type itself */
 struct libspectrum_tape {
 
-  /* All the blocks */
-  GSList* blocks;
-
-  /* The last block */
-  GSList* last_block;
+  /* All the blocks, followed by a NULL */
+  libspectrum_tape_block **blocks;
+  size_t count, allocated;
 
   /* The state of the current block */
   libspectrum_tape_block_state state;
 
+  /* Built when first needed by libspectrum_tape_seek_tstates() or
+     libspectrum_tape_tell_tstates() */
+  tape_index *index;
+
+  /* The chunks of memory which blocks read with
+     LIBSPECTRUM_FLAG_TAPE_ARENA were allocated from, newest first; all
+     freed at once when the tape is cleared */
+  tape_arena_chunk *arena;
+  int use_arena;		/* Should new blocks come from the arena? */
+
 };
 
 /*** Constants ***/
@@ -55,10 +129,6 @@ const libspectrum_dword LIBSPECTRUM_TAPE_TIMING_TAIL  =  945; /*Tail*/
 
 /*** Local function prototypes ***/
 
-/* Free the memory used by a block */
-static void
-block_free( gpointer data, gpointer user_data );
-
 /* Functions to get the next edge */
 
 static libspectrum_error
@@ -100,12 +170,13 @@ raw_data_edge( libspectrum_tape_raw_data_block *block,
                int *flags );
 
 static libspectrum_error
-jump_blocks( libspectrum_tape *tape, int offset );
+jump_blocks( libspectrum_tape *tape, libspectrum_tape_block_state *it,
+             int offset );
 
 static libspectrum_error
 rle_pulse_edge( libspectrum_tape_rle_pulse_block *block,
                 libspectrum_tape_rle_pulse_block_state *state,
-		libspectrum_dword *tstates, int *end_of_block );
+		libspectrum_dword *tstates, int *end_of_block, int *flags );
 
 static libspectrum_error
 pulse_sequence_edge( libspectrum_tape_pulse_sequence_block *block,
@@ -122,6 +193,17 @@ data_block_edge( libspectrum_tape_data_block *block,
                  libspectrum_tape_data_block_state *state,
                  libspectrum_dword *tstates, int *end_of_block, int *flags );
 
+static libspectrum_error
+block_edge( libspectrum_tape_block *block, libspectrum_tape_block_state *it,
+            libspectrum_dword *tstates, int *end_of_block, int *flags );
+
+static libspectrum_error
+check_compiled( libspectrum_tape_block *block,
+                libspectrum_tape_block_state *it );
+static void
+compiled_edge( libspectrum_tape_compiled_block_state *state,
+               libspectrum_dword *tstates, int *end_of_block, int *flags );
+
 /*** Function definitions ****/
 
 /* Allocate a list of blocks */
@@ -130,9 +212,16 @@ libspectrum_tape_alloc( void )
 {
   libspectrum_tape *tape = libspectrum_new( libspectrum_tape, 1 );
   tape->blocks = NULL;
-  tape->last_block = NULL;
-  libspectrum_tape_iterator_init( &(tape->state.current_block), tape );
-  tape->state.loop_block = NULL;
+  tape->count = tape->allocated = 0;
+  tape->state.current_block = 0;
+  tape->state.loop_block = 0;
+  tape->state.loop_count = 0;
+  tape->state.index_entry = 0;
+  tape->state.block_tstates = 0;
+  tape->state.compiled.block = NULL;
+  tape->index = NULL;
+  tape->arena = NULL;
+  tape->use_arena = 0;
   return tape;
 }
 
@@ -140,10 +229,28 @@ libspectrum_tape_alloc( void )
 libspectrum_error
 libspectrum_tape_clear( libspectrum_tape *tape )
 {
-  g_slist_foreach( tape->blocks, block_free, NULL );
-  g_slist_free( tape->blocks );
+  size_t i;
+
+  libspectrum_tape_invalidate_index( tape );
+
+  /* Blocks wholly in the arena only need their compiled pulses freed
+     before the arena goes */
+  for( i = 0; i < tape->count; i++ )
+    libspectrum_tape_block_free( tape->blocks[i] );
+  libspectrum_free( tape->blocks );
+
+  while( tape->arena ) {
+    tape_arena_chunk *next = tape->arena->next;
+    libspectrum_free( tape->arena );
+    tape->arena = next;
+  }
+
   tape->blocks = NULL;
-  libspectrum_tape_iterator_init( &(tape->state.current_block), tape );
+  tape->count = tape->allocated = 0;
+  tape->state.current_block = 0;
+  tape->state.loop_block = 0;
+  tape->state.loop_count = 0;
+  tape->state.index_entry = LIBSPECTRUM_TAPE_INDEX_UNKNOWN;
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -162,23 +269,123 @@ libspectrum_tape_free( libspectrum_tape *tape )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
-/* Free the memory used by one block */
-static void
-block_free( gpointer data, gpointer user_data GCC_UNUSED )
+void*
+libspectrum_tape_arena_malloc_n( libspectrum_tape *tape, size_t nmemb,
+                                 size_t size )
+{
+  tape_arena_chunk *chunk;
+  size_t chunk_size;
+  void *ptr;
+
+  if( !tape || !tape->use_arena ) return libspectrum_malloc_n( nmemb, size );
+
+  /* Leave room for the rounding and the chunk header */
+  if( size && nmemb > SIZE_MAX / 2 / size ) abort();
+  size *= nmemb;
+
+  /* Even empty allocations get some space, so every pointer handed out
+     lies inside a chunk */
+  size = ARENA_ROUND( size ? size : 1 );
+
+  chunk = tape->arena;
+
+  if( !chunk || chunk->size - chunk->used < size ) {
+
+    chunk_size = chunk ? chunk->size * 2 : ARENA_CHUNK_MIN;
+    if( chunk_size > ARENA_CHUNK_MAX ) chunk_size = ARENA_CHUNK_MAX;
+
+    if( size > chunk_size / 2 ) {
+
+      /* Big allocations get a chunk of their own, which goes behind the
+         current chunk so any space left there can still be used */
+      chunk = libspectrum_malloc( ARENA_HEADER + size );
+      chunk->size = chunk->used = size;
+
+      if( tape->arena ) {
+        chunk->next = tape->arena->next; tape->arena->next = chunk;
+      } else {
+        chunk->next = NULL; tape->arena = chunk;
+      }
+
+      return (libspectrum_byte*)chunk + ARENA_HEADER;
+    }
+
+    chunk = libspectrum_malloc( ARENA_HEADER + chunk_size );
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    chunk->next = tape->arena;
+    tape->arena = chunk;
+  }
+
+  ptr = (libspectrum_byte*)chunk + ARENA_HEADER + chunk->used;
+  chunk->used += size;
+
+  return ptr;
+}
+
+void
+libspectrum_tape_arena_free( libspectrum_tape *tape, void *ptr )
+{
+  if( !libspectrum_tape_arena_owns( tape, ptr ) ) libspectrum_free( ptr );
+}
+
+int
+libspectrum_tape_using_arena( libspectrum_tape *tape )
+{
+  return tape && tape->use_arena;
+}
+
+int
+libspectrum_tape_arena_owns( libspectrum_tape *tape, const void *ptr )
+{
+  const tape_arena_chunk *chunk;
+  const libspectrum_byte *start;
+
+  if( !tape || !ptr ) return 0;
+
+  for( chunk = tape->arena; chunk; chunk = chunk->next ) {
+    start = (const libspectrum_byte*)chunk + ARENA_HEADER;
+    if( (const libspectrum_byte*)ptr >= start &&
+        (const libspectrum_byte*)ptr < start + chunk->used )
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Get the block being played by `it', or NULL if the tape is empty */
+static libspectrum_tape_block*
+state_block( libspectrum_tape *tape, libspectrum_tape_block_state *it )
 {
-  libspectrum_tape_block_free( data );
+  return it->current_block < tape->count ? tape->blocks[ it->current_block ]
+                                         : NULL;
 }
 
+/* The flags that can be given to libspectrum_tape_read2() */
+const int LIBSPECTRUM_FLAG_TAPE_BORROW_DATA = 1 << 0;
+const int LIBSPECTRUM_FLAG_TAPE_STREAM_DATA = 1 << 1;
+const int LIBSPECTRUM_FLAG_TAPE_ARENA = 1 << 2;
+
 /* Read in a tape file, optionally guessing what sort of file it is */
 libspectrum_error
 libspectrum_tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
 		       size_t length, libspectrum_id_t type,
 		       const char *filename )
+{
+  return libspectrum_tape_read2( tape, buffer, length, type, filename, 0 );
+}
+
+libspectrum_error
+libspectrum_tape_read2( libspectrum_tape *tape, const libspectrum_byte *buffer,
+                        size_t length, libspectrum_id_t type,
+                        const char *filename, int flags )
 {
   libspectrum_id_t raw_type;
   libspectrum_class_t class;
   libspectrum_byte *new_buffer;
   libspectrum_error error;
+  int borrow_data = flags & LIBSPECTRUM_FLAG_TAPE_BORROW_DATA;
+  int stream_data = flags & LIBSPECTRUM_FLAG_TAPE_STREAM_DATA;
 
   /* If we don't know what sort of file this is, make a best guess */
   if( type == LIBSPECTRUM_ID_UNKNOWN ) {
@@ -212,8 +419,13 @@ libspectrum_tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
 					 raw_type, buffer, length, NULL );
     if( error ) return error;
     buffer = new_buffer; length = new_length;
+
+    /* The uncompressed data goes away once we're done */
+    borrow_data = 0;
   }
 
+  tape->use_arena = flags & LIBSPECTRUM_FLAG_TAPE_ARENA;
+
   switch( type ) {
 
   case LIBSPECTRUM_ID_TAPE_TAP:
@@ -223,7 +435,9 @@ libspectrum_tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
     error = internal_tap_read( tape, buffer, length, type ); break;
 
   case LIBSPECTRUM_ID_TAPE_TZX:
-    error = internal_tzx_read( tape, buffer, length ); break;
+    error = internal_tzx_read( tape, buffer, length, borrow_data,
+                               stream_data );
+    break;
 
   case LIBSPECTRUM_ID_TAPE_WARAJEVO:
     error = internal_warajevo_read( tape, buffer, length ); break;
@@ -232,37 +446,42 @@ libspectrum_tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
     error = libspectrum_z80em_read( tape, buffer, length ); break;
 
   case LIBSPECTRUM_ID_TAPE_CSW:
-    error = libspectrum_csw_read( tape, buffer, length ); break;
+    error = libspectrum_csw_read( tape, buffer, length, stream_data );
+    break;
 
   case LIBSPECTRUM_ID_TAPE_WAV:
-#ifdef HAVE_LIB_AUDIOFILE
-    error = libspectrum_wav_read( tape, filename ); break;
-#else     /* #ifdef HAVE_LIB_AUDIOFILE */
-    error = LIBSPECTRUM_ERROR_LOGIC;
-    libspectrum_print_error(
-      LIBSPECTRUM_ERROR_LOGIC,
-      "libspectrum_tape_read: format not supported without libaudiofile"
-    );
-    break;
-#endif    /* #ifdef HAVE_LIB_AUDIOFILE */
+    error = libspectrum_wav_read( tape, buffer, length, filename ); break;
 
   case LIBSPECTRUM_ID_TAPE_PZX:
-    error = internal_pzx_read( tape, buffer, length ); break;
+    error = internal_pzx_read( tape, buffer, length, borrow_data ); break;
 
   default:
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
 			     "libspectrum_tape_read: not a tape file" );
-    libspectrum_free( new_buffer );
-    return LIBSPECTRUM_ERROR_CORRUPT;
+    error = LIBSPECTRUM_ERROR_CORRUPT;
+    break;
   }
 
+  tape->use_arena = 0;
+
   libspectrum_free( new_buffer );
   return error;
 }
 
+/* The flags that can be given to libspectrum_tape_write2() */
+const int LIBSPECTRUM_FLAG_TAPE_CSW_BLOCKS = 1 << 0;
+
 libspectrum_error
 libspectrum_tape_write( libspectrum_byte **buffer, size_t *length,
 			libspectrum_tape *tape, libspectrum_id_t type )
+{
+  return libspectrum_tape_write2( buffer, length, tape, type, 0 );
+}
+
+libspectrum_error
+libspectrum_tape_write2( libspectrum_byte **buffer, size_t *length,
+                         libspectrum_tape *tape, libspectrum_id_t type,
+                         int flags )
 {
   libspectrum_byte *ptr = *buffer;
   libspectrum_buffer *new_buffer;
@@ -293,11 +512,11 @@ libspectrum_tape_write( libspectrum_byte **buffer, size_t *length,
     break;
 
   case LIBSPECTRUM_ID_TAPE_TZX:
-    error = internal_tzx_write( new_buffer, tape );
+    error = internal_tzx_write( new_buffer, tape, flags );
     break;
 
   case LIBSPECTRUM_ID_TAPE_CSW:
-    error = libspectrum_csw_write( new_buffer, tape );
+    error = libspectrum_csw_write( new_buffer, tape, flags );
     break;
 
   default:
@@ -318,7 +537,7 @@ libspectrum_tape_write( libspectrum_byte **buffer, size_t *length,
 int
 libspectrum_tape_present( const libspectrum_tape *tape )
 {
-  return tape->blocks != NULL;
+  return tape->count != 0;
 }
 
 /* Some flags which may be set after calling libspectrum_tape_get_next_edge */
@@ -335,6 +554,39 @@ const int LIBSPECTRUM_TAPE_FLAGS_LENGTH_LONG = 1 << 7; /* Long edge; used for
                                                           loader acceleration */
 const int LIBSPECTRUM_TAPE_FLAGS_TAPE       = 1 << 8; /* End of tape */
 
+/* Called when an edge has ended the current block: flag that, move onto
+   the next block (unless we've been told not to) and initialise it */
+static libspectrum_error
+end_block( libspectrum_tape *tape, libspectrum_tape_block_state *it,
+           int *flags, int no_advance )
+{
+  *flags |= LIBSPECTRUM_TAPE_FLAGS_BLOCK;
+
+  /* Whatever happens, we're onto the next block in playing order */
+  if( it->index_entry != LIBSPECTRUM_TAPE_INDEX_UNKNOWN ) it->index_entry++;
+
+  /* Advance to the next block, unless we've been told not to */
+  if( !no_advance ) {
+
+    it->current_block++;
+
+    /* If we've just hit the end of the tape, stop the tape (and
+       then `rewind' to the start) */
+    if( it->current_block >= tape->count ) {
+      *flags |= LIBSPECTRUM_TAPE_FLAGS_STOP;
+      *flags |= LIBSPECTRUM_TAPE_FLAGS_TAPE;
+      /* Need to have an edge at the end of the tape to terminate the last
+         pulse so clear the NO_EDGE flag if it has been set */
+      *flags &= ~LIBSPECTRUM_TAPE_FLAGS_NO_EDGE;
+      it->current_block = 0;
+      it->index_entry = 0;
+    }
+  }
+
+  /* Initialise the new block */
+  return libspectrum_tape_block_init( state_block( tape, it ), it );
+}
+
 libspectrum_error
 libspectrum_tape_get_next_edge_internal( libspectrum_dword *tstates,
                                          int *flags,
@@ -343,8 +595,7 @@ libspectrum_tape_get_next_edge_internal( libspectrum_dword *tstates,
 {
   int error;
 
-  libspectrum_tape_block *block =
-    libspectrum_tape_iterator_current( it->current_block );
+  libspectrum_tape_block *block = state_block( tape, it );
 
   /* Has this edge ended the block? */
   int end_of_block = 0;
@@ -356,43 +607,25 @@ libspectrum_tape_get_next_edge_internal( libspectrum_dword *tstates,
   *flags = 0;
 
   if( block ) {
+    error = check_compiled( block, it );
+    if( error ) return error;
+  }
+
+  if( block && it->compiled.block ) {
+    compiled_edge( &(it->compiled), tstates, &end_of_block, flags );
+  } else if( block ) {
     switch( block->type ) {
     case LIBSPECTRUM_TAPE_BLOCK_ROM:
-      error = rom_edge( &(block->types.rom), &(it->block_state.rom), tstates,
-                        &end_of_block, flags );
-      if( error ) return error;
-      break;
     case LIBSPECTRUM_TAPE_BLOCK_TURBO:
-      error = turbo_edge( &(block->types.turbo), &(it->block_state.turbo), tstates,
-                          &end_of_block, flags );
-      if( error ) return error;
-      break;
     case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
-      error = tone_edge( &(block->types.pure_tone), &(it->block_state.pure_tone),
-                         tstates, &end_of_block );
-      if( error ) return error;
-      break;
     case LIBSPECTRUM_TAPE_BLOCK_PULSES:
-      error = pulses_edge( &(block->types.pulses), &(it->block_state.pulses),
-                           tstates, &end_of_block );
-      if( error ) return error;
-      break;
     case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
-      error = pure_data_edge( &(block->types.pure_data),
-                              &(it->block_state.pure_data), tstates,
-			      &end_of_block, flags );
-      if( error ) return error;
-      break;
     case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
-      error = raw_data_edge( &(block->types.raw_data), &(it->block_state.raw_data),
-                             tstates, &end_of_block, flags );
-      if( error ) return error;
-      break;
-
     case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
-      error = generalised_data_edge( &(block->types.generalised_data),
-                                     &(it->block_state.generalised_data),
-                                     tstates, &end_of_block, flags );
+    case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+    case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
+    case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+      error = block_edge( block, it, tstates, &end_of_block, flags );
       if( error ) return error;
       break;
 
@@ -410,27 +643,26 @@ libspectrum_tape_get_next_edge_internal( libspectrum_dword *tstates,
       break;
 
     case LIBSPECTRUM_TAPE_BLOCK_JUMP:
-      error = jump_blocks( tape, block->types.jump.offset );
+      error = jump_blocks( tape, it, block->types.jump.offset );
       if( error ) return error;
       *tstates = 0; *flags |= LIBSPECTRUM_TAPE_FLAGS_NO_EDGE; end_of_block = 1;
       no_advance = 1;
       break;
 
     case LIBSPECTRUM_TAPE_BLOCK_LOOP_START:
-      if( it->current_block->next && block->types.loop_start.count ) {
-        it->loop_block = it->current_block->next;
+      if( it->current_block + 1 < tape->count &&
+          block->types.loop_start.count ) {
+        it->loop_block = it->current_block + 1;
         it->loop_count = block->types.loop_start.count;
       }
       *tstates = 0; *flags |= LIBSPECTRUM_TAPE_FLAGS_NO_EDGE; end_of_block = 1;
       break;
 
     case LIBSPECTRUM_TAPE_BLOCK_LOOP_END:
-      if( it->loop_block ) {
+      if( it->loop_count ) {
         if( --(it->loop_count) ) {
           it->current_block = it->loop_block;
           no_advance = 1;
-        } else {
-          it->loop_block = NULL;
         }
       }
       *tstates = 0; *flags |= LIBSPECTRUM_TAPE_FLAGS_NO_EDGE; end_of_block = 1;
@@ -461,26 +693,6 @@ libspectrum_tape_get_next_edge_internal( libspectrum_dword *tstates,
       *tstates = 0; *flags |= LIBSPECTRUM_TAPE_FLAGS_NO_EDGE; end_of_block = 1;
       break;
 
-    case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
-      error = rle_pulse_edge( &(block->types.rle_pulse),
-                              &(it->block_state.rle_pulse), tstates, &end_of_block);
-      if( error ) return error;
-      break;
-
-    case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
-      error = pulse_sequence_edge( &(block->types.pulse_sequence),
-                                   &(it->block_state.pulse_sequence), tstates,
-                                   &end_of_block, flags );
-      if( error ) return error;
-      break;
-
-    case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
-      error = data_block_edge( &(block->types.data_block),
-                               &(it->block_state.data_block), tstates,
-                               &end_of_block, flags );
-      if( error ) return error;
-      break;
-
     default:
       *tstates = 0;
       libspectrum_print_error(
@@ -495,34 +707,12 @@ libspectrum_tape_get_next_edge_internal( libspectrum_dword *tstates,
     end_of_block = 1;
   }
 
+  it->block_tstates += *tstates;
+
   /* If that ended the block, move onto the next block */
   if( end_of_block ) {
-
-    *flags |= LIBSPECTRUM_TAPE_FLAGS_BLOCK;
-
-    /* Advance to the next block, unless we've been told not to */
-    if( !no_advance ) {
-
-      libspectrum_tape_iterator_next( &(it->current_block) );
-
-      /* If we've just hit the end of the tape, stop the tape (and
-	 then `rewind' to the start) */
-      if( libspectrum_tape_iterator_current( it->current_block ) == NULL ) {
-	*flags |= LIBSPECTRUM_TAPE_FLAGS_STOP;
-        *flags |= LIBSPECTRUM_TAPE_FLAGS_TAPE;
-        /* Need to have an edge at the end of the tape to terminate the last
-           pulse so clear the NO_EDGE flag if it has been set */
-        *flags &= ~LIBSPECTRUM_TAPE_FLAGS_NO_EDGE;
-        libspectrum_tape_iterator_init( &(it->current_block), tape );
-      }
-    }
-
-    /* Initialise the new block */
-    error = libspectrum_tape_block_init(
-                      libspectrum_tape_iterator_current( it->current_block ),
-                      it );
+    error = end_block( tape, it, flags, no_advance );
     if( error ) return error;
-
   }
 
   return LIBSPECTRUM_ERROR_NONE;
@@ -539,6 +729,294 @@ libspectrum_tape_get_next_edge( libspectrum_dword *tstates, int *flags,
                                                   &(tape->state) );
 }
 
+/* The number of edges in a byte of ROM, turbo or pure data */
+#define EDGES_PER_BYTE 16
+
+/* Are we at the start of a byte of data which can be played in one go,
+   that is a whole byte which isn't the last one in the block? */
+#define WHOLE_DATA_BYTE( block, state ) \
+  ( (state)->state == LIBSPECTRUM_TAPE_STATE_DATA1 && \
+    (state)->bits_through_byte == 0 && \
+    (state)->bytes_through_block + 1 < (block)->length )
+
+/* Give the EDGES_PER_BYTE edges for `byte'. The lengths and flags are
+   picked from two-entry tables by each bit, so there's no branching */
+static void
+data_byte_edges( libspectrum_byte byte, libspectrum_dword bit0_length,
+                 libspectrum_dword bit1_length, libspectrum_dword *tstates,
+                 int *flags )
+{
+  const libspectrum_dword lengths[2] = { bit0_length, bit1_length };
+  const int length_flags[2] = {
+    LIBSPECTRUM_TAPE_FLAGS_LENGTH_SHORT,
+    bit1_length == bit0_length ? LIBSPECTRUM_TAPE_FLAGS_LENGTH_SHORT :
+                                 LIBSPECTRUM_TAPE_FLAGS_LENGTH_LONG
+  };
+  int i, bit;
+
+  for( i = 0; i < EDGES_PER_BYTE; i += 2, byte <<= 1 ) {
+    bit = byte >> 7;
+    tstates[i] = tstates[i+1] = lengths[ bit ];
+    flags[i] = flags[i+1] = length_flags[ bit ];
+  }
+}
+
+/* Get up to `max' edges in one go. The block type is looked up once per
+   block rather than once per edge, whole bytes of ROM, turbo and pure
+   data are played at once, and we stop early after any edge which
+   asks for the tape to be stopped so the caller can act on it */
+libspectrum_error
+libspectrum_tape_get_next_edges_internal( libspectrum_dword *tstates,
+                                          int *flags, size_t max,
+                                          size_t *count,
+                                          libspectrum_tape *tape,
+                                          libspectrum_tape_block_state *it )
+{
+  libspectrum_error error;
+  size_t n = 0;
+
+  while( n < max ) {
+
+    libspectrum_tape_block *block = state_block( tape, it );
+    int end_of_block = 0;
+    size_t first = n;
+
+    if( !block ) {
+      error = libspectrum_tape_get_next_edge_internal( &tstates[n], &flags[n],
+                                                       tape, it );
+      if( error ) { *count = n; return error; }
+      n++;
+      break;
+    }
+
+    error = check_compiled( block, it );
+    if( error ) { *count = n; return error; }
+
+    if( it->compiled.block ) {
+
+      while( n < max && !end_of_block ) {
+        flags[n] = 0;
+        compiled_edge( &(it->compiled), &tstates[n], &end_of_block,
+                       &flags[n] );
+        n++;
+      }
+
+    } else {
+
+      switch( block->type ) {
+
+      case LIBSPECTRUM_TAPE_BLOCK_ROM:
+        while( n < max && !end_of_block ) {
+          libspectrum_tape_rom_block *rom = &(block->types.rom);
+          libspectrum_tape_rom_block_state *state = &(it->block_state.rom);
+          if( max - n >= EDGES_PER_BYTE && WHOLE_DATA_BYTE( rom, state ) ) {
+            data_byte_edges( rom->data[ state->bytes_through_block ],
+                             LIBSPECTRUM_TAPE_TIMING_DATA0,
+                             LIBSPECTRUM_TAPE_TIMING_DATA1, &tstates[n],
+                             &flags[n] );
+            n += EDGES_PER_BYTE;
+            state->bits_through_byte = 7;
+            error = rom_next_bit( rom, state );
+            if( error ) { *count = n; return error; }
+            continue;
+          }
+          flags[n] = 0;
+          error = rom_edge( &(block->types.rom), &(it->block_state.rom),
+                            &tstates[n], &end_of_block, &flags[n] );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+        while( n < max && !end_of_block ) {
+          libspectrum_tape_turbo_block *turbo = &(block->types.turbo);
+          libspectrum_tape_turbo_block_state *state = &(it->block_state.turbo);
+          if( max - n >= EDGES_PER_BYTE && WHOLE_DATA_BYTE( turbo, state ) ) {
+            data_byte_edges( turbo->data[ state->bytes_through_block ],
+                             turbo->bit0_length, turbo->bit1_length,
+                             &tstates[n], &flags[n] );
+            n += EDGES_PER_BYTE;
+            state->bits_through_byte = 7;
+            error = turbo_next_bit( turbo, state );
+            if( error ) { *count = n; return error; }
+            continue;
+          }
+          flags[n] = 0;
+          error = turbo_edge( &(block->types.turbo), &(it->block_state.turbo),
+                              &tstates[n], &end_of_block, &flags[n] );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
+        while( n < max && !end_of_block ) {
+          flags[n] = 0;
+          error = tone_edge( &(block->types.pure_tone),
+                             &(it->block_state.pure_tone), &tstates[n],
+                             &end_of_block );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      case LIBSPECTRUM_TAPE_BLOCK_PULSES:
+        while( n < max && !end_of_block ) {
+          flags[n] = 0;
+          error = pulses_edge( &(block->types.pulses),
+                               &(it->block_state.pulses), &tstates[n],
+                               &end_of_block );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+        while( n < max && !end_of_block ) {
+          libspectrum_tape_pure_data_block *data = &(block->types.pure_data);
+          libspectrum_tape_pure_data_block_state *state =
+            &(it->block_state.pure_data);
+          if( max - n >= EDGES_PER_BYTE && WHOLE_DATA_BYTE( data, state ) ) {
+            data_byte_edges( data->data[ state->bytes_through_block ],
+                             data->bit0_length, data->bit1_length,
+                             &tstates[n], &flags[n] );
+            n += EDGES_PER_BYTE;
+            state->bits_through_byte = 7;
+            error = libspectrum_tape_pure_data_next_bit( data, state );
+            if( error ) { *count = n; return error; }
+            continue;
+          }
+          flags[n] = 0;
+          error = pure_data_edge( &(block->types.pure_data),
+                                  &(it->block_state.pure_data), &tstates[n],
+                                  &end_of_block, &flags[n] );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+        while( n < max && !end_of_block ) {
+          flags[n] = 0;
+          error = raw_data_edge( &(block->types.raw_data),
+                                 &(it->block_state.raw_data), &tstates[n],
+                                 &end_of_block, &flags[n] );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
+        while( n < max && !end_of_block ) {
+          flags[n] = 0;
+          error = generalised_data_edge( &(block->types.generalised_data),
+                                         &(it->block_state.generalised_data),
+                                         &tstates[n], &end_of_block,
+                                         &flags[n] );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+        while( n < max && !end_of_block ) {
+          flags[n] = 0;
+          error = rle_pulse_edge( &(block->types.rle_pulse),
+                                  &(it->block_state.rle_pulse), &tstates[n],
+                                  &end_of_block, &flags[n] );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
+        while( n < max && !end_of_block ) {
+          flags[n] = 0;
+          error = pulse_sequence_edge( &(block->types.pulse_sequence),
+                                       &(it->block_state.pulse_sequence),
+                                       &tstates[n], &end_of_block, &flags[n] );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+        while( n < max && !end_of_block ) {
+          flags[n] = 0;
+          error = data_block_edge( &(block->types.data_block),
+                                   &(it->block_state.data_block), &tstates[n],
+                                   &end_of_block, &flags[n] );
+          if( error ) { *count = n; return error; }
+          n++;
+        }
+        break;
+
+      default:
+        /* Everything else produces at most one edge before moving on, so
+           just use the general routine */
+        error = libspectrum_tape_get_next_edge_internal( &tstates[n], &flags[n],
+                                                         tape, it );
+        if( error ) { *count = n; return error; }
+        n++;
+        if( !( flags[n-1] & ( LIBSPECTRUM_TAPE_FLAGS_STOP |
+                              LIBSPECTRUM_TAPE_FLAGS_STOP48 ) ) )
+          continue;
+        *count = n;
+        return LIBSPECTRUM_ERROR_NONE;
+      }
+
+    }
+
+    for( ; first < n; first++ ) it->block_tstates += tstates[ first ];
+
+    if( end_of_block ) {
+      error = end_block( tape, it, &flags[n-1], 0 );
+      if( error ) { *count = n; return error; }
+      if( flags[n-1] & ( LIBSPECTRUM_TAPE_FLAGS_STOP |
+                         LIBSPECTRUM_TAPE_FLAGS_STOP48 ) )
+        break;
+    }
+  }
+
+  *count = n;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_tape_get_next_edges( libspectrum_dword *tstates, int *flags,
+                                 size_t max, size_t *count,
+                                 libspectrum_tape *tape )
+{
+  return libspectrum_tape_get_next_edges_internal( tstates, flags, max, count,
+                                                   tape, &(tape->state) );
+}
+
+/* Get the edges libspectrum_tape_get_next_edges() would return, but from
+   a copy of the tape's state so the tape itself doesn't move. A streamed
+   RLE pulse block's data belongs to the block rather than the state, so
+   tell it we're only peeking */
+libspectrum_error
+libspectrum_tape_peek_edges( libspectrum_dword *tstates, int *flags,
+                             size_t max, size_t *count,
+                             libspectrum_tape *tape )
+{
+  libspectrum_tape_block_state it = tape->state;
+  libspectrum_tape_block *block = state_block( tape, &it );
+  libspectrum_error error;
+
+  if( block && block->type == LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE )
+    libspectrum_tape_rle_pulse_set_peeking( &(block->types.rle_pulse), 1 );
+
+  error = libspectrum_tape_get_next_edges_internal( tstates, flags, max,
+                                                    count, tape, &it );
+
+  if( block && block->type == LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE )
+    libspectrum_tape_rle_pulse_set_peeking( &(block->types.rle_pulse), 0 );
+
+  return error;
+}
+
 /* TZX pauses should have no edge if there is no duration, from the spec:
    A 'Pause' block of zero duration is completely ignored, so the 'current pulse
    level' will NOT change in this case. This also applies to 'Data' blocks that
@@ -895,11 +1373,58 @@ raw_data_edge( libspectrum_tape_raw_data_block *block,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Count the leading zero bits of a non-zero word */
+static int
+leading_zeros( libspectrum_qword word )
+{
+#if GNUC_PREREQ( 3, 4 )
+  return __builtin_clzll( word );
+#else				/* #if GNUC_PREREQ( 3, 4 ) */
+  int n = 0, shift;
+
+  for( shift = 32; shift; shift >>= 1 ) {
+    if( !( word >> ( 64 - shift ) ) ) { n += shift; word <<= shift; }
+  }
+
+  return n;
+#endif				/* #if GNUC_PREREQ( 3, 4 ) */
+}
+
+/* Find the first bit numbered from `from' up to (but not including) `to'
+   which is equal to `bit', numbering the bits of `data' from the most
+   significant bit of the first byte. Returns `to' if there isn't one */
+static size_t
+raw_data_find_bit( const libspectrum_byte *data, size_t from, size_t to,
+                   int bit )
+{
+  while( from < to ) {
+
+    size_t byte = from / 8, bytes = ( to + 7 ) / 8 - byte, i;
+    size_t limit = to - byte * 8;
+    libspectrum_qword word = 0;
+
+    /* Look at (up to) the next 64 bits in one go */
+    if( bytes > 8 ) bytes = 8;
+    for( i = 0; i < bytes; i++ )
+      word |= (libspectrum_qword)data[ byte + i ] << ( 56 - 8 * i );
+
+    if( !bit ) word = ~word;
+    word &= ~(libspectrum_qword)0 >> ( from % 8 );
+    if( limit < 64 ) word &= ~( ~(libspectrum_qword)0 >> limit );
+
+    if( word ) return byte * 8 + leading_zeros( word );
+
+    from = byte * 8 + 64;
+  }
+
+  return to;
+}
+
 void
 libspectrum_tape_raw_data_next_bit( libspectrum_tape_raw_data_block *block,
                                     libspectrum_tape_raw_data_block_state *state )
 {
-  int length = 0;
+  size_t end, last_byte, last_bit, next, found, length;
 
   if( state->bytes_through_block == block->length ) {
     state->state = LIBSPECTRUM_TAPE_STATE_PAUSE;
@@ -908,56 +1433,53 @@ libspectrum_tape_raw_data_next_bit( libspectrum_tape_raw_data_block *block,
 
   state->state = LIBSPECTRUM_TAPE_STATE_DATA1;
 
-  /* Step through the data until we find an edge */
-  do {
-    length++;
-    if( ++(state->bits_through_byte) == 8 ) {
-      if( ++(state->bytes_through_block) == block->length - 1 ) {
-	state->bits_through_byte = 8 - block->bits_in_last_byte;
-      } else {
-	state->bits_through_byte = 0;
-      }
-      if( state->bytes_through_block == block->length )
-	break;
-    }
-  } while( ( block->data[state->bytes_through_block] <<
-             state->bits_through_byte & 0x80 ) != state->last_bit) ;
+  /* Only the last `bits_in_last_byte' bits of the last byte are used, so
+     the bits from `last_byte' up to `last_bit' are skipped */
+  end = block->length * 8;
+  last_byte = end - 8;
+  last_bit = end - block->bits_in_last_byte;
 
-  state->bit_tstates = length * block->bit_length;
-  state->last_bit ^= 0x80;
-}
+  /* Step onto the next bit; at the start of the block, we're on the
+     (wrapped) bit before the first one */
+  next = state->bytes_through_block * 8 + state->bits_through_byte + 1;
+  if( next >= last_byte && next < last_bit ) next = last_bit;
 
-static libspectrum_byte
-get_generalised_data_bit( libspectrum_tape_generalised_data_block *block,
-                      libspectrum_tape_generalised_data_block_state *state )
-{
-  libspectrum_byte r = state->current_byte & 0x80 ? 1 : 0;
-  state->current_byte <<= 1;
+  /* The edge comes after the next bit equal to `last_bit' */
+  found = raw_data_find_bit( block->data, next, last_byte, !!state->last_bit );
+  if( found == last_byte )
+    found = raw_data_find_bit( block->data, next > last_bit ? next : last_bit,
+                               end, !!state->last_bit );
 
-  if( ++state->bits_through_byte == 8 ) {
-    state->bits_through_byte = 0;
-    state->bytes_through_stream++;
-    state->current_byte = block->data[ state->bytes_through_stream ];
-  }
-  
-  return r;
+  /* If there is no such bit, the edge comes at the end of the data */
+  length = found - next + 1;
+  if( next < last_byte && found >= last_bit ) length -= last_bit - last_byte;
+
+  state->bytes_through_block = found / 8;
+  state->bits_through_byte = found % 8;
+
+  state->bit_tstates = length * block->bit_length;
+  state->last_bit ^= 0x80;
 }
 
+/* Get the `symbol'th symbol of the data stream. A symbol of up to eight
+   bits is in at most two bytes, and we read the second only if the
+   symbol runs into it, so we never read past the end of the data */
 libspectrum_byte
 get_generalised_data_symbol( libspectrum_tape_generalised_data_block *block,
-                      libspectrum_tape_generalised_data_block_state *state )
+                             size_t symbol )
 {
-  libspectrum_byte symbol;
-  size_t i;
-    
-  for( i = 0, symbol = 0;
-       i < block->bits_per_data_symbol;
-       i++ ) {
-    symbol <<= 1;
-    symbol |= get_generalised_data_bit( block, state );
-  }
-    
-  return symbol;
+  size_t bits = block->bits_per_data_symbol;
+  size_t offset = ( symbol * bits ) % 8;
+  const libspectrum_byte *data;
+  unsigned int word;
+
+  if( !bits ) return 0;
+
+  data = &( block->data[ symbol * bits / 8 ] );
+  word = data[0] << 8;
+  if( offset + bits > 8 ) word |= data[1];
+
+  return ( word >> ( 16 - offset - bits ) ) & ( ( 1 << bits ) - 1 );
 }
 
 static void
@@ -1003,19 +1525,14 @@ generalised_data_edge( libspectrum_tape_generalised_data_block *block,
     set_tstates_and_flags( symbol, state->edges_through_symbol, tstates,
 			   flags );
 
-    state->edges_through_symbol++;
-    if( state->edges_through_symbol == table->max_pulses    ||
-	symbol->lengths[ state->edges_through_symbol ] == 0    ) {
+    if( ++state->edges_through_symbol == symbol->pulses ) {
       state->edges_through_symbol = 0;
       if( ++state->symbols_through_run == block->pilot_repeats[ state->run ] ) {
 	state->symbols_through_run = 0;
 	if( ++state->run == table->symbols_in_block ) {
 	  state->state = LIBSPECTRUM_TAPE_STATE_DATA1;
-	  state->bits_through_byte = 0;
-	  state->bytes_through_stream = 0;
 	  state->symbols_through_stream = 0;
-	  state->current_byte = block->data[ 0 ];
-	  state->current_symbol = get_generalised_data_symbol( block, state );
+	  state->current_symbol = get_generalised_data_symbol( block, 0 );
 	}
       }
     }
@@ -1028,14 +1545,13 @@ generalised_data_edge( libspectrum_tape_generalised_data_block *block,
     set_tstates_and_flags( symbol, state->edges_through_symbol, tstates,
 			   flags );
 
-    state->edges_through_symbol++;
-    if( state->edges_through_symbol == table->max_pulses    ||
-	symbol->lengths[ state->edges_through_symbol ] == 0    ) {
+    if( ++state->edges_through_symbol == symbol->pulses ) {
       if( ++state->symbols_through_stream == table->symbols_in_block ) {
 	state->state = LIBSPECTRUM_TAPE_STATE_PAUSE;
       } else {
 	state->edges_through_symbol = 0;
-	state->current_symbol = get_generalised_data_symbol( block, state );
+	state->current_symbol =
+          get_generalised_data_symbol( block, state->symbols_through_stream );
       }
     }
     break;
@@ -1056,18 +1572,16 @@ generalised_data_edge( libspectrum_tape_generalised_data_block *block,
 }
 
 static libspectrum_error
-jump_blocks( libspectrum_tape *tape, int offset )
+jump_blocks( libspectrum_tape *tape, libspectrum_tape_block_state *it,
+             int offset )
 {
-  gint current_position; GSList *new_block;
+  if( it->current_block >= tape->count ) return LIBSPECTRUM_ERROR_LOGIC;
 
-  current_position =
-    g_slist_position( tape->blocks, tape->state.current_block );
-  if( current_position == -1 ) return LIBSPECTRUM_ERROR_LOGIC;
-
-  new_block = g_slist_nth( tape->blocks, current_position + offset );
-  if( new_block == NULL ) return LIBSPECTRUM_ERROR_CORRUPT;
+  if( offset < 0 ? (size_t)-offset > it->current_block
+                 : it->current_block + offset >= tape->count )
+    return LIBSPECTRUM_ERROR_CORRUPT;
 
-  tape->state.current_block = new_block;
+  it->current_block += offset;
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -1077,31 +1591,64 @@ jump_blocks( libspectrum_tape *tape, int offset )
 static libspectrum_error
 rle_pulse_edge( libspectrum_tape_rle_pulse_block *block,
                 libspectrum_tape_rle_pulse_block_state *state,
-		libspectrum_dword *tstates, int *end_of_block )
+		libspectrum_dword *tstates, int *end_of_block, int *flags )
 {
-  if( block->data[state->index] ) {
+  const libspectrum_byte *data;
+  size_t available;
+  libspectrum_error error;
+
+  if( state->state == LIBSPECTRUM_TAPE_STATE_PAUSE ) {
+    /* The pause at the end of the block, which is always low */
+    *tstates = block->pause_tstates;
+    *flags |= LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW;
+    do_tail_pause( tstates, end_of_block, flags );
+    return LIBSPECTRUM_ERROR_NONE;
+  }
 
-    *tstates = block->scale * block->data[ state->index++ ];
+  error = libspectrum_tape_rle_pulse_data( &data, &available, block,
+                                           state->index, 5 );
+  if( error ) return error;
+
+  if( !available ) {
+
+    *tstates = 0;
+
+  } else if( data[0] ) {
+
+    *tstates = block->scale * data[0];
+    state->index++;
 
   } else {
 
-    if( state->index + 5 > block->length ) {
+    if( available < 5 ) {
       libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			       "rle_pulse_edge: file is truncated\n" );
       return LIBSPECTRUM_ERROR_LOGIC;
     }
 
-    *tstates = block->scale * ( block->data[ state->index + 1 ]       |
-			        block->data[ state->index + 2 ] << 8  |
-			        block->data[ state->index + 3 ] << 16 |
-			        block->data[ state->index + 4 ] << 24   );
+    *tstates = block->scale * ( data[1]       |
+			        data[2] << 8  |
+			        data[3] << 16 |
+			        data[4] << 24   );
     state->index += 5;
 
   }
 
-  if( state->index == block->length ) *end_of_block = 1;
+  /* Data we're inflating as we go has no known length, so look ahead to
+     see if there's any more */
+  error = libspectrum_tape_rle_pulse_data( &data, &available, block,
+                                           state->index, 1 );
+  if( error ) return error;
 
-  return LIBSPECTRUM_ERROR_NONE;
+  if( !available ) {
+    if( block->pause_tstates ) {
+      state->state = LIBSPECTRUM_TAPE_STATE_PAUSE;
+    } else {
+      *end_of_block = 1;
+    }
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
 }
 
 static libspectrum_error
@@ -1144,220 +1691,1511 @@ pulse_sequence_edge( libspectrum_tape_pulse_sequence_block *block,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
-libspectrum_error
-libspectrum_tape_data_block_next_bit( libspectrum_tape_data_block *block,
-                                      libspectrum_tape_data_block_state *state )
-{
-  int next_bit;
+libspectrum_error
+libspectrum_tape_data_block_next_bit( libspectrum_tape_data_block *block,
+                                      libspectrum_tape_data_block_state *state )
+{
+  int next_bit;
+
+  /* Have we finished the current byte? */
+  if( ++(state->bits_through_byte) == 8 ) {
+
+    /* If so, have we finished the entire block? If so, all we've got
+       left after this is the tail at the end */
+    if( ++(state->bytes_through_block) == block->length ) {
+      state->state = LIBSPECTRUM_TAPE_STATE_TAIL;
+      return LIBSPECTRUM_ERROR_NONE;
+    }
+    
+    /* If we've finished the current byte, but not the entire block,
+       get the next byte */
+    state->current_byte = block->data[ state->bytes_through_block ];
+
+    /* If we're looking at the last byte, take account of the fact it
+       may have less than 8 bits in it */
+    if( state->bytes_through_block == block->length-1 ) {
+      state->bits_through_byte = 8 - block->bits_in_last_byte;
+    } else {
+      state->bits_through_byte = 0;
+    }
+  }
+
+  /* Get the high bit, and shift the byte out leftwards */
+  next_bit = state->current_byte & 0x80;
+  state->current_byte <<= 1;
+
+  /* And set state for another data bit */
+  state->bit_pulses = ( next_bit ? block->bit1_pulses : block->bit0_pulses );
+  state->pulse_count = ( next_bit ? block->bit1_pulse_count :
+                                    block->bit0_pulse_count );
+  state->bit_flags = ( next_bit ? state->bit1_flags : state->bit0_flags );
+  state->index = 0;
+  state->state = LIBSPECTRUM_TAPE_STATE_DATA1;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static libspectrum_error
+data_block_edge( libspectrum_tape_data_block *block,
+                 libspectrum_tape_data_block_state *state,
+		 libspectrum_dword *tstates, int *end_of_block, int *flags )
+{
+  int error;
+
+  switch( state->state ) {
+
+  case LIBSPECTRUM_TAPE_STATE_DATA1:
+    /* The next pulse for a bit of data */
+    *tstates = state->bit_pulses[ state->index ];
+    *flags |= state->bit_flags;
+    if( ++(state->index) == state->pulse_count ) {
+      /* Followed by the next bit of data (or the end of data) */
+      error = libspectrum_tape_data_block_next_bit( block, state );
+      if( error ) return error;
+    }
+    break;
+
+  case LIBSPECTRUM_TAPE_STATE_TAIL:
+    /* The pulse at the end of the block */
+    *tstates = block->tail_length;
+    do_tail_pause( tstates, end_of_block, flags );
+    break;
+
+  default:
+    libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
+			     "data_block_edge: unknown state %d",
+			     state->state );
+    return LIBSPECTRUM_ERROR_LOGIC;
+
+  }
+
+  if( !(*flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE )) {
+    *flags |= state->level ? LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH :
+                             LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW;
+    state->level = !state->level;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Get the next edge from any block which produces edges from its own
+   description */
+static libspectrum_error
+block_edge( libspectrum_tape_block *block, libspectrum_tape_block_state *it,
+            libspectrum_dword *tstates, int *end_of_block, int *flags )
+{
+  switch( block->type ) {
+
+  case LIBSPECTRUM_TAPE_BLOCK_ROM:
+    return rom_edge( &(block->types.rom), &(it->block_state.rom), tstates,
+                     end_of_block, flags );
+  case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+    return turbo_edge( &(block->types.turbo), &(it->block_state.turbo),
+                       tstates, end_of_block, flags );
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
+    return tone_edge( &(block->types.pure_tone), &(it->block_state.pure_tone),
+                      tstates, end_of_block );
+  case LIBSPECTRUM_TAPE_BLOCK_PULSES:
+    return pulses_edge( &(block->types.pulses), &(it->block_state.pulses),
+                        tstates, end_of_block );
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+    return pure_data_edge( &(block->types.pure_data),
+                           &(it->block_state.pure_data), tstates,
+                           end_of_block, flags );
+  case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+    return raw_data_edge( &(block->types.raw_data),
+                          &(it->block_state.raw_data), tstates, end_of_block,
+                          flags );
+  case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
+    return generalised_data_edge( &(block->types.generalised_data),
+                                  &(it->block_state.generalised_data),
+                                  tstates, end_of_block, flags );
+  case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+    return rle_pulse_edge( &(block->types.rle_pulse),
+                           &(it->block_state.rle_pulse), tstates,
+                           end_of_block, flags );
+  case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
+    return pulse_sequence_edge( &(block->types.pulse_sequence),
+                                &(it->block_state.pulse_sequence), tstates,
+                                end_of_block, flags );
+  case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+    return data_block_edge( &(block->types.data_block),
+                            &(it->block_state.data_block), tstates,
+                            end_of_block, flags );
+
+  default:
+    *tstates = 0;
+    libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
+                             "%s: unknown block type 0x%02x", __func__,
+                             block->type );
+    return LIBSPECTRUM_ERROR_LOGIC;
+  }
+}
+
+/*
+ * Compiled blocks
+ */
+
+/* If the block being played has been changed since it was started, the
+   compiled form we were walking has gone away; start the block again */
+static libspectrum_error
+check_compiled( libspectrum_tape_block *block,
+                libspectrum_tape_block_state *it )
+{
+  if( it->compiled.block &&
+      it->compiled.generation != block->compiled_generation )
+    return libspectrum_tape_block_init( block, it );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static void
+compiled_edge( libspectrum_tape_compiled_block_state *state,
+               libspectrum_dword *tstates, int *end_of_block, int *flags )
+{
+  const libspectrum_tape_pulse_run *run = &(state->block->runs[ state->run ]);
+
+  *tstates = run->length;
+  *flags |= run->flags;
+
+  if( --(state->pulse_count) == 0 ) {
+    if( ++(state->run) == state->block->count ) {
+      *end_of_block = 1;
+    } else {
+      state->pulse_count = run[1].count;
+    }
+  }
+}
+
+/* Can this block be compiled? Anything whose edges depend on more than
+   the block itself (or which is already a compact list of pulses) can't */
+static int
+compilable( libspectrum_tape_block *block )
+{
+  switch( block->type ) {
+
+  case LIBSPECTRUM_TAPE_BLOCK_ROM:
+  case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+  case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+  case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
+    return 1;
+
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
+    return block->types.pure_tone.pulses != 0;
+  case LIBSPECTRUM_TAPE_BLOCK_PULSES:
+    return block->types.pulses.count != 0;
+  case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
+    return block->types.pulse_sequence.count != 0;
+
+  /* Data blocks can take their initial level from the previous block */
+  case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+  case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+  default:
+    return 0;
+  }
+}
+
+/* The state of a pulse in a compiled run */
+static libspectrum_tape_state_type
+run_state( const libspectrum_tape_pulse_run *run, libspectrum_dword pulse )
+{
+  if( !run->alternate || !( pulse & 1 ) ) return run->state;
+
+  return run->state == LIBSPECTRUM_TAPE_STATE_DATA1 ?
+         LIBSPECTRUM_TAPE_STATE_DATA2 : LIBSPECTRUM_TAPE_STATE_DATA1;
+}
+
+/* The state of the current block, as reported by libspectrum_tape_state() */
+static libspectrum_tape_state_type
+block_state( libspectrum_tape_block *block, libspectrum_tape_block_state *it )
+{
+  if( it->compiled.block ) {
+    const libspectrum_tape_pulse_run *run =
+      &(it->compiled.block->runs[ it->compiled.run ]);
+    return run_state( run, run->count - it->compiled.pulse_count );
+  }
+
+  switch( block->type ) {
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA: return it->block_state.pure_data.state;
+  case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA: return it->block_state.raw_data.state;
+  case LIBSPECTRUM_TAPE_BLOCK_ROM: return it->block_state.rom.state;
+  case LIBSPECTRUM_TAPE_BLOCK_TURBO: return it->block_state.turbo.state;
+  default: return LIBSPECTRUM_TAPE_STATE_INVALID;
+  }
+}
+
+/* Lower a block into a list of runs of identical pulses, so playing it
+   back is just a walk along an array. The two edges of a data bit can
+   share a run, with the state alternating from pulse to pulse */
+libspectrum_error
+libspectrum_tape_block_compile( libspectrum_tape_block *block )
+{
+  libspectrum_tape_block_state it;
+  libspectrum_tape_compiled_block *compiled;
+  libspectrum_tape_pulse_run *run = NULL;
+  size_t allocated = 64;
+  int end_of_block = 0;
+  libspectrum_error error;
+
+  if( block->compiled || !compilable( block ) ) return LIBSPECTRUM_ERROR_NONE;
+
+  error = libspectrum_tape_block_init( block, &it );
+  if( error ) return error;
+
+  compiled = libspectrum_new( libspectrum_tape_compiled_block, 1 );
+  compiled->count = 0;
+  compiled->runs = libspectrum_new( libspectrum_tape_pulse_run, allocated );
+
+  while( !end_of_block ) {
+
+    libspectrum_tape_state_type state = block_state( block, &it );
+    libspectrum_dword tstates;
+    int flags = 0;
+
+    error = block_edge( block, &it, &tstates, &end_of_block, &flags );
+    if( error ) {
+      libspectrum_free( compiled->runs );
+      libspectrum_free( compiled );
+      return error;
+    }
+
+    if( run && run->length == tstates && run->flags == flags &&
+        run->count != 0xffffffff ) {
+
+      /* A second pulse decides whether the run alternates */
+      if( run->count == 1 && run->state != state &&
+          ( ( run->state == LIBSPECTRUM_TAPE_STATE_DATA1 &&
+              state == LIBSPECTRUM_TAPE_STATE_DATA2 ) ||
+            ( run->state == LIBSPECTRUM_TAPE_STATE_DATA2 &&
+              state == LIBSPECTRUM_TAPE_STATE_DATA1 ) ) )
+        run->alternate = 1;
+
+      if( run_state( run, run->count ) == state ) {
+        run->count++;
+        continue;
+      }
+    }
+
+    if( compiled->count == allocated ) {
+      allocated *= 2;
+      compiled->runs = libspectrum_renew( libspectrum_tape_pulse_run,
+                                          compiled->runs, allocated );
+    }
+
+    run = &(compiled->runs[ compiled->count++ ]);
+    run->length = tstates;
+    run->count = 1;
+    run->flags = flags;
+    run->state = state;
+    run->alternate = 0;
+  }
+
+  compiled->runs = libspectrum_renew( libspectrum_tape_pulse_run,
+                                      compiled->runs, compiled->count );
+  block->compiled = compiled;
+  block->compiled_generation++;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Compile every block on a tape. Blocks already being played carry on
+   from their description; the compiled form is used from the next time
+   the block is started */
+libspectrum_error
+libspectrum_tape_compile( libspectrum_tape *tape )
+{
+  size_t i;
+  libspectrum_error error;
+
+  for( i = 0; i < tape->count; i++ ) {
+    error = libspectrum_tape_block_compile( tape->blocks[i] );
+    if( error ) return error;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Carry on playing a compiled block from its description, at the same
+   place; used where the compiled form can't do what's wanted */
+static libspectrum_error
+decompile_state( libspectrum_tape_block *block,
+                 libspectrum_tape_block_state *it )
+{
+  libspectrum_tape_compiled_block *compiled = block->compiled;
+  libspectrum_dword block_tstates = it->block_tstates, tstates, edges;
+  size_t i;
+  int end_of_block = 0, flags;
+  libspectrum_error error;
+
+  /* How many edges of the block have been played */
+  edges = it->compiled.block->runs[ it->compiled.run ].count -
+          it->compiled.pulse_count;
+  for( i = 0; i < it->compiled.run; i++ )
+    edges += it->compiled.block->runs[i].count;
+
+  block->compiled = NULL;
+  error = libspectrum_tape_block_init( block, it );
+  block->compiled = compiled;
+  if( error ) return error;
+
+  for( ; edges; edges-- ) {
+    flags = 0;
+    error = block_edge( block, it, &tstates, &end_of_block, &flags );
+    if( error ) return error;
+  }
+
+  it->block_tstates = block_tstates;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Get the current block */
+libspectrum_tape_block*
+libspectrum_tape_current_block( libspectrum_tape *tape )
+{
+  return state_block( tape, &(tape->state) );
+}
+
+/* Peek at the next block on the tape */
+libspectrum_tape_block*
+libspectrum_tape_peek_next_block( libspectrum_tape *tape )
+{
+  if( !tape->count ) return NULL;
+
+  return tape->state.current_block + 1 < tape->count ?
+         tape->blocks[ tape->state.current_block + 1 ] : tape->blocks[0];
+}
+
+/* Peek at the last block on the tape */
+libspectrum_tape_block WIN32_DLL *
+libspectrum_tape_peek_last_block( libspectrum_tape *tape )
+{
+  return tape->count ? tape->blocks[ tape->count - 1 ] : NULL;
+}
+
+/* Cause the next block on the tape to be active, initialise it
+   and return it */
+libspectrum_tape_block*
+libspectrum_tape_select_next_block( libspectrum_tape *tape )
+{
+  libspectrum_tape_block *block;
+
+  if( !tape->count ) return NULL;
+
+  if( ++(tape->state.current_block) >= tape->count )
+    tape->state.current_block = 0;
+
+  block = tape->blocks[ tape->state.current_block ];
+
+  if( libspectrum_tape_block_init( block, &(tape->state) ) )
+    return NULL;
+
+  tape->state.index_entry = LIBSPECTRUM_TAPE_INDEX_UNKNOWN;
+
+  return block;
+}
+  
+/* Get the position on the tape of the current block */
+libspectrum_error
+libspectrum_tape_position( int *n, libspectrum_tape *tape )
+{
+  if( tape->state.current_block >= tape->count ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_LOGIC,
+      "libspectrum_tape_position: current block is not in tape!"
+    );
+    return LIBSPECTRUM_ERROR_LOGIC;
+  }
+
+  *n = tape->state.current_block;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Select the nth block on the tape */
+libspectrum_error
+libspectrum_tape_nth_block( libspectrum_tape *tape, int n )
+{
+  libspectrum_error error;
+
+  if( n < 0 || (size_t)n >= tape->count ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "libspectrum_tape_nth_block: tape does not have block %d", n
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  tape->state.current_block = n;
+  tape->state.index_entry = LIBSPECTRUM_TAPE_INDEX_UNKNOWN;
+
+  error = libspectrum_tape_block_init( tape->blocks[n], &(tape->state) );
+  if( error ) return error;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Make room for `position' to hold a new block, moving any blocks already
+   there (and the terminating NULL) along by one */
+static void
+make_room( libspectrum_tape *tape, size_t position )
+{
+  if( tape->count + 1 >= tape->allocated ) {
+    tape->allocated = tape->allocated ? 2 * tape->allocated : 64;
+    tape->blocks = libspectrum_renew( libspectrum_tape_block*, tape->blocks,
+                                      tape->allocated );
+  }
+
+  memmove( &(tape->blocks[ position + 1 ]), &(tape->blocks[ position ]),
+           ( tape->count - position ) * sizeof( *tape->blocks ) );
+  tape->blocks[ ++(tape->count) ] = NULL;
+}
+
+/* If we previously didn't have a tape loaded, set up so that we point to
+   the start of the tape */
+static void
+first_block_added( libspectrum_tape *tape )
+{
+  tape->state.current_block = 0;
+  tape->state.loop_block = 0;
+  tape->state.loop_count = 0;
+  tape->state.index_entry = 0;
+  libspectrum_tape_block_init( tape->blocks[0], &(tape->state) );
+}
+
+void
+libspectrum_tape_append_block( libspectrum_tape *tape,
+			       libspectrum_tape_block *block )
+{
+  block->tape = tape;
+  libspectrum_tape_invalidate_index( tape );
+
+  /* The block is complete now its reader has finished with it */
+  if( tape->use_arena ) libspectrum_tape_block_check_arena( block );
+
+  make_room( tape, tape->count );
+  tape->blocks[ tape->count - 1 ] = block;
+
+  if( tape->count == 1 ) first_block_added( tape );
+}
+
+void
+libspectrum_tape_remove_block( libspectrum_tape *tape,
+			       libspectrum_tape_iterator it )
+{
+  size_t position = it - tape->blocks;
+  int removed_current = ( tape->state.current_block == position );
+
+  libspectrum_tape_invalidate_index( tape );
+  if( *it ) libspectrum_tape_block_free( *it );
+
+  /* Move everything after the block, including the terminating NULL,
+     down one */
+  memmove( it, it + 1, ( tape->count - position ) * sizeof( *it ) );
+  tape->count--;
+
+  /* Keep the current block (and any loop) pointing at the same blocks */
+  if( tape->state.current_block > position ) tape->state.current_block--;
+  if( tape->state.loop_block > position ) tape->state.loop_block--;
+
+  /* If the current block has gone, start the one which replaced it */
+  if( removed_current ) {
+    if( tape->state.current_block >= tape->count )
+      tape->state.current_block = 0;
+    libspectrum_tape_block_init( state_block( tape, &(tape->state) ),
+                                 &(tape->state) );
+  }
+}
+
+libspectrum_error
+libspectrum_tape_insert_block( libspectrum_tape *tape,
+			       libspectrum_tape_block *block,
+			       size_t position )
+{
+  block->tape = tape;
+  libspectrum_tape_invalidate_index( tape );
+
+  if( tape->use_arena ) libspectrum_tape_block_check_arena( block );
+
+  if( position > tape->count ) position = tape->count;
+
+  make_room( tape, position );
+  tape->blocks[ position ] = block;
+
+  if( tape->count == 1 ) {
+    first_block_added( tape );
+  } else {
+    if( tape->state.current_block >= position ) tape->state.current_block++;
+    if( tape->state.loop_block >= position ) tape->state.loop_block++;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/*
+ * Seeking within a tape
+ */
+
+/* How many edges apart the checkpoints within a block are */
+static const size_t CHECKPOINT_INTERVAL = 1024;
+
+static void
+free_index( tape_index *index )
+{
+  size_t i;
+
+  for( i = 0; i < index->block_count; i++ )
+    libspectrum_free( index->blocks[i].checkpoints );
+
+  libspectrum_free( index->blocks );
+  libspectrum_free( index->first_entry );
+  libspectrum_free( index->entries );
+  libspectrum_free( index );
+}
+
+/* Called whenever the tape or any block on it changes */
+void
+libspectrum_tape_invalidate_index( libspectrum_tape *tape )
+{
+  tape->state.index_entry = LIBSPECTRUM_TAPE_INDEX_UNKNOWN;
+
+  if( !tape->index ) return;
+
+  free_index( tape->index );
+  tape->index = NULL;
+}
+
+/* Work out the order in which the blocks are played, following loops and
+   jumps, and when each block starts. A backwards jump means the tape
+   never ends, so we stop there */
+static tape_index*
+build_index( libspectrum_tape *tape )
+{
+  tape_index *index = libspectrum_new( tape_index, 1 );
+  size_t position, loop_block = 0, loop_count = 0, allocated = 64, i;
+  libspectrum_qword start = 0;
+  int finished = 0;
+
+  index->block_count = tape->count;
+  index->first_entry = libspectrum_new( size_t, index->block_count );
+  index->blocks = libspectrum_new0( tape_block_checkpoints,
+                                    index->block_count );
+
+  for( i = 0; i < index->block_count; i++ )
+    index->first_entry[i] = LIBSPECTRUM_TAPE_INDEX_UNKNOWN;
+
+  index->count = 0;
+  index->entries = libspectrum_new( tape_index_entry, allocated );
+
+  position = 0;
+  while( !finished && position < index->block_count ) {
+
+    libspectrum_tape_block *block = tape->blocks[ position ];
+    tape_index_entry *entry;
+
+    if( index->count == allocated ) {
+      allocated *= 2;
+      index->entries = libspectrum_renew( tape_index_entry, index->entries,
+                                          allocated );
+    }
+
+    entry = &(index->entries[ index->count ]);
+    entry->position = position;
+    entry->loop_block = loop_block;
+    entry->loop_count = loop_count;
+    entry->start = start;
+
+    if( index->first_entry[ position ] == LIBSPECTRUM_TAPE_INDEX_UNKNOWN )
+      index->first_entry[ position ] = index->count;
+    index->count++;
+
+    start += libspectrum_tape_block_length( block );
+
+    switch( block->type ) {
+
+    case LIBSPECTRUM_TAPE_BLOCK_JUMP:
+      if( block->types.jump.offset <= 0 ) {
+        finished = 1;
+      } else {
+        position += block->types.jump.offset;
+      }
+      continue;
+
+    case LIBSPECTRUM_TAPE_BLOCK_LOOP_START:
+      if( position + 1 < index->block_count &&
+          block->types.loop_start.count ) {
+        loop_block = position + 1;
+        loop_count = block->types.loop_start.count;
+      }
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_LOOP_END:
+      if( loop_count ) {
+        if( --loop_count ) {
+          position = loop_block;
+          continue;
+        }
+      }
+      break;
+
+    default:
+      break;
+    }
+
+    position++;
+  }
+
+  index->length = start;
+
+  return index;
+}
+
+static libspectrum_error
+get_index( tape_index **index, libspectrum_tape *tape, const char *caller )
+{
+  if( !tape->count ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID, "%s: empty tape",
+                             caller );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  if( !tape->index ) tape->index = build_index( tape );
+
+  *index = tape->index;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Does this block produce its edges via block_edge()? */
+static int
+has_edges( libspectrum_tape_block *block )
+{
+  switch( block->type ) {
+  case LIBSPECTRUM_TAPE_BLOCK_ROM:
+  case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
+  case LIBSPECTRUM_TAPE_BLOCK_PULSES:
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+  case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+  case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
+  case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+  case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
+  case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static libspectrum_error
+state_edge( libspectrum_tape_block *block, libspectrum_tape_block_state *it,
+            libspectrum_dword *tstates, int *end_of_block, int *flags )
+{
+  if( it->compiled.block ) {
+    compiled_edge( &(it->compiled), tstates, end_of_block, flags );
+    return LIBSPECTRUM_ERROR_NONE;
+  }
+
+  return block_edge( block, it, tstates, end_of_block, flags );
+}
+
+/* Record the state of a block every CHECKPOINT_INTERVAL edges */
+static libspectrum_error
+find_checkpoints( tape_block_checkpoints *checkpoints,
+                  libspectrum_tape_block *block )
+{
+  libspectrum_tape_block_state it;
+  libspectrum_qword tstates = 0;
+  size_t edges = 0, allocated = 0;
+  int end_of_block = 0;
+  libspectrum_error error;
+
+  memset( &it, 0, sizeof( it ) );
+  error = libspectrum_tape_block_init( block, &it );
+  if( error ) return error;
+
+  while( !end_of_block ) {
+
+    libspectrum_dword edge_tstates;
+    int flags = 0;
+
+    if( edges && edges % CHECKPOINT_INTERVAL == 0 ) {
+      if( checkpoints->count == allocated ) {
+        allocated = allocated ? 2 * allocated : 16;
+        checkpoints->checkpoints =
+          libspectrum_renew( tape_checkpoint, checkpoints->checkpoints,
+                             allocated );
+      }
+      checkpoints->checkpoints[ checkpoints->count ].tstates = tstates;
+      checkpoints->checkpoints[ checkpoints->count ].state = it;
+      checkpoints->count++;
+    }
+
+    error = state_edge( block, &it, &edge_tstates, &end_of_block, &flags );
+    if( error ) return error;
+
+    tstates += edge_tstates;
+    edges++;
+  }
+
+  checkpoints->done = 1;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Move forward through the current block to the last edge which starts
+   at or before `offset' tstates into it */
+static libspectrum_error
+seek_in_block( libspectrum_tape *tape, tape_block_checkpoints *checkpoints,
+               libspectrum_qword offset )
+{
+  libspectrum_tape_block_state *it = &(tape->state);
+  libspectrum_tape_block *block = state_block( tape, it );
+  libspectrum_error error;
+  size_t lo, hi;
+
+  if( !offset || !has_edges( block ) ) return LIBSPECTRUM_ERROR_NONE;
+
+  if( !checkpoints->done ) {
+    error = find_checkpoints( checkpoints, block );
+    if( error ) return error;
+  }
+
+  /* Find the last checkpoint at or before the position */
+  lo = 0; hi = checkpoints->count;
+  while( lo < hi ) {
+    size_t mid = lo + ( hi - lo ) / 2;
+    if( checkpoints->checkpoints[ mid ].tstates <= offset ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if( lo ) {
+    tape_checkpoint *checkpoint = &(checkpoints->checkpoints[ lo - 1 ]);
+    it->compiled = checkpoint->state.compiled;
+    it->block_state = checkpoint->state.block_state;
+    it->block_tstates = checkpoint->tstates;
+  }
+
+  /* And then step forward edge by edge */
+  while( 1 ) {
+
+    libspectrum_tape_block_state next = *it;
+    libspectrum_dword tstates;
+    int end_of_block = 0, flags = 0;
+
+    error = state_edge( block, &next, &tstates, &end_of_block, &flags );
+    if( error ) return error;
+
+    if( end_of_block || it->block_tstates + tstates > offset ) break;
+
+    next.block_tstates += tstates;
+    *it = next;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Move the tape to the last edge at or before `tstates' from its start */
+libspectrum_error
+libspectrum_tape_seek_tstates( libspectrum_tape *tape,
+                               libspectrum_qword tstates )
+{
+  tape_index *index;
+  tape_index_entry *entry;
+  libspectrum_error error;
+  size_t lo, hi;
+
+  error = get_index( &index, tape, __func__ );
+  if( error ) return error;
+
+  if( tstates >= index->length ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                             "%s: position is beyond the end of the tape",
+                             __func__ );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  /* Find the last block started at or before the position */
+  lo = 0; hi = index->count;
+  while( hi - lo > 1 ) {
+    size_t mid = lo + ( hi - lo ) / 2;
+    if( index->entries[ mid ].start <= tstates ) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  entry = &(index->entries[ lo ]);
+
+  tape->state.current_block = entry->position;
+  tape->state.loop_block = entry->loop_block;
+  tape->state.loop_count = entry->loop_count;
+
+  error = libspectrum_tape_block_init( tape->blocks[ entry->position ],
+                                       &(tape->state) );
+  if( error ) return error;
+
+  tape->state.index_entry = lo;
+
+  return seek_in_block( tape, &(index->blocks[ entry->position ]),
+                        tstates - entry->start );
+}
+
+/* Get the length of the tape in tstates, up to any backwards jump */
+libspectrum_error
+libspectrum_tape_total_tstates( libspectrum_qword *tstates,
+                                libspectrum_tape *tape )
+{
+  tape_index *index;
+  libspectrum_error error;
+
+  if( !tape->count ) { *tstates = 0; return LIBSPECTRUM_ERROR_NONE; }
+
+  error = get_index( &index, tape, __func__ );
+  if( error ) return error;
+
+  *tstates = index->length;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Get the time at which the nth block on the tape first starts */
+libspectrum_error
+libspectrum_tape_block_start_tstates( libspectrum_qword *tstates,
+                                      libspectrum_tape *tape, int n )
+{
+  tape_index *index;
+  size_t entry;
+  libspectrum_error error;
+
+  error = get_index( &index, tape, __func__ );
+  if( error ) return error;
+
+  if( n < 0 || (size_t)n >= tape->count ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                             "%s: tape does not have block %d", __func__,
+                             n );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  entry = index->first_entry[ n ];
+  if( entry == LIBSPECTRUM_TAPE_INDEX_UNKNOWN ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                             "%s: block %d is never played", __func__, n );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  *tstates = index->entries[ entry ].start;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Find the entry which plays the current block with the current loop
+   state. If there isn't one (for example, after
+   libspectrum_tape_nth_block() into the middle of a loop), assume this is
+   the first time the block has been played */
+static size_t
+find_entry( tape_index *index, libspectrum_tape_block_state *it )
+{
+  size_t first = index->first_entry[ it->current_block ], i;
+
+  if( first == LIBSPECTRUM_TAPE_INDEX_UNKNOWN ) return first;
+
+  for( i = first; i < index->count; i++ ) {
+    tape_index_entry *entry = &(index->entries[i]);
+    if( entry->position == it->current_block &&
+        entry->loop_count == it->loop_count &&
+        ( !it->loop_count || entry->loop_block == it->loop_block ) )
+      return i;
+  }
+
+  return first;
+}
+
+/* Get the current position on the tape, in tstates from its start */
+libspectrum_error
+libspectrum_tape_tell_tstates( libspectrum_qword *tstates,
+                               libspectrum_tape *tape )
+{
+  tape_index *index;
+  size_t entry;
+  libspectrum_error error;
+
+  error = get_index( &index, tape, __func__ );
+  if( error ) return error;
+
+  /* If we've lost track of where we are in playing order (for example,
+     after the tape was edited), find it again from the loop state */
+  entry = tape->state.index_entry;
+  if( entry >= index->count ||
+      index->entries[ entry ].position != tape->state.current_block ) {
+
+    if( tape->state.current_block >= tape->count ) {
+      libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
+                               "%s: current block is not in tape!",
+                               __func__ );
+      return LIBSPECTRUM_ERROR_LOGIC;
+    }
+
+    entry = find_entry( index, &(tape->state) );
+    if( entry == LIBSPECTRUM_TAPE_INDEX_UNKNOWN ) {
+      libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                               "%s: current block is never played",
+                               __func__ );
+      return LIBSPECTRUM_ERROR_INVALID;
+    }
+
+    tape->state.index_entry = entry;
+  }
+
+  *tstates = index->entries[ entry ].start + tape->state.block_tstates;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/*
+ * Saving and restoring the playback position
+ */
 
-  /* Have we finished the current byte? */
-  if( ++(state->bits_through_byte) == 8 ) {
+/* A saved state is a header of STATE_HEADER bytes (the format version,
+   the type of the current block, whether it is being played from its
+   compiled form and which bit's pulses a PZX data block is playing)
+   followed by STATE_FIELDS little-endian 64-bit values */
+#define STATE_VERSION 1
+#define STATE_HEADER 8
+#define STATE_FIELDS 20
+
+const size_t LIBSPECTRUM_TAPE_STATE_LENGTH = STATE_HEADER + 8 * STATE_FIELDS;
+
+typedef struct state_field {
+  size_t offset;
+  size_t size;
+} state_field;
+
+#define STATE_FIELD( member ) \
+  { offsetof( libspectrum_tape_block_state, member ), \
+    sizeof( ((libspectrum_tape_block_state*)NULL)->member ) }
+
+#define STATE_END { 0, 0 }
+
+static const state_field common_fields[] = {
+  STATE_FIELD( current_block ),
+  STATE_FIELD( loop_block ),
+  STATE_FIELD( loop_count ),
+  STATE_FIELD( index_entry ),
+  STATE_FIELD( block_tstates ),
+  STATE_FIELD( compiled.run ),
+  STATE_FIELD( compiled.pulse_count ),
+  STATE_END
+};
 
-    /* If so, have we finished the entire block? If so, all we've got
-       left after this is the tail at the end */
-    if( ++(state->bytes_through_block) == block->length ) {
-      state->state = LIBSPECTRUM_TAPE_STATE_TAIL;
-      return LIBSPECTRUM_ERROR_NONE;
-    }
-    
-    /* If we've finished the current byte, but not the entire block,
-       get the next byte */
-    state->current_byte = block->data[ state->bytes_through_block ];
+static const state_field rom_fields[] = {
+  STATE_FIELD( block_state.rom.state ),
+  STATE_FIELD( block_state.rom.edge_count ),
+  STATE_FIELD( block_state.rom.bytes_through_block ),
+  STATE_FIELD( block_state.rom.bits_through_byte ),
+  STATE_FIELD( block_state.rom.current_byte ),
+  STATE_FIELD( block_state.rom.bit_tstates ),
+  STATE_END
+};
 
-    /* If we're looking at the last byte, take account of the fact it
-       may have less than 8 bits in it */
-    if( state->bytes_through_block == block->length-1 ) {
-      state->bits_through_byte = 8 - block->bits_in_last_byte;
-    } else {
-      state->bits_through_byte = 0;
-    }
-  }
+static const state_field turbo_fields[] = {
+  STATE_FIELD( block_state.turbo.state ),
+  STATE_FIELD( block_state.turbo.edge_count ),
+  STATE_FIELD( block_state.turbo.bytes_through_block ),
+  STATE_FIELD( block_state.turbo.bits_through_byte ),
+  STATE_FIELD( block_state.turbo.current_byte ),
+  STATE_FIELD( block_state.turbo.bit_tstates ),
+  STATE_END
+};
 
-  /* Get the high bit, and shift the byte out leftwards */
-  next_bit = state->current_byte & 0x80;
-  state->current_byte <<= 1;
+static const state_field pure_tone_fields[] = {
+  STATE_FIELD( block_state.pure_tone.edge_count ),
+  STATE_END
+};
 
-  /* And set state for another data bit */
-  state->bit_pulses = ( next_bit ? block->bit1_pulses : block->bit0_pulses );
-  state->pulse_count = ( next_bit ? block->bit1_pulse_count :
-                                    block->bit0_pulse_count );
-  state->bit_flags = ( next_bit ? state->bit1_flags : state->bit0_flags );
-  state->index = 0;
-  state->state = LIBSPECTRUM_TAPE_STATE_DATA1;
+static const state_field pulses_fields[] = {
+  STATE_FIELD( block_state.pulses.edge_count ),
+  STATE_END
+};
 
-  return LIBSPECTRUM_ERROR_NONE;
-}
+static const state_field pure_data_fields[] = {
+  STATE_FIELD( block_state.pure_data.state ),
+  STATE_FIELD( block_state.pure_data.bytes_through_block ),
+  STATE_FIELD( block_state.pure_data.bits_through_byte ),
+  STATE_FIELD( block_state.pure_data.current_byte ),
+  STATE_FIELD( block_state.pure_data.bit_tstates ),
+  STATE_END
+};
 
-static libspectrum_error
-data_block_edge( libspectrum_tape_data_block *block,
-                 libspectrum_tape_data_block_state *state,
-		 libspectrum_dword *tstates, int *end_of_block, int *flags )
-{
-  int error;
+static const state_field raw_data_fields[] = {
+  STATE_FIELD( block_state.raw_data.state ),
+  STATE_FIELD( block_state.raw_data.bytes_through_block ),
+  STATE_FIELD( block_state.raw_data.bits_through_byte ),
+  STATE_FIELD( block_state.raw_data.last_bit ),
+  STATE_FIELD( block_state.raw_data.bit_tstates ),
+  STATE_END
+};
 
-  switch( state->state ) {
+static const state_field generalised_data_fields[] = {
+  STATE_FIELD( block_state.generalised_data.state ),
+  STATE_FIELD( block_state.generalised_data.run ),
+  STATE_FIELD( block_state.generalised_data.symbols_through_run ),
+  STATE_FIELD( block_state.generalised_data.edges_through_symbol ),
+  STATE_FIELD( block_state.generalised_data.current_symbol ),
+  STATE_FIELD( block_state.generalised_data.symbols_through_stream ),
+  STATE_END
+};
 
-  case LIBSPECTRUM_TAPE_STATE_DATA1:
-    /* The next pulse for a bit of data */
-    *tstates = state->bit_pulses[ state->index ];
-    *flags |= state->bit_flags;
-    if( ++(state->index) == state->pulse_count ) {
-      /* Followed by the next bit of data (or the end of data) */
-      error = libspectrum_tape_data_block_next_bit( block, state );
-      if( error ) return error;
-    }
-    break;
+static const state_field rle_pulse_fields[] = {
+  STATE_FIELD( block_state.rle_pulse.state ),
+  STATE_FIELD( block_state.rle_pulse.index ),
+  STATE_END
+};
 
-  case LIBSPECTRUM_TAPE_STATE_TAIL:
-    /* The pulse at the end of the block */
-    *tstates = block->tail_length;
-    do_tail_pause( tstates, end_of_block, flags );
-    break;
+static const state_field pulse_sequence_fields[] = {
+  STATE_FIELD( block_state.pulse_sequence.index ),
+  STATE_FIELD( block_state.pulse_sequence.pulse_count ),
+  STATE_FIELD( block_state.pulse_sequence.level ),
+  STATE_END
+};
 
-  default:
-    libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
-			     "data_block_edge: unknown state %d",
-			     state->state );
-    return LIBSPECTRUM_ERROR_LOGIC;
+/* data_block.bit_pulses is a pointer, so is saved in the header */
+static const state_field data_block_fields[] = {
+  STATE_FIELD( block_state.data_block.state ),
+  STATE_FIELD( block_state.data_block.bit0_flags ),
+  STATE_FIELD( block_state.data_block.bit1_flags ),
+  STATE_FIELD( block_state.data_block.bytes_through_block ),
+  STATE_FIELD( block_state.data_block.bits_through_byte ),
+  STATE_FIELD( block_state.data_block.current_byte ),
+  STATE_FIELD( block_state.data_block.pulse_count ),
+  STATE_FIELD( block_state.data_block.bit_flags ),
+  STATE_FIELD( block_state.data_block.level ),
+  STATE_FIELD( block_state.data_block.index ),
+  STATE_END
+};
 
-  }
+static const state_field no_fields[] = { STATE_END };
 
-  if( !(*flags & LIBSPECTRUM_TAPE_FLAGS_NO_EDGE )) {
-    *flags |= state->level ? LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH :
-                             LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW;
-    state->level = !state->level;
+static const state_field*
+block_state_fields( libspectrum_tape_type type )
+{
+  switch( type ) {
+  case LIBSPECTRUM_TAPE_BLOCK_ROM: return rom_fields;
+  case LIBSPECTRUM_TAPE_BLOCK_TURBO: return turbo_fields;
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE: return pure_tone_fields;
+  case LIBSPECTRUM_TAPE_BLOCK_PULSES: return pulses_fields;
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA: return pure_data_fields;
+  case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA: return raw_data_fields;
+  case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
+    return generalised_data_fields;
+  case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE: return rle_pulse_fields;
+  case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE: return pulse_sequence_fields;
+  case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK: return data_block_fields;
+  default: return no_fields;
   }
+}
 
-  return LIBSPECTRUM_ERROR_NONE;
+/* Fields are saved as unsigned values, except that -1 (used for `not
+   started yet' and `unknown') is saved as -1 whatever the size of the
+   field, so a state can move between 32 and 64 bit builds */
+static libspectrum_qword
+get_state_field( const libspectrum_tape_block_state *state,
+                 const state_field *field )
+{
+  const libspectrum_byte *ptr = (const libspectrum_byte*)state + field->offset;
+  libspectrum_byte b; libspectrum_word w; libspectrum_dword d;
+  libspectrum_qword q;
+
+  switch( field->size ) {
+  case 1: memcpy( &b, ptr, 1 ); return b == 0xff ? (libspectrum_qword)-1 : b;
+  case 2:
+    memcpy( &w, ptr, 2 ); return w == 0xffff ? (libspectrum_qword)-1 : w;
+  case 4:
+    memcpy( &d, ptr, 4 ); return d == 0xffffffff ? (libspectrum_qword)-1 : d;
+  default: memcpy( &q, ptr, 8 ); return q;
+  }
 }
 
-/* Get the current block */
-libspectrum_tape_block*
-libspectrum_tape_current_block( libspectrum_tape *tape )
+static int
+set_state_field( libspectrum_tape_block_state *state,
+                 const state_field *field, libspectrum_qword value )
 {
-  return libspectrum_tape_iterator_current( tape->state.current_block );
+  libspectrum_byte *ptr = (libspectrum_byte*)state + field->offset;
+  libspectrum_byte b; libspectrum_word w; libspectrum_dword d;
+
+  if( field->size < 8 && value != (libspectrum_qword)-1 &&
+      value >> ( 8 * field->size ) ) return 1;
+
+  switch( field->size ) {
+  case 1: b = value; memcpy( ptr, &b, 1 ); break;
+  case 2: w = value; memcpy( ptr, &w, 2 ); break;
+  case 4: d = value; memcpy( ptr, &d, 4 ); break;
+  default: memcpy( ptr, &value, 8 ); break;
+  }
+
+  return 0;
 }
 
-/* Peek at the next block on the tape */
-libspectrum_tape_block*
-libspectrum_tape_peek_next_block( libspectrum_tape *tape )
+/* Save the playback position of a tape into `buffer', which must be at
+   least LIBSPECTRUM_TAPE_STATE_LENGTH bytes long */
+libspectrum_error
+libspectrum_tape_state_save( libspectrum_byte *buffer, size_t length,
+                             libspectrum_tape *tape )
 {
+  libspectrum_tape_block_state *it = &(tape->state);
   libspectrum_tape_block *block;
+  const state_field *lists[2], *field;
+  libspectrum_byte *ptr;
+  libspectrum_qword value;
+  size_t i, j;
+
+  if( length < LIBSPECTRUM_TAPE_STATE_LENGTH ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                             "%s: buffer too small", __func__ );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  block = state_block( tape, it );
+  if( !block ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID, "%s: empty tape",
+                             __func__ );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  memset( buffer, 0, LIBSPECTRUM_TAPE_STATE_LENGTH );
 
-  if( !tape->state.current_block ) return NULL;
+  buffer[0] = STATE_VERSION;
+  buffer[1] = block->type & 0xff;
+  buffer[2] = block->type >> 8;
+  buffer[3] = it->compiled.block != NULL;
 
-  block = libspectrum_tape_iterator_current( tape->state.current_block->next );
-  return block ? block : tape->blocks->data;
+  if( block->type == LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK ) {
+    const libspectrum_word *pulses = it->block_state.data_block.bit_pulses;
+    if( pulses == block->types.data_block.bit0_pulses ) {
+      buffer[4] = 1;
+    } else if( pulses == block->types.data_block.bit1_pulses ) {
+      buffer[4] = 2;
+    }
+  }
+
+  ptr = buffer + STATE_HEADER;
+  lists[0] = common_fields; lists[1] = block_state_fields( block->type );
+
+  for( i = 0; i < 2; i++ ) {
+    for( field = lists[i]; field->size; field++ ) {
+      value = get_state_field( it, field );
+      for( j = 0; j < 8; j++, value >>= 8 ) *ptr++ = value & 0xff;
+    }
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
 }
 
-/* Peek at the last block on the tape */
-libspectrum_tape_block WIN32_DLL *
-libspectrum_tape_peek_last_block( libspectrum_tape *tape )
+/* Is a data position in a block of `length' bytes playable? */
+static int
+data_position_ok( size_t bytes, size_t bits, size_t length )
 {
-  return tape->last_block ? tape->last_block->data : NULL;
+  return ( bytes == (size_t)-1 || bytes <= length ) && bits <= 8;
 }
 
-/* Cause the next block on the tape to be active, initialise it
-   and return it */
-libspectrum_tape_block*
-libspectrum_tape_select_next_block( libspectrum_tape *tape )
+/* Check a restored block state can be played without going outside the
+   block */
+static int
+block_state_ok( libspectrum_tape_block *block,
+                const libspectrum_tape_block_state *it, int bit_pulses )
 {
-  libspectrum_tape_block *block;
+  switch( block->type ) {
 
-  if( !tape->state.current_block ) return NULL;
+  case LIBSPECTRUM_TAPE_BLOCK_ROM:
+    return data_position_ok( it->block_state.rom.bytes_through_block,
+                             it->block_state.rom.bits_through_byte,
+                             block->types.rom.length );
+  case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+    return data_position_ok( it->block_state.turbo.bytes_through_block,
+                             it->block_state.turbo.bits_through_byte,
+                             block->types.turbo.length );
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+    return data_position_ok( it->block_state.pure_data.bytes_through_block,
+                             it->block_state.pure_data.bits_through_byte,
+                             block->types.pure_data.length );
+  case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+    return data_position_ok( it->block_state.raw_data.bytes_through_block,
+                             it->block_state.raw_data.bits_through_byte,
+                             block->types.raw_data.length );
 
-  block = libspectrum_tape_iterator_next( &(tape->state.current_block) );
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
+    /* The count goes down to zero, which ends the block */
+    return it->block_state.pure_tone.edge_count <=
+             block->types.pure_tone.pulses &&
+           ( it->block_state.pure_tone.edge_count ||
+             !block->types.pure_tone.pulses );
 
-  if( !block )
-    block = libspectrum_tape_iterator_init( &(tape->state.current_block), tape );
+  case LIBSPECTRUM_TAPE_BLOCK_PULSES:
+    return it->block_state.pulses.edge_count < block->types.pulses.count;
 
-  if( libspectrum_tape_block_init( block, &(tape->state) ) )
-    return NULL;
+  case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+    {
+      const libspectrum_tape_rle_pulse_block *data =
+        &(block->types.rle_pulse);
+      const libspectrum_tape_rle_pulse_block_state *state =
+        &(it->block_state.rle_pulse);
+
+      switch( state->state ) {
+      case LIBSPECTRUM_TAPE_STATE_DATA1:
+        /* Data inflated as it is played checks its own position */
+        return !data->data || state->index <= data->length;
+      case LIBSPECTRUM_TAPE_STATE_PAUSE:
+        return data->pause_tstates != 0;
+      default:
+        return 0;
+      }
+    }
 
-  return block;
-}
-  
-/* Get the position on the tape of the current block */
-libspectrum_error
-libspectrum_tape_position( int *n, libspectrum_tape *tape )
-{
-  *n = g_slist_position( tape->blocks, tape->state.current_block );
+  case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
+    return it->block_state.pulse_sequence.index <
+           block->types.pulse_sequence.count;
 
-  if( *n == -1 ) {
-    libspectrum_print_error(
-      LIBSPECTRUM_ERROR_LOGIC,
-      "libspectrum_tape_position: current block is not in tape!"
-    );
-    return LIBSPECTRUM_ERROR_LOGIC;
-  }
+  case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
+    {
+      const libspectrum_tape_generalised_data_block *data =
+        &(block->types.generalised_data);
+      const libspectrum_tape_generalised_data_block_state *state =
+        &(it->block_state.generalised_data);
+      size_t symbol;
+
+      switch( state->state ) {
+      case LIBSPECTRUM_TAPE_STATE_PILOT:
+        if( state->run >= data->pilot_table.symbols_in_block ) return 0;
+        symbol = data->pilot_symbols[ state->run ];
+        return symbol < data->pilot_table.symbols_in_table &&
+               state->edges_through_symbol <
+                 data->pilot_table.symbols[ symbol ].pulses;
+      case LIBSPECTRUM_TAPE_STATE_DATA1:
+        symbol = state->current_symbol;
+        return symbol < data->data_table.symbols_in_table &&
+               state->edges_through_symbol <
+                 data->data_table.symbols[ symbol ].pulses &&
+               state->symbols_through_stream <
+                 data->data_table.symbols_in_block;
+      default:
+        return 1;
+      }
+    }
 
-  return LIBSPECTRUM_ERROR_NONE;
+  case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+    {
+      const libspectrum_tape_data_block *data = &(block->types.data_block);
+      const libspectrum_tape_data_block_state *state =
+        &(it->block_state.data_block);
+      size_t count;
+
+      if( !data_position_ok( state->bytes_through_block,
+                             state->bits_through_byte, data->length ) )
+        return 0;
+      if( state->state != LIBSPECTRUM_TAPE_STATE_DATA1 ) return 1;
+
+      switch( bit_pulses ) {
+      case 1: count = data->bit0_pulse_count; break;
+      case 2: count = data->bit1_pulse_count; break;
+      default: return 0;
+      }
+
+      return state->index < state->pulse_count && state->pulse_count <= count;
+    }
+
+  default:
+    return 1;
+  }
 }
 
-/* Select the nth block on the tape */
+/* Restore a playback position saved by libspectrum_tape_state_save() to
+   a tape with the same blocks */
 libspectrum_error
-libspectrum_tape_nth_block( libspectrum_tape *tape, int n )
+libspectrum_tape_state_restore( libspectrum_tape *tape,
+                                const libspectrum_byte *buffer,
+                                size_t length )
 {
-  GSList *new_block;
+  libspectrum_tape_block_state it;
+  libspectrum_tape_block *block;
+  const state_field *lists[2], *field;
+  const libspectrum_byte *ptr;
+  libspectrum_qword value;
+  libspectrum_tape_type type;
+  int compiled, bit_pulses;
+  size_t i, j;
   libspectrum_error error;
 
-  new_block = g_slist_nth( tape->blocks, n );
-  if( !new_block ) {
-    libspectrum_print_error(
-      LIBSPECTRUM_ERROR_CORRUPT,
-      "libspectrum_tape_nth_block: tape does not have block %d", n
-    );
+  if( length < LIBSPECTRUM_TAPE_STATE_LENGTH ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "%s: not enough data in buffer", __func__ );
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  tape->state.current_block = new_block;
+  if( buffer[0] != STATE_VERSION ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
+                             "%s: unknown state version %d", __func__,
+                             buffer[0] );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
 
-  error = libspectrum_tape_block_init( tape->state.current_block->data,
-                                       &(tape->state) );
-  if( error ) return error;
+  type = buffer[1] | buffer[2] << 8;
+  compiled = buffer[3];
+  bit_pulses = buffer[4];
 
-  return LIBSPECTRUM_ERROR_NONE;
-}
+  memset( &it, 0, sizeof( it ) );
 
-void
-libspectrum_tape_append_block( libspectrum_tape *tape,
-			       libspectrum_tape_block *block )
-{
-  if( tape->blocks == NULL ) {
-    tape->blocks = g_slist_append( tape->blocks, (gpointer)block );
-    tape->last_block = tape->blocks;
-  } else {
-    tape->last_block =
-      g_slist_append( tape->last_block, (gpointer)block )->next;
+  ptr = buffer + STATE_HEADER;
+  lists[0] = common_fields; lists[1] = block_state_fields( type );
+
+  for( i = 0; i < 2; i++ ) {
+    for( field = lists[i]; field->size; field++ ) {
+      for( j = 0, value = 0; j < 8; j++ )
+        value |= (libspectrum_qword)*ptr++ << ( 8 * j );
+      if( set_state_field( &it, field, value ) ) {
+        libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                                 "%s: value out of range", __func__ );
+        return LIBSPECTRUM_ERROR_CORRUPT;
+      }
+    }
+  }
+
+  block = state_block( tape, &it );
+  if( !block || block->type != type ||
+      ( it.loop_count && it.loop_block >= tape->count ) ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                             "%s: state does not match tape", __func__ );
+    return LIBSPECTRUM_ERROR_INVALID;
   }
 
-  /* If we previously didn't have a tape loaded ( implied by
-     tape->current_block == NULL ), set up so that we point to the
-     start of the tape */
-  if( !tape->state.current_block ) {
-    tape->state.current_block = tape->blocks;
-    libspectrum_tape_block_init( tape->blocks->data, &(tape->state) );
+  if( compiled ) {
+
+    error = libspectrum_tape_block_compile( block );
+    if( error ) return error;
+
+    if( !block->compiled || it.compiled.run >= block->compiled->count ||
+        !it.compiled.pulse_count ||
+        it.compiled.pulse_count >
+          block->compiled->runs[ it.compiled.run ].count ) {
+      libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                               "%s: state does not match tape", __func__ );
+      return LIBSPECTRUM_ERROR_INVALID;
+    }
+
+    it.compiled.block = block->compiled;
+    it.compiled.generation = block->compiled_generation;
+
+  } else {
+
+    if( !block_state_ok( block, &it, bit_pulses ) ) {
+      libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
+                               "%s: state does not match tape", __func__ );
+      return LIBSPECTRUM_ERROR_INVALID;
+    }
+
+    if( type == LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK ) {
+      switch( bit_pulses ) {
+      case 1:
+        it.block_state.data_block.bit_pulses =
+          block->types.data_block.bit0_pulses;
+        break;
+      case 2:
+        it.block_state.data_block.bit_pulses =
+          block->types.data_block.bit1_pulses;
+        break;
+      }
+    }
+
   }
+
+  tape->state = it;
+
+  return LIBSPECTRUM_ERROR_NONE;
 }
 
-void
-libspectrum_tape_remove_block( libspectrum_tape *tape,
-			       libspectrum_tape_iterator it )
+/*
+ * Fast loading
+ */
+
+/* Is each bit of this PZX data block two equal pulses, with the pulses
+   for a set bit longer than those for a reset bit, as the ROM loader
+   expects? */
+static int
+data_block_rom_like( libspectrum_tape_data_block *block )
+{
+  return block->bit0_pulse_count == 2 && block->bit1_pulse_count == 2 &&
+         block->bit0_pulses[ 0 ] == block->bit0_pulses[ 1 ] &&
+         block->bit1_pulses[ 0 ] == block->bit1_pulses[ 1 ] &&
+         block->bit0_pulses[ 0 ] > 0 &&
+         block->bit0_pulses[ 0 ] < block->bit1_pulses[ 0 ];
+}
+
+/* Get the bytes which the ROM loader would read from `block', or NULL if
+   it doesn't hold a whole number of bytes in a form the ROM loader can
+   read */
+static const libspectrum_byte*
+fast_load_data( size_t *length, libspectrum_tape_block *block )
 {
-  if( it->data ) libspectrum_tape_block_free( it->data );
-  tape->blocks = g_slist_delete_link( tape->blocks, it );
-  tape->last_block = g_slist_last( tape->blocks );
+  switch( block->type ) {
+
+  case LIBSPECTRUM_TAPE_BLOCK_ROM:
+    *length = block->types.rom.length;
+    return block->types.rom.data;
+
+  case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+    if( block->types.turbo.bits_in_last_byte != 8 ) return NULL;
+    *length = block->types.turbo.length;
+    return block->types.turbo.data;
+
+  case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+    if( block->types.pure_data.bits_in_last_byte != 8 ) return NULL;
+    *length = block->types.pure_data.length;
+    return block->types.pure_data.data;
+
+  case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+    if( block->types.data_block.bits_in_last_byte != 8 ||
+        !data_block_rom_like( &(block->types.data_block) ) ) return NULL;
+    *length = block->types.data_block.length;
+    return block->types.data_block.data;
+
+  default:
+    return NULL;
+
+  }
 }
 
+/* Read the current block as the ROM loader would, without generating any
+   edges, and move on to the next block */
 libspectrum_error
-libspectrum_tape_insert_block( libspectrum_tape *tape,
-			       libspectrum_tape_block *block,
-			       size_t position )
+libspectrum_tape_fast_load( const libspectrum_byte **data, size_t *length,
+                            int *flag, int *checksum_ok, int *flags,
+                            libspectrum_tape *tape )
 {
-  tape->blocks = g_slist_insert( tape->blocks, block, position );
-  tape->last_block = g_slist_last( tape->blocks );
+  libspectrum_tape_block *block;
+  libspectrum_byte parity;
+  size_t i;
 
-  return LIBSPECTRUM_ERROR_NONE;
+  *data = NULL; *length = 0; *flag = -1; *checksum_ok = 0; *flags = 0;
+
+  block = state_block( tape, &(tape->state) );
+  if( !block ) return LIBSPECTRUM_ERROR_NONE;
+
+  *data = fast_load_data( length, block );
+  if( !*data ) { *length = 0; return LIBSPECTRUM_ERROR_NONE; }
+
+  /* The first byte is the flag byte and the last the checksum, which makes
+     the exclusive-or of all the bytes zero */
+  if( *length ) {
+    *flag = (*data)[0];
+    for( i = 0, parity = 0; i < *length; i++ ) parity ^= (*data)[i];
+    *checksum_ok = !parity;
+  }
+
+  return end_block( tape, &(tape->state), flags, 0 );
 }
 
 libspectrum_error
@@ -1471,15 +3309,15 @@ libspectrum_error
 libspectrum_tape_guess_hardware( libspectrum_machine *machine,
 				 const libspectrum_tape *tape )
 {
-  GSList *ptr; int score, current_score; size_t i;
+  int score, current_score; size_t i, j;
 
   *machine = LIBSPECTRUM_MACHINE_UNKNOWN; current_score = 0;
 
   if( !libspectrum_tape_present( tape ) ) return LIBSPECTRUM_ERROR_NONE;
 
-  for( ptr = tape->blocks; ptr; ptr = ptr->next ) {
+  for( j = 0; j < tape->count; j++ ) {
 
-    libspectrum_tape_block *block = (libspectrum_tape_block*)ptr->data;
+    libspectrum_tape_block *block = tape->blocks[j];
     libspectrum_tape_hardware_block *hardware;
 
     if( block->type != LIBSPECTRUM_TAPE_BLOCK_HARDWARE ) continue;
@@ -1552,29 +3390,38 @@ libspectrum_tape_block_internal_init(
                                 libspectrum_tape_block_state *it,
 				libspectrum_tape *tape )
 {
-  if( !tape || !tape->blocks )
+  if( !tape || !tape->count )
     return NULL;
 
-  it->current_block = tape->blocks;
+  it->current_block = 0;
+  it->loop_count = 0;
+  it->index_entry = 0;
 
-  if( libspectrum_tape_block_init( it->current_block->data,
-                                   it ) )
+  if( libspectrum_tape_block_init( tape->blocks[0], it ) )
     return NULL;
 
-  return libspectrum_tape_iterator_current( it->current_block );
+  return tape->blocks[0];
+}
+
+/* Get the position on the tape of the block `iterator' points to */
+size_t
+libspectrum_tape_iterator_position( libspectrum_tape *tape,
+                                    libspectrum_tape_iterator iterator )
+{
+  return iterator - tape->blocks;
 }
 
 libspectrum_tape_block*
 libspectrum_tape_iterator_current( libspectrum_tape_iterator iterator )
 {
-  return iterator ? iterator->data : NULL;
+  return iterator ? *iterator : NULL;
 }
 
 libspectrum_tape_block*
 libspectrum_tape_iterator_next( libspectrum_tape_iterator *iterator )
 {
-  if( iterator && *iterator ) {
-    *iterator = (*iterator)->next;
+  if( iterator && *iterator && **iterator ) {
+    (*iterator)++;
     return libspectrum_tape_iterator_current( *iterator );
   }
   return NULL;
@@ -1583,8 +3430,8 @@ libspectrum_tape_iterator_next( libspectrum_tape_iterator *iterator )
 libspectrum_tape_block*
 libspectrum_tape_iterator_peek_next( libspectrum_tape_iterator iterator )
 {
-  if( iterator ) {
-    return libspectrum_tape_iterator_current( iterator->next );
+  if( iterator && *iterator ) {
+    return libspectrum_tape_iterator_current( iterator + 1 );
   }
   return NULL;
 }
@@ -1592,14 +3439,14 @@ libspectrum_tape_iterator_peek_next( libspectrum_tape_iterator iterator )
 libspectrum_tape_state_type
 libspectrum_tape_state( libspectrum_tape *tape )
 {
-  libspectrum_tape_block *block =
-    libspectrum_tape_iterator_current( tape->state.current_block );
+  libspectrum_tape_block *block = state_block( tape, &(tape->state) );
   switch( block->type ) {
 
-    case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA: return tape->state.block_state.pure_data.state;
-    case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA: return tape->state.block_state.raw_data.state;
-    case LIBSPECTRUM_TAPE_BLOCK_ROM: return tape->state.block_state.rom.state;
-    case LIBSPECTRUM_TAPE_BLOCK_TURBO: return tape->state.block_state.turbo.state;
+    case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+    case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+    case LIBSPECTRUM_TAPE_BLOCK_ROM:
+    case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+      return block_state( block, &(tape->state) );
 
     default:
       libspectrum_print_error(
@@ -1613,8 +3460,16 @@ libspectrum_tape_state( libspectrum_tape *tape )
 libspectrum_error
 libspectrum_tape_set_state( libspectrum_tape *tape, libspectrum_tape_state_type state )
 {
-  libspectrum_tape_block *block =
-    libspectrum_tape_iterator_current( tape->state.current_block );
+  libspectrum_tape_block *block = state_block( tape, &(tape->state) );
+
+  /* Compiled blocks only have a state if their uncompiled form does; if
+     so, the rest of the block is played from its description */
+  if( tape->state.compiled.block &&
+      block_state( block, &(tape->state) ) != LIBSPECTRUM_TAPE_STATE_INVALID ) {
+    libspectrum_error error = decompile_state( block, &(tape->state) );
+    if( error ) return error;
+  }
+
   switch( block->type ) {
 
     case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA: tape->state.block_state.pure_data.state = state; break;
@@ -61,61 +61,110 @@ data_block_init( libspectrum_tape_data_block *block,
 libspectrum_tape_block*
 libspectrum_tape_block_alloc( libspectrum_tape_type type )
 {
-  libspectrum_tape_block *block = libspectrum_new( libspectrum_tape_block, 1 );
+  return libspectrum_tape_arena_block_alloc( NULL, type );
+}
+
+libspectrum_tape_block*
+libspectrum_tape_arena_block_alloc( libspectrum_tape *tape,
+                                    libspectrum_tape_type type )
+{
+  libspectrum_tape_block *block =
+    libspectrum_tape_arena_new( tape, libspectrum_tape_block, 1 );
+  block->compiled = NULL;
+  block->compiled_generation = 0;
+  block->length_known = 0;
+  block->tape = NULL;
+  block->borrowed = 0;
+  block->arena = libspectrum_tape_using_arena( tape ) ? tape : NULL;
+  /* Until the block is complete, check every member when freeing it */
+  block->heap_members = 1;
+  if( type == LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE ) {
+    block->types.rle_pulse.sample_rate = 0;
+    block->types.rle_pulse.pause = 0;
+    block->types.rle_pulse.pause_tstates = 0;
+    block->types.rle_pulse.window = NULL;
+  }
   libspectrum_tape_block_set_type( block, type );
   return block;
 }
 
+/* Something to do with each piece of memory a block owns */
+typedef void (*member_fn)( libspectrum_tape_block *block, void *ptr );
+
+/* Free one member of a block, unless it lives in the tape's arena. Only
+   blocks with members from the heap need each member checked */
+static void
+free_member( libspectrum_tape_block *block, void *ptr )
+{
+  if( !block->arena ) {
+    libspectrum_free( ptr );
+  } else if( block->heap_members ) {
+    libspectrum_tape_arena_free( block->arena, ptr );
+  }
+}
+
+/* Note a member of an arena block which isn't in the arena */
 static void
-free_symbol_table( libspectrum_tape_generalised_data_symbol_table *table )
+check_member( libspectrum_tape_block *block, void *ptr )
+{
+  if( ptr && !libspectrum_tape_arena_owns( block->arena, ptr ) )
+    block->heap_members = 1;
+}
+
+static void
+symbol_table_members( libspectrum_tape_block *block,
+                      libspectrum_tape_generalised_data_symbol_table *table,
+                      member_fn fn )
 {
   size_t i;
 
   if( table->symbols ) {
     for( i = 0; i < table->symbols_in_table; i++ )
-      libspectrum_free( table->symbols[ i ].lengths );
+      fn( block, table->symbols[ i ].lengths );
 
-    libspectrum_free( table->symbols );
+    fn( block, table->symbols );
   }
 }
 
-/* Free the memory used by one block */
-libspectrum_error
-libspectrum_tape_block_free( libspectrum_tape_block *block )
+/* Call `fn' for each piece of memory owned by `block' */
+static libspectrum_error
+block_members( libspectrum_tape_block *block, member_fn fn )
 {
   size_t i;
 
   switch( block->type ) {
 
   case LIBSPECTRUM_TAPE_BLOCK_ROM:
-    libspectrum_free( block->types.rom.data );
+    if( !block->borrowed ) fn( block, block->types.rom.data );
     break;
   case LIBSPECTRUM_TAPE_BLOCK_TURBO:
-    libspectrum_free( block->types.turbo.data );
+    if( !block->borrowed ) fn( block, block->types.turbo.data );
     break;
   case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
     break;
   case LIBSPECTRUM_TAPE_BLOCK_PULSES:
-    libspectrum_free( block->types.pulses.lengths );
+    fn( block, block->types.pulses.lengths );
     break;
   case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
-    libspectrum_free( block->types.pure_data.data );
+    if( !block->borrowed ) fn( block, block->types.pure_data.data );
     break;
   case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
-    libspectrum_free( block->types.raw_data.data );
+    if( !block->borrowed ) fn( block, block->types.raw_data.data );
     break;
   case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
-    free_symbol_table( &block->types.generalised_data.pilot_table );
-    free_symbol_table( &block->types.generalised_data.data_table );
-    libspectrum_free( block->types.generalised_data.pilot_symbols );
-    libspectrum_free( block->types.generalised_data.pilot_repeats );
-    libspectrum_free( block->types.generalised_data.data );
+    symbol_table_members( block, &block->types.generalised_data.pilot_table,
+                          fn );
+    symbol_table_members( block, &block->types.generalised_data.data_table,
+                          fn );
+    fn( block, block->types.generalised_data.pilot_symbols );
+    fn( block, block->types.generalised_data.pilot_repeats );
+    fn( block, block->types.generalised_data.data );
     break;
 
   case LIBSPECTRUM_TAPE_BLOCK_PAUSE:
     break;
   case LIBSPECTRUM_TAPE_BLOCK_GROUP_START:
-    libspectrum_free( block->types.group_start.name );
+    fn( block, block->types.group_start.name );
     break;
   case LIBSPECTRUM_TAPE_BLOCK_GROUP_END:
     break;
@@ -128,10 +177,10 @@ libspectrum_tape_block_free( libspectrum_tape_block *block )
 
   case LIBSPECTRUM_TAPE_BLOCK_SELECT:
     for( i=0; i<block->types.select.count; i++ ) {
-      libspectrum_free( block->types.select.descriptions[i] );
+      fn( block, block->types.select.descriptions[i] );
     }
-    libspectrum_free( block->types.select.descriptions );
-    libspectrum_free( block->types.select.offsets );
+    fn( block, block->types.select.descriptions );
+    fn( block, block->types.select.offsets );
     break;
 
   case LIBSPECTRUM_TAPE_BLOCK_STOP48:
@@ -141,44 +190,44 @@ libspectrum_tape_block_free( libspectrum_tape_block *block )
     break;
 
   case LIBSPECTRUM_TAPE_BLOCK_COMMENT:
-    libspectrum_free( block->types.comment.text );
+    fn( block, block->types.comment.text );
     break;
   case LIBSPECTRUM_TAPE_BLOCK_MESSAGE:
-    libspectrum_free( block->types.message.text );
+    fn( block, block->types.message.text );
     break;
   case LIBSPECTRUM_TAPE_BLOCK_ARCHIVE_INFO:
     for( i=0; i<block->types.archive_info.count; i++ ) {
-      libspectrum_free( block->types.archive_info.strings[i] );
+      fn( block, block->types.archive_info.strings[i] );
     }
-    libspectrum_free( block->types.archive_info.ids );
-    libspectrum_free( block->types.archive_info.strings );
+    fn( block, block->types.archive_info.ids );
+    fn( block, block->types.archive_info.strings );
     break;
   case LIBSPECTRUM_TAPE_BLOCK_HARDWARE:
-    libspectrum_free( block->types.hardware.types  );
-    libspectrum_free( block->types.hardware.ids    );
-    libspectrum_free( block->types.hardware.values );
+    fn( block, block->types.hardware.types  );
+    fn( block, block->types.hardware.ids    );
+    fn( block, block->types.hardware.values );
     break;
 
   case LIBSPECTRUM_TAPE_BLOCK_CUSTOM:
-    libspectrum_free( block->types.custom.description );
-    libspectrum_free( block->types.custom.data );
+    fn( block, block->types.custom.description );
+    if( !block->borrowed ) fn( block, block->types.custom.data );
     break;
 
   /* Block types not present in .tzx follow here */
 
   case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
-    libspectrum_free( block->types.rle_pulse.data );
+    fn( block, block->types.rle_pulse.data );
     break;
 
   case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
-    libspectrum_free( block->types.pulse_sequence.lengths );
-    libspectrum_free( block->types.pulse_sequence.pulse_repeats );
+    fn( block, block->types.pulse_sequence.lengths );
+    fn( block, block->types.pulse_sequence.pulse_repeats );
     break;
 
   case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
-    libspectrum_free( block->types.data_block.data );
-    libspectrum_free( block->types.data_block.bit0_pulses );
-    libspectrum_free( block->types.data_block.bit1_pulses );
+    if( !block->borrowed ) fn( block, block->types.data_block.data );
+    fn( block, block->types.data_block.bit0_pulses );
+    fn( block, block->types.data_block.bit1_pulses );
     break;
 
   case LIBSPECTRUM_TAPE_BLOCK_CONCAT: /* This should never occur */
@@ -189,11 +238,43 @@ libspectrum_tape_block_free( libspectrum_tape_block *block )
     return LIBSPECTRUM_ERROR_LOGIC;
   }
 
-  libspectrum_free( block );
-
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Find whether an arena block has any members from the heap, once it
+   is complete */
+void
+libspectrum_tape_block_check_arena( libspectrum_tape_block *block )
+{
+  if( !block->arena ) return;
+
+  block->heap_members = 0;
+  block_members( block, check_member );
+}
+
+/* Free the memory used by one block */
+libspectrum_error
+libspectrum_tape_block_free( libspectrum_tape_block *block )
+{
+  libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
+
+  libspectrum_tape_block_invalidate( block );
+
+#ifdef HAVE_ZLIB_H
+  if( block->type == LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE &&
+      block->types.rle_pulse.window )
+    libspectrum_zlib_window_free( block->types.rle_pulse.window );
+#endif
+
+  /* Members in the arena go when the arena does */
+  if( !block->arena || block->heap_members )
+    error = block_members( block, free_member );
+
+  if( !block->arena ) libspectrum_free( block );
+
+  return error;
+}
+
 libspectrum_tape_type
 libspectrum_tape_block_type( libspectrum_tape_block *block )
 {
@@ -204,17 +285,54 @@ libspectrum_error
 libspectrum_tape_block_set_type( libspectrum_tape_block *block,
 				 libspectrum_tape_type type )
 {
+  libspectrum_tape_block_invalidate( block );
   block->type = type;
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+void
+libspectrum_tape_block_set_borrowed( libspectrum_tape_block *block,
+                                     int borrowed )
+{
+  block->borrowed = borrowed;
+}
+
+/* Throw away any compiled form of a block, and the seek index of the
+   tape it is on; called whenever the block changes */
+void
+libspectrum_tape_block_invalidate( libspectrum_tape_block *block )
+{
+  if( block->tape ) libspectrum_tape_invalidate_index( block->tape );
+
+  block->length_known = 0;
+
+  if( !block->compiled ) return;
+
+  libspectrum_free( block->compiled->runs );
+  libspectrum_free( block->compiled );
+  block->compiled = NULL;
+  block->compiled_generation++;
+}
+
 /* Called when a new block is started to initialise its internal state */
 libspectrum_error
 libspectrum_tape_block_init( libspectrum_tape_block *block,
                              libspectrum_tape_block_state *state )
 {
+  state->compiled.block = NULL;
+  state->block_tstates = 0;
+
   if( !block ) return LIBSPECTRUM_ERROR_NONE;
 
+  /* Compiled blocks just walk their list of runs */
+  if( block->compiled ) {
+    state->compiled.block = block->compiled;
+    state->compiled.generation = block->compiled_generation;
+    state->compiled.run = 0;
+    state->compiled.pulse_count = block->compiled->runs[0].count;
+    return LIBSPECTRUM_ERROR_NONE;
+  }
+
   switch( libspectrum_tape_block_type( block ) ) {
 
   case LIBSPECTRUM_TAPE_BLOCK_ROM:
@@ -237,6 +355,7 @@ libspectrum_tape_block_init( libspectrum_tape_block *block,
     return generalised_data_init( &(block->types.generalised_data),
                                   &(state->block_state.generalised_data) );
   case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+    state->block_state.rle_pulse.state = LIBSPECTRUM_TAPE_STATE_DATA1;
     state->block_state.rle_pulse.index = 0;
     return LIBSPECTRUM_ERROR_NONE;
   case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
@@ -353,16 +472,11 @@ generalised_data_init( libspectrum_tape_generalised_data_block *block,
   state->current_symbol = 0;
   state->symbols_through_stream = 0;
 
-  state->current_byte = 0;
-  state->bits_through_byte = 0;
-  state->bytes_through_stream = 0;
-
   if( block->pilot_table.symbols_in_block ) {
     state->state = LIBSPECTRUM_TAPE_STATE_PILOT;
   } else if( block->data_table.symbols_in_block ) {
     state->state = LIBSPECTRUM_TAPE_STATE_DATA1;
-    state->current_byte = block->data[ 0 ];
-    state->current_symbol = get_generalised_data_symbol( block, state );
+    state->current_symbol = get_generalised_data_symbol( block, 0 );
   } else {
     state->state = LIBSPECTRUM_TAPE_STATE_PAUSE;
   }
@@ -470,7 +584,7 @@ libspectrum_tape_block_read_symbol_table_parameters(
 
 libspectrum_error
 libspectrum_tape_block_read_symbol_table(
-  libspectrum_tape_generalised_data_symbol_table *table,
+  libspectrum_tape *tape, libspectrum_tape_generalised_data_symbol_table *table,
   const libspectrum_byte **ptr, size_t length )
 {
   if( table->symbols_in_block ) {
@@ -487,18 +601,23 @@ libspectrum_tape_block_read_symbol_table(
 
 
     table->symbols =
-      libspectrum_new( libspectrum_tape_generalised_data_symbol,
-                       table->symbols_in_table );
+      libspectrum_tape_arena_new( tape, libspectrum_tape_generalised_data_symbol,
+                                  table->symbols_in_table );
 
     for( i = 0, symbol = table->symbols;
 	 i < table->symbols_in_table;
 	 i++, symbol++ ) {
       symbol->edge_type = **ptr; (*ptr)++;
-      symbol->lengths = libspectrum_new( libspectrum_word, table->max_pulses );
+      symbol->lengths =
+        libspectrum_tape_arena_new( tape, libspectrum_word, table->max_pulses );
       for( j = 0; j < table->max_pulses; j++ ) {
 	symbol->lengths[ j ] = (*ptr)[0] + (*ptr)[1] * 0x100;
 	(*ptr) += 2;
       }
+
+      for( j = 1; j < table->max_pulses && symbol->lengths[ j ]; j++ )
+        ;
+      symbol->pulses = j;
     }
 
   }
@@ -524,37 +643,26 @@ libspectrum_tape_block_zero( libspectrum_tape_block *block )
 
 /* Give the length of a tape block */
 
-#define BITS_SET_ARRAY_SIZE 256
-static int bits_set[ BITS_SET_ARRAY_SIZE ];
-
 const int LIBSPECTRUM_BITS_IN_BYTE = 8;
 
+/* The number of bits set in each byte */
+#define BITS_SET_2( n ) n, n + 1, n + 1, n + 2
+#define BITS_SET_4( n ) \
+  BITS_SET_2( n ), BITS_SET_2( n + 1 ), BITS_SET_2( n + 1 ), BITS_SET_2( n + 2 )
+#define BITS_SET_6( n ) \
+  BITS_SET_4( n ), BITS_SET_4( n + 1 ), BITS_SET_4( n + 1 ), BITS_SET_4( n + 2 )
+
+static const libspectrum_byte bits_set[ 256 ] = {
+  BITS_SET_6( 0 ), BITS_SET_6( 1 ), BITS_SET_6( 1 ), BITS_SET_6( 2 )
+};
+
+/* The number of bits set in the top `bits' bits of `byte' */
 static int
 libspectrum_bits_set_n_bits( libspectrum_byte byte, libspectrum_byte bits )
 {
-  int i;
-  int retval = 0;
-
   if( bits > LIBSPECTRUM_BITS_IN_BYTE) bits = LIBSPECTRUM_BITS_IN_BYTE;
 
-  for( i = 0; i < bits; i++ ) {
-    if( byte & 0x80 ) retval++;
-    byte <<= 1;
-  }
-
-  return retval;
-}
-
-void
-libspectrum_init_bits_set( void )
-{
-  int i;
-
-  /* Not big or clever, but easy to understand */
-  for( i = 0; i < BITS_SET_ARRAY_SIZE; i++ ) {
-    bits_set[ i ] = libspectrum_bits_set_n_bits( (libspectrum_byte)i,
-                                                 LIBSPECTRUM_BITS_IN_BYTE );
-  }
+  return bits_set[ byte & ( 0xff00 >> bits ) & 0xff ];
 }
 
 static libspectrum_dword
@@ -673,17 +781,64 @@ raw_data_block_length( libspectrum_tape_raw_data_block *raw_data )
   return length;
 }
 
+/* Get at least `wanted' bytes of the data of an RLE pulse block starting
+   at `index', or as many as there are; `*available' is set to the number
+   of bytes at `*data' */
+libspectrum_error
+libspectrum_tape_rle_pulse_data( const libspectrum_byte **data,
+                                 size_t *available,
+                                 libspectrum_tape_rle_pulse_block *block,
+                                 size_t index, size_t wanted )
+{
+#ifdef HAVE_ZLIB_H
+  if( !block->data && block->window )
+    return libspectrum_zlib_window_get( data, available, block->window,
+                                        index, wanted );
+#endif
+
+  if( index < block->length ) {
+    *data = block->data + index;
+    *available = block->length - index;
+  } else {
+    *data = NULL;
+    *available = 0;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Start or stop peeking at the data of an RLE pulse block; while peeking,
+   data inflated as it is played is read without losing what the block's
+   real position still needs */
+void
+libspectrum_tape_rle_pulse_set_peeking( libspectrum_tape_rle_pulse_block *block,
+                                        int peeking )
+{
+#ifdef HAVE_ZLIB_H
+  if( block->window )
+    libspectrum_zlib_window_set_peeking( block->window, peeking );
+#endif
+}
+
 static libspectrum_dword
 rle_pulse_block_length( libspectrum_tape_rle_pulse_block *rle_pulse )
 {
   libspectrum_dword length = 0;
-  size_t i;
-
-  for( i = 0; i < rle_pulse->length; i++ ) {
-    length += rle_pulse->data[ i ] * rle_pulse->scale;
+  const libspectrum_byte *data;
+  size_t i = 0, available, j;
+
+  while( 1 ) {
+    if( libspectrum_tape_rle_pulse_data( &data, &available, rle_pulse, i,
+                                         1 ) ||
+        !available )
+      break;
+
+    for( j = 0; j < available; j++ )
+      length += data[ j ] * rle_pulse->scale;
+    i += available;
   }
 
-  return length;
+  return length + rle_pulse->pause_tstates;
 }
 
 static libspectrum_dword
@@ -768,8 +923,9 @@ data_block_length( libspectrum_tape_data_block *data_block )
   return length;
 }
 
-libspectrum_dword
-libspectrum_tape_block_length( libspectrum_tape_block *block )
+/* Work out the length of a block; see libspectrum_tape_block_length() */
+static libspectrum_dword
+block_length( libspectrum_tape_block *block )
 {
   libspectrum_tape_pure_tone_block *pure_tone;
 
@@ -816,3 +972,16 @@ libspectrum_tape_block_length( libspectrum_tape_block *block )
     return -1;
   }
 }
+
+/* The length is kept until the block next changes, as working it out
+   means going through all the block's data */
+libspectrum_dword
+libspectrum_tape_block_length( libspectrum_tape_block *block )
+{
+  if( !block->length_known ) {
+    block->length = block_length( block );
+    block->length_known = 1;
+  }
+
+  return block->length;
+}
@@ -185,6 +185,10 @@ struct libspectrum_tape_generalised_data_symbol {
   libspectrum_tape_generalised_data_symbol_edge_type edge_type;
   libspectrum_word *lengths;
 
+  /* How many edges are played for this symbol: those before the first
+     zero length, but always at least one */
+  libspectrum_byte pulses;
+
 };
 
 struct libspectrum_tape_generalised_data_symbol_table {
@@ -225,10 +229,6 @@ typedef struct libspectrum_tape_generalised_data_block_state {
   libspectrum_byte current_symbol;
   size_t symbols_through_stream;
 
-  libspectrum_byte current_byte;
-  size_t bits_through_byte;
-  size_t bytes_through_stream;
-
 } libspectrum_tape_generalised_data_block_state;
 
 /* A pause block - some formats use pause in ms, some use tstates. Fuse uses
@@ -352,12 +352,24 @@ typedef struct libspectrum_tape_rle_pulse_block {
   libspectrum_byte *data;
   long scale;
 
+  /* The sample rate `scale' came from, if known, so it can be written
+     back exactly; 0 if not known */
+  libspectrum_dword sample_rate;
+
+  libspectrum_dword pause;	/* Pause after data (in ms) */
+  libspectrum_dword pause_tstates; /* Pause after block (tstates) */
+
+  /* If `data' is NULL, the data is inflated from here as it is played */
+  libspectrum_zlib_window *window;
+
 } libspectrum_tape_rle_pulse_block;
 
 typedef struct libspectrum_tape_rle_pulse_block_state {
 
   /* Private data */
 
+  libspectrum_tape_state_type state;
+
   size_t index;
 
 } libspectrum_tape_rle_pulse_block_state;
@@ -422,6 +434,40 @@ typedef struct libspectrum_tape_data_block_state {
 
 } libspectrum_tape_data_block_state;
 
+/* A block lowered into a flat list of runs of identical pulses */
+typedef struct libspectrum_tape_pulse_run {
+
+  libspectrum_dword length;	/* Length of each pulse (in tstates) */
+  libspectrum_dword count;	/* Number of pulses in this run */
+  int flags;			/* Flags returned with each pulse */
+  libspectrum_tape_state_type state; /* Block state for the first pulse */
+  int alternate;		/* Does the state alternate between DATA1
+				   and DATA2 from pulse to pulse? */
+
+} libspectrum_tape_pulse_run;
+
+typedef struct libspectrum_tape_compiled_block {
+
+  size_t count;
+  libspectrum_tape_pulse_run *runs;
+
+} libspectrum_tape_compiled_block;
+
+typedef struct libspectrum_tape_compiled_block_state {
+
+  /* Private data */
+
+  /* The compiled form being played, or NULL if the block is being
+     played from its description */
+  libspectrum_tape_compiled_block *block;
+  unsigned int generation;	/* The block's compiled_generation when
+				   this was started */
+
+  size_t run;			/* The current run */
+  libspectrum_dword pulse_count; /* Pulses to go in the current run */
+
+} libspectrum_tape_compiled_block_state;
+
 /*
  * The generic tape block
  */
@@ -430,6 +476,31 @@ struct libspectrum_tape_block {
 
   libspectrum_tape_type type;
 
+  /* The compiled form of this block, if any; freed whenever the block
+     is changed */
+  libspectrum_tape_compiled_block *compiled;
+  unsigned int compiled_generation; /* Changed whenever `compiled' is */
+
+  /* The length of the block in tstates, if it has been worked out since
+     the block last changed */
+  int length_known;
+  libspectrum_dword length;
+
+  /* The tape this block is on, if any */
+  libspectrum_tape *tape;
+
+  /* Does the block's data belong to the buffer it was read from rather
+     than to the block? */
+  int borrowed;
+
+  /* The tape whose arena the block was allocated from, or NULL if it is
+     on the heap. Members of the block may be in the arena too */
+  libspectrum_tape *arena;
+
+  /* Might any members of an arena block be on the heap? If not, freeing
+     the block needn't look at its members at all */
+  int heap_members;
+
   union {
     libspectrum_tape_rom_block rom;
     libspectrum_tape_turbo_block turbo;
@@ -468,16 +539,27 @@ struct libspectrum_tape_block {
 
 };
 
+#define LIBSPECTRUM_TAPE_INDEX_UNKNOWN ( (size_t)-1 )
+
 struct libspectrum_tape_block_state {
 
-  /* The current block */
-  libspectrum_tape_iterator current_block;
+  /* The position on the tape of the current block */
+  size_t current_block;
 
   /* Where to return to after a loop, and how many iterations of the loop
-     to do */
-  GSList* loop_block;
+     to do (zero if we're not in a loop) */
+  size_t loop_block;
   size_t loop_count;
 
+  /* Which entry of the tape's seek index is being played (or
+     LIBSPECTRUM_TAPE_INDEX_UNKNOWN), and how many tstates of the block
+     have been played so far */
+  size_t index_entry;
+  libspectrum_qword block_tstates;
+
+  /* Used instead of block_state if the block has been compiled */
+  libspectrum_tape_compiled_block_state compiled;
+
   union {
     libspectrum_tape_rom_block_state rom;
     libspectrum_tape_turbo_block_state turbo;
@@ -495,6 +577,10 @@ struct libspectrum_tape_block_state {
 };
 
 /* Functions needed by both tape.c and tape_block.c */
+void
+libspectrum_tape_block_invalidate( libspectrum_tape_block *block );
+void
+libspectrum_tape_invalidate_index( libspectrum_tape *tape );
 libspectrum_error
 libspectrum_tape_pure_data_next_bit( libspectrum_tape_pure_data_block *block,
                              libspectrum_tape_pure_data_block_state *state );
@@ -503,7 +589,7 @@ libspectrum_tape_raw_data_next_bit( libspectrum_tape_raw_data_block *block,
                              libspectrum_tape_raw_data_block_state *state );
 libspectrum_byte
 get_generalised_data_symbol( libspectrum_tape_generalised_data_block *block,
-                        libspectrum_tape_generalised_data_block_state *state );
+                             size_t symbol );
 libspectrum_error
 generalised_data_edge( libspectrum_tape_generalised_data_block *block,
                        libspectrum_tape_generalised_data_block_state *state,
@@ -512,6 +598,14 @@ generalised_data_edge( libspectrum_tape_generalised_data_block *block,
 libspectrum_error
 libspectrum_tape_data_block_next_bit( libspectrum_tape_data_block *block,
                                     libspectrum_tape_data_block_state *state );
+libspectrum_error
+libspectrum_tape_rle_pulse_data( const libspectrum_byte **data,
+                                 size_t *available,
+                                 libspectrum_tape_rle_pulse_block *block,
+                                 size_t index, size_t wanted );
+void
+libspectrum_tape_rle_pulse_set_peeking( libspectrum_tape_rle_pulse_block *block,
+                                        int peeking );
 
 
 #endif				/* #ifndef LIBSPECTRUM_TAPE_BLOCK_H */
@@ -56,11 +56,17 @@ print << "CODE";
 
 CODE
 
-my( $name, $default, $started, $pointer );
+my( $name, $default, $started, $pointer, $memory );
 
-sub trailer ($) {
+sub trailer ($$) {
 
-    my( $name ) = @_;
+    my( $name, $memory ) = @_;
+
+    # Data given to a block always belongs to it
+    my $ownership = $name eq 'data' ? "  block->borrowed = 0;\n" : '';
+
+    # Memory given to a block from an arena may come from the heap
+    $ownership .= "  block->heap_members = 1;\n" if $memory;
 
     return << "CODE";
 
@@ -72,6 +78,8 @@ sub trailer ($) {
       return LIBSPECTRUM_ERROR_INVALID;
   }
 
+$ownership  libspectrum_tape_block_invalidate( block );
+
   return LIBSPECTRUM_ERROR_NONE;
 }
 
@@ -95,12 +103,14 @@ while( <> ) {
 
     } else {
 
-	print trailer( $name ) if $started;
+	print trailer( $name, $memory ) if $started;
 
 	my( $type, $indexed );
 
 	( $type, $name, $indexed, undef, $pointer ) = split;
 
+	$memory = $indexed || $pointer || $type =~ /\*/;
+
 	printf "libspectrum_error\nlibspectrum_tape_block_set_$name( libspectrum_tape_block *block, $type %s$name",
             ( $indexed ? "*" : "" );
 	print " )\n{\n  switch( block->type ) {\n\n";
@@ -109,4 +119,4 @@ while( <> ) {
     }
 }
 
-print trailer( $name ) if $started;
+print trailer( $name, $memory ) if $started;
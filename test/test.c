@@ -895,6 +895,2538 @@ test_72( void )
   return r;
 }
 
+/* Check getting `batch' edges at a time gives the same edges as getting
+   them one by one */
+static test_return_t
+check_batched_edges( const char *filename, size_t batch )
+{
+  libspectrum_tape *tape, *batch_tape;
+  libspectrum_dword tstates, batch_tstates[100];
+  int flags, batch_flags[100];
+  size_t i, count;
+  test_return_t r;
+
+  if( batch > ARRAY_SIZE( batch_tstates ) ) return TEST_INCOMPLETE;
+
+  r = load_tape( &tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  r = load_tape( &batch_tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) { libspectrum_tape_free( tape ); return r; }
+
+  do {
+
+    if( libspectrum_tape_get_next_edges( batch_tstates, batch_flags, batch,
+                                         &count, batch_tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    for( i = 0; i < count; i++ ) {
+      if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+        r = TEST_INCOMPLETE;
+        break;
+      }
+      if( tstates != batch_tstates[i] || flags != batch_flags[i] ) {
+        fprintf( stderr, "%s: expected %u tstates and flags %d, got %u tstates and flags %d\n",
+                 progname, tstates, flags, batch_tstates[i], batch_flags[i] );
+        r = TEST_FAIL;
+        break;
+      }
+    }
+
+  } while( r == TEST_PASS && count &&
+           !( batch_flags[ count - 1 ] & LIBSPECTRUM_TAPE_FLAGS_TAPE ) );
+
+  libspectrum_tape_free( batch_tape );
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_73( void )
+{
+  libspectrum_snap *snap;
+  libspectrum_byte *buffer = NULL, *page;
+  size_t length = 0;
+  int out_flags, i;
+  test_return_t r = TEST_PASS;
+
+  /* Page counts larger than the snap has room for */
+  snap = libspectrum_snap_alloc();
+  libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_48 );
+  libspectrum_snap_set_zxatasp_active( snap, 1 );
+  libspectrum_snap_set_zxatasp_pages( snap, SNAPSHOT_ZXATASP_PAGES + 8 );
+  libspectrum_snap_set_zxcf_active( snap, 1 );
+  libspectrum_snap_set_zxcf_pages( snap, SNAPSHOT_ZXCF_PAGES + 21 );
+
+  for( i = 0; i < SNAPSHOT_ZXATASP_PAGES; i++ ) {
+    page = libspectrum_new( libspectrum_byte, 0x4000 );
+    memset( page, i, 0x4000 );
+    libspectrum_snap_set_zxatasp_ram( snap, i, page );
+  }
+
+  for( i = 0; i < SNAPSHOT_ZXCF_PAGES; i++ ) {
+    page = libspectrum_new( libspectrum_byte, 0x4000 );
+    memset( page, 0xff - i, 0x4000 );
+    libspectrum_snap_set_zxcf_ram( snap, i, page );
+  }
+
+  if( libspectrum_snap_write( &buffer, &length, &out_flags, snap,
+                              LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 0 ) ) {
+    libspectrum_snap_free( snap );
+    return TEST_INCOMPLETE;
+  }
+
+  libspectrum_snap_free( snap );
+
+  /* Every page which was there should come back */
+  snap = libspectrum_snap_alloc();
+  if( libspectrum_snap_read( snap, buffer, length,
+                             LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL ) ) {
+    r = TEST_INCOMPLETE;
+  } else {
+    for( i = 0; r == TEST_PASS && i < SNAPSHOT_ZXATASP_PAGES; i++ ) {
+      page = libspectrum_snap_zxatasp_ram( snap, i );
+      if( !page || page[0] != i || page[ 0x3fff ] != i ) {
+        fprintf( stderr, "%s: ZXATASP page %d not restored\n", progname, i );
+        r = TEST_FAIL;
+      }
+    }
+    for( i = 0; r == TEST_PASS && i < SNAPSHOT_ZXCF_PAGES; i++ ) {
+      page = libspectrum_snap_zxcf_ram( snap, i );
+      if( !page || page[0] != 0xff - i || page[ 0x3fff ] != 0xff - i ) {
+        fprintf( stderr, "%s: ZXCF page %d not restored\n", progname, i );
+        r = TEST_FAIL;
+      }
+    }
+  }
+
+  libspectrum_snap_free( snap );
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+static test_return_t
+test_74( void )
+{
+  return check_batched_edges( DYNAMIC_TEST_PATH( "complete-tzx.tzx" ), 7 );
+}
+
+static test_return_t
+test_75( void )
+{
+  const char *filename = DYNAMIC_TEST_PATH( "complete-tzx.tzx" );
+  libspectrum_tape *tape, *compiled_tape;
+  libspectrum_dword tstates, compiled_tstates[7];
+  int flags, compiled_flags[7];
+  size_t i, count;
+  test_return_t r;
+
+  r = load_tape( &tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  r = load_tape( &compiled_tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) { libspectrum_tape_free( tape ); return r; }
+
+  if( libspectrum_tape_compile( compiled_tape ) ||
+      libspectrum_tape_nth_block( compiled_tape, 0 ) ) {
+    libspectrum_tape_free( compiled_tape );
+    libspectrum_tape_free( tape );
+    return TEST_INCOMPLETE;
+  }
+
+  do {
+
+    if( libspectrum_tape_get_next_edges( compiled_tstates, compiled_flags,
+                                         ARRAY_SIZE( compiled_tstates ),
+                                         &count, compiled_tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    for( i = 0; i < count; i++ ) {
+      if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+        r = TEST_INCOMPLETE;
+        break;
+      }
+      if( tstates != compiled_tstates[i] || flags != compiled_flags[i] ) {
+        fprintf( stderr, "%s: expected %u tstates and flags %d, got %u tstates and flags %d\n",
+                 progname, tstates, flags, compiled_tstates[i],
+                 compiled_flags[i] );
+        r = TEST_FAIL;
+        break;
+      }
+    }
+
+  } while( r == TEST_PASS && count &&
+           !( compiled_flags[ count - 1 ] & LIBSPECTRUM_TAPE_FLAGS_TAPE ) );
+
+  libspectrum_tape_free( compiled_tape );
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+check_seek( const char *filename )
+{
+  libspectrum_tape *tape;
+  libspectrum_qword position = 0, told, positions[64];
+  libspectrum_dword tstates, edge_tstates[64];
+  int flags, edge_flags[64];
+  size_t edges = 0, count = 0, i;
+  test_return_t r;
+
+  r = load_tape( &tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  /* Play the tape, checking the position as we go and remembering some
+     edges to seek back to */
+  do {
+
+    if( libspectrum_tape_tell_tstates( &told, tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+    if( told != position ) {
+      fprintf( stderr, "%s: expected position %lu, got %lu\n", progname,
+               (unsigned long)position, (unsigned long)told );
+      r = TEST_FAIL;
+      break;
+    }
+
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    if( tstates && edges++ % 97 == 0 && count < ARRAY_SIZE( positions ) ) {
+      positions[ count ] = position;
+      edge_tstates[ count ] = tstates;
+      edge_flags[ count ] = flags;
+      count++;
+    }
+
+    position += tstates;
+
+  } while( !( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) );
+
+  /* Then seek back to those edges, in reverse order */
+  for( i = count; r == TEST_PASS && i > 0; i-- ) {
+
+    if( libspectrum_tape_seek_tstates( tape, positions[ i - 1 ] ) ||
+        libspectrum_tape_tell_tstates( &told, tape ) ||
+        libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    if( told != positions[ i - 1 ] || tstates != edge_tstates[ i - 1 ] ||
+        flags != edge_flags[ i - 1 ] ) {
+      fprintf( stderr, "%s: after seeking to %lu, got position %lu, tstates %u and flags %d; expected tstates %u and flags %d\n",
+               progname, (unsigned long)positions[ i - 1 ],
+               (unsigned long)told, tstates, flags, edge_tstates[ i - 1 ],
+               edge_flags[ i - 1 ] );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_76( void )
+{
+  test_return_t r;
+
+  r = check_seek( DYNAMIC_TEST_PATH( "complete-tzx.tzx" ) );
+  if( !r ) r = check_seek( STATIC_TEST_PATH( "standard-tap.tap" ) );
+  if( !r ) r = check_seek( STATIC_TEST_PATH( "loop.tzx" ) );
+  if( !r ) r = check_seek( STATIC_TEST_PATH( "loop2.tzx" ) );
+  if( !r ) r = check_seek( STATIC_TEST_PATH( "jump.tzx" ) );
+
+  return r;
+}
+
+static libspectrum_tape_block*
+pause_block( libspectrum_dword length )
+{
+  libspectrum_tape_block *block =
+    libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PAUSE );
+  libspectrum_tape_block_set_pause_tstates( block, length );
+  return block;
+}
+
+static test_return_t
+test_77( void )
+{
+  libspectrum_tape *tape = libspectrum_tape_alloc();
+  libspectrum_tape_iterator it;
+  libspectrum_tape_block *block;
+  const libspectrum_dword expected[] = { 5, 0, 1, 3, 4, 6 };
+  size_t i;
+  int n;
+  test_return_t r = TEST_PASS;
+
+  for( i = 0; i < 5; i++ )
+    libspectrum_tape_append_block( tape, pause_block( i ) );
+
+  /* Make block 3 current, then move things around it */
+  libspectrum_tape_nth_block( tape, 3 );
+  libspectrum_tape_insert_block( tape, pause_block( 5 ), 0 );
+  libspectrum_tape_insert_block( tape, pause_block( 6 ), 100 );
+
+  libspectrum_tape_iterator_init( &it, tape );
+  libspectrum_tape_iterator_next( &it );
+  libspectrum_tape_iterator_next( &it );
+  libspectrum_tape_iterator_next( &it );
+  libspectrum_tape_remove_block( tape, it );
+
+  for( block = libspectrum_tape_iterator_init( &it, tape ), i = 0;
+       block;
+       block = libspectrum_tape_iterator_next( &it ), i++ ) {
+    if( i >= ARRAY_SIZE( expected ) ||
+        libspectrum_tape_block_pause_tstates( block ) != expected[i] ) {
+      fprintf( stderr, "%s: block %lu is wrong\n", progname,
+               (unsigned long)i );
+      r = TEST_FAIL;
+      break;
+    }
+  }
+
+  if( r == TEST_PASS && i != ARRAY_SIZE( expected ) ) {
+    fprintf( stderr, "%s: expected %lu blocks, got %lu\n", progname,
+             (unsigned long)ARRAY_SIZE( expected ), (unsigned long)i );
+    r = TEST_FAIL;
+  }
+
+  if( r == TEST_PASS &&
+      ( libspectrum_tape_position( &n, tape ) || n != 3 ||
+        libspectrum_tape_block_pause_tstates(
+          libspectrum_tape_current_block( tape ) ) != 3 ) ) {
+    fprintf( stderr, "%s: current block moved\n", progname );
+    r = TEST_FAIL;
+  }
+
+  if( r == TEST_PASS &&
+      libspectrum_tape_block_pause_tstates(
+        libspectrum_tape_peek_last_block( tape ) ) != 6 ) {
+    fprintf( stderr, "%s: wrong last block\n", progname );
+    r = TEST_FAIL;
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_78( void )
+{
+  libspectrum_tape *tape, *played;
+  const libspectrum_byte *data;
+  const size_t lengths[] = { 19, 14 };
+  const int flag_bytes[] = { 0x00, 0xff };
+  libspectrum_qword position, expected;
+  libspectrum_dword tstates;
+  size_t i, length;
+  int flag, checksum_ok, flags, n;
+  test_return_t r = TEST_PASS;
+
+  r = load_tape( &tape, STATIC_TEST_PATH( "standard-tap.tap" ),
+                 LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  r = load_tape( &played, STATIC_TEST_PATH( "standard-tap.tap" ),
+                 LIBSPECTRUM_ERROR_NONE );
+  if( r ) { libspectrum_tape_free( tape ); return r; }
+
+  for( i = 0; r == TEST_PASS && i < ARRAY_SIZE( lengths ); i++ ) {
+
+    if( libspectrum_tape_fast_load( &data, &length, &flag, &checksum_ok,
+                                    &flags, tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    if( !data || length != lengths[i] || flag != flag_bytes[i] ||
+        !checksum_ok ) {
+      fprintf( stderr, "%s: block %lu loaded wrongly\n", progname,
+               (unsigned long)i );
+      r = TEST_FAIL;
+      break;
+    }
+
+    if( !( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) ||
+        !( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) !=
+          ( i + 1 < ARRAY_SIZE( lengths ) ) ) {
+      fprintf( stderr, "%s: block %lu gave flags 0x%04x\n", progname,
+               (unsigned long)i, flags );
+      r = TEST_FAIL;
+      break;
+    }
+
+    /* The tape should be where playing the block would have left it */
+    do {
+      if( libspectrum_tape_get_next_edge( &tstates, &flags, played ) ) {
+        r = TEST_INCOMPLETE;
+        break;
+      }
+    } while( !( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) );
+    if( r ) break;
+
+    if( libspectrum_tape_tell_tstates( &position, tape ) ||
+        libspectrum_tape_tell_tstates( &expected, played ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    if( position != expected ) {
+      fprintf( stderr, "%s: expected position %lu after block %lu, got %lu\n",
+               progname, (unsigned long)expected, (unsigned long)i,
+               (unsigned long)position );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( libspectrum_tape_free( played ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+  if( r ) return r;
+
+  /* A block the ROM loader can't read shouldn't move the tape */
+  tape = libspectrum_tape_alloc();
+  libspectrum_tape_append_block( tape, pause_block( 100 ) );
+  libspectrum_tape_append_block( tape, pause_block( 200 ) );
+
+  if( libspectrum_tape_fast_load( &data, &length, &flag, &checksum_ok,
+                                  &flags, tape ) ||
+      libspectrum_tape_position( &n, tape ) ) {
+    r = TEST_INCOMPLETE;
+  } else if( data || n != 0 ) {
+    fprintf( stderr, "%s: loaded a pause block\n", progname );
+    r = TEST_FAIL;
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+/* Check the edges from a raw data block against the bits it contains,
+   read one at a time */
+static test_return_t
+check_raw_data( libspectrum_byte *data, size_t length,
+                size_t bits_in_last_byte )
+{
+  libspectrum_tape *tape = libspectrum_tape_alloc();
+  libspectrum_tape_block *block =
+    libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RAW_DATA );
+  libspectrum_dword tstates;
+  size_t bits = 0, bit = 0, edge = 0, run, i;
+  int flags, last, done = 0, *values;
+  test_return_t r = TEST_PASS;
+
+  values = libspectrum_new( int, length * 8 );
+  for( i = 0; i < length * 8; i++ ) {
+    if( i / 8 == length - 1 && i % 8 < 8 - bits_in_last_byte ) continue;
+    values[ bits++ ] = !!( data[ i / 8 ] & ( 0x80 >> ( i % 8 ) ) );
+  }
+
+  libspectrum_tape_block_set_data( block, data );
+  libspectrum_tape_block_set_data_length( block, length );
+  libspectrum_tape_block_set_bits_in_last_byte( block, bits_in_last_byte );
+  libspectrum_tape_block_set_bit_length( block, 3 );
+  libspectrum_tape_block_set_pause_tstates( block, 1000 );
+  libspectrum_tape_append_block( tape, block );
+
+  /* The first level comes from the top bit of the data, even if that
+     bit is unused */
+  last = !!( data[0] & 0x80 );
+
+  /* Each edge is the run of bits up to and including the next one equal
+     to `last', which flips after every edge; the last edge ends with
+     the data */
+  do {
+    run = 0;
+    do {
+      run++;
+      if( bit == bits ) { done = 1; break; }
+    } while( values[ bit++ ] != last );
+    last = !last;
+
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    /* The level is set from the run after this one, if there is one */
+    if( tstates != run * 3 ||
+        !( flags & ( ( done ? last : !last ) ?
+                     LIBSPECTRUM_TAPE_FLAGS_LEVEL_LOW :
+                     LIBSPECTRUM_TAPE_FLAGS_LEVEL_HIGH ) ) ) {
+      fprintf( stderr,
+               "%s: edge %lu of %lu byte block: expected %lu tstates, "
+               "got %lu with flags 0x%04x\n", progname, (unsigned long)edge,
+               (unsigned long)length, (unsigned long)run * 3,
+               (unsigned long)tstates, flags );
+      r = TEST_FAIL;
+      break;
+    }
+
+    edge++;
+  } while( !done );
+
+  if( r == TEST_PASS ) {
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( tstates != 1000 || !( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) ) {
+      fprintf( stderr, "%s: expected pause after %lu byte block\n",
+               progname, (unsigned long)length );
+      r = TEST_FAIL;
+    }
+  }
+
+  libspectrum_free( values );
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_79( void )
+{
+  const size_t lengths[] = { 1, 2, 7, 8, 9, 16, 17, 100 };
+  libspectrum_dword seed = 1;
+  size_t i, j, bits_in_last_byte, run = 0;
+  int level = 0;
+  test_return_t r = TEST_PASS;
+
+  for( i = 0; r == TEST_PASS && i < ARRAY_SIZE( lengths ); i++ ) {
+    for( bits_in_last_byte = 1;
+         r == TEST_PASS && bits_in_last_byte <= 8;
+         bits_in_last_byte++ ) {
+
+      /* Runs of between 1 and 150 bits; the data belongs to the block */
+      libspectrum_byte *data = libspectrum_new0( libspectrum_byte,
+                                                 lengths[i] );
+      for( j = 0; j < lengths[i] * 8; j++ ) {
+        if( !run ) {
+          seed = seed * 1103515245 + 12345;
+          run = 1 + ( seed >> 16 ) % 150;
+          level = !level;
+        }
+        if( level ) data[ j / 8 ] |= 0x80 >> ( j % 8 );
+        run--;
+      }
+
+      r = check_raw_data( data, lengths[i], bits_in_last_byte );
+    }
+  }
+
+  return r;
+}
+
+static test_return_t
+test_80( void )
+{
+  libspectrum_tape *tape = libspectrum_tape_alloc();
+  libspectrum_tape_block *block =
+    libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_TONE );
+  libspectrum_tape_pcm *pcm;
+  libspectrum_byte samples[64], *buffer = NULL;
+  size_t done = 0, rendered, length = 0, i;
+  test_return_t r = TEST_PASS;
+
+  /* Four pulses, each 10 samples long at 1 kHz */
+  libspectrum_tape_block_set_pulse_length( block, 35000 );
+  libspectrum_tape_block_set_count( block, 4 );
+  libspectrum_tape_append_block( tape, block );
+
+  pcm = libspectrum_tape_pcm_alloc( tape, 1000, 8 );
+  if( !pcm ) { libspectrum_tape_free( tape ); return TEST_INCOMPLETE; }
+
+  do {
+    if( libspectrum_tape_render_pcm( samples + done, 7, &rendered, pcm ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+    done += rendered;
+  } while( rendered == 7 );
+
+  libspectrum_tape_pcm_free( pcm );
+
+  if( r == TEST_PASS && done != 40 ) {
+    fprintf( stderr, "%s: expected 40 samples, got %lu\n", progname,
+             (unsigned long)done );
+    r = TEST_FAIL;
+  }
+
+  for( i = 0; r == TEST_PASS && i < done; i++ ) {
+    if( samples[i] != ( ( i / 10 ) % 2 ? 0xff : 0x00 ) ) {
+      fprintf( stderr, "%s: sample %lu is 0x%02x\n", progname,
+               (unsigned long)i, samples[i] );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( r == TEST_PASS ) {
+    if( libspectrum_tape_write_wav( &buffer, &length, tape, 1000, 16 ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( length != 44 + 80 || memcmp( buffer, "RIFF", 4 ) ||
+               memcmp( buffer + 36, "data", 4 ) || buffer[40] != 80 ||
+               buffer[44] != 0x00 || buffer[45] != 0x80 ||
+               buffer[64] != 0xff || buffer[65] != 0x7f ) {
+      fprintf( stderr, "%s: wrong .wav file written\n", progname );
+      r = TEST_FAIL;
+    }
+    libspectrum_free( buffer );
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+/* Read a tape both normally and borrowing its data from the file,
+   and check the borrowed data is used and gives the same edges */
+static test_return_t
+check_borrowed( const char *filename )
+{
+  libspectrum_byte *buffer = NULL, *data;
+  size_t length = 0;
+  libspectrum_tape *copied, *borrowed;
+  libspectrum_tape_iterator it;
+  libspectrum_tape_block *block;
+  libspectrum_dword tstates, borrowed_tstates;
+  int flags, borrowed_flags, found = 0;
+  test_return_t r = TEST_PASS;
+
+  if( read_file( &buffer, &length, filename ) ) return TEST_INCOMPLETE;
+
+  copied = libspectrum_tape_alloc();
+  borrowed = libspectrum_tape_alloc();
+
+  if( libspectrum_tape_read( copied, buffer, length, LIBSPECTRUM_ID_UNKNOWN,
+                             filename ) ||
+      libspectrum_tape_read2( borrowed, buffer, length,
+                              LIBSPECTRUM_ID_UNKNOWN, filename,
+                              LIBSPECTRUM_FLAG_TAPE_BORROW_DATA ) ) {
+    r = TEST_INCOMPLETE;
+  }
+
+  for( block = libspectrum_tape_iterator_init( &it, borrowed );
+       r == TEST_PASS && block;
+       block = libspectrum_tape_iterator_next( &it ) ) {
+
+    switch( libspectrum_tape_block_type( block ) ) {
+    case LIBSPECTRUM_TAPE_BLOCK_ROM:
+    case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+    case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+    case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+    case LIBSPECTRUM_TAPE_BLOCK_CUSTOM:
+    case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+      data = libspectrum_tape_block_data( block );
+      if( data && ( data < buffer || data >= buffer + length ) ) {
+        fprintf( stderr, "%s: block data in `%s' was copied\n", progname,
+                 filename );
+        r = TEST_FAIL;
+      }
+      found = 1;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if( r == TEST_PASS && !found ) {
+    fprintf( stderr, "%s: no data blocks in `%s'\n", progname, filename );
+    r = TEST_INCOMPLETE;
+  }
+
+  while( r == TEST_PASS ) {
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, copied ) ||
+        libspectrum_tape_get_next_edge( &borrowed_tstates, &borrowed_flags,
+                                        borrowed ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+    if( tstates != borrowed_tstates || flags != borrowed_flags ) {
+      fprintf( stderr, "%s: edges from `%s' differ\n", progname, filename );
+      r = TEST_FAIL;
+    }
+    if( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) break;
+  }
+
+  /* The tape must go before the buffer it borrows from */
+  if( libspectrum_tape_free( borrowed ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( copied ) ) r = TEST_INCOMPLETE;
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+static test_return_t
+test_81( void )
+{
+  test_return_t r;
+
+  r = check_borrowed( DYNAMIC_TEST_PATH( "complete-tzx.tzx" ) );
+  if( !r ) r = check_borrowed( DYNAMIC_TEST_PATH( "zero-tail.pzx" ) );
+
+  return r;
+}
+
+/* Check the next `count' edges from two tapes are the same */
+static test_return_t
+compare_edges( libspectrum_tape *a, libspectrum_tape *b, size_t count,
+               const char *what )
+{
+  libspectrum_dword a_tstates, b_tstates;
+  int a_flags, b_flags;
+  size_t i;
+
+  for( i = 0; i < count; i++ ) {
+    if( libspectrum_tape_get_next_edge( &a_tstates, &a_flags, a ) ||
+        libspectrum_tape_get_next_edge( &b_tstates, &b_flags, b ) )
+      return TEST_INCOMPLETE;
+    if( a_tstates != b_tstates || a_flags != b_flags ) {
+      fprintf( stderr, "%s: edge %lu %s differs\n", progname,
+               (unsigned long)i, what );
+      return TEST_FAIL;
+    }
+    if( a_flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) break;
+  }
+
+  return TEST_PASS;
+}
+
+static test_return_t
+test_82( void )
+{
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0;
+  libspectrum_tape *tape, *inflated, *streamed;
+  libspectrum_tape_block *block;
+  test_return_t r = TEST_PASS;
+
+  /* Enough pulses for several megabytes of CSW data */
+  tape = libspectrum_tape_alloc();
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_TONE );
+  libspectrum_tape_block_set_pulse_length( block, 400 );
+  libspectrum_tape_block_set_count( block, 5000000 );
+  libspectrum_tape_append_block( tape, block );
+
+  if( libspectrum_tape_write( &buffer, &length, tape,
+                              LIBSPECTRUM_ID_TAPE_CSW ) ) {
+    libspectrum_tape_free( tape );
+    return TEST_INCOMPLETE;
+  }
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  inflated = libspectrum_tape_alloc();
+  streamed = libspectrum_tape_alloc();
+
+  if( libspectrum_tape_read( inflated, buffer, length,
+                             LIBSPECTRUM_ID_TAPE_CSW, NULL ) ||
+      libspectrum_tape_read2( streamed, buffer, length,
+                              LIBSPECTRUM_ID_TAPE_CSW, NULL,
+                              LIBSPECTRUM_FLAG_TAPE_STREAM_DATA ) ) {
+    r = TEST_INCOMPLETE;
+  }
+
+  /* The streamed data goes with the tape, not the buffer */
+  libspectrum_free( buffer );
+
+  if( r == TEST_PASS ) {
+    block = libspectrum_tape_current_block( streamed );
+    if( libspectrum_tape_block_data( block ) ) {
+      fprintf( stderr, "%s: streamed CSW data was inflated\n", progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( r == TEST_PASS )
+    r = compare_edges( inflated, streamed, (size_t)-1, "playing" );
+
+  /* Go back into the middle of the data, and then to its start */
+  if( r == TEST_PASS ) {
+    if( libspectrum_tape_seek_tstates( inflated, 1800000000 ) ||
+        libspectrum_tape_seek_tstates( streamed, 1800000000 ) ) {
+      r = TEST_INCOMPLETE;
+    } else {
+      r = compare_edges( inflated, streamed, 1000, "after seeking" );
+    }
+  }
+
+  if( r == TEST_PASS ) {
+    if( libspectrum_tape_nth_block( inflated, 0 ) ||
+        libspectrum_tape_nth_block( streamed, 0 ) ) {
+      r = TEST_INCOMPLETE;
+    } else {
+      r = compare_edges( inflated, streamed, 1000, "after rewinding" );
+    }
+  }
+
+  if( libspectrum_tape_free( streamed ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( inflated ) ) r = TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_83( void )
+{
+  libspectrum_byte buffer[ 44 + 60 * 6 ], *ptr;
+  libspectrum_tape *tape;
+  libspectrum_tape_block *block;
+  const libspectrum_byte expected[] = { 20, 20, 20 };
+  test_return_t r = TEST_PASS;
+  size_t i;
+
+  /* A 44100 Hz stereo 24-bit file: 20 samples low with a spike of noise,
+     20 high and 20 low again */
+  memcpy( buffer, "RIFF\x8c\x01\0\0WAVEfmt \x10\0\0\0"
+                  "\x01\0\x02\0\x44\xac\0\0\x98\x09\x04\0\x06\0\x18\0"
+                  "data\x68\x01\0\0", 44 );
+
+  for( i = 0, ptr = buffer + 44; i < 60; i++, ptr += 6 ) {
+    libspectrum_signed_word sample = ( i / 20 ) % 2 ? 0x6000 : -0x6000;
+    if( i == 10 ) sample = 0x0200;
+    ptr[0] = 0x00; ptr[1] = sample & 0xff; ptr[2] = sample >> 8;
+    ptr[3] = 0x00; ptr[4] = sample & 0xff; ptr[5] = sample >> 8;
+  }
+
+  tape = libspectrum_tape_alloc();
+
+  if( libspectrum_tape_read( tape, buffer, sizeof( buffer ),
+                             LIBSPECTRUM_ID_UNKNOWN, NULL ) ) {
+    libspectrum_tape_free( tape );
+    return TEST_INCOMPLETE;
+  }
+
+  block = libspectrum_tape_current_block( tape );
+  if( !block ||
+      libspectrum_tape_block_type( block ) !=
+        LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE ||
+      libspectrum_tape_block_scale( block ) != 79 ||
+      libspectrum_tape_block_data_length( block ) != sizeof( expected ) ||
+      memcmp( libspectrum_tape_block_data( block ), expected,
+              sizeof( expected ) ) ) {
+    fprintf( stderr, "%s: wrong pulses read from .wav file\n", progname );
+    r = TEST_FAIL;
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+struct file_sink {
+  libspectrum_byte *data;
+  size_t length;
+  int out_of_order;
+};
+
+static libspectrum_error
+write_to_file_sink( const libspectrum_byte *data, size_t length,
+                    size_t offset, void *context )
+{
+  struct file_sink *sink = context;
+
+  if( offset != sink->length ) sink->out_of_order++;
+
+  if( offset + length > sink->length ) {
+    sink->data = libspectrum_renew( libspectrum_byte, sink->data,
+                                    offset + length );
+    sink->length = offset + length;
+  }
+
+  memcpy( sink->data + offset, data, length );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static test_return_t
+test_84( void )
+{
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0;
+  libspectrum_tape *tape;
+  struct file_sink sink;
+  const char *filename = DYNAMIC_TEST_PATH( "complete-tzx.tzx" );
+  int profiles[2];
+  size_t i;
+  test_return_t r;
+
+  r = load_tape( &tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  profiles[0] = 0;
+  profiles[1] = LIBSPECTRUM_FLAG_COMPRESS_FASTEST;
+
+  for( i = 0; r == TEST_PASS && i < ARRAY_SIZE( profiles ); i++ ) {
+
+    sink.data = NULL; sink.length = 0; sink.out_of_order = 0;
+
+    if( libspectrum_tape_write2( &buffer, &length, tape,
+                                 LIBSPECTRUM_ID_TAPE_CSW, profiles[i] ) ||
+        libspectrum_tape_write_csw( write_to_file_sink, &sink, tape,
+                                    profiles[i] ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( sink.length != length ||
+               memcmp( sink.data, buffer, length ) ) {
+      fprintf( stderr, "%s: .csw files written differently with flags %d\n",
+               progname, profiles[i] );
+      r = TEST_FAIL;
+    } else if( sink.out_of_order != 1 || length < 0x21 ||
+               !( buffer[0x1d] | buffer[0x1e] | buffer[0x1f] |
+                  buffer[0x20] ) ) {
+      fprintf( stderr, "%s: .csw header not filled in\n", progname );
+      r = TEST_FAIL;
+    }
+
+    libspectrum_free( sink.data );
+    libspectrum_free( buffer ); buffer = NULL; length = 0;
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_85( void )
+{
+  libspectrum_byte *csw = NULL, *tzx = NULL, *drb = NULL;
+  size_t csw_length = 0, tzx_length = 0, drb_length = 0;
+  libspectrum_tape *tape, *csw_tape, *tzx_tape;
+  libspectrum_tape_block *block, *tzx_block;
+  const char *filename = DYNAMIC_TEST_PATH( "standard-tap.tap" );
+  test_return_t r;
+
+  r = load_tape( &tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  csw_tape = libspectrum_tape_alloc();
+  tzx_tape = libspectrum_tape_alloc();
+
+  if( libspectrum_tape_write( &csw, &csw_length, tape,
+                              LIBSPECTRUM_ID_TAPE_CSW ) ||
+      libspectrum_tape_read( csw_tape, csw, csw_length,
+                             LIBSPECTRUM_ID_TAPE_CSW, NULL ) ||
+      libspectrum_tape_write( &drb, &drb_length, csw_tape,
+                              LIBSPECTRUM_ID_TAPE_TZX ) ||
+      libspectrum_tape_write2( &tzx, &tzx_length, csw_tape,
+                               LIBSPECTRUM_ID_TAPE_TZX,
+                               LIBSPECTRUM_FLAG_TAPE_CSW_BLOCKS ) ||
+      libspectrum_tape_read( tzx_tape, tzx, tzx_length,
+                             LIBSPECTRUM_ID_TAPE_TZX, NULL ) ) {
+    r = TEST_INCOMPLETE;
+  }
+
+  if( r == TEST_PASS ) {
+    block = libspectrum_tape_current_block( csw_tape );
+    tzx_block = libspectrum_tape_current_block( tzx_tape );
+
+    if( tzx_length < 11 || tzx[10] != 0x18 || tzx_length >= drb_length ) {
+      fprintf( stderr, "%s: no CSW recording block written\n", progname );
+      r = TEST_FAIL;
+    } else if( libspectrum_tape_block_type( tzx_block ) !=
+                 LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE ||
+               libspectrum_tape_block_scale( tzx_block ) !=
+                 libspectrum_tape_block_scale( block ) ||
+               libspectrum_tape_block_data_length( tzx_block ) !=
+                 libspectrum_tape_block_data_length( block ) ||
+               memcmp( libspectrum_tape_block_data( tzx_block ),
+                       libspectrum_tape_block_data( block ),
+                       libspectrum_tape_block_data_length( block ) ) ) {
+      fprintf( stderr, "%s: CSW recording block read back differently\n",
+               progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  libspectrum_free( csw );
+  libspectrum_free( tzx );
+  libspectrum_free( drb );
+  if( libspectrum_tape_free( tzx_tape ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( csw_tape ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( tape ) ) r = TEST_INCOMPLETE;
+
+  return r;
+}
+
+/* Read a tape both normally and into an arena, and check the two give
+   the same edges and write out the same */
+static test_return_t
+check_arena( const char *filename )
+{
+  libspectrum_byte *buffer = NULL, *written = NULL, *arena_written = NULL;
+  libspectrum_byte *data;
+  size_t length = 0, written_length = 0, arena_written_length = 0;
+  libspectrum_tape *tape, *arena;
+  libspectrum_tape_iterator it;
+  libspectrum_tape_block *block;
+  test_return_t r = TEST_PASS;
+
+  if( read_file( &buffer, &length, filename ) ) return TEST_INCOMPLETE;
+
+  tape = libspectrum_tape_alloc();
+  arena = libspectrum_tape_alloc();
+
+  if( libspectrum_tape_read( tape, buffer, length, LIBSPECTRUM_ID_UNKNOWN,
+                             filename ) ||
+      libspectrum_tape_read2( arena, buffer, length, LIBSPECTRUM_ID_UNKNOWN,
+                              filename, LIBSPECTRUM_FLAG_TAPE_ARENA ) ||
+      libspectrum_tape_write( &written, &written_length, tape,
+                              LIBSPECTRUM_ID_TAPE_TZX ) ||
+      libspectrum_tape_write( &arena_written, &arena_written_length, arena,
+                              LIBSPECTRUM_ID_TAPE_TZX ) ) {
+    r = TEST_INCOMPLETE;
+  }
+
+  if( r == TEST_PASS && ( written_length != arena_written_length ||
+                          memcmp( written, arena_written, written_length ) ) ) {
+    fprintf( stderr, "%s: `%s' written differently from an arena\n",
+             progname, filename );
+    r = TEST_FAIL;
+  }
+
+  if( r == TEST_PASS ) r = compare_edges( tape, arena, 1000000, filename );
+
+  /* Blocks in the arena can still be changed and removed */
+  if( r == TEST_PASS ) {
+    block = libspectrum_tape_iterator_init( &it, arena );
+    if( libspectrum_tape_block_type( block ) == LIBSPECTRUM_TAPE_BLOCK_ROM ) {
+      data = libspectrum_new( libspectrum_byte, 1 ); data[0] = 0xff;
+      libspectrum_tape_block_set_data( block, data );
+      libspectrum_tape_block_set_data_length( block, 1 );
+    }
+    libspectrum_tape_remove_block( arena, it );
+
+    /* And data given to a block left on the tape goes with the tape */
+    block = libspectrum_tape_iterator_init( &it, arena );
+    if( block &&
+        libspectrum_tape_block_type( block ) == LIBSPECTRUM_TAPE_BLOCK_ROM ) {
+      data = libspectrum_new( libspectrum_byte, 1 ); data[0] = 0xff;
+      libspectrum_tape_block_set_data( block, data );
+      libspectrum_tape_block_set_data_length( block, 1 );
+    }
+  }
+
+  if( libspectrum_tape_free( arena ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( tape ) ) r = TEST_INCOMPLETE;
+  libspectrum_free( arena_written );
+  libspectrum_free( written );
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+static test_return_t
+test_86( void )
+{
+  test_return_t r;
+
+  r = check_arena( DYNAMIC_TEST_PATH( "complete-tzx.tzx" ) );
+  if( !r ) r = check_arena( DYNAMIC_TEST_PATH( "zero-tail.pzx" ) );
+  if( !r ) r = check_arena( DYNAMIC_TEST_PATH( "standard-tap.tap" ) );
+
+  return r;
+}
+
+static test_return_t
+test_87( void )
+{
+  libspectrum_tape *tape;
+  libspectrum_tape_iterator it;
+  libspectrum_tape_block *block;
+  libspectrum_qword sum = 0, start, total;
+  libspectrum_dword length;
+  const char *filename = DYNAMIC_TEST_PATH( "standard-tap.tap" );
+  int n = 0;
+  test_return_t r;
+
+  r = load_tape( &tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  for( block = libspectrum_tape_iterator_init( &it, tape );
+       r == TEST_PASS && block;
+       block = libspectrum_tape_iterator_next( &it ), n++ ) {
+    if( libspectrum_tape_block_start_tstates( &start, tape, n ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( start != sum ) {
+      fprintf( stderr, "%s: block %d starts at %lu, not %lu\n", progname, n,
+               (unsigned long)start, (unsigned long)sum );
+      r = TEST_FAIL;
+    }
+    sum += libspectrum_tape_block_length( block );
+  }
+
+  if( r == TEST_PASS ) {
+    if( libspectrum_tape_total_tstates( &total, tape ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( total != sum ) {
+      fprintf( stderr, "%s: tape is %lu tstates long, not %lu\n", progname,
+               (unsigned long)total, (unsigned long)sum );
+      r = TEST_FAIL;
+    }
+  }
+
+  /* Changing a block must change the lengths */
+  if( r == TEST_PASS ) {
+    block = libspectrum_tape_iterator_init( &it, tape );
+    length = libspectrum_tape_block_length( block );
+    libspectrum_tape_block_set_pause_tstates(
+      block, libspectrum_tape_block_pause_tstates( block ) + 1000
+    );
+    if( libspectrum_tape_block_length( block ) != length + 1000 ||
+        libspectrum_tape_total_tstates( &total, tape ) ||
+        total != sum + 1000 ||
+        libspectrum_tape_block_start_tstates( &start, tape, 1 ) ||
+        start != length + 1000 ) {
+      fprintf( stderr, "%s: lengths not updated after block changed\n",
+               progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+/* Check a tape restored to a saved position plays the same edges as the
+   tape it was saved from */
+static test_return_t
+check_state_restore( const char *filename, size_t skip, int compile )
+{
+  libspectrum_tape *tape, *restored;
+  libspectrum_byte state[ 256 ];
+  libspectrum_dword tstates;
+  int flags;
+  size_t i;
+  test_return_t r;
+
+  if( LIBSPECTRUM_TAPE_STATE_LENGTH > sizeof( state ) ) return TEST_FAIL;
+
+  r = load_tape( &tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+  r = load_tape( &restored, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) { libspectrum_tape_free( tape ); return r; }
+
+  if( compile && libspectrum_tape_compile( tape ) ) r = TEST_INCOMPLETE;
+
+  for( i = 0; r == TEST_PASS && i < skip; i++ )
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) )
+      r = TEST_INCOMPLETE;
+
+  if( r == TEST_PASS &&
+      ( libspectrum_tape_state_save( state, sizeof( state ), tape ) ||
+        libspectrum_tape_state_restore( restored, state, sizeof( state ) ) ) )
+    r = TEST_INCOMPLETE;
+
+  if( r == TEST_PASS ) r = compare_edges( tape, restored, 5000, filename );
+
+  /* And going back to the saved position again */
+  if( r == TEST_PASS &&
+      ( libspectrum_tape_state_restore( tape, state, sizeof( state ) ) ||
+        libspectrum_tape_state_restore( restored, state, sizeof( state ) ) ) )
+    r = TEST_INCOMPLETE;
+
+  if( r == TEST_PASS ) r = compare_edges( tape, restored, 5000, filename );
+
+  if( libspectrum_tape_free( restored ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( tape ) ) r = TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_88( void )
+{
+  const char *tzx = DYNAMIC_TEST_PATH( "complete-tzx.tzx" );
+  const char *pzx = DYNAMIC_TEST_PATH( "zero-tail.pzx" );
+  libspectrum_tape *tape;
+  libspectrum_byte state[ 256 ];
+  size_t skips[] = { 0, 1, 100, 3000, 20000 };
+  size_t i;
+  test_return_t r = TEST_PASS;
+
+  for( i = 0; r == TEST_PASS && i < ARRAY_SIZE( skips ); i++ ) {
+    r = check_state_restore( tzx, skips[i], 0 );
+    if( !r ) r = check_state_restore( tzx, skips[i], 1 );
+    if( !r ) r = check_state_restore( pzx, skips[i], 0 );
+  }
+  if( r ) return r;
+
+  r = load_tape( &tape, tzx, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  /* Too small a buffer, and a state which doesn't fit the tape */
+  if( libspectrum_tape_state_save( state, LIBSPECTRUM_TAPE_STATE_LENGTH - 1,
+                                   tape ) != LIBSPECTRUM_ERROR_INVALID ) {
+    fprintf( stderr, "%s: state saved into too small a buffer\n", progname );
+    r = TEST_FAIL;
+  } else if( libspectrum_tape_state_save( state, sizeof( state ), tape ) ) {
+    r = TEST_INCOMPLETE;
+  } else {
+    state[ 8 ] = 0xff;
+    if( libspectrum_tape_state_restore( tape, state, sizeof( state ) ) !=
+        LIBSPECTRUM_ERROR_INVALID ) {
+      fprintf( stderr, "%s: state for missing block restored\n", progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_89( void )
+{
+  const char *filename = DYNAMIC_TEST_PATH( "complete-tzx.tzx" );
+  libspectrum_tape *tape;
+  libspectrum_dword peek_tstates[7], tstates[7];
+  int peek_flags[7], flags[7];
+  size_t peek_count, count;
+  test_return_t r;
+
+  r = load_tape( &tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  do {
+
+    if( libspectrum_tape_peek_edges( peek_tstates, peek_flags,
+                                     ARRAY_SIZE( peek_tstates ), &peek_count,
+                                     tape ) ||
+        libspectrum_tape_get_next_edges( tstates, flags, ARRAY_SIZE( tstates ),
+                                         &count, tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    if( peek_count != count ||
+        memcmp( peek_tstates, tstates, count * sizeof( *tstates ) ) ||
+        memcmp( peek_flags, flags, count * sizeof( *flags ) ) ) {
+      fprintf( stderr, "%s: peeked edges differ from those played\n",
+               progname );
+      r = TEST_FAIL;
+    }
+
+  } while( r == TEST_PASS && count &&
+           !( flags[ count - 1 ] & LIBSPECTRUM_TAPE_FLAGS_TAPE ) );
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_90( void )
+{
+  test_return_t r;
+
+  /* Enough for whole bytes of data to be played at once */
+  r = check_batched_edges( DYNAMIC_TEST_PATH( "complete-tzx.tzx" ), 100 );
+  if( !r ) r = check_batched_edges( DYNAMIC_TEST_PATH( "standard-tap.tap" ),
+                                    100 );
+  if( !r ) r = check_batched_edges( DYNAMIC_TEST_PATH( "standard-tap.tap" ),
+                                    17 );
+
+  return r;
+}
+
+static test_return_t
+test_91( void )
+{
+  libspectrum_tape *tape, *sampled;
+  libspectrum_tape_iterator it, sampled_it;
+  libspectrum_tape_block *block, *sampled_block;
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0;
+  test_return_t r;
+
+  r = load_tape( &tape, DYNAMIC_TEST_PATH( "standard-tap.tap" ),
+                 LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  if( libspectrum_tape_write( &buffer, &length, tape,
+                              LIBSPECTRUM_ID_TAPE_CSW ) ) {
+    libspectrum_tape_free( tape );
+    return TEST_INCOMPLETE;
+  }
+
+  sampled = libspectrum_tape_alloc();
+  if( libspectrum_tape_read( sampled, buffer, length, LIBSPECTRUM_ID_TAPE_CSW,
+                             NULL ) ||
+      libspectrum_tape_reconstruct( sampled ) ) {
+    r = TEST_INCOMPLETE;
+  }
+  libspectrum_free( buffer );
+
+  /* Each block of the .tap file should have been recovered in turn */
+  block = libspectrum_tape_iterator_init( &it, tape );
+  sampled_block = libspectrum_tape_iterator_init( &sampled_it, sampled );
+
+  while( r == TEST_PASS && block ) {
+
+    libspectrum_tape_type type;
+
+    if( !sampled_block ) {
+      fprintf( stderr, "%s: block not recovered from sampled tape\n",
+               progname );
+      r = TEST_FAIL;
+      break;
+    }
+
+    type = libspectrum_tape_block_type( sampled_block );
+    if( type == LIBSPECTRUM_TAPE_BLOCK_ROM ||
+        type == LIBSPECTRUM_TAPE_BLOCK_TURBO ) {
+      if( libspectrum_tape_block_data_length( sampled_block ) !=
+            libspectrum_tape_block_data_length( block ) ||
+          memcmp( libspectrum_tape_block_data( sampled_block ),
+                  libspectrum_tape_block_data( block ),
+                  libspectrum_tape_block_data_length( block ) ) ) {
+        fprintf( stderr, "%s: recovered data differs from original\n",
+                 progname );
+        r = TEST_FAIL;
+      }
+      block = libspectrum_tape_iterator_next( &it );
+    }
+
+    sampled_block = libspectrum_tape_iterator_next( &sampled_it );
+  }
+
+  if( libspectrum_tape_free( sampled ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( tape ) ) r = TEST_INCOMPLETE;
+
+  return r;
+}
+
+/* Runs jobs last first, and counts how many it was given */
+static void
+reverse_executor( libspectrum_job_fn job, void *job_context, size_t count,
+                  void *executor_context )
+{
+  size_t *jobs = executor_context;
+
+  *jobs += count;
+  while( count-- ) job( job_context, count );
+}
+
+static test_return_t
+test_92( void )
+{
+  libspectrum_snap *snap;
+  libspectrum_byte *buffer = NULL, *page;
+  size_t length = 0;
+  int out_flags, i;
+  test_return_t r = TEST_PASS;
+
+  snap = libspectrum_snap_alloc();
+  libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_PENT1024 );
+
+  for( i = 0; i < 64; i++ ) {
+    page = libspectrum_new( libspectrum_byte, 0x4000 );
+    memset( page, i, 0x4000 );
+    libspectrum_snap_set_pages( snap, i, page );
+  }
+
+  if( libspectrum_snap_write( &buffer, &length, &out_flags, snap,
+                              LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 0 ) ) {
+    libspectrum_snap_free( snap );
+    return TEST_INCOMPLETE;
+  }
+
+  libspectrum_snap_free( snap );
+
+  snap = libspectrum_snap_alloc();
+  if( libspectrum_snap_read( snap, buffer, length,
+                             LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL ) ) {
+    r = TEST_INCOMPLETE;
+  } else {
+    for( i = 0; r == TEST_PASS && i < 64; i++ ) {
+      page = libspectrum_snap_pages( snap, i );
+      if( !page || page[0] != i || page[ 0x3fff ] != i ) {
+        fprintf( stderr, "%s: page %d not restored\n", progname, i );
+        r = TEST_FAIL;
+      }
+    }
+
+    /* The pages must not have spilt over into the level data */
+    for( i = 0; r == TEST_PASS && i < SNAPSHOT_SLT_PAGES; i++ ) {
+      if( libspectrum_snap_slt( snap, i ) ) {
+        fprintf( stderr, "%s: SLT level %d overwritten\n", progname, i );
+        r = TEST_FAIL;
+      }
+    }
+  }
+
+  libspectrum_snap_free( snap );
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+static test_return_t
+test_93( void )
+{
+  libspectrum_snap *snap;
+  libspectrum_byte *serial = NULL, *parallel = NULL, *page;
+  size_t serial_length = 0, parallel_length = 0, jobs = 0;
+  int out_flags, i;
+  test_return_t r = TEST_PASS;
+
+  snap = libspectrum_snap_alloc();
+  libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_PENT1024 );
+
+  for( i = 0; i < 64; i++ ) {
+    page = libspectrum_new( libspectrum_byte, 0x4000 );
+    memset( page, i, 0x4000 );
+    page[ i ] = 0xff;
+    libspectrum_snap_set_pages( snap, i, page );
+  }
+
+  if( libspectrum_snap_write( &serial, &serial_length, &out_flags, snap,
+                              LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 0 ) ) {
+    r = TEST_INCOMPLETE;
+  } else {
+    libspectrum_set_executor( reverse_executor, &jobs );
+    if( libspectrum_snap_write( &parallel, &parallel_length, &out_flags, snap,
+                                LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 0 ) )
+      r = TEST_INCOMPLETE;
+    libspectrum_set_executor( NULL, NULL );
+  }
+
+  if( r == TEST_PASS && jobs != 64 ) {
+    fprintf( stderr, "%s: executor given %lu jobs, expected 64\n", progname,
+             (unsigned long)jobs );
+    r = TEST_FAIL;
+  }
+
+  if( r == TEST_PASS &&
+      ( parallel_length != serial_length ||
+        memcmp( parallel, serial, serial_length ) ) ) {
+    fprintf( stderr, "%s: snapshot written with executor differs\n",
+             progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_snap_free( snap );
+
+  /* Every page should come back as it went in */
+  if( r == TEST_PASS ) {
+    snap = libspectrum_snap_alloc();
+    if( libspectrum_snap_read( snap, parallel, parallel_length,
+                               LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL ) ) {
+      r = TEST_INCOMPLETE;
+    } else {
+      for( i = 0; r == TEST_PASS && i < 64; i++ ) {
+        page = libspectrum_snap_pages( snap, i );
+        if( !page || page[0] != ( i ? i : 0xff ) || page[ i ] != 0xff ||
+            page[ 0x3fff ] != i ) {
+          fprintf( stderr, "%s: page %d not restored\n", progname, i );
+          r = TEST_FAIL;
+        }
+      }
+    }
+    libspectrum_snap_free( snap );
+  }
+
+  libspectrum_free( serial );
+  libspectrum_free( parallel );
+
+  return r;
+}
+
+static test_return_t
+test_94( void )
+{
+  libspectrum_snap *snap;
+  libspectrum_byte *buffer, *page;
+  size_t length, lengths[4];
+  int profiles[4], out_flags, i, j;
+  test_return_t r = TEST_PASS;
+
+  profiles[0] = 0;
+  profiles[1] = LIBSPECTRUM_FLAG_COMPRESS_FASTEST;
+  profiles[2] = LIBSPECTRUM_FLAG_COMPRESS_DEFAULT;
+  profiles[3] = LIBSPECTRUM_FLAG_COMPRESS_RLE;
+
+  /* Mostly empty memory, with a little text in each page */
+  snap = libspectrum_snap_alloc();
+  libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_128 );
+  for( i = 0; i < 8; i++ ) {
+    page = libspectrum_new0( libspectrum_byte, 0x4000 );
+    for( j = 0; j < 0x800; j++ )
+      page[ 0x1000 + j ] = "libspectrum"[ j % 11 ] + i;
+    libspectrum_snap_set_pages( snap, i, page );
+  }
+
+  for( i = 0; r == TEST_PASS && i < 4; i++ ) {
+
+    libspectrum_snap *copy;
+
+    buffer = NULL; length = 0;
+    if( libspectrum_snap_write( &buffer, &length, &out_flags, snap,
+                                LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL,
+                                profiles[i] ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+    lengths[i] = length;
+
+    copy = libspectrum_snap_alloc();
+    if( libspectrum_snap_read( copy, buffer, length,
+                               LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL ) ) {
+      r = TEST_INCOMPLETE;
+    } else {
+      for( j = 0; r == TEST_PASS && j < 8; j++ ) {
+        if( memcmp( libspectrum_snap_pages( copy, j ),
+                    libspectrum_snap_pages( snap, j ), 0x4000 ) ) {
+          fprintf( stderr, "%s: page %d differs with profile %d\n", progname,
+                   j, i );
+          r = TEST_FAIL;
+        }
+      }
+    }
+
+    libspectrum_snap_free( copy );
+    libspectrum_free( buffer );
+  }
+
+  libspectrum_snap_free( snap );
+
+  /* Every profile should actually compress the pages, and the default of
+     trying hardest should do best */
+  for( i = 0; r == TEST_PASS && i < 4; i++ ) {
+    if( lengths[i] > 8 * 0x1000 || lengths[i] < lengths[0] ) {
+      fprintf( stderr, "%s: snapshot length %lu with profile %d\n",
+               progname, (unsigned long)lengths[i], i );
+      r = TEST_FAIL;
+    }
+  }
+
+  return r;
+}
+
+static test_return_t
+test_95( void )
+{
+  libspectrum_rzx *rzx, *copy;
+  libspectrum_snap *snap;
+  libspectrum_byte in_bytes[4], byte, *buffer = NULL, *page;
+  size_t length = 0;
+  int block, frame, finished, i;
+  const int pages[3] = { 5, 2, 0 };
+  test_return_t r = TEST_PASS;
+
+  /* Two snapshots, each followed by some input; all the blocks in the
+     file are compressed one after another */
+  rzx = libspectrum_rzx_alloc();
+
+  for( block = 0; block < 2; block++ ) {
+
+    snap = libspectrum_snap_alloc();
+    libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_48 );
+    for( i = 0; i < 3; i++ ) {
+      page = libspectrum_new0( libspectrum_byte, 0x4000 );
+      page[0] = block; page[0x2000] = i;
+      libspectrum_snap_set_pages( snap, pages[i], page );
+    }
+    libspectrum_rzx_add_snap( rzx, snap, 0 );
+
+    libspectrum_rzx_start_input( rzx, 0 );
+    for( frame = 0; frame < 50; frame++ ) {
+      for( i = 0; i < 4; i++ ) in_bytes[i] = block * 50 + frame + i;
+      libspectrum_rzx_store_frame( rzx, 1000 + frame, 4, in_bytes );
+    }
+    libspectrum_rzx_stop_input( rzx );
+  }
+
+  if( libspectrum_rzx_write( &buffer, &length, rzx,
+                             LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 1, NULL ) ) {
+    libspectrum_rzx_free( rzx );
+    return TEST_INCOMPLETE;
+  }
+  libspectrum_rzx_free( rzx );
+
+  copy = libspectrum_rzx_alloc();
+  if( libspectrum_rzx_read( copy, buffer, length ) ||
+      libspectrum_rzx_start_playback( copy, 0, &snap ) ) {
+    libspectrum_rzx_free( copy );
+    libspectrum_free( buffer );
+    return TEST_INCOMPLETE;
+  }
+  libspectrum_free( buffer );
+
+  finished = 0;
+
+  for( block = 0; r == TEST_PASS && block < 2; block++ ) {
+
+    if( !snap || libspectrum_snap_pages( snap, 5 )[0] != block ||
+        libspectrum_snap_pages( snap, 0 )[0x2000] != 2 ) {
+      fprintf( stderr, "%s: snapshot %d wrong\n", progname, block );
+      r = TEST_FAIL;
+      break;
+    }
+
+    for( frame = 0; r == TEST_PASS && frame < 50; frame++ ) {
+
+      if( libspectrum_rzx_instructions( copy ) != (size_t)( 1000 + frame ) ) {
+        fprintf( stderr, "%s: block %d frame %d has wrong instruction count\n",
+                 progname, block, frame );
+        r = TEST_FAIL;
+      }
+
+      for( i = 0; r == TEST_PASS && i < 4; i++ ) {
+        if( libspectrum_rzx_playback( copy, &byte ) ||
+            byte != (libspectrum_byte)( block * 50 + frame + i ) ) {
+          fprintf( stderr, "%s: block %d frame %d has wrong input\n",
+                   progname, block, frame );
+          r = TEST_FAIL;
+        }
+      }
+
+      if( r == TEST_PASS &&
+          libspectrum_rzx_playback_frame( copy, &finished, &snap ) )
+        r = TEST_FAIL;
+    }
+  }
+
+  if( r == TEST_PASS && !finished ) {
+    fprintf( stderr, "%s: recording didn't finish\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_rzx_free( copy );
+
+  return r;
+}
+
+static test_return_t
+test_96( void )
+{
+  libspectrum_byte data[0x1000], out[0x1001], *gzptr;
+  size_t gzlength, length;
+  size_t i;
+  test_return_t r = TEST_PASS;
+
+  for( i = 0; i < sizeof( data ); i++ ) data[i] = i * i / 7;
+
+  if( libspectrum_zlib_compress( data, sizeof( data ), &gzptr, &gzlength ) )
+    return TEST_INCOMPLETE;
+
+  /* More space than needed is fine, and we're told how much was used */
+  length = sizeof( out );
+  if( libspectrum_zlib_inflate_into( gzptr, gzlength, out, &length ) ||
+      length != sizeof( data ) || memcmp( out, data, sizeof( data ) ) ) {
+    fprintf( stderr, "%s: inflating into a larger buffer failed\n",
+             progname );
+    r = TEST_FAIL;
+  }
+
+  /* Too little space is an error */
+  length = sizeof( data ) - 1;
+  if( r == TEST_PASS &&
+      libspectrum_zlib_inflate_into( gzptr, gzlength, out, &length ) !=
+        LIBSPECTRUM_ERROR_CORRUPT ) {
+    fprintf( stderr, "%s: inflating into a short buffer succeeded\n",
+             progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_free( gzptr );
+
+  return r;
+}
+
+static test_return_t
+test_97( void )
+{
+  libspectrum_snap *snap, *copy;
+  libspectrum_byte *buffer, *page, *arena;
+  size_t length;
+  int flags[2], out_flags, i, j;
+  test_return_t r = TEST_PASS;
+
+  flags[0] = 0;
+  flags[1] = LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION;
+
+  snap = libspectrum_snap_alloc();
+  libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_128 );
+  for( i = 0; i < 8; i++ ) {
+    page = libspectrum_new0( libspectrum_byte, 0x4000 );
+    for( j = 0; j < 0x4000; j += 0x100 ) page[j] = i + j / 0x100;
+    libspectrum_snap_set_pages( snap, i, page );
+  }
+
+  /* The arena covers only the first five pages */
+  arena = libspectrum_new0( libspectrum_byte, 5 * 0x4000 );
+
+  for( i = 0; r == TEST_PASS && i < 2; i++ ) {
+
+    buffer = NULL; length = 0;
+    if( libspectrum_snap_write( &buffer, &length, &out_flags, snap,
+                                LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL,
+                                flags[i] ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    copy = libspectrum_snap_alloc();
+    libspectrum_snap_set_ram_arena( copy, arena );
+    libspectrum_snap_set_ram_arena_pages( copy, 5 );
+
+    if( libspectrum_snap_read( copy, buffer, length,
+                               LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL ) ) {
+      r = TEST_INCOMPLETE;
+    } else {
+      for( j = 0; r == TEST_PASS && j < 8; j++ ) {
+        page = libspectrum_snap_pages( copy, j );
+        if( ( j < 5 ) != ( page == arena + j * 0x4000 ) ) {
+          fprintf( stderr, "%s: page %d in the wrong place\n", progname, j );
+          r = TEST_FAIL;
+        } else if( memcmp( page, libspectrum_snap_pages( snap, j ),
+                           0x4000 ) ) {
+          fprintf( stderr, "%s: page %d differs\n", progname, j );
+          r = TEST_FAIL;
+        }
+      }
+    }
+
+    /* Frees only the pages outside the arena */
+    libspectrum_snap_free( copy );
+    libspectrum_free( buffer );
+  }
+
+  libspectrum_free( arena );
+  libspectrum_snap_free( snap );
+
+  return r;
+}
+
+static test_return_t
+test_98( void )
+{
+  const char *filename = STATIC_TEST_PATH( "standard-tap.tap" );
+  libspectrum_tape *tape, *compiled_tape;
+  libspectrum_dword tstates, compiled_tstates;
+  int flags, compiled_flags;
+  libspectrum_tape_state_type state, compiled_state;
+  size_t data2_edges = 0;
+  test_return_t r;
+
+  r = load_tape( &tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  r = load_tape( &compiled_tape, filename, LIBSPECTRUM_ERROR_NONE );
+  if( r ) { libspectrum_tape_free( tape ); return r; }
+
+  if( libspectrum_tape_compile( compiled_tape ) ||
+      libspectrum_tape_nth_block( compiled_tape, 0 ) ) {
+    libspectrum_tape_free( compiled_tape );
+    libspectrum_tape_free( tape );
+    return TEST_INCOMPLETE;
+  }
+
+  do {
+
+    state = libspectrum_tape_state( tape );
+    compiled_state = libspectrum_tape_state( compiled_tape );
+    if( state != compiled_state ) {
+      fprintf( stderr, "%s: expected state %d, got %d\n", progname, state,
+               compiled_state );
+      r = TEST_FAIL;
+      break;
+    }
+
+    /* Moving the state around should work the same way on both tapes:
+       play the first edge of a bit twice, and later cut a block short */
+    if( state == LIBSPECTRUM_TAPE_STATE_DATA2 ) {
+      data2_edges++;
+      if( data2_edges == 100 ) state = LIBSPECTRUM_TAPE_STATE_DATA1;
+      if( data2_edges == 300 ) state = LIBSPECTRUM_TAPE_STATE_PAUSE;
+      if( state != LIBSPECTRUM_TAPE_STATE_DATA2 &&
+          ( libspectrum_tape_set_state( tape, state ) ||
+            libspectrum_tape_set_state( compiled_tape, state ) ) ) {
+        r = TEST_INCOMPLETE;
+        break;
+      }
+    }
+
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ||
+        libspectrum_tape_get_next_edge( &compiled_tstates, &compiled_flags,
+                                        compiled_tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+    if( tstates != compiled_tstates || flags != compiled_flags ) {
+      fprintf( stderr, "%s: expected %u tstates and flags %d, got %u tstates and flags %d\n",
+               progname, tstates, flags, compiled_tstates, compiled_flags );
+      r = TEST_FAIL;
+      break;
+    }
+
+  } while( !( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) );
+
+  libspectrum_tape_free( compiled_tape );
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_99( void )
+{
+  libspectrum_tape *tape;
+  libspectrum_tape_block *block;
+  libspectrum_qword before, after;
+  libspectrum_dword tstates;
+  int flags;
+  size_t edges = 0;
+  test_return_t r;
+
+  r = load_tape( &tape, DYNAMIC_TEST_PATH( "complete-tzx.tzx" ),
+                 LIBSPECTRUM_ERROR_NONE );
+  if( r ) return r;
+
+  /* Appending a block shouldn't change where we are, even in a loop */
+  do {
+
+    if( edges++ % 7 == 0 ) {
+
+      if( libspectrum_tape_tell_tstates( &before, tape ) ) {
+        r = TEST_INCOMPLETE;
+        break;
+      }
+
+      block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_COMMENT );
+      libspectrum_tape_block_set_text( block, NULL );
+      libspectrum_tape_append_block( tape, block );
+
+      if( libspectrum_tape_tell_tstates( &after, tape ) ) {
+        r = TEST_INCOMPLETE;
+        break;
+      }
+
+      if( after != before ) {
+        fprintf( stderr, "%s: position moved from %lu to %lu\n", progname,
+                 (unsigned long)before, (unsigned long)after );
+        r = TEST_FAIL;
+        break;
+      }
+    }
+
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+
+  } while( !( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) );
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_100( void )
+{
+  libspectrum_tape *tape = libspectrum_tape_alloc();
+  libspectrum_tape_iterator it;
+  libspectrum_tape_block *block;
+  libspectrum_byte *data;
+  libspectrum_dword tstates;
+  int flags, i;
+  test_return_t r = TEST_PASS;
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ROM );
+  data = libspectrum_new0( libspectrum_byte, 2 );
+  libspectrum_tape_block_set_data_length( block, 2 );
+  libspectrum_tape_block_set_data( block, data );
+  libspectrum_tape_block_set_pause( block, 0 );
+  libspectrum_tape_append_block( tape, block );
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_TONE );
+  libspectrum_tape_block_set_pulse_length( block, 1234 );
+  libspectrum_tape_block_set_count( block, 3 );
+  libspectrum_tape_append_block( tape, block );
+
+  /* Start playing the ROM block, then take it away */
+  for( i = 0; i < 10; i++ ) {
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      libspectrum_tape_free( tape );
+      return TEST_INCOMPLETE;
+    }
+  }
+
+  libspectrum_tape_iterator_init( &it, tape );
+  libspectrum_tape_remove_block( tape, it );
+
+  /* The tone should now be played from its start */
+  for( i = 0; r == TEST_PASS && i < 3; i++ ) {
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( tstates != 1234 ||
+               !!( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) != ( i == 2 ) ) {
+      fprintf( stderr, "%s: edge %d is wrong after removing the block\n",
+               progname, i );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_101( void )
+{
+  libspectrum_tape *tape = libspectrum_tape_alloc();
+  libspectrum_tape_block *block;
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0;
+  test_return_t r = TEST_PASS;
+
+  /* Four pulses, each 10 samples long at 1 kHz, played for ever */
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_TONE );
+  libspectrum_tape_block_set_pulse_length( block, 35000 );
+  libspectrum_tape_block_set_count( block, 4 );
+  libspectrum_tape_append_block( tape, block );
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_JUMP );
+  libspectrum_tape_block_set_offset( block, -1 );
+  libspectrum_tape_append_block( tape, block );
+
+  if( libspectrum_tape_write_wav( &buffer, &length, tape, 1000, 8 ) ) {
+    r = TEST_INCOMPLETE;
+  } else if( length != 44 + 40 ) {
+    fprintf( stderr, "%s: expected %d bytes of WAV, got %lu\n", progname,
+             44 + 40, (unsigned long)length );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_free( buffer );
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+struct trickle_source {
+  const libspectrum_byte *data;
+  size_t length;
+};
+
+/* Give a file out a few bytes at a time */
+static libspectrum_error
+read_from_trickle_source( libspectrum_byte *data, size_t length,
+                          size_t *read, void *context )
+{
+  struct trickle_source *source = context;
+
+  *read = length < 7 ? length : 7;
+  if( *read > source->length ) *read = source->length;
+
+  memcpy( data, source->data, *read );
+  source->data += *read;
+  source->length -= *read;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static test_return_t
+test_102( void )
+{
+  const size_t leader = 10000, frames = leader + 200;
+  libspectrum_byte *buffer, *ptr, *expected;
+  size_t length = 44 + 2 * frames, i;
+  libspectrum_tape *tape, *stream_tape;
+  libspectrum_tape_block *block, *stream_block;
+  struct trickle_source source;
+  test_return_t r = TEST_PASS;
+
+  /* A 44100 Hz mono 16-bit file: a quiet square wave, 20 samples high
+     and 20 low, well away from zero after a leader at the same level */
+  buffer = libspectrum_new( libspectrum_byte, length );
+  memcpy( buffer, "RIFF\0\0\0\0WAVEfmt \x10\0\0\0"
+                  "\x01\0\x01\0\x44\xac\0\0\x88\x58\x01\0\x02\0\x10\0"
+                  "data", 40 );
+  ptr = buffer + 4; libspectrum_write_dword( &ptr, length - 8 );
+  ptr = buffer + 40; libspectrum_write_dword( &ptr, 2 * frames );
+
+  for( i = 0; i < frames; i++ ) {
+    libspectrum_word sample = 0x2000;
+    if( i >= leader ) sample += ( i - leader ) / 20 % 2 ? -0x200 : 0x200;
+    libspectrum_write_word( &ptr, sample );
+  }
+
+  /* One long pulse for the leader and the first half wave, then 20
+     samples at a time */
+  expected = libspectrum_new( libspectrum_byte, 5 + 9 );
+  ptr = expected; *ptr++ = 0; libspectrum_write_dword( &ptr, leader + 20 );
+  memset( ptr, 20, 9 );
+
+  tape = libspectrum_tape_alloc();
+  if( libspectrum_tape_read( tape, buffer, length, LIBSPECTRUM_ID_UNKNOWN,
+                             NULL ) ) {
+    r = TEST_INCOMPLETE;
+  } else {
+    block = libspectrum_tape_current_block( tape );
+    if( !block ||
+        libspectrum_tape_block_data_length( block ) != 5 + 9 ||
+        memcmp( libspectrum_tape_block_data( block ), expected, 5 + 9 ) ) {
+      fprintf( stderr, "%s: wrong pulses read from quiet .wav file\n",
+               progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  /* Reading the file a piece at a time should give the same pulses */
+  source.data = buffer;
+  source.length = length;
+  stream_tape = libspectrum_tape_alloc();
+  if( r == TEST_PASS &&
+      libspectrum_wav_read_stream( stream_tape, read_from_trickle_source,
+                                   &source ) ) {
+    r = TEST_INCOMPLETE;
+  } else if( r == TEST_PASS ) {
+    stream_block = libspectrum_tape_current_block( stream_tape );
+    if( !stream_block ||
+        libspectrum_tape_block_data_length( stream_block ) != 5 + 9 ||
+        memcmp( libspectrum_tape_block_data( stream_block ), expected,
+                5 + 9 ) ) {
+      fprintf( stderr, "%s: wrong pulses read from .wav stream\n",
+               progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  libspectrum_tape_free( stream_tape );
+  libspectrum_tape_free( tape );
+  libspectrum_free( expected );
+  libspectrum_free( buffer );
+
+  return r;
+}
+
+static test_return_t
+test_103( void )
+{
+  /* A CSW recording block at 44100 Hz with a 1234 ms pause */
+  const libspectrum_byte buffer[] = {
+    'Z', 'X', 'T', 'a', 'p', 'e', '!', 0x1a, 0x01, 0x14,
+    0x18, 0x0d, 0x00, 0x00, 0x00, 0xd2, 0x04, 0x44, 0xac, 0x00, 0x01,
+    0x03, 0x00, 0x00, 0x00, 10, 20, 30
+  };
+  const libspectrum_dword expected[] = {
+    79 * 10, 79 * 20, 79 * 30, 1234 * 3500
+  };
+  libspectrum_byte *tzx = NULL;
+  size_t tzx_length = 0, i,
+    count = sizeof( expected ) / sizeof( expected[0] );
+  libspectrum_tape *tape;
+  libspectrum_tape_block *block;
+  libspectrum_tape_iterator it;
+  libspectrum_dword tstates;
+  int flags;
+  test_return_t r = TEST_PASS;
+
+  tape = libspectrum_tape_alloc();
+  if( libspectrum_tape_read( tape, buffer, sizeof( buffer ),
+                             LIBSPECTRUM_ID_TAPE_TZX, NULL ) ) {
+    libspectrum_tape_free( tape );
+    return TEST_INCOMPLETE;
+  }
+
+  block = libspectrum_tape_iterator_init( &it, tape );
+  if( libspectrum_tape_block_type( block ) !=
+        LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE ||
+      libspectrum_tape_iterator_next( &it ) ||
+      libspectrum_tape_block_pause( block ) != 1234 ||
+      libspectrum_tape_block_sample_rate( block ) != 44100 ) {
+    fprintf( stderr, "%s: CSW recording block pause not kept on block\n",
+             progname );
+    r = TEST_FAIL;
+  }
+
+  for( i = 0; r == TEST_PASS && i < count; i++ ) {
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( tstates != expected[i] ||
+               !!( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) != ( i == count - 1 ) ) {
+      fprintf( stderr, "%s: edge %lu of CSW recording block is %lu, not %lu\n",
+               progname, (unsigned long)i, (unsigned long)tstates,
+               (unsigned long)expected[i] );
+      r = TEST_FAIL;
+    }
+  }
+
+  /* The pause and the exact sample rate should be written back */
+  if( r == TEST_PASS &&
+      libspectrum_tape_write2( &tzx, &tzx_length, tape,
+                               LIBSPECTRUM_ID_TAPE_TZX,
+                               LIBSPECTRUM_FLAG_TAPE_CSW_BLOCKS ) ) {
+    r = TEST_INCOMPLETE;
+  } else if( r == TEST_PASS &&
+             ( tzx_length < 20 || tzx[10] != 0x18 ||
+               memcmp( &tzx[15], &buffer[15], 5 ) ||
+               tzx_length != 15 + ( tzx[11] | tzx[12] << 8 ) ) ) {
+    fprintf( stderr, "%s: CSW recording block written back differently\n",
+             progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_free( tzx );
+  if( libspectrum_tape_free( tape ) ) r = TEST_INCOMPLETE;
+
+  return r;
+}
+
+/* Restore `state' after changing the 64-bit field at `offset' to `value',
+   and check it is refused */
+static test_return_t
+check_bad_state( libspectrum_tape *tape, const libspectrum_byte *state,
+                 size_t offset, libspectrum_qword value, const char *what )
+{
+  libspectrum_byte bad[ 256 ];
+  size_t i;
+
+  memcpy( bad, state, sizeof( bad ) );
+  for( i = 0; i < 8; i++ ) bad[ offset + i ] = value >> ( 8 * i );
+
+  if( libspectrum_tape_state_restore( tape, bad, sizeof( bad ) ) !=
+      LIBSPECTRUM_ERROR_INVALID ) {
+    fprintf( stderr, "%s: state with %s restored\n", progname, what );
+    return TEST_FAIL;
+  }
+
+  return TEST_PASS;
+}
+
+static test_return_t
+test_104( void )
+{
+  libspectrum_byte state[ 256 ], *data;
+  libspectrum_tape *tape;
+  libspectrum_tape_block *block;
+  test_return_t r = TEST_PASS;
+
+  tape = libspectrum_tape_alloc();
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_TONE );
+  libspectrum_tape_block_set_count( block, 10 );
+  libspectrum_tape_block_set_pulse_length( block, 2168 );
+  libspectrum_tape_append_block( tape, block );
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE );
+  data = libspectrum_new( libspectrum_byte, 3 );
+  data[0] = 10; data[1] = 20; data[2] = 30;
+  libspectrum_tape_block_set_scale( block, 79 );
+  libspectrum_tape_block_set_data_length( block, 3 );
+  libspectrum_tape_block_set_data( block, data );
+  libspectrum_tape_append_block( tape, block );
+
+  /* The block fields follow the 8 byte header and 7 common fields; the
+     loop block and count are the second and third common fields */
+  if( libspectrum_tape_state_save( state, sizeof( state ), tape ) ||
+      libspectrum_tape_state_restore( tape, state, sizeof( state ) ) ) {
+    r = TEST_INCOMPLETE;
+  } else {
+    r = check_bad_state( tape, state, 64, 0, "pure tone finished" );
+    if( !r ) r = check_bad_state( tape, state, 64, 11, "too many pulses" );
+    if( !r ) {
+      state[ 24 ] = 1;
+      r = check_bad_state( tape, state, 16, 2, "loop past the end" );
+    }
+  }
+
+  if( r == TEST_PASS ) {
+    if( libspectrum_tape_nth_block( tape, 1 ) ||
+        libspectrum_tape_state_save( state, sizeof( state ), tape ) ||
+        libspectrum_tape_state_restore( tape, state, sizeof( state ) ) ) {
+      r = TEST_INCOMPLETE;
+    } else {
+      r = check_bad_state( tape, state, 72, 4, "RLE index past the end" );
+      if( !r ) r = check_bad_state( tape, state, 64,
+                                    LIBSPECTRUM_TAPE_STATE_PAUSE,
+                                    "RLE pause which isn't there" );
+    }
+  }
+
+  if( libspectrum_tape_free( tape ) ) r = TEST_INCOMPLETE;
+
+  return r;
+}
+
+/* Write `tape' out as `type' and read it back as a sampled tape */
+static libspectrum_tape*
+sample_tape( libspectrum_tape *tape, libspectrum_id_t type )
+{
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0;
+  libspectrum_tape *sampled = libspectrum_tape_alloc();
+
+  if( libspectrum_tape_write( &buffer, &length, tape, type ) ||
+      libspectrum_tape_read( sampled, buffer, length, type, NULL ) ) {
+    libspectrum_tape_free( sampled );
+    sampled = NULL;
+  }
+
+  libspectrum_free( buffer );
+  return sampled;
+}
+
+/* Find the first block of `type' on `tape', and where it is */
+static libspectrum_tape_block*
+find_type( libspectrum_tape *tape, libspectrum_tape_type type,
+           size_t *position )
+{
+  libspectrum_tape_iterator it;
+  libspectrum_tape_block *block;
+
+  for( block = libspectrum_tape_iterator_init( &it, tape ), *position = 0;
+       block && libspectrum_tape_block_type( block ) != type;
+       block = libspectrum_tape_iterator_next( &it ), (*position)++ )
+    ;
+
+  return block;
+}
+
+static test_return_t
+test_105( void )
+{
+  libspectrum_tape *tape, *csw, *drb, *sampled;
+  libspectrum_tape_block *block, *turbo;
+  libspectrum_byte *data;
+  libspectrum_dword *lengths;
+  char **texts;
+  int *offsets;
+  size_t i, pause_position, turbo_position, position;
+  test_return_t r = TEST_PASS;
+
+  /* A few stray pulses, then a turbo block which the ROM couldn't have
+     saved */
+  tape = libspectrum_tape_alloc();
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PULSES );
+  lengths = libspectrum_new( libspectrum_dword, 3 );
+  lengths[0] = lengths[1] = lengths[2] = 5000;
+  libspectrum_tape_block_set_count( block, 3 );
+  libspectrum_tape_block_set_pulse_lengths( block, lengths );
+  libspectrum_tape_append_block( tape, block );
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_TURBO );
+  data = libspectrum_new( libspectrum_byte, 16 );
+  for( i = 0; i < 16; i++ ) data[i] = i * 0x11;
+  libspectrum_tape_block_set_pilot_length( block, 1500 );
+  libspectrum_tape_block_set_pilot_pulses( block, 1000 );
+  libspectrum_tape_block_set_sync1_length( block, 400 );
+  libspectrum_tape_block_set_sync2_length( block, 450 );
+  libspectrum_tape_block_set_bit0_length( block, 500 );
+  libspectrum_tape_block_set_bit1_length( block, 1000 );
+  libspectrum_tape_block_set_bits_in_last_byte( block, 8 );
+  libspectrum_tape_block_set_data_length( block, 16 );
+  libspectrum_tape_block_set_data( block, data );
+  libspectrum_set_pause_ms( block, 1000 );
+  libspectrum_tape_append_block( tape, block );
+
+  /* Sampled as RLE pulses by .csw files, and as a direct recording by
+     .tzx files */
+  csw = sample_tape( tape, LIBSPECTRUM_ID_TAPE_CSW );
+  drb = csw ? sample_tape( csw, LIBSPECTRUM_ID_TAPE_TZX ) : NULL;
+  if( !drb || !find_type( drb, LIBSPECTRUM_TAPE_BLOCK_RAW_DATA, &i ) ) {
+    r = TEST_INCOMPLETE;
+  }
+
+  for( i = 0; r == TEST_PASS && i < 2; i++ ) {
+    sampled = i ? drb : csw;
+    if( libspectrum_tape_reconstruct( sampled ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( !( turbo = find_type( sampled, LIBSPECTRUM_TAPE_BLOCK_TURBO,
+                                     &position ) ) ||
+               libspectrum_tape_block_data_length( turbo ) != 16 ||
+               memcmp( libspectrum_tape_block_data( turbo ), data, 16 ) ) {
+      fprintf( stderr, "%s: turbo block not recovered from %s\n", progname,
+               i ? "direct recording" : "RLE pulses" );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( drb ) libspectrum_tape_free( drb );
+  if( csw ) libspectrum_tape_free( csw );
+  if( r ) { libspectrum_tape_free( tape ); return r; }
+
+  /* Jumps and selections across the sampled block should still reach
+     the same blocks */
+  sampled = sample_tape( tape, LIBSPECTRUM_ID_TAPE_CSW );
+  if( !sampled ) { libspectrum_tape_free( tape ); return TEST_INCOMPLETE; }
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_SELECT );
+  texts = libspectrum_new( char*, 2 );
+  texts[0] = libspectrum_new( char, 2 ); strcpy( texts[0], "a" );
+  texts[1] = libspectrum_new( char, 2 ); strcpy( texts[1], "b" );
+  offsets = libspectrum_new( int, 2 );
+  offsets[0] = 2; offsets[1] = 3;
+  libspectrum_tape_block_set_count( block, 2 );
+  libspectrum_tape_block_set_texts( block, texts );
+  libspectrum_tape_block_set_offsets( block, offsets );
+  libspectrum_tape_insert_block( sampled, block, 0 );
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_JUMP );
+  libspectrum_tape_block_set_offset( block, 2 );
+  libspectrum_tape_insert_block( sampled, block, 1 );
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PAUSE );
+  libspectrum_set_pause_ms( block, 100 );
+  libspectrum_tape_append_block( sampled, block );
+
+  if( libspectrum_tape_reconstruct( sampled ) ||
+      !find_type( sampled, LIBSPECTRUM_TAPE_BLOCK_TURBO, &turbo_position ) ||
+      !find_type( sampled, LIBSPECTRUM_TAPE_BLOCK_PAUSE, &pause_position ) ) {
+    r = TEST_INCOMPLETE;
+  } else if( turbo_position < 3 ) {
+    fprintf( stderr, "%s: no samples kept before turbo block\n", progname );
+    r = TEST_FAIL;
+  } else {
+    block = find_type( sampled, LIBSPECTRUM_TAPE_BLOCK_SELECT, &position );
+    if( libspectrum_tape_block_offsets( block, 0 ) != 2 ||
+        libspectrum_tape_block_offsets( block, 1 ) != (int)pause_position ) {
+      fprintf( stderr, "%s: select offsets not updated\n", progname );
+      r = TEST_FAIL;
+    }
+    block = find_type( sampled, LIBSPECTRUM_TAPE_BLOCK_JUMP, &position );
+    if( libspectrum_tape_block_offset( block ) != (int)pause_position - 1 ) {
+      fprintf( stderr, "%s: jump offset not updated\n", progname );
+      r = TEST_FAIL;
+    }
+  }
+
+  libspectrum_tape_free( sampled );
+  libspectrum_tape_free( tape );
+
+  return r;
+}
+
+static test_return_t
+test_106( void )
+{
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0;
+  libspectrum_tape *tape, *inflated, *streamed;
+  libspectrum_tape_block *block;
+  test_return_t r = TEST_PASS;
+
+  /* Over 8 MiB of pulses, so the streamed data has several checkpoints */
+  tape = libspectrum_tape_alloc();
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_TONE );
+  libspectrum_tape_block_set_pulse_length( block, 160 );
+  libspectrum_tape_block_set_count( block, 12500000 );
+  libspectrum_tape_append_block( tape, block );
+
+  if( libspectrum_tape_write( &buffer, &length, tape,
+                              LIBSPECTRUM_ID_TAPE_CSW ) ) {
+    libspectrum_tape_free( tape );
+    return TEST_INCOMPLETE;
+  }
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  inflated = libspectrum_tape_alloc();
+  streamed = libspectrum_tape_alloc();
+
+  if( libspectrum_tape_read( inflated, buffer, length,
+                             LIBSPECTRUM_ID_TAPE_CSW, NULL ) ||
+      libspectrum_tape_read2( streamed, buffer, length,
+                              LIBSPECTRUM_ID_TAPE_CSW, NULL,
+                              LIBSPECTRUM_FLAG_TAPE_STREAM_DATA ) ) {
+    r = TEST_INCOMPLETE;
+  }
+  libspectrum_free( buffer );
+
+  /* Play all the way through, then go back past the newest checkpoint
+     to about 5 MiB into the data */
+  if( r == TEST_PASS )
+    r = compare_edges( inflated, streamed, (size_t)-1, "playing" );
+
+  if( r == TEST_PASS ) {
+    if( libspectrum_tape_seek_tstates( inflated, 800000000 ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( libspectrum_tape_seek_tstates( streamed, 800000000 ) ) {
+      fprintf( stderr, "%s: couldn't go back in streamed CSW data\n",
+               progname );
+      r = TEST_FAIL;
+    } else {
+      r = compare_edges( inflated, streamed, 1000, "after seeking" );
+    }
+  }
+
+  if( libspectrum_tape_free( streamed ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( inflated ) ) r = TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_107( void )
+{
+  libspectrum_tape *tape = libspectrum_tape_alloc();
+  libspectrum_tape_iterator it;
+  libspectrum_tape_block *block;
+  libspectrum_dword tstates;
+  libspectrum_qword position;
+  int flags, i, n;
+  test_return_t r = TEST_PASS;
+
+  for( i = 0; i < 2; i++ ) {
+    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_TONE );
+    libspectrum_tape_block_set_pulse_length( block, 100 );
+    libspectrum_tape_block_set_count( block, 10 );
+    libspectrum_tape_append_block( tape, block );
+  }
+
+  /* Play halfway into the second tone, then take away the first */
+  for( i = 0; i < 15; i++ ) {
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      libspectrum_tape_free( tape );
+      return TEST_INCOMPLETE;
+    }
+  }
+
+  libspectrum_tape_iterator_init( &it, tape );
+  libspectrum_tape_remove_block( tape, it );
+
+  /* The second tone should carry on from where it was */
+  if( libspectrum_tape_position( &n, tape ) ||
+      libspectrum_tape_tell_tstates( &position, tape ) ) {
+    r = TEST_INCOMPLETE;
+  } else if( n != 0 || position != 500 ) {
+    fprintf( stderr, "%s: at block %d, %lu tstates after removing the block "
+             "before it; expected block 0, 500 tstates\n", progname, n,
+             (unsigned long)position );
+    r = TEST_FAIL;
+  }
+
+  for( i = 0; r == TEST_PASS && i < 5; i++ ) {
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, tape ) ) {
+      r = TEST_INCOMPLETE;
+    } else if( tstates != 100 ||
+               !!( flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK ) != ( i == 4 ) ) {
+      fprintf( stderr, "%s: edge %d is wrong after removing the block\n",
+               progname, i );
+      r = TEST_FAIL;
+    }
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+static test_return_t
+test_108( void )
+{
+  const size_t peek_max = 70000, play_max = 20000;
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0, i, a_count, b_count;
+  libspectrum_tape *tape, *inflated, *streamed;
+  libspectrum_tape_block *block;
+  libspectrum_dword *a_tstates, *b_tstates;
+  int *a_flags, *b_flags;
+  test_return_t r = TEST_PASS;
+
+  /* Tones of different lengths, so the data changes along the way */
+  tape = libspectrum_tape_alloc();
+  for( i = 0; i < 128; i++ ) {
+    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_TONE );
+    libspectrum_tape_block_set_pulse_length( block,
+                                             160 + ( i * 37 ) % 64 * 40 );
+    libspectrum_tape_block_set_count( block, 50000 );
+    libspectrum_tape_append_block( tape, block );
+  }
+
+  if( libspectrum_tape_write( &buffer, &length, tape,
+                              LIBSPECTRUM_ID_TAPE_CSW ) ) {
+    libspectrum_tape_free( tape );
+    return TEST_INCOMPLETE;
+  }
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  inflated = libspectrum_tape_alloc();
+  streamed = libspectrum_tape_alloc();
+
+  if( libspectrum_tape_read( inflated, buffer, length,
+                             LIBSPECTRUM_ID_TAPE_CSW, NULL ) ||
+      libspectrum_tape_read2( streamed, buffer, length,
+                              LIBSPECTRUM_ID_TAPE_CSW, NULL,
+                              LIBSPECTRUM_FLAG_TAPE_STREAM_DATA ) ) {
+    r = TEST_INCOMPLETE;
+  }
+  libspectrum_free( buffer );
+
+  a_tstates = libspectrum_new( libspectrum_dword, peek_max );
+  b_tstates = libspectrum_new( libspectrum_dword, peek_max );
+  a_flags = libspectrum_new( int, peek_max );
+  b_flags = libspectrum_new( int, peek_max );
+
+  /* Peek further ahead than the streamed data's window each time, and
+     check both the peeked and the played edges */
+  while( r == TEST_PASS ) {
+
+    if( libspectrum_tape_peek_edges( a_tstates, a_flags, peek_max, &a_count,
+                                     inflated ) ||
+        libspectrum_tape_peek_edges( b_tstates, b_flags, peek_max, &b_count,
+                                     streamed ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+    if( a_count != b_count ||
+        memcmp( a_tstates, b_tstates, a_count * sizeof( *a_tstates ) ) ||
+        memcmp( a_flags, b_flags, a_count * sizeof( *a_flags ) ) ) {
+      fprintf( stderr, "%s: peeked streamed edges differ\n", progname );
+      r = TEST_FAIL;
+      break;
+    }
+
+    if( libspectrum_tape_get_next_edges( a_tstates, a_flags, play_max,
+                                         &a_count, inflated ) ||
+        libspectrum_tape_get_next_edges( b_tstates, b_flags, play_max,
+                                         &b_count, streamed ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+    if( a_count != b_count ||
+        memcmp( a_tstates, b_tstates, a_count * sizeof( *a_tstates ) ) ||
+        memcmp( a_flags, b_flags, a_count * sizeof( *a_flags ) ) ) {
+      fprintf( stderr, "%s: played streamed edges differ\n", progname );
+      r = TEST_FAIL;
+      break;
+    }
+
+    for( i = 0; i < a_count; i++ )
+      if( a_flags[i] & LIBSPECTRUM_TAPE_FLAGS_TAPE ) break;
+    if( i < a_count ) break;
+  }
+
+  libspectrum_free( b_flags );
+  libspectrum_free( a_flags );
+  libspectrum_free( b_tstates );
+  libspectrum_free( a_tstates );
+
+  if( libspectrum_tape_free( streamed ) ) r = TEST_INCOMPLETE;
+  if( libspectrum_tape_free( inflated ) ) r = TEST_INCOMPLETE;
+
+  return r;
+}
+
 struct test_description {
 
   test_fn test;
@@ -975,7 +3507,43 @@ static struct test_description tests[] = {
   { test_69, "Read uncompressed SZX ATRP chunk", 0 },
   { test_70, "Read uncompressed SZX CFRP chunk", 0 },
   { test_71, "Write RZX with incompressible snap", 0 },
-  { test_72, "Tape peek next block", 0 }
+  { test_72, "Tape peek next block", 0 },
+  { test_73, "Writing more ZXATASP and ZXCF pages than a snap holds", 0 },
+  { test_74, "Batched tape edges", 0 },
+  { test_75, "Compiled tape edges", 0 },
+  { test_76, "Seek and tell on tape", 0 },
+  { test_77, "Tape block insertion and removal", 0 },
+  { test_78, "Fast loading tape blocks", 0 },
+  { test_79, "Raw data tape edges", 0 },
+  { test_80, "Rendering tapes as PCM audio", 0 },
+  { test_81, "Borrowing tape data from the file", 0 },
+  { test_82, "Streaming CSW data", 0 },
+  { test_83, "Reading PCM .wav files", 0 },
+  { test_84, "Writing .csw files a piece at a time", 0 },
+  { test_85, "TZX CSW recording blocks", 0 },
+  { test_86, "Reading tapes into an arena", 0 },
+  { test_87, "Tape and block lengths", 0 },
+  { test_88, "Saving and restoring tape state", 0 },
+  { test_89, "Peeking at tape edges", 0 },
+  { test_90, "Batched tape edges for whole data bytes", 0 },
+  { test_91, "Reconstructing data blocks from sampled tapes", 0 },
+  { test_92, "Pentagon 1024 SZX snapshots keep all 64 RAM pages", 0 },
+  { test_93, "Compressing SZX RAM pages with an executor", 0 },
+  { test_94, "Compression profiles for SZX snapshots", 0 },
+  { test_95, "Reusing zlib state across RZX blocks", 0 },
+  { test_96, "Inflating into a caller's buffer", 0 },
+  { test_97, "Reading SZX RAM pages into a caller's arena", 0 },
+  { test_98, "Compiled tape blocks report the same states", 0 },
+  { test_99, "Tape position kept in a loop when the tape is edited", 0 },
+  { test_100, "Removing the block being played", 0 },
+  { test_101, "Writing a tape with a backwards jump as WAV", 0 },
+  { test_102, "Reading quiet and streamed .wav files", 0 },
+  { test_103, "Keeping the pause and rate of TZX CSW recording blocks", 0 },
+  { test_104, "Refusing states outside tone and RLE blocks", 0 },
+  { test_105, "Reconstructing turbo blocks, direct recordings and jumps", 0 },
+  { test_106, "Going back to an older checkpoint of streamed CSW data", 0 },
+  { test_107, "Removing the block before the one being played", 0 },
+  { test_108, "Peeking past the window of streamed CSW data", 0 }
 };
 
 static size_t test_count = ARRAY_SIZE( tests );
@@ -37,10 +37,10 @@ const char * const libspectrum_tzx_signature = "ZXTape!\x1a";
 
 static libspectrum_error
 tzx_read_rom_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
-		    const libspectrum_byte *end );
+		    const libspectrum_byte *end, int borrow_data );
 static libspectrum_error
 tzx_read_turbo_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
-		      const libspectrum_byte *end );
+		      const libspectrum_byte *end, int borrow_data );
 static libspectrum_error
 tzx_read_pure_tone( libspectrum_tape *tape, const libspectrum_byte **ptr,
 		    const libspectrum_byte *end );
@@ -49,10 +49,13 @@ tzx_read_pulses_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
 		       const libspectrum_byte *end );
 static libspectrum_error
 tzx_read_pure_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
-		    const libspectrum_byte *end );
+		    const libspectrum_byte *end, int borrow_data );
 static libspectrum_error
 tzx_read_raw_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
-		   const libspectrum_byte *end );
+		   const libspectrum_byte *end, int borrow_data );
+static libspectrum_error
+tzx_read_csw_recording( libspectrum_tape *tape, const libspectrum_byte **ptr,
+                        const libspectrum_byte *end, int stream_data );
 static libspectrum_error
 tzx_read_generalised_data( libspectrum_tape *tape,
 			   const libspectrum_byte **ptr,
@@ -92,7 +95,7 @@ tzx_read_hardware( libspectrum_tape *tape, const libspectrum_byte **ptr,
 		   const libspectrum_byte *end );
 static libspectrum_error
 tzx_read_custom( libspectrum_tape *tape, const libspectrum_byte **ptr,
-		 const libspectrum_byte *end );
+		 const libspectrum_byte *end, int borrow_data );
 static libspectrum_error
 tzx_read_concat( const libspectrum_byte **ptr, const libspectrum_byte *end );
 
@@ -100,11 +103,12 @@ static void
 tzx_read_empty_block( libspectrum_tape *tape, libspectrum_tape_type id );
 
 static libspectrum_error
-tzx_read_data( const libspectrum_byte **ptr, const libspectrum_byte *end,
-	       size_t *length, int bytes, libspectrum_byte **data );
+tzx_read_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
+	       const libspectrum_byte *end, size_t *length, int bytes,
+	       libspectrum_byte **data, int borrow_data );
 static libspectrum_error
-tzx_read_string( const libspectrum_byte **ptr, const libspectrum_byte *end,
-		 char **dest );
+tzx_read_string( libspectrum_tape *tape, const libspectrum_byte **ptr,
+		 const libspectrum_byte *end, char **dest );
 
 /*** Function definitions ***/
 
@@ -112,7 +116,7 @@ tzx_read_string( const libspectrum_byte **ptr, const libspectrum_byte *end,
 
 libspectrum_error
 internal_tzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
-		   const size_t length )
+		   const size_t length, int borrow_data, int stream_data )
 {
 
   libspectrum_error error;
@@ -148,13 +152,20 @@ internal_tzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
     /* Get the ID of the next block */
     libspectrum_tape_type id = *ptr++;
 
+    /* CSW recording blocks become a block type of their own */
+    if( id == LIBSPECTRUM_TZX_CSW_RECORDING ) {
+      error = tzx_read_csw_recording( tape, &ptr, end, stream_data );
+      if( error ) { libspectrum_tape_clear( tape ); return error; }
+      continue;
+    }
+
     switch( id ) {
     case LIBSPECTRUM_TAPE_BLOCK_ROM:
-      error = tzx_read_rom_block( tape, &ptr, end );
+      error = tzx_read_rom_block( tape, &ptr, end, borrow_data );
       if( error ) { libspectrum_tape_clear( tape ); return error; }
       break;
     case LIBSPECTRUM_TAPE_BLOCK_TURBO:
-      error = tzx_read_turbo_block( tape, &ptr, end );
+      error = tzx_read_turbo_block( tape, &ptr, end, borrow_data );
       if( error ) { libspectrum_tape_clear( tape ); return error; }
       break;
     case LIBSPECTRUM_TAPE_BLOCK_PURE_TONE:
@@ -166,11 +177,11 @@ internal_tzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
       if( error ) { libspectrum_tape_clear( tape ); return error; }
       break;
     case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
-      error = tzx_read_pure_data( tape, &ptr, end );
+      error = tzx_read_pure_data( tape, &ptr, end, borrow_data );
       if( error ) { libspectrum_tape_clear( tape ); return error; }
       break;
     case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
-      error = tzx_read_raw_data( tape, &ptr, end );
+      error = tzx_read_raw_data( tape, &ptr, end, borrow_data );
       if( error ) { libspectrum_tape_clear( tape ); return error; }
       break;
 
@@ -235,7 +246,7 @@ internal_tzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
       break;
 
     case LIBSPECTRUM_TAPE_BLOCK_CUSTOM:
-      error = tzx_read_custom( tape, &ptr, end );
+      error = tzx_read_custom( tape, &ptr, end, borrow_data );
       if( error ) { libspectrum_tape_clear( tape ); return error; }
       break;
 
@@ -259,7 +270,7 @@ internal_tzx_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
 
 static libspectrum_error
 tzx_read_rom_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
-		    const libspectrum_byte *end )
+		    const libspectrum_byte *end, int borrow_data )
 {
   libspectrum_tape_block* block;
   size_t length; libspectrum_byte *data;
@@ -273,17 +284,19 @@ tzx_read_rom_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ROM );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_ROM );
 
   /* Get the pause length */
   libspectrum_set_pause_ms( block, (*ptr)[0] + (*ptr)[1] * 0x100 );
   (*ptr) += 2;
 
   /* And the data */
-  error = tzx_read_data( ptr, end, &length, 2, &data );
-  if( error ) { libspectrum_free( block ); return error; }
+  error = tzx_read_data( tape, ptr, end, &length, 2, &data, borrow_data );
+  if( error ) { libspectrum_tape_arena_free( tape, block ); return error; }
   libspectrum_tape_block_set_data_length( block, length );
   libspectrum_tape_block_set_data( block, data );
+  libspectrum_tape_block_set_borrowed( block, borrow_data );
 
   libspectrum_tape_append_block( tape, block );
 
@@ -292,7 +305,7 @@ tzx_read_rom_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
 
 static libspectrum_error
 tzx_read_turbo_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
-		      const libspectrum_byte *end )
+		      const libspectrum_byte *end, int borrow_data )
 {
   libspectrum_tape_block* block;
   size_t length; libspectrum_byte *data;
@@ -308,7 +321,8 @@ tzx_read_turbo_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_TURBO );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_TURBO );
 
   /* Get the metadata */
   libspectrum_tape_block_set_pilot_length( block,
@@ -338,8 +352,8 @@ tzx_read_turbo_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
   (*ptr) += 2;
 
   /* Read the data in */
-  error = tzx_read_data( ptr, end, &length, 3, &data );
-  if( error ) { libspectrum_free( block ); return error; }
+  error = tzx_read_data( tape, ptr, end, &length, 3, &data, borrow_data );
+  if( error ) { libspectrum_tape_arena_free( tape, block ); return error; }
 
   if( bits_in_last_byte == 0 && length >= 1 ) {
     bits_in_last_byte = 8;
@@ -354,6 +368,7 @@ tzx_read_turbo_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
 
   libspectrum_tape_block_set_data_length( block, length );
   libspectrum_tape_block_set_data( block, data );
+  libspectrum_tape_block_set_borrowed( block, borrow_data );
 
   libspectrum_tape_append_block( tape, block );
 
@@ -373,7 +388,9 @@ tzx_read_pure_tone( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_TONE );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_PURE_TONE
+  );
 
   /* Read in the data, and move along */
   libspectrum_tape_block_set_pulse_length( block,
@@ -404,7 +421,8 @@ tzx_read_pulses_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PULSES );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_PULSES );
 
   /* Get the count byte */
   count = **ptr; (*ptr)++;
@@ -412,7 +430,7 @@ tzx_read_pulses_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
 
   /* Check enough data exists for every pulse */
   if( end - (*ptr) < (ptrdiff_t)( 2 * count ) ) {
-    libspectrum_free( block );
+    libspectrum_tape_arena_free( tape, block );
     libspectrum_print_error(
       LIBSPECTRUM_ERROR_CORRUPT,
       "tzx_read_pulses_block: not enough data in buffer"
@@ -420,7 +438,7 @@ tzx_read_pulses_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  lengths = libspectrum_new( libspectrum_dword, count );
+  lengths = libspectrum_tape_arena_new( tape, libspectrum_dword, count );
 
   /* Copy the data across */
   for( i = 0; i < count; i++ ) {
@@ -435,7 +453,7 @@ tzx_read_pulses_block( libspectrum_tape *tape, const libspectrum_byte **ptr,
 
 static libspectrum_error
 tzx_read_pure_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
-		    const libspectrum_byte *end )
+		    const libspectrum_byte *end, int borrow_data )
 {
   libspectrum_tape_block* block;
   size_t length; libspectrum_byte *data;
@@ -451,7 +469,9 @@ tzx_read_pure_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PURE_DATA );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_PURE_DATA
+  );
 
   /* Get the metadata */
   libspectrum_tape_block_set_bit0_length( block,
@@ -468,8 +488,8 @@ tzx_read_pure_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
   (*ptr) += 2;
 
   /* And the actual data */
-  error = tzx_read_data( ptr, end, &length, 3, &data );
-  if( error ) { libspectrum_free( block ); return error; }
+  error = tzx_read_data( tape, ptr, end, &length, 3, &data, borrow_data );
+  if( error ) { libspectrum_tape_arena_free( tape, block ); return error; }
 
   if( bits_in_last_byte == 0 && length > 1 ) {
     bits_in_last_byte = 8;
@@ -483,6 +503,7 @@ tzx_read_pure_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
   libspectrum_tape_block_set_bits_in_last_byte( block, bits_in_last_byte );
   libspectrum_tape_block_set_data_length( block, length );
   libspectrum_tape_block_set_data( block, data );
+  libspectrum_tape_block_set_borrowed( block, borrow_data );
 
   libspectrum_tape_append_block( tape, block );
 
@@ -491,7 +512,7 @@ tzx_read_pure_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
 
 static libspectrum_error
 tzx_read_raw_data (libspectrum_tape *tape, const libspectrum_byte **ptr,
-		   const libspectrum_byte *end)
+		   const libspectrum_byte *end, int borrow_data )
 {
   libspectrum_tape_block* block;
   size_t length; libspectrum_byte *data;
@@ -505,7 +526,9 @@ tzx_read_raw_data (libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RAW_DATA );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_RAW_DATA
+  );
 
   /* Get the metadata */
   libspectrum_tape_block_set_bit_length( block,
@@ -516,8 +539,8 @@ tzx_read_raw_data (libspectrum_tape *tape, const libspectrum_byte **ptr,
   (*ptr) += 5;
 
   /* And the actual data */
-  error = tzx_read_data( ptr, end, &length, 3, &data );
-  if( error ) { libspectrum_free( block ); return error; }
+  error = tzx_read_data( tape, ptr, end, &length, 3, &data, borrow_data );
+  if( error ) { libspectrum_tape_arena_free( tape, block ); return error; }
 
   if( bits_in_last_byte == 0 && length >= 1 ) {
     bits_in_last_byte = 8;
@@ -531,6 +554,7 @@ tzx_read_raw_data (libspectrum_tape *tape, const libspectrum_byte **ptr,
   libspectrum_tape_block_set_bits_in_last_byte( block, bits_in_last_byte );
   libspectrum_tape_block_set_data_length( block, length );
   libspectrum_tape_block_set_data( block, data );
+  libspectrum_tape_block_set_borrowed( block, borrow_data );
 
   libspectrum_tape_append_block( tape, block );
 
@@ -538,6 +562,63 @@ tzx_read_raw_data (libspectrum_tape *tape, const libspectrum_byte **ptr,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+static libspectrum_error
+tzx_read_csw_recording( libspectrum_tape *tape, const libspectrum_byte **ptr,
+                        const libspectrum_byte *end, int stream_data )
+{
+  libspectrum_tape_block *block;
+  libspectrum_dword length, sample_rate;
+  int pause, compression;
+  libspectrum_error error;
+
+  /* Check there's enough left in the buffer for all the metadata */
+  if( end - (*ptr) < 14 ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "tzx_read_csw_recording: not enough data in buffer"
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  length = libspectrum_read_dword( ptr );
+  if( length < 10 || (size_t)( end - (*ptr) ) < length ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "tzx_read_csw_recording: not enough data in buffer"
+    );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  pause = (*ptr)[0] + (*ptr)[1] * 0x100;
+  sample_rate = (*ptr)[2] + (*ptr)[3] * 0x100 + (*ptr)[4] * 0x10000;
+  compression = (*ptr)[5];
+
+  /* The number of pulses in the data is implied by the data itself */
+
+  if( sample_rate < 7 ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "tzx_read_csw_recording: bad sample rate" );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE
+  );
+  libspectrum_tape_block_set_scale( block, 3500000 / sample_rate );
+  libspectrum_tape_block_set_sample_rate( block, sample_rate );
+  libspectrum_set_pause_ms( block, pause );
+
+  error = libspectrum_csw_read_data( block, (*ptr) + 10, length - 10,
+                                     compression, stream_data );
+  if( error ) { libspectrum_tape_block_free( block ); return error; }
+
+  (*ptr) += length;
+
+  libspectrum_tape_append_block( tape, block );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
 static libspectrum_error
 tzx_read_generalised_data( libspectrum_tape *tape,
 			   const libspectrum_byte **ptr,
@@ -580,7 +661,9 @@ tzx_read_generalised_data( libspectrum_tape *tape,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA
+  );
 
   libspectrum_tape_block_zero( block );
 
@@ -598,7 +681,7 @@ tzx_read_generalised_data( libspectrum_tape *tape,
   ptr2 = *ptr;
 
   table = libspectrum_tape_block_pilot_table( block );
-  error = libspectrum_tape_block_read_symbol_table( table, ptr, length );
+  error = libspectrum_tape_block_read_symbol_table( tape, table, ptr, length );
   if( error ) { libspectrum_tape_block_free( block ); return error; }
 
   length -= ptr2 - *ptr;
@@ -612,8 +695,8 @@ tzx_read_generalised_data( libspectrum_tape *tape,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  symbols = libspectrum_new( libspectrum_byte, symbol_count );
-  repeats = libspectrum_new( libspectrum_word, symbol_count );
+  symbols = libspectrum_tape_arena_new( tape, libspectrum_byte, symbol_count );
+  repeats = libspectrum_tape_arena_new( tape, libspectrum_word, symbol_count );
 
   for( i = 0; i < symbol_count; i++ ) {
     symbols[ i ] = **ptr; (*ptr)++;
@@ -628,7 +711,7 @@ tzx_read_generalised_data( libspectrum_tape *tape,
   ptr2 = *ptr;
 
   table = libspectrum_tape_block_data_table( block );
-  libspectrum_tape_block_read_symbol_table( table, ptr, length );
+  libspectrum_tape_block_read_symbol_table( tape, table, ptr, length );
 
   length -= ptr2 - *ptr;
 
@@ -643,10 +726,10 @@ tzx_read_generalised_data( libspectrum_tape *tape,
   data_count = ( ( bits_per_symbol * symbol_count ) + 7 ) / 8;
   data_size = data_count * sizeof( *data );
 
-  data = libspectrum_new( libspectrum_byte, data_size );
+  data = libspectrum_tape_arena_new( tape, libspectrum_byte, data_size );
 
   if( end - (*ptr) < data_size ) {
-    libspectrum_free( data );
+    libspectrum_tape_arena_free( tape, data );
     libspectrum_tape_block_free( block );
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
 			     "%s: data extends beyond end of block", __func__ );
@@ -684,7 +767,8 @@ tzx_read_pause( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_PAUSE );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_PAUSE );
 
   /* Get the pause length */
   libspectrum_set_pause_ms( block, (*ptr)[0] + (*ptr)[1] * 0x100 );
@@ -715,11 +799,13 @@ tzx_read_group_start( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_GROUP_START );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_GROUP_START
+  );
 
   /* Read in the description of the group */
-  error = tzx_read_string( ptr, end, &name );
-  if( error ) { libspectrum_free( block ); return error; }
+  error = tzx_read_string( tape, ptr, end, &name );
+  if( error ) { libspectrum_tape_arena_free( tape, block ); return error; }
   libspectrum_tape_block_set_text( block, name );
 			  
   libspectrum_tape_append_block( tape, block );
@@ -741,7 +827,8 @@ tzx_read_jump( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_JUMP );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_JUMP );
 
   /* Get the offset */
   offset = (*ptr)[0] + (*ptr)[1] * 0x100; (*ptr) += 2;
@@ -768,7 +855,9 @@ tzx_read_loop_start( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_LOOP_START );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_LOOP_START
+  );
 
   /* Get the repeat count */
   libspectrum_tape_block_set_count( block, (*ptr)[0] + (*ptr)[1] * 0x100 );
@@ -806,17 +895,18 @@ tzx_read_select( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_SELECT );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_SELECT );
 
   /* Get the number of selections */
   count = **ptr; (*ptr)++;
   libspectrum_tape_block_set_count( block, count );
 
   /* Allocate memory */
-  offsets = libspectrum_new( int, count );
+  offsets = libspectrum_tape_arena_new( tape, int, count );
   libspectrum_tape_block_set_offsets( block, offsets );
 
-  descriptions = libspectrum_new( char *, count );
+  descriptions = libspectrum_tape_arena_new( tape, char *, count );
   libspectrum_tape_block_set_texts( block, descriptions );
 
   /* Read in the data */
@@ -824,8 +914,11 @@ tzx_read_select( libspectrum_tape *tape, const libspectrum_byte **ptr,
 
     /* Check we've got the offset and a length byte */
     if( end - (*ptr) < 3 ) {
-      for( j = 0; j < i; j++ ) libspectrum_free( descriptions[j] );
-      libspectrum_free( descriptions ); libspectrum_free( offsets ); libspectrum_free( block );
+      for( j = 0; j < i; j++ )
+        libspectrum_tape_arena_free( tape, descriptions[j] );
+      libspectrum_tape_arena_free( tape, descriptions );
+      libspectrum_tape_arena_free( tape, offsets );
+      libspectrum_tape_arena_free( tape, block );
       libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
 			       "tzx_read_select: not enough data in buffer" );
       return LIBSPECTRUM_ERROR_CORRUPT;
@@ -835,10 +928,13 @@ tzx_read_select( libspectrum_tape *tape, const libspectrum_byte **ptr,
     offsets[i] = (*ptr)[0] + (*ptr)[1] * 0x100; (*ptr) += 2;
 
     /* Get the description of this selection */
-    error = tzx_read_string( ptr, end, &descriptions[i] );
+    error = tzx_read_string( tape, ptr, end, &descriptions[i] );
     if( error ) {
-      for( j = 0; j < i; j++ ) libspectrum_free( descriptions[j] );
-      libspectrum_free( descriptions ); libspectrum_free( offsets ); libspectrum_free( block );
+      for( j = 0; j < i; j++ )
+        libspectrum_tape_arena_free( tape, descriptions[j] );
+      libspectrum_tape_arena_free( tape, descriptions );
+      libspectrum_tape_arena_free( tape, offsets );
+      libspectrum_tape_arena_free( tape, block );
       return error;
     }
 
@@ -865,7 +961,8 @@ tzx_read_stop( libspectrum_tape *tape, const libspectrum_byte **ptr,
   /* But then just skip over it, as I don't care what it is */
   (*ptr) += 4;
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_STOP48 );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_STOP48 );
 
   libspectrum_tape_append_block( tape, block );
 
@@ -888,8 +985,9 @@ tzx_read_set_signal_level( libspectrum_tape *tape, const libspectrum_byte **ptr,
   /* But then just skip over it, as I don't care what it is */
   (*ptr) += 4;
 
-  block =
-    libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_SET_SIGNAL_LEVEL );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_SET_SIGNAL_LEVEL
+  );
 
   libspectrum_tape_block_set_level( block, !!(**ptr) ); (*ptr)++;
 
@@ -913,11 +1011,12 @@ tzx_read_comment( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_COMMENT );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_COMMENT );
 
   /* Get the actual comment */
-  error = tzx_read_string( ptr, end, &text );
-  if( error ) { libspectrum_free( block ); return error; }
+  error = tzx_read_string( tape, ptr, end, &text );
+  if( error ) { libspectrum_tape_arena_free( tape, block ); return error; }
   libspectrum_tape_block_set_text( block, text );
 
   libspectrum_tape_append_block( tape, block );
@@ -940,14 +1039,15 @@ tzx_read_message( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_MESSAGE );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_MESSAGE );
 
   /* Get the time in seconds */
   libspectrum_set_pause_ms( block, (**ptr) * 1000 ); (*ptr)++;
 
   /* Get the message itself */
-  error = tzx_read_string( ptr, end, &text );
-  if( error ) { libspectrum_free( block ); return error; }
+  error = tzx_read_string( tape, ptr, end, &text );
+  if( error ) { libspectrum_tape_arena_free( tape, block ); return error; }
   libspectrum_tape_block_set_text( block, text );
 
   libspectrum_tape_append_block( tape, block );
@@ -976,7 +1076,9 @@ tzx_read_archive_info( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ARCHIVE_INFO );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_ARCHIVE_INFO
+  );
 
   /* Skip the length, as I don't care about it */
   (*ptr) += 2;
@@ -986,10 +1088,10 @@ tzx_read_archive_info( libspectrum_tape *tape, const libspectrum_byte **ptr,
   libspectrum_tape_block_set_count( block, count );
 
   /* Allocate memory */
-  ids = libspectrum_new( int, count );
+  ids = libspectrum_tape_arena_new( tape, int, count );
   libspectrum_tape_block_set_ids( block, ids );
 
-  strings = libspectrum_new( char *, count );
+  strings = libspectrum_tape_arena_new( tape, char *, count );
   libspectrum_tape_block_set_texts( block, strings );
 
   for( i = 0; i < count; i++ ) {
@@ -997,8 +1099,10 @@ tzx_read_archive_info( libspectrum_tape *tape, const libspectrum_byte **ptr,
     /* Must be ID byte and length byte */
     if( end - (*ptr) < 2 ) {
       size_t j;
-      for( j=0; j<i; j++ ) libspectrum_free( strings[j] );
-      libspectrum_free( strings ); libspectrum_free( ids ); libspectrum_free( block );
+      for( j=0; j<i; j++ ) libspectrum_tape_arena_free( tape, strings[j] );
+      libspectrum_tape_arena_free( tape, strings );
+      libspectrum_tape_arena_free( tape, ids );
+      libspectrum_tape_arena_free( tape, block );
       libspectrum_print_error(
         LIBSPECTRUM_ERROR_CORRUPT,
         "tzx_read_archive_info: not enough data in buffer"
@@ -1010,11 +1114,13 @@ tzx_read_archive_info( libspectrum_tape *tape, const libspectrum_byte **ptr,
     ids[i] = **ptr; (*ptr)++;
 
     /* Read in the string itself */
-    error = tzx_read_string( ptr, end, &strings[i] );
+    error = tzx_read_string( tape, ptr, end, &strings[i] );
     if( error ) {
       size_t j;
-      for( j = 0; j < i; j++ ) libspectrum_free( strings[j] );
-      libspectrum_free( strings ); libspectrum_free( ids ); libspectrum_free( block );
+      for( j = 0; j < i; j++ ) libspectrum_tape_arena_free( tape, strings[j] );
+      libspectrum_tape_arena_free( tape, strings );
+      libspectrum_tape_arena_free( tape, ids );
+      libspectrum_tape_arena_free( tape, block );
       return error;
     }
 
@@ -1040,7 +1146,9 @@ tzx_read_hardware( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_HARDWARE );
+  block = libspectrum_tape_arena_block_alloc(
+    tape, LIBSPECTRUM_TAPE_BLOCK_HARDWARE
+  );
 
   /* Get the number of string */
   count = **ptr; (*ptr)++;
@@ -1048,20 +1156,20 @@ tzx_read_hardware( libspectrum_tape *tape, const libspectrum_byte **ptr,
 
   /* Check there's enough data in the buffer for all the data */
   if( end - (*ptr) < 3 * (ptrdiff_t)count ) {
-    libspectrum_free( block );
+    libspectrum_tape_arena_free( tape, block );
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
 			     "tzx_read_hardware: not enough data in buffer" );
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
   /* Allocate memory */
-  types = libspectrum_new( int, count );
+  types = libspectrum_tape_arena_new( tape, int, count );
   libspectrum_tape_block_set_types( block, types );
 
-  ids = libspectrum_new( int, count );
+  ids = libspectrum_tape_arena_new( tape, int, count );
   libspectrum_tape_block_set_ids( block, ids );
 
-  values = libspectrum_new( int, count );
+  values = libspectrum_tape_arena_new( tape, int, count );
   libspectrum_tape_block_set_values( block, values );
 
   /* Actually read in all the data */
@@ -1078,7 +1186,7 @@ tzx_read_hardware( libspectrum_tape *tape, const libspectrum_byte **ptr,
 
 static libspectrum_error
 tzx_read_custom( libspectrum_tape *tape, const libspectrum_byte **ptr,
-		 const libspectrum_byte *end )
+		 const libspectrum_byte *end, int borrow_data )
 {
   libspectrum_tape_block* block;
   char *description;
@@ -1092,18 +1200,24 @@ tzx_read_custom( libspectrum_tape *tape, const libspectrum_byte **ptr,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_CUSTOM );
+  block =
+    libspectrum_tape_arena_block_alloc( tape, LIBSPECTRUM_TAPE_BLOCK_CUSTOM );
 
   /* Get the description */
-  description = libspectrum_new( char, 17 );
+  description = libspectrum_tape_arena_new( tape, char, 17 );
   memcpy( description, *ptr, 16 ); (*ptr) += 16; description[16] = '\0';
   libspectrum_tape_block_set_text( block, description );
 
   /* Read in the data */
-  error = tzx_read_data( ptr, end, &length, 4, &data );
-  if( error ) { libspectrum_free( description ); libspectrum_free( block ); return error; }
+  error = tzx_read_data( tape, ptr, end, &length, 4, &data, borrow_data );
+  if( error ) {
+    libspectrum_tape_arena_free( tape, description );
+    libspectrum_tape_arena_free( tape, block );
+    return error;
+  }
   libspectrum_tape_block_set_data_length( block, length );
   libspectrum_tape_block_set_data( block, data );
+  libspectrum_tape_block_set_borrowed( block, borrow_data );
 
   libspectrum_tape_append_block( tape, block );
 
@@ -1135,13 +1249,14 @@ static void
 tzx_read_empty_block( libspectrum_tape *tape, libspectrum_tape_type id )
 {
   libspectrum_tape_block *block;
-  block = libspectrum_tape_block_alloc( id );
+  block = libspectrum_tape_arena_block_alloc( tape, id );
   libspectrum_tape_append_block( tape, block );
 }  
 
 static libspectrum_error
-tzx_read_data( const libspectrum_byte **ptr, const libspectrum_byte *end,
-	       size_t *length, int bytes, libspectrum_byte **data )
+tzx_read_data( libspectrum_tape *tape, const libspectrum_byte **ptr,
+	       const libspectrum_byte *end, size_t *length, int bytes,
+	       libspectrum_byte **data, int borrow_data )
 {
   int i; libspectrum_dword multiplier = 0x01;
   size_t padding;
@@ -1166,8 +1281,12 @@ tzx_read_data( const libspectrum_byte **ptr, const libspectrum_byte *end,
 
   /* Allocate memory for the data; the check for *length is to avoid
      the implementation-defined behaviour of malloc( 0 ) */
-  if( *length || padding ) {
-    *data = libspectrum_new( libspectrum_byte, *length + padding );
+  if( borrow_data && *length && !padding ) {
+    /* Just point at the data where it is */
+    *data = (libspectrum_byte*)*ptr; *ptr += *length;
+  } else if( *length || padding ) {
+    *data = libspectrum_tape_arena_new( tape, libspectrum_byte,
+                                        *length + padding );
     /* Copy the block data across, and move along */
     memcpy( *data, *ptr, *length ); *ptr += *length;
   } else {
@@ -1179,14 +1298,15 @@ tzx_read_data( const libspectrum_byte **ptr, const libspectrum_byte *end,
 }
 
 static libspectrum_error
-tzx_read_string( const libspectrum_byte **ptr, const libspectrum_byte *end,
-		 char **dest )
+tzx_read_string( libspectrum_tape *tape, const libspectrum_byte **ptr,
+		 const libspectrum_byte *end, char **dest )
 {
   size_t length;
   libspectrum_error error;
   char *ptr2;
 
-  error = tzx_read_data( ptr, end, &length, -1, (libspectrum_byte**)dest );
+  error = tzx_read_data( tape, ptr, end, &length, -1, (libspectrum_byte**)dest,
+                         0 );
   if( error ) return error;
   
   /* Null terminate the string */
@@ -78,6 +78,9 @@ static libspectrum_error
 tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer* buffer,
                libspectrum_tape *tape,
                libspectrum_tape_iterator iterator );
+static libspectrum_error
+tzx_write_csw_recording( libspectrum_tape_block *block,
+                         libspectrum_buffer *buffer, int flags );
 static void
 add_pulses_block( size_t pulse_count, libspectrum_dword *lengths,
                   libspectrum_tape_block *block, libspectrum_buffer* buffer );
@@ -100,7 +103,8 @@ tzx_write_string( libspectrum_buffer* buffer, char *string );
 /* The main write function */
 
 libspectrum_error
-internal_tzx_write( libspectrum_buffer* buffer, libspectrum_tape *tape )
+internal_tzx_write( libspectrum_buffer* buffer, libspectrum_tape *tape,
+                    int flags )
 {
   libspectrum_error error;
   libspectrum_tape_iterator iterator;
@@ -200,7 +204,11 @@ internal_tzx_write( libspectrum_buffer* buffer, libspectrum_tape *tape )
       break;
 
     case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
-      error = tzx_write_rle( block, buffer, tape, iterator );
+      if( flags & LIBSPECTRUM_FLAG_TAPE_CSW_BLOCKS ) {
+        error = tzx_write_csw_recording( block, buffer, flags );
+      } else {
+        error = tzx_write_rle( block, buffer, tape, iterator );
+      }
       if( error != LIBSPECTRUM_ERROR_NONE ) { return error; }
       break;
 
@@ -633,36 +641,76 @@ typedef struct {
   size_t length; /* size of the buffer used so far */
 } rle_write_state;
 
-static rle_write_state rle_state;
-
 /* write a pulse of pulse_length bits into the tape_buffer */
 static void
-write_pulse( libspectrum_dword pulse_length )
+write_pulse( rle_write_state *state, libspectrum_dword pulse_length )
 {
   int i;
-  size_t target_size = rle_state.length + pulse_length/8;
-
-  if( rle_state.tape_length <= target_size ) {
-    rle_state.tape_length = target_size * 2;
-    rle_state.tape_buffer = libspectrum_renew( libspectrum_byte,
-					       rle_state.tape_buffer,
-					       rle_state.tape_length );
+  /* Allow for the byte in progress and the one after it being zeroed */
+  size_t target_size = state->length + pulse_length/8 + 2;
+
+  if( state->tape_length <= target_size ) {
+    state->tape_length = target_size * 2;
+    state->tape_buffer = libspectrum_renew( libspectrum_byte,
+                                            state->tape_buffer,
+                                            state->tape_length );
   }
 
   for( i = pulse_length; i > 0; i-- ) {
-    if( rle_state.level ) 
-      *(rle_state.tape_buffer + rle_state.length) |=
-        1 << (7 - rle_state.bits_used);
-    rle_state.bits_used++;
-
-    if( rle_state.bits_used == 8 ) {
-      rle_state.length++;
-      *(rle_state.tape_buffer + rle_state.length) = 0;
-      rle_state.bits_used = 0;
+    if( state->level ) 
+      *(state->tape_buffer + state->length) |=
+        1 << (7 - state->bits_used);
+    state->bits_used++;
+
+    if( state->bits_used == 8 ) {
+      state->length++;
+      *(state->tape_buffer + state->length) = 0;
+      state->bits_used = 0;
     }
   }
 
-  rle_state.level = !rle_state.level;
+  state->level = !state->level;
+}
+
+/* Write an RLE block as a TZX CSW recording block */
+static libspectrum_error
+tzx_write_csw_recording( libspectrum_tape_block *block,
+                         libspectrum_buffer *buffer, int flags )
+{
+  libspectrum_buffer *data;
+  libspectrum_dword scale = libspectrum_tape_block_scale( block );
+  libspectrum_dword sample_rate, pulses;
+  int compression;
+  libspectrum_error error;
+
+  data = libspectrum_buffer_alloc();
+
+  error = libspectrum_csw_write_data( data, &compression, &pulses, block,
+                                      flags );
+  if( error ) { libspectrum_buffer_free( data ); return error; }
+
+  /* Use the rate the block was read with if it still gives its scale, as
+     the scale alone has lost the fractional part */
+  sample_rate = libspectrum_tape_block_sample_rate( block );
+  if( !sample_rate || (libspectrum_dword)( 3500000 / sample_rate ) != scale )
+    sample_rate = scale ? 3500000 / scale : 0;
+
+  /* Write the ID byte and the metadata */
+  libspectrum_buffer_write_byte( buffer, LIBSPECTRUM_TZX_CSW_RECORDING );
+  libspectrum_buffer_write_dword( buffer,
+                                  10 + libspectrum_buffer_get_data_size( data ) );
+  libspectrum_buffer_write_word( buffer,
+                                 libspectrum_tape_block_pause( block ) );
+  libspectrum_buffer_write_word( buffer, sample_rate & 0xffff );
+  libspectrum_buffer_write_byte( buffer, sample_rate >> 16 );
+  libspectrum_buffer_write_byte( buffer, compression );
+  libspectrum_buffer_write_dword( buffer, pulses );
+
+  /* And the actual data */
+  libspectrum_buffer_write_buffer( buffer, data );
+  libspectrum_buffer_free( data );
+
+  return LIBSPECTRUM_ERROR_NONE;
 }
 
 /* Convert RLE block to a TZX DRB as TZX CSW block support is limited :/ */
@@ -677,12 +725,14 @@ tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer *buffer,
   libspectrum_dword pulse_tstates = 0;
   libspectrum_dword balance_tstates = 0;
   int flags = 0;
+  rle_write_state rle_state;
 
   libspectrum_tape_block *raw_block = 
     libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RAW_DATA );
 
   libspectrum_tape_block_set_bit_length( raw_block, scale );
-  libspectrum_set_pause_ms( raw_block, 0 );
+  libspectrum_set_pause_ms( raw_block,
+                            libspectrum_tape_block_pause( block ) );
 
   rle_state.bits_used = 0;
   rle_state.level = 0;
@@ -692,7 +742,9 @@ tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer *buffer,
 
   *rle_state.tape_buffer = 0;
 
-  it.current_block = iterator;
+  it.current_block = libspectrum_tape_iterator_position( tape, iterator );
+  it.loop_count = 0;
+  it.index_entry = LIBSPECTRUM_TAPE_INDEX_UNKNOWN;
   error = libspectrum_tape_block_init( block, &it );
   if( error != LIBSPECTRUM_ERROR_NONE ) {
     libspectrum_free( rle_state.tape_buffer );
@@ -700,7 +752,9 @@ tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer *buffer,
     return error;
   }
 
-  while( !(flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK) ) {
+  /* The pause at the end becomes the pause of the direct recording */
+  while( !(flags & LIBSPECTRUM_TAPE_FLAGS_BLOCK) &&
+         it.block_state.rle_pulse.state != LIBSPECTRUM_TAPE_STATE_PAUSE ) {
     libspectrum_dword pulse_length = 0;
 
     /* Use internal version of this that doesn't bugger up the
@@ -720,7 +774,7 @@ tzx_write_rle( libspectrum_tape_block *block, libspectrum_buffer *buffer,
     balance_tstates = balance_tstates % scale;
 
     /* write pulse_length bits of the current level into the buffer */
-    write_pulse( pulse_length );
+    write_pulse( &rle_state, pulse_length );
   }
 
   if( rle_state.length || rle_state.bits_used ) {
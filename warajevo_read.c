@@ -102,8 +102,6 @@ typedef struct
   size_t pattern_depth;
 } copy_command;
 
-static copy_command command;
-
 /* The Warajevo .tap file signature (3rd group of 4 bytes) also end of tap
    marker */
 static const libspectrum_dword warajevo_signature = 0xffffffff;
@@ -114,9 +112,10 @@ static libspectrum_dword lsb2dword( const libspectrum_byte *mem );
 static libspectrum_word lsb2word( const libspectrum_byte *mem ); 
 
 static libspectrum_error
-exec_command( libspectrum_byte *dest, const libspectrum_byte *src,
-	      const libspectrum_byte *end, size_t *sp, size_t *pc,
-	      size_t *bytes_written, const size_t to_write );
+exec_command( copy_command *command, libspectrum_byte *dest,
+	      const libspectrum_byte *src, const libspectrum_byte *end,
+	      size_t *sp, size_t *pc, size_t *bytes_written,
+	      const size_t to_write );
 
 static libspectrum_error
 get_next_block( size_t *offset, const libspectrum_byte *buffer,
@@ -131,12 +130,13 @@ read_raw_data( libspectrum_tape *tape, const libspectrum_byte *ptr,
 	       const libspectrum_byte *end, size_t offset );
 
 static libspectrum_error
-add_bit_to_copy_command( libspectrum_byte *dest, const libspectrum_byte *src,
+add_bit_to_copy_command( copy_command *command, libspectrum_byte *dest,
+			 const libspectrum_byte *src,
 			 const libspectrum_byte *end, libspectrum_byte bit,
 			 size_t *sp, size_t *bytes_written );
 
 static void
-reset_copy_command( void );
+reset_copy_command( copy_command *command );
 
 static libspectrum_error
 decompress_block( libspectrum_byte *dest, const libspectrum_byte *src,
@@ -242,7 +242,8 @@ get_next_block( size_t *offset, const libspectrum_byte *buffer,
 
 /* Executes a bytes worth of commands */
 static libspectrum_error
-exec_command( libspectrum_byte *dest, const libspectrum_byte *src,
+exec_command( copy_command *command, libspectrum_byte *dest,
+	      const libspectrum_byte *src,
 	      const libspectrum_byte *end GCC_UNUSED, size_t *sp, size_t *pc,
 	      size_t *bytes_written, const size_t to_write )
 {
@@ -256,8 +257,8 @@ exec_command( libspectrum_byte *dest, const libspectrum_byte *src,
   for( i = 0; i < 8; i++ ) {
     bit = ( command_byte & ( 0x80 >> i ) ) ? 1 : 0;
 
-    error = add_bit_to_copy_command( dest, src, dest + to_write, bit, sp,
-                                     bytes_written );
+    error = add_bit_to_copy_command( command, dest, src, dest + to_write,
+                                     bit, sp, bytes_written );
     if( error ) { return error; }
 
     if( *bytes_written >= to_write ) break;
@@ -267,170 +268,171 @@ exec_command( libspectrum_byte *dest, const libspectrum_byte *src,
 }
 
 static libspectrum_error
-execute_copy_command( libspectrum_byte *dest, const libspectrum_byte *end,
-                      size_t *bytes_written )
+execute_copy_command( copy_command *command, libspectrum_byte *dest,
+                      const libspectrum_byte *end, size_t *bytes_written )
 {
-  if( ( (*bytes_written + 1) < command.offset ) ||
-      ( dest + *bytes_written - command.offset + 1 + command.size > end ) ) {
+  if( ( (*bytes_written + 1) < command->offset ) ||
+      ( dest + *bytes_written - command->offset + 1 + command->size > end ) ) {
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
                      "execute_copy_command: corrupt compressed block in file" );
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
   memcpy( dest + *bytes_written,
-          dest + *bytes_written - command.offset + 1, command.size );
+          dest + *bytes_written - command->offset + 1, command->size );
 
-  *bytes_written += command.size;
+  *bytes_written += command->size;
 
-  reset_copy_command();
+  reset_copy_command( command );
 
   return LIBSPECTRUM_ERROR_NONE;
 }
 
 static libspectrum_error
-add_bit_to_copy_command( libspectrum_byte *dest, const libspectrum_byte *src,
+add_bit_to_copy_command( copy_command *command, libspectrum_byte *dest,
+			 const libspectrum_byte *src,
 			 const libspectrum_byte *end, libspectrum_byte bit,
 			 size_t *sp, size_t *bytes_written )
 {
-  if( command.mode == 0 ) {
+  if( command->mode == 0 ) {
     if( bit == 0 ) {
       dest[(*bytes_written)++] = src[(*sp)++];
     } else {
-      command.mode = 1;
+      command->mode = 1;
       return LIBSPECTRUM_ERROR_NONE;
     }
   }
 
-  if( command.mode == 1 ) {
-    switch( command.state ){
+  if( command->mode == 1 ) {
+    switch( command->state ){
     case  b: /* start */
-      command.state = bit == 0 ? b0 : b1;
+      command->state = bit == 0 ? b0 : b1;
       break;
     case b0:
       if( bit == 0 ) { /* b00 */
-        command.size=3;
-        command.mode=2;
+        command->size=3;
+        command->mode=2;
       } else
-        command.state = b01;
+        command->state = b01;
       break;
     case b1:
-      command.state = bit == 0 ? b10 : b11;
+      command->state = bit == 0 ? b10 : b11;
       break;
     case b01:
       if( bit == 0 ) { /* b010 */
         /* no higher byte */
-        command.size=2;
-        command.mode=3;
-        command.offset = src[(*sp)++];
-        return execute_copy_command( dest, end, bytes_written );
+        command->size=2;
+        command->mode=3;
+        command->offset = src[(*sp)++];
+        return execute_copy_command( command, dest, end, bytes_written );
       } else { /* b011 */
-        command.size=10 + src[(*sp)++];
-        command.mode=2;
+        command->size=10 + src[(*sp)++];
+        command->mode=2;
       }
       break;
     case b10:
       if( bit == 0 ) { /* b100 */
-        command.size=4;
-        command.mode=2;
+        command->size=4;
+        command->mode=2;
       } else { /* b101 */
-        command.size=5;
-        command.mode=2;
+        command->size=5;
+        command->mode=2;
       }
       break;
     case b11:
-      command.state = bit == 0 ? b110 : b111;
+      command->state = bit == 0 ? b110 : b111;
       break;
     case b110:
       if( bit == 0 ) { /* b1100 */
-        command.size=6;
-        command.mode=2;
+        command->size=6;
+        command->mode=2;
       } else { /* b1101 */
-        command.size=7;
-        command.mode=2;
+        command->size=7;
+        command->mode=2;
       }
       break;
     case b111:
       if( bit == 0 ) { /* b1110 */
-        command.size=8;
-        command.mode=2;
+        command->size=8;
+        command->mode=2;
       } else { /* b1111 */
-        command.size=9;
-        command.mode=2;
+        command->size=9;
+        command->mode=2;
       }
       break;
     }
     return LIBSPECTRUM_ERROR_NONE;
   }
 
-  if( command.mode == 2 ) {
-    switch( command.vstate ){
+  if( command->mode == 2 ) {
+    switch( command->vstate ){
     case v: /* start */
-      command.offset = src[(*sp)++];
+      command->offset = src[(*sp)++];
       if( bit == 0 )
-        command.vstate = v0;
+        command->vstate = v0;
       else { /* v1 */
         /* no higher byte */
-        command.mode=3;
+        command->mode=3;
       }
       break;
     case v0:
-      command.vstate = bit == 0 ? v00 : v01;
+      command->vstate = bit == 0 ? v00 : v01;
       break;
     case v01: /* v01 + nnnn */
-      command.pattern <<= 1;
-      command.pattern |= bit;
-      if( ++command.pattern_depth == 4 ) {
-        command.offset += (command.pattern + 7) << 8;
-        command.mode=3;
+      command->pattern <<= 1;
+      command->pattern |= bit;
+      if( ++command->pattern_depth == 4 ) {
+        command->offset += (command->pattern + 7) << 8;
+        command->mode=3;
       }
       break;
     case v00:
-      command.vstate = bit == 0 ? v000 : v001;
+      command->vstate = bit == 0 ? v000 : v001;
       break;
     case v000:
       if( bit == 0 ) { /* v0000 */
-        command.offset += 1 << 8;
-        command.mode=3;
+        command->offset += 1 << 8;
+        command->mode=3;
       } else { /* v0001 */
-        command.offset += 2 << 8;
-        command.mode=3;
+        command->offset += 2 << 8;
+        command->mode=3;
       }
       break;
     case v001:
-      command.vstate = bit == 0 ? v0010 : v0011;
+      command->vstate = bit == 0 ? v0010 : v0011;
       break;
     case v0010:
       if( bit == 0 ) { /* v00100 */
-        command.offset += 3 << 8;
-        command.mode=3;
+        command->offset += 3 << 8;
+        command->mode=3;
       } else { /* v00101 */
-        command.offset += 4 << 8;
-        command.mode=3;
+        command->offset += 4 << 8;
+        command->mode=3;
       }
       break;
     case v0011:
       if( bit == 0 ) { /* v00110 */
-        command.offset += 5 << 8;
-        command.mode=3;
+        command->offset += 5 << 8;
+        command->mode=3;
       } else { /* v00111 */
-        command.offset += 6 << 8;
-        command.mode=3;
+        command->offset += 6 << 8;
+        command->mode=3;
       }
       break;
     }
   }
 
-  if( command.mode == 3 ) {
-    return execute_copy_command( dest, end, bytes_written );
+  if( command->mode == 3 ) {
+    return execute_copy_command( command, dest, end, bytes_written );
   }
 
   return LIBSPECTRUM_ERROR_NONE;
 }
 
 static void
-reset_copy_command( void )
+reset_copy_command( copy_command *command )
 {
-  memset( &command, 0, sizeof( copy_command ) );
+  memset( command, 0, sizeof( copy_command ) );
 }
 
 static libspectrum_error
@@ -619,13 +621,15 @@ decompress_block( libspectrum_byte *dest, const libspectrum_byte *src,
 {
   size_t bytes_written = 0, pc = 0;
   size_t sp = signature + 1;
+  copy_command command;
 
   libspectrum_error error;
 
-  reset_copy_command();
+  reset_copy_command( &command );
     
   while( ( pc <= signature ) && ( bytes_written != length ) ) {
-    error = exec_command( dest, src, end, &sp, &pc, &bytes_written, length );
+    error = exec_command( &command, dest, src, end, &sp, &pc, &bytes_written,
+                          length );
     if( error ) return error;
   }
 
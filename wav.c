@@ -25,14 +25,391 @@
 #include <string.h>
 
 #ifdef HAVE_LIB_AUDIOFILE
-
 #include <audiofile.h>
+#endif    /* #ifdef HAVE_LIB_AUDIOFILE */
 
 #include "internals.h"
 #include "tape_block.h"
 
-libspectrum_error
-libspectrum_wav_read( libspectrum_tape *tape, const char *filename )
+/* The clock which tape edge lengths are measured against */
+#define TAPE_CLOCK 3500000
+
+/* The format tags we can read ourselves */
+#define WAVE_FORMAT_PCM        0x0001
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+/* How much sample data to read at once */
+#define WAV_CHUNK_LENGTH 0x10000
+
+/* The least distance from the centre of the signal which changes the
+   level, with samples scaled to 16 bits, so that quiet noise in the
+   gaps doesn't become edges */
+#define WAV_MIN_HYSTERESIS 0x0080
+
+typedef struct wav_format {
+
+  libspectrum_word tag;
+  libspectrum_word channels;
+  libspectrum_dword sample_rate;
+  libspectrum_word block_align;	/* Bytes per frame */
+  libspectrum_word bits;	/* Bits per sample */
+
+} wav_format;
+
+/* A Schmitt trigger whose thresholds follow the signal: the centre line
+   is the running mean of the samples, so a DC offset doesn't matter, and
+   the hysteresis is a quarter of the recent peak distance from it, so
+   quiet recordings still give edges */
+typedef struct wav_detector {
+
+  long centre;			/* Mean sample, scaled by 1 << shift */
+  long peak;			/* Decaying peak distance from the
+				   centre, scaled by 1 << shift */
+  int shift;			/* How slowly the two follow the signal */
+
+  int level;
+  libspectrum_dword run;	/* Samples since the last edge */
+
+} wav_detector;
+
+/* RLE pulse data as it is built */
+typedef struct wav_pulses {
+
+  libspectrum_byte *data, *ptr;
+  size_t allocated;
+
+} wav_pulses;
+
+/* A file held in memory, for libspectrum_wav_read() */
+typedef struct wav_memory {
+
+  const libspectrum_byte *ptr, *end;
+
+} wav_memory;
+
+static libspectrum_error
+wav_read_memory( libspectrum_byte *data, size_t length, size_t *read,
+                 void *context )
+{
+  wav_memory *memory = context;
+  size_t available = memory->end - memory->ptr;
+
+  *read = length < available ? length : available;
+  memcpy( data, memory->ptr, *read );
+  memory->ptr += *read;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Get `length' bytes from `source', or as many as there are before the
+   end of the file */
+static libspectrum_error
+wav_fill( libspectrum_byte *data, size_t length, size_t *got,
+          libspectrum_read_fn source, void *context )
+{
+  size_t read;
+  libspectrum_error error;
+
+  for( *got = 0; *got < length; *got += read ) {
+    error = source( data + *got, length - *got, &read, context );
+    if( error ) return error;
+    if( !read ) break;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Skip `length' bytes of `source'; `*got' is how many there were */
+static libspectrum_error
+wav_skip( libspectrum_dword length, libspectrum_dword *got,
+          libspectrum_read_fn source, void *context )
+{
+  libspectrum_byte scratch[ 256 ];
+  size_t read;
+  libspectrum_error error;
+
+  for( *got = 0; *got < length; *got += read ) {
+    error = wav_fill( scratch, length - *got < sizeof( scratch ) ?
+                               length - *got : sizeof( scratch ),
+                      &read, source, context );
+    if( error ) return error;
+    if( !read ) break;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Read the header of a RIFF/WAVE file, up to the start of its sample
+   data; `*found' is zero if this isn't one */
+static libspectrum_error
+wav_parse( wav_format *format, libspectrum_dword *data_length, int *found,
+           libspectrum_read_fn source, void *context )
+{
+  libspectrum_byte header[40];
+  const libspectrum_byte *ptr;
+  libspectrum_dword chunk_length, skip, skipped;
+  size_t got, wanted;
+  int have_format = 0;
+  libspectrum_error error;
+
+  *found = 0;
+
+  error = wav_fill( header, 12, &got, source, context );
+  if( error ) return error;
+
+  if( got < 12 || memcmp( header, "RIFF", 4 ) ||
+      memcmp( header + 8, "WAVE", 4 ) )
+    return LIBSPECTRUM_ERROR_NONE;
+
+  while( 1 ) {
+
+    error = wav_fill( header, 8, &got, source, context );
+    if( error ) return error;
+    if( got < 8 ) return LIBSPECTRUM_ERROR_NONE;
+
+    ptr = header + 4;
+    chunk_length = libspectrum_read_dword( &ptr );
+
+    /* Chunks are padded to an even length */
+    skip = chunk_length + ( chunk_length & 1 );
+
+    if( !memcmp( header, "fmt ", 4 ) ) {
+
+      if( chunk_length < 16 ) return LIBSPECTRUM_ERROR_NONE;
+
+      wanted = chunk_length < sizeof( header ) ? chunk_length
+                                               : sizeof( header );
+      error = wav_fill( header, wanted, &got, source, context );
+      if( error ) return error;
+      if( got < wanted ) return LIBSPECTRUM_ERROR_NONE;
+      skip -= wanted;
+
+      format->tag = header[0] | header[1] << 8;
+      format->channels = header[2] | header[3] << 8;
+      ptr = header + 4;
+      format->sample_rate = libspectrum_read_dword( &ptr );
+      format->block_align = header[12] | header[13] << 8;
+      format->bits = header[14] | header[15] << 8;
+
+      /* The real format of an extensible file is the start of its
+         subformat GUID */
+      if( format->tag == WAVE_FORMAT_EXTENSIBLE && chunk_length >= 40 )
+        format->tag = header[24] | header[25] << 8;
+
+      have_format = 1;
+
+    } else if( !memcmp( header, "data", 4 ) ) {
+
+      if( !have_format ) return LIBSPECTRUM_ERROR_NONE;
+
+      /* Recordings which were never finished may claim more data than
+         there is, so this is only an upper limit */
+      *data_length = chunk_length;
+      *found = 1;
+      return LIBSPECTRUM_ERROR_NONE;
+
+    }
+
+    error = wav_skip( skip, &skipped, source, context );
+    if( error ) return error;
+    if( skipped < skip ) return LIBSPECTRUM_ERROR_NONE;
+  }
+}
+
+static int
+wav_supported( const wav_format *format )
+{
+  return format->tag == WAVE_FORMAT_PCM &&
+         format->channels &&
+         ( format->bits == 8 || format->bits == 16 || format->bits == 24 ||
+           format->bits == 32 ) &&
+         format->block_align == format->channels * format->bits / 8 &&
+         format->sample_rate && format->sample_rate <= TAPE_CLOCK;
+}
+
+/* Get one frame, mixed down to a signed 16-bit sample */
+static long
+wav_frame( const libspectrum_byte *frame, const wav_format *format )
+{
+  long total = 0;
+  size_t i;
+
+  for( i = 0; i < format->channels; i++ ) {
+    switch( format->bits ) {
+    case 8:
+      total += ( frame[0] - 0x80 ) * 0x100;
+      frame++;
+      break;
+    case 16:
+      total += (libspectrum_signed_word)( frame[0] | frame[1] << 8 );
+      frame += 2;
+      break;
+    case 24:
+      total += (libspectrum_signed_word)( frame[1] | frame[2] << 8 );
+      frame += 3;
+      break;
+    case 32:
+      total += (libspectrum_signed_word)( frame[2] | frame[3] << 8 );
+      frame += 4;
+      break;
+    }
+  }
+
+  return total / format->channels;
+}
+
+/* Add a pulse `samples' long to RLE pulse data */
+static void
+wav_write_pulse( wav_pulses *pulses, libspectrum_dword samples )
+{
+  libspectrum_make_room( &pulses->data, 5, &pulses->ptr, &pulses->allocated );
+
+  if( samples < 0x100 ) {
+    *(pulses->ptr)++ = samples;
+  } else {
+    *(pulses->ptr)++ = 0;
+    libspectrum_write_dword( &pulses->ptr, samples );
+  }
+}
+
+static void
+wav_detector_init( wav_detector *detector, libspectrum_dword sample_rate )
+{
+  /* Follow the signal over a few hundredths of a second */
+  for( detector->shift = 4;
+       detector->shift < 12 && ( 64UL << detector->shift ) < sample_rate;
+       detector->shift++ )
+    ;
+
+  detector->centre = 0x8000L << detector->shift;
+  detector->peak = 0;
+  detector->level = -1;
+  detector->run = 0;
+}
+
+/* Pass one sample through the detector */
+static void
+wav_detect( wav_detector *detector, long sample, wav_pulses *pulses )
+{
+  long centre = detector->centre >> detector->shift, distance, hysteresis;
+
+  /* Work with unsigned samples, so everything here is positive */
+  sample += 0x8000;
+
+  detector->centre += sample - centre;
+
+  distance = sample > centre ? sample - centre : centre - sample;
+  if( distance << detector->shift > detector->peak ) {
+    detector->peak = distance << detector->shift;
+  } else {
+    detector->peak -= detector->peak >> detector->shift;
+  }
+
+  hysteresis = ( detector->peak >> detector->shift ) / 4;
+  if( hysteresis < WAV_MIN_HYSTERESIS ) hysteresis = WAV_MIN_HYSTERESIS;
+
+  if( detector->level == -1 ) {
+    detector->level = sample >= centre;
+  } else if( detector->level ? sample < centre - hysteresis
+                             : sample > centre + hysteresis ) {
+    wav_write_pulse( pulses, detector->run );
+    detector->run = 0;
+    detector->level = !detector->level;
+  }
+
+  detector->run++;
+}
+
+/* Turn PCM data into an RLE pulse block, a piece at a time */
+static libspectrum_error
+wav_read_pcm( libspectrum_tape *tape, const wav_format *format,
+              libspectrum_dword data_length, libspectrum_read_fn source,
+              void *context )
+{
+  libspectrum_tape_block *block;
+  libspectrum_byte *chunk, *frame;
+  wav_detector detector;
+  wav_pulses pulses = { NULL, NULL, 0 };
+  size_t chunk_frames, wanted, got, frames;
+  libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
+
+  chunk_frames = WAV_CHUNK_LENGTH / format->block_align;
+  if( !chunk_frames ) chunk_frames = 1;
+  chunk = libspectrum_new( libspectrum_byte,
+                           chunk_frames * format->block_align );
+
+  wav_detector_init( &detector, format->sample_rate );
+
+  do {
+
+    wanted = chunk_frames * format->block_align;
+    if( wanted > data_length ) wanted = data_length;
+
+    error = wav_fill( chunk, wanted, &got, source, context );
+    if( error ) break;
+    data_length -= got;
+
+    frames = got / format->block_align;
+    for( frame = chunk; frames; frames--, frame += format->block_align )
+      wav_detect( &detector, wav_frame( frame, format ), &pulses );
+
+  } while( got == wanted && data_length );
+
+  libspectrum_free( chunk );
+
+  if( !error && detector.level == -1 ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_CORRUPT,
+      "libspectrum_wav_read: empty audio file, nothing to load"
+    );
+    error = LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  if( error ) {
+    libspectrum_free( pulses.data );
+    return error;
+  }
+
+  wav_write_pulse( &pulses, detector.run );
+
+  block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE );
+
+  /* 44100 Hz 79 t-states 22050 Hz 158 t-states */
+  libspectrum_tape_block_set_scale( block,
+                                    TAPE_CLOCK / format->sample_rate );
+  libspectrum_tape_block_set_sample_rate( block, format->sample_rate );
+  libspectrum_tape_block_set_data_length( block, pulses.ptr - pulses.data );
+  libspectrum_tape_block_set_data(
+    block, libspectrum_renew( libspectrum_byte, pulses.data,
+                              pulses.ptr - pulses.data ) );
+
+  libspectrum_tape_append_block( tape, block );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Read a PCM .wav file from `source'; `*found' is zero if it isn't one */
+static libspectrum_error
+wav_read_source( libspectrum_tape *tape, int *found,
+                 libspectrum_read_fn source, void *context )
+{
+  wav_format format;
+  libspectrum_dword data_length;
+  libspectrum_error error;
+
+  error = wav_parse( &format, &data_length, found, source, context );
+  if( error ) return error;
+
+  if( *found ) *found = wav_supported( &format );
+  if( !*found ) return LIBSPECTRUM_ERROR_NONE;
+
+  return wav_read_pcm( tape, &format, data_length, source, context );
+}
+
+#ifdef HAVE_LIB_AUDIOFILE
+
+static libspectrum_error
+wav_read_audiofile( libspectrum_tape *tape, const char *filename )
 {
   libspectrum_byte *buffer; size_t length;
   libspectrum_byte *tape_buffer; size_t tape_length;
@@ -167,3 +544,46 @@ libspectrum_wav_read( libspectrum_tape *tape, const char *filename )
 }
 
 #endif    /* #ifdef HAVE_LIB_AUDIOFILE */
+
+libspectrum_error
+libspectrum_wav_read_stream( libspectrum_tape *tape,
+                             libspectrum_read_fn source, void *context )
+{
+  libspectrum_error error;
+  int found;
+
+  error = wav_read_source( tape, &found, source, context );
+  if( error || found ) return error;
+
+  libspectrum_print_error(
+    LIBSPECTRUM_ERROR_UNKNOWN,
+    "libspectrum_wav_read_stream: not a PCM .wav file"
+  );
+  return LIBSPECTRUM_ERROR_UNKNOWN;
+}
+
+libspectrum_error
+libspectrum_wav_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
+                      size_t length, const char *filename GCC_UNUSED )
+{
+  wav_memory memory;
+  libspectrum_error error;
+  int found;
+
+  memory.ptr = buffer;
+  memory.end = buffer + length;
+
+  error = wav_read_source( tape, &found, wav_read_memory, &memory );
+  if( error || found ) return error;
+
+#ifdef HAVE_LIB_AUDIOFILE
+  /* Let libaudiofile deal with anything we can't */
+  return wav_read_audiofile( tape, filename );
+#else     /* #ifdef HAVE_LIB_AUDIOFILE */
+  libspectrum_print_error(
+    LIBSPECTRUM_ERROR_UNKNOWN,
+    "libspectrum_wav_read: not a PCM .wav file, and no libaudiofile to read it"
+  );
+  return LIBSPECTRUM_ERROR_UNKNOWN;
+#endif    /* #ifdef HAVE_LIB_AUDIOFILE */
+}
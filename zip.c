@@ -493,6 +493,12 @@ decompress_stream( struct libspectrum_zip *z, libspectrum_byte **buffer,
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
+  /* The output is allocated up front at the size given in the directory,
+     so don't believe a size the data couldn't possibly inflate to */
+  if( *buffer_size / LIBSPECTRUM_DEFLATE_MAX_RATIO > file_compressed_left ) {
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
   error = libspectrum_zip_inflate( z->ptr, file_compressed_left, buffer,
                                    buffer_size );
   if( error ) return error;
@@ -47,7 +47,17 @@ skip_null_terminated_string( const libspectrum_byte **ptr, size_t *length,
 			     const char *name );
 static libspectrum_error
 zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
-	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack );
+	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack,
+	      size_t hint );
+static libspectrum_error
+init_inflater( z_stream *stream, int gzip_hack );
+static libspectrum_error
+inflate_all( z_stream *stream, const libspectrum_byte *gzptr,
+             size_t gzlength, libspectrum_byte **outptr, size_t *outlength,
+             size_t hint );
+static libspectrum_error
+inflate_into( z_stream *stream, const libspectrum_byte *gzptr,
+              size_t gzlength, libspectrum_byte *outptr, size_t *outlength );
 
 libspectrum_error 
 libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
@@ -60,7 +70,32 @@ libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
  * Returns:	error flag (libspectrum_error)
  */
 {
-  return zlib_inflate( gzptr, gzlength, outptr, outlength, 0 );
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, 0, 0 );
+}
+
+libspectrum_error 
+libspectrum_zlib_inflate_into( const libspectrum_byte *gzptr, size_t gzlength,
+			       libspectrum_byte *outptr, size_t *outlength )
+/* Inflates a block of data into memory the caller already has.
+ * Input:	gzptr		-> source (deflated) data
+ *		*gzlength	== source data length
+ *		outptr		-> where to put the inflated data
+ *		*outlength	== space available at outptr
+ * Output:	*outlength	== length of the inflated data
+ * Returns:	error flag (libspectrum_error); it is an error for the
+ *		inflated data not to fit
+ */
+{
+  z_stream stream;
+  libspectrum_error error;
+
+  error = init_inflater( &stream, 0 ); if( error ) return error;
+
+  error = inflate_into( &stream, gzptr, gzlength, outptr, outlength );
+
+  inflateEnd( &stream );
+
+  return error;
 }
 
 libspectrum_error
@@ -68,30 +103,68 @@ libspectrum_gzip_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 			  libspectrum_byte **outptr, size_t *outlength )
 {
   int error;
+  size_t hint = 0;
 
   error = skip_gzip_header( &gzptr, &gzlength ); if( error ) return error;
 
-  return zlib_inflate( gzptr, gzlength, outptr, outlength, 1 );
+  /* The trailer holds the inflated length (modulo 2^32), which lets us
+     allocate the right amount of space in one go */
+  if( !*outlength && gzlength >= 8 ) {
+    const libspectrum_byte *isize = gzptr + gzlength - 4;
+    hint = libspectrum_read_dword( &isize );
+    if( hint / LIBSPECTRUM_DEFLATE_MAX_RATIO > gzlength ) hint = 0;
+  }
+
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, 1, hint );
 }
 
 libspectrum_error
 libspectrum_zip_inflate( const libspectrum_byte *zipptr, size_t ziplength,
                          libspectrum_byte **outptr, size_t *outlength )
 {
-  return zlib_inflate( zipptr, ziplength, outptr, outlength, 1 );
+  return zlib_inflate( zipptr, ziplength, outptr, outlength, 1, 0 );
 }
 
+/* Inflate some data. If `*outlength' is non-zero, that's how long the
+   inflated data should be; otherwise `hint', if non-zero, is how much
+   space to start with */
 static libspectrum_error
 zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
-	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack )
+	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack,
+	      size_t hint )
 {
   z_stream stream;
   int error;
+  libspectrum_error lserror;
+
+  lserror = init_inflater( &stream, gzip_hack ); if( lserror ) return lserror;
+
+  lserror = inflate_all( &stream, gzptr, gzlength, outptr, outlength, hint );
+  if( lserror ) {
+    inflateEnd( &stream );
+    return lserror;
+  }
+
+  error = inflateEnd( &stream );
+  if( error != Z_OK ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
+			     "gzip error from inflateEnd: %s", stream.msg );
+    libspectrum_free( *outptr );
+    return LIBSPECTRUM_ERROR_LOGIC;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static libspectrum_error
+init_inflater( z_stream *stream, int gzip_hack )
+{
+  int error;
 
   /* Use default memory management */
-  stream.zalloc = Z_NULL; stream.zfree = Z_NULL; stream.opaque = Z_NULL;
+  stream->zalloc = Z_NULL; stream->zfree = Z_NULL; stream->opaque = Z_NULL;
 
-  stream.next_in = gzptr; stream.avail_in = gzlength;
+  stream->next_in = Z_NULL; stream->avail_in = 0;
 
   if( gzip_hack ) { 
 
@@ -105,11 +178,11 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
      * are present after the compressed stream.
      *
      */
-    error = inflateInit2( &stream, -15 );
+    error = inflateInit2( stream, -15 );
 
   } else {
 
-    error = inflateInit( &stream );
+    error = inflateInit( stream );
 
   }
 
@@ -120,46 +193,24 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
   case Z_MEM_ERROR: 
     libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
 			     "out of memory at %s:%d", __FILE__, __LINE__ );
-    inflateEnd( &stream );
+    inflateEnd( stream );
     return LIBSPECTRUM_ERROR_MEMORY;
 
   default:
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
-			     "error from inflateInit2: %s", stream.msg );
-    inflateEnd( &stream );
+			     "error from inflateInit2: %s", stream->msg );
+    inflateEnd( stream );
     return LIBSPECTRUM_ERROR_MEMORY;
 
   }
 
-  if( *outlength ) {
-
-    *outptr = libspectrum_new( libspectrum_byte, *outlength );
-    stream.next_out = *outptr; stream.avail_out = *outlength;
-    error = inflate( &stream, Z_FINISH );
-
-  } else {
-
-    *outptr = stream.next_out = NULL;
-    *outlength = stream.avail_out = 0;
-
-    do {
-
-      libspectrum_byte *ptr;
-
-      *outlength += 16384; stream.avail_out += 16384;
-      ptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
-      stream.next_out = ptr + ( stream.next_out - *outptr );
-      *outptr = ptr;
-
-      error = inflate( &stream, 0 );
-
-    } while( error == Z_OK );
-
-  }
-
-  *outlength = stream.next_out - *outptr;
-  *outptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
+  return LIBSPECTRUM_ERROR_NONE;
+}
 
+/* Report the result of inflating a whole stream */
+static libspectrum_error
+inflate_error( int error, z_stream *stream )
+{
   switch( error ) {
 
   case Z_STREAM_END: break;
@@ -167,52 +218,106 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
   case Z_NEED_DICT:
     libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
 			     "gzip inflation needs dictionary" );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_UNKNOWN;
 
   case Z_DATA_ERROR:
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT, "corrupt gzip data" );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_CORRUPT;
 
   case Z_MEM_ERROR:
     libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
 			     "out of memory at %s:%d", __FILE__, __LINE__ );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_MEMORY;
 
   case Z_BUF_ERROR:
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
 			     "not enough space in gzip output buffer" );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
     return LIBSPECTRUM_ERROR_CORRUPT;
 
   default:
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			     "gzip error from inflate: %s",
-			     stream.msg );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
+			     stream->msg );
     return LIBSPECTRUM_ERROR_LOGIC;
 
   }
 
-  error = inflateEnd( &stream );
-  if( error != Z_OK ) {
-    libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
-			     "gzip error from inflateEnd: %s", stream.msg );
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Inflate `gzlength' bytes at `gzptr' with `stream', which has been
+   initialised or reset, into newly allocated memory. If `*outlength' is
+   non-zero, that's how long the inflated data should be; otherwise
+   `hint', if non-zero, is how much space to start with */
+static libspectrum_error
+inflate_all( z_stream *stream, const libspectrum_byte *gzptr,
+             size_t gzlength, libspectrum_byte **outptr, size_t *outlength,
+             size_t hint )
+{
+  libspectrum_error lserror;
+  size_t allocated;
+  int error;
+
+  if( *outlength ) {
+
+    *outptr = libspectrum_new( libspectrum_byte, *outlength );
+    lserror = inflate_into( stream, gzptr, gzlength, *outptr, outlength );
+    if( lserror ) libspectrum_free( *outptr );
+    return lserror;
+
+  }
+
+  allocated = hint ? hint : 16384;
+  *outptr = libspectrum_new( libspectrum_byte, allocated );
+
+  stream->next_in = (Bytef*)gzptr; stream->avail_in = gzlength;
+  stream->next_out = *outptr; stream->avail_out = allocated;
+
+  /* Double the space each time we run out, so a poor guess costs only a
+     few reallocations */
+  while( ( error = inflate( stream, 0 ) ) == Z_OK ) {
+
+    if( !stream->avail_out ) {
+      *outptr = libspectrum_renew( libspectrum_byte, *outptr, 2 * allocated );
+      stream->next_out = *outptr + allocated;
+      stream->avail_out = allocated;
+      allocated *= 2;
+    }
+
+  }
+
+  *outlength = stream->next_out - *outptr;
+
+  lserror = inflate_error( error, stream );
+  if( lserror ) {
     libspectrum_free( *outptr );
-    inflateEnd( &stream );
-    return LIBSPECTRUM_ERROR_LOGIC;
+    return lserror;
   }
 
+  if( *outlength != allocated )
+    *outptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
+
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Inflate `gzlength' bytes at `gzptr' with `stream', which has been
+   initialised or reset, into the `*outlength' bytes at `outptr' */
+static libspectrum_error
+inflate_into( z_stream *stream, const libspectrum_byte *gzptr,
+              size_t gzlength, libspectrum_byte *outptr, size_t *outlength )
+{
+  int error;
+
+  stream->next_in = (Bytef*)gzptr; stream->avail_in = gzlength;
+  stream->next_out = outptr; stream->avail_out = *outlength;
+
+  error = inflate( stream, Z_FINISH );
+
+  *outlength = stream->next_out - outptr;
+
+  return inflate_error( error, stream );
+}
+
 static libspectrum_error
 skip_gzip_header( const libspectrum_byte **gzptr, size_t *gzlength )
 {
@@ -308,27 +413,62 @@ skip_null_terminated_string( const libspectrum_byte **ptr, size_t *length,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Get the zlib level and strategy for the compression profile given in
+   `flags'; without one, we go for the smallest output */
+static void
+compression_profile( int flags, int *level, int *strategy )
+{
+  *strategy = Z_DEFAULT_STRATEGY;
+
+  if( flags & LIBSPECTRUM_FLAG_COMPRESS_FASTEST ) {
+    *level = Z_BEST_SPEED;
+  } else if( flags & LIBSPECTRUM_FLAG_COMPRESS_RLE ) {
+    *level = Z_DEFAULT_COMPRESSION;
+    *strategy = Z_RLE;
+  } else if( flags & LIBSPECTRUM_FLAG_COMPRESS_DEFAULT ) {
+    *level = Z_DEFAULT_COMPRESSION;
+  } else {
+    *level = Z_BEST_COMPRESSION;
+  }
+}
+
 libspectrum_error
 libspectrum_zlib_compress( const libspectrum_byte *data, size_t length,
 			   libspectrum_byte **gzptr, size_t *gzlength )
-/* Deflates a block of data.
- * Input:	data		-> source data
- *		length		== source data length
- * Output:	*gzptr		-> deflated data (malloced in this fn),
- *		*gzlength	== length of the deflated data
- * Returns:	error flag (libspectrum_error)
- */
 {
-  uLongf gzl = (uLongf)( length * 1.001 ) + 12;
+  return libspectrum_zlib_compress2( data, length, gzptr, gzlength, 0 );
+}
+
+/* Deflate `length' bytes at `data' in one go with `stream', which has
+   been initialised or reset; returns a zlib error code */
+static int
+deflate_all( z_stream *stream, const libspectrum_byte *data, size_t length,
+             libspectrum_byte **gzptr, size_t *gzlength )
+{
+  uLong gzl = deflateBound( stream, length );
   int gzret;
 
   *gzptr = libspectrum_new( libspectrum_byte, gzl );
-  gzret = compress2( *gzptr, &gzl, data, length, Z_BEST_COMPRESSION );
 
+  stream->next_in = (Bytef*)data; stream->avail_in = length;
+  stream->next_out = *gzptr; stream->avail_out = gzl;
+
+  gzret = deflate( stream, Z_FINISH );
+  if( gzret == Z_STREAM_END ) {
+    *gzlength = stream->total_out;
+    return Z_OK;
+  }
+
+  return gzret == Z_OK ? Z_BUF_ERROR : gzret;
+}
+
+/* Report an error code from deflating, freeing any output */
+static libspectrum_error
+deflate_error( int gzret, libspectrum_byte **gzptr )
+{
   switch (gzret) {
 
   case Z_OK:			/* initialised OK */
-    *gzlength = gzl;
     return LIBSPECTRUM_ERROR_NONE;
 
   case Z_MEM_ERROR:		/* out of memory */
@@ -357,3 +497,604 @@ libspectrum_zlib_compress( const libspectrum_byte *data, size_t length,
     return LIBSPECTRUM_ERROR_LOGIC;
   }
 }
+
+libspectrum_error
+libspectrum_zlib_compress2( const libspectrum_byte *data, size_t length,
+			    libspectrum_byte **gzptr, size_t *gzlength,
+			    int flags )
+/* Deflates a block of data.
+ * Input:	data		-> source data
+ *		length		== source data length
+ *		flags		== compression profile
+ * Output:	*gzptr		-> deflated data (malloced in this fn),
+ *		*gzlength	== length of the deflated data
+ * Returns:	error flag (libspectrum_error)
+ */
+{
+  z_stream stream;
+  int gzret, level, strategy;
+
+  compression_profile( flags, &level, &strategy );
+
+  *gzptr = NULL;
+
+  stream.zalloc = Z_NULL; stream.zfree = Z_NULL; stream.opaque = Z_NULL;
+
+  gzret = deflateInit2( &stream, level, Z_DEFLATED, MAX_WBITS, 8, strategy );
+  if( gzret == Z_OK ) {
+    gzret = deflate_all( &stream, data, length, gzptr, gzlength );
+    deflateEnd( &stream );
+  }
+
+  return deflate_error( gzret, gzptr );
+}
+
+/*
+ * zlib state kept for (de)compressing many blocks of data
+ */
+
+struct libspectrum_zlib_codec {
+
+  int flags;			/* The compression profile */
+  int raw;			/* No zlib header or checksum? */
+
+  z_stream inflater, deflater;
+  int inflater_ready, deflater_ready; /* Initialised yet? */
+
+};
+
+libspectrum_zlib_codec*
+libspectrum_zlib_codec_alloc( int flags, int raw )
+{
+  libspectrum_zlib_codec *codec = libspectrum_new( libspectrum_zlib_codec, 1 );
+
+  codec->flags = flags;
+  codec->raw = raw;
+  codec->inflater_ready = codec->deflater_ready = 0;
+
+  return codec;
+}
+
+void
+libspectrum_zlib_codec_free( libspectrum_zlib_codec *codec )
+{
+  if( !codec ) return;
+
+  if( codec->inflater_ready ) inflateEnd( &codec->inflater );
+  if( codec->deflater_ready ) deflateEnd( &codec->deflater );
+
+  libspectrum_free( codec );
+}
+
+/* Get the codec's inflate state ready for a new block of data */
+static libspectrum_error
+codec_inflater( libspectrum_zlib_codec *codec )
+{
+  z_stream *stream = &codec->inflater;
+  int error;
+
+  if( codec->inflater_ready ) {
+    error = inflateReset( stream );
+  } else {
+    stream->zalloc = Z_NULL; stream->zfree = Z_NULL;
+    stream->opaque = Z_NULL;
+    stream->next_in = Z_NULL; stream->avail_in = 0;
+    error = inflateInit2( stream, codec->raw ? -MAX_WBITS : MAX_WBITS );
+    codec->inflater_ready = error == Z_OK;
+  }
+
+  if( error != Z_OK ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+                             "%s: error from inflateInit2", __func__ );
+    return LIBSPECTRUM_ERROR_MEMORY;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* As libspectrum_zlib_inflate, but reusing the codec's inflate state */
+libspectrum_error
+libspectrum_zlib_codec_inflate( libspectrum_zlib_codec *codec,
+                                const libspectrum_byte *gzptr,
+                                size_t gzlength, libspectrum_byte **outptr,
+                                size_t *outlength )
+{
+  libspectrum_error error;
+
+  error = codec_inflater( codec ); if( error ) return error;
+
+  return inflate_all( &codec->inflater, gzptr, gzlength, outptr, outlength,
+                      0 );
+}
+
+/* As libspectrum_zlib_inflate_into, but reusing the codec's inflate state */
+libspectrum_error
+libspectrum_zlib_codec_inflate_into( libspectrum_zlib_codec *codec,
+                                     const libspectrum_byte *gzptr,
+                                     size_t gzlength,
+                                     libspectrum_byte *outptr,
+                                     size_t *outlength )
+{
+  libspectrum_error error;
+
+  error = codec_inflater( codec ); if( error ) return error;
+
+  return inflate_into( &codec->inflater, gzptr, gzlength, outptr,
+                       outlength );
+}
+
+/* As libspectrum_zlib_compress2, but reusing the codec's deflate state */
+libspectrum_error
+libspectrum_zlib_codec_deflate( libspectrum_zlib_codec *codec,
+                                const libspectrum_byte *data, size_t length,
+                                libspectrum_byte **gzptr, size_t *gzlength )
+{
+  z_stream *stream = &codec->deflater;
+  int gzret, level, strategy;
+
+  *gzptr = NULL;
+
+  if( codec->deflater_ready ) {
+    gzret = deflateReset( stream );
+  } else {
+    compression_profile( codec->flags, &level, &strategy );
+    stream->zalloc = Z_NULL; stream->zfree = Z_NULL;
+    stream->opaque = Z_NULL;
+    gzret = deflateInit2( stream, level, Z_DEFLATED,
+                          codec->raw ? -MAX_WBITS : MAX_WBITS, 8, strategy );
+    codec->deflater_ready = gzret == Z_OK;
+  }
+
+  if( gzret == Z_OK )
+    gzret = deflate_all( stream, data, length, gzptr, gzlength );
+
+  return deflate_error( gzret, gzptr );
+}
+
+/*
+ * Inflating data a little at a time
+ */
+
+/* How much inflated data a window keeps */
+#define WINDOW_SIZE 0x10000
+
+/* How often to save the state of the inflater so we can come back to it
+   without starting again from the beginning */
+#define WINDOW_CHECKPOINT_INTERVAL 0x400000
+
+typedef struct window_checkpoint {
+  size_t offset;		/* The offset of the inflated data */
+  z_stream stream;		/* The inflater at that point */
+} window_checkpoint;
+
+/* A stretch of the inflated data and the inflater which carries on from
+   it. Each is allocated on its own, as zlib won't use a stream which has
+   moved since it was made */
+typedef struct window_view {
+  z_stream stream;		/* Inflates the data after `data' */
+  int ended;			/* Has `stream' reached the end of the data? */
+
+  libspectrum_byte *data;	/* WINDOW_SIZE bytes of inflated data */
+  size_t start;			/* The offset of data[0] */
+  size_t length;		/* How many bytes of `data' are valid */
+} window_view;
+
+struct libspectrum_zlib_window {
+
+  libspectrum_byte *compressed;	/* Our own copy of the deflated data */
+  size_t compressed_length;
+
+  window_view *view;		/* The data being played */
+
+  /* While peeking, data beyond `view' is read into here instead, so
+     `view' keeps the data the real position still needs */
+  int peeking;
+  window_view *ahead;		/* NULL until first needed */
+
+  /* Checkpoint n is at offset ( n + 1 ) * WINDOW_CHECKPOINT_INTERVAL */
+  window_checkpoint **checkpoints;
+  size_t checkpoint_count;
+
+};
+
+libspectrum_error
+libspectrum_zlib_window_alloc( libspectrum_zlib_window **window,
+                               const libspectrum_byte *data, size_t length )
+{
+  libspectrum_zlib_window *w;
+  window_view *view;
+  int error;
+
+  w = libspectrum_new( libspectrum_zlib_window, 1 );
+
+  w->compressed = libspectrum_new( libspectrum_byte, length );
+  memcpy( w->compressed, data, length );
+  w->compressed_length = length;
+
+  view = libspectrum_new( window_view, 1 );
+  view->stream.zalloc = Z_NULL; view->stream.zfree = Z_NULL;
+  view->stream.opaque = Z_NULL;
+  view->stream.next_in = w->compressed; view->stream.avail_in = length;
+
+  error = inflateInit( &view->stream );
+  if( error != Z_OK ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+                             "error from inflateInit: %s",
+                             view->stream.msg ? view->stream.msg : "unknown" );
+    libspectrum_free( view );
+    libspectrum_free( w->compressed );
+    libspectrum_free( w );
+    return LIBSPECTRUM_ERROR_MEMORY;
+  }
+
+  view->ended = 0;
+
+  view->data = libspectrum_new( libspectrum_byte, WINDOW_SIZE );
+  view->start = view->length = 0;
+
+  w->view = view;
+  w->peeking = 0;
+  w->ahead = NULL;
+
+  w->checkpoints = NULL;
+  w->checkpoint_count = 0;
+
+  *window = w;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static void
+window_view_free( window_view *view )
+{
+  inflateEnd( &view->stream );
+  libspectrum_free( view->data );
+  libspectrum_free( view );
+}
+
+void
+libspectrum_zlib_window_free( libspectrum_zlib_window *window )
+{
+  size_t i;
+
+  for( i = 0; i < window->checkpoint_count; i++ ) {
+    inflateEnd( &window->checkpoints[i]->stream );
+    libspectrum_free( window->checkpoints[i] );
+  }
+  libspectrum_free( window->checkpoints );
+
+  window_view_free( window->view );
+  if( window->ahead ) window_view_free( window->ahead );
+  libspectrum_free( window->compressed );
+  libspectrum_free( window );
+}
+
+/* Start or stop peeking at the data */
+void
+libspectrum_zlib_window_set_peeking( libspectrum_zlib_window *window,
+                                     int peeking )
+{
+  window->peeking = peeking;
+}
+
+/* Go back to the last point at or before `offset' we can inflate from */
+static libspectrum_error
+window_rewind( libspectrum_zlib_window *window, window_view *view,
+               size_t offset )
+{
+  size_t i = offset / WINDOW_CHECKPOINT_INTERVAL;
+  int error;
+
+  if( i > window->checkpoint_count ) i = window->checkpoint_count;
+
+  if( i ) {
+    inflateEnd( &view->stream );
+    error = inflateCopy( &view->stream, &window->checkpoints[ i - 1 ]->stream );
+    view->start = window->checkpoints[ i - 1 ]->offset;
+  } else {
+    error = inflateReset( &view->stream );
+    view->stream.next_in = window->compressed;
+    view->stream.avail_in = window->compressed_length;
+    view->start = 0;
+  }
+
+  if( error != Z_OK ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+                             "%s: couldn't restart inflation", __func__ );
+    return LIBSPECTRUM_ERROR_MEMORY;
+  }
+
+  view->length = 0;
+  view->ended = 0;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Save the state of the inflater if we've just reached a new checkpoint */
+static libspectrum_error
+window_checkpoint_save( libspectrum_zlib_window *window, window_view *view )
+{
+  window_checkpoint *checkpoint;
+  size_t offset = view->start + view->length;
+
+  if( offset !=
+      ( window->checkpoint_count + 1 ) * WINDOW_CHECKPOINT_INTERVAL )
+    return LIBSPECTRUM_ERROR_NONE;
+
+  checkpoint = libspectrum_new( window_checkpoint, 1 );
+
+  if( inflateCopy( &checkpoint->stream, &view->stream ) != Z_OK ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+                             "%s: couldn't save inflater", __func__ );
+    libspectrum_free( checkpoint );
+    return LIBSPECTRUM_ERROR_MEMORY;
+  }
+  checkpoint->offset = offset;
+
+  window->checkpoints = libspectrum_renew( window_checkpoint*,
+                                           window->checkpoints,
+                                           window->checkpoint_count + 1 );
+  window->checkpoints[ window->checkpoint_count++ ] = checkpoint;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Throw away everything before `offset' and fill the rest of the view */
+static libspectrum_error
+window_fill( libspectrum_zlib_window *window, window_view *view,
+             size_t offset )
+{
+  size_t drop, space, boundary, position;
+  libspectrum_error error;
+  int zerror;
+
+  while( 1 ) {
+
+    drop = offset - view->start;
+    if( drop > view->length ) drop = view->length;
+    if( drop ) {
+      memmove( view->data, view->data + drop, view->length - drop );
+      view->start += drop; view->length -= drop;
+    }
+
+    if( view->length == WINDOW_SIZE || view->ended ) break;
+
+    /* Stop at the next checkpoint so we can save the inflater there */
+    position = view->start + view->length;
+    space = WINDOW_SIZE - view->length;
+    boundary =
+      ( window->checkpoint_count + 1 ) * WINDOW_CHECKPOINT_INTERVAL;
+    if( position < boundary && boundary - position < space )
+      space = boundary - position;
+
+    view->stream.next_out = view->data + view->length;
+    view->stream.avail_out = space;
+
+    zerror = inflate( &view->stream, Z_NO_FLUSH );
+    view->length += space - view->stream.avail_out;
+
+    switch( zerror ) {
+
+    case Z_OK: break;
+
+    case Z_STREAM_END: view->ended = 1; break;
+
+    case Z_BUF_ERROR:
+      /* No progress possible: we've run out of input */
+      libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                               "zlib data is truncated" );
+      return LIBSPECTRUM_ERROR_CORRUPT;
+
+    case Z_MEM_ERROR:
+      libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+                               "out of memory at %s:%d", __FILE__, __LINE__ );
+      return LIBSPECTRUM_ERROR_MEMORY;
+
+    default:
+      libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                               "corrupt zlib data" );
+      return LIBSPECTRUM_ERROR_CORRUPT;
+
+    }
+
+    error = window_checkpoint_save( window, view );
+    if( error ) return error;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Does `view' already hold `wanted' bytes from `offset', or everything
+   there is from there? */
+static int
+window_view_holds( window_view *view, size_t offset, size_t wanted )
+{
+  return offset >= view->start &&
+         ( offset + wanted <= view->start + view->length || view->ended );
+}
+
+/* Is `ahead' somewhere we can carry on reading `offset' from, and no
+   further back than `view'? */
+static int
+window_view_ahead( window_view *ahead, window_view *view, size_t offset )
+{
+  return ahead && offset >= ahead->start &&
+         ahead->start + ahead->length >= view->start + view->length;
+}
+
+/* Make `window->ahead' somewhere to read `offset' from without moving
+   `window->view', starting from a copy of `window->view' if need be */
+static libspectrum_error
+window_read_ahead( libspectrum_zlib_window *window, size_t offset )
+{
+  window_view *view = window->view, *ahead = window->ahead;
+
+  if( window_view_ahead( ahead, view, offset ) )
+    return LIBSPECTRUM_ERROR_NONE;
+
+  if( ahead ) {
+    inflateEnd( &ahead->stream );
+  } else {
+    ahead = libspectrum_new( window_view, 1 );
+    ahead->data = libspectrum_new( libspectrum_byte, WINDOW_SIZE );
+  }
+
+  if( inflateCopy( &ahead->stream, &view->stream ) != Z_OK ) {
+    libspectrum_free( ahead->data );
+    libspectrum_free( ahead );
+    window->ahead = NULL;
+    libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+                             "%s: couldn't copy inflater", __func__ );
+    return LIBSPECTRUM_ERROR_MEMORY;
+  }
+
+  memcpy( ahead->data, view->data, view->length );
+  ahead->start = view->start; ahead->length = view->length;
+  ahead->ended = view->ended;
+
+  window->ahead = ahead;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Get at least `wanted' bytes of the inflated data starting at `offset'
+   into `*data', or as much as there is if the data ends before then;
+   `*available' is set to the number of bytes there */
+libspectrum_error
+libspectrum_zlib_window_get( const libspectrum_byte **data, size_t *available,
+                             libspectrum_zlib_window *window, size_t offset,
+                             size_t wanted )
+{
+  window_view *view = window->view;
+  libspectrum_error error;
+
+  if( wanted > WINDOW_SIZE ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
+                             "%s: %lu bytes is more than the window holds",
+                             __func__, (unsigned long)wanted );
+    return LIBSPECTRUM_ERROR_LOGIC;
+  }
+
+  if( !window_view_holds( view, offset, wanted ) ) {
+    if( window->peeking ) {
+      /* Leave the data being played alone */
+      error = window_read_ahead( window, offset );
+      if( error ) return error;
+      view = window->ahead;
+    } else if( window_view_ahead( window->ahead, view, offset ) ) {
+      /* An earlier peek has already inflated this far, so play from there */
+      window->view = window->ahead;
+      window->ahead = view;
+      view = window->view;
+    }
+  }
+
+  if( offset < view->start ) {
+    error = window_rewind( window, view, offset );
+    if( error ) return error;
+  }
+
+  if( !window_view_holds( view, offset, wanted ) ) {
+    error = window_fill( window, view, offset );
+    if( error ) return error;
+  }
+
+  if( offset < view->start + view->length ) {
+    *data = view->data + ( offset - view->start );
+    *available = view->start + view->length - offset;
+  } else {
+    *data = NULL;
+    *available = 0;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/*
+ * Deflating data a little at a time
+ */
+
+/* How much deflated data to collect before passing it on */
+#define DEFLATER_CHUNK_SIZE 0x4000
+
+struct libspectrum_zlib_deflater {
+
+  z_stream stream;
+
+  libspectrum_zlib_output output; /* Where the deflated data goes */
+  void *context;
+
+  libspectrum_byte chunk[ DEFLATER_CHUNK_SIZE ];
+
+};
+
+libspectrum_error
+libspectrum_zlib_deflater_alloc( libspectrum_zlib_deflater **deflater,
+                                 int flags, libspectrum_zlib_output output,
+                                 void *context )
+{
+  libspectrum_zlib_deflater *d = libspectrum_new( libspectrum_zlib_deflater, 1 );
+  int level, strategy;
+
+  compression_profile( flags, &level, &strategy );
+
+  d->stream.zalloc = Z_NULL; d->stream.zfree = Z_NULL;
+  d->stream.opaque = Z_NULL;
+
+  if( deflateInit2( &d->stream, level, Z_DEFLATED, MAX_WBITS, 8,
+                    strategy ) != Z_OK ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+                             "%s: error from deflateInit", __func__ );
+    libspectrum_free( d );
+    return LIBSPECTRUM_ERROR_MEMORY;
+  }
+
+  d->output = output;
+  d->context = context;
+
+  *deflater = d;
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+void
+libspectrum_zlib_deflater_free( libspectrum_zlib_deflater *deflater )
+{
+  deflateEnd( &deflater->stream );
+  libspectrum_free( deflater );
+}
+
+/* Deflate `length' bytes at `data', passing on any deflated data which is
+   ready; if `finish' is set, this is the end of the data */
+libspectrum_error
+libspectrum_zlib_deflater_write( libspectrum_zlib_deflater *deflater,
+                                 const libspectrum_byte *data, size_t length,
+                                 int finish )
+{
+  z_stream *stream = &deflater->stream;
+  libspectrum_error error;
+  int zerror;
+
+  stream->next_in = data;
+  stream->avail_in = length;
+
+  do {
+
+    stream->next_out = deflater->chunk;
+    stream->avail_out = DEFLATER_CHUNK_SIZE;
+
+    zerror = deflate( stream, finish ? Z_FINISH : Z_NO_FLUSH );
+    if( zerror == Z_STREAM_ERROR ) {
+      libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
+                               "%s: error from deflate", __func__ );
+      return LIBSPECTRUM_ERROR_LOGIC;
+    }
+
+    if( stream->avail_out != DEFLATER_CHUNK_SIZE ) {
+      error = deflater->output( deflater->chunk,
+                                DEFLATER_CHUNK_SIZE - stream->avail_out,
+                                deflater->context );
+      if( error ) return error;
+    }
+
+  } while( stream->avail_out == 0 || ( finish && zerror != Z_STREAM_END ) );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
@@ -32,12 +32,20 @@
 
 #include "internals.h"
 
+/* State shared by all the chunks in one file */
+typedef struct zxs_context {
+
+  int compression;		/* Are the RAM pages compressed? */
+  libspectrum_zlib_codec *codec;
+
+} zxs_context;
+
 static libspectrum_error
-read_chunk( libspectrum_snap *snap, const libspectrum_byte **buffer,
-	    const libspectrum_byte *end );
+read_chunk( libspectrum_snap *snap, zxs_context *ctx,
+	    const libspectrum_byte **buffer, const libspectrum_byte *end );
 
 typedef libspectrum_error (*read_chunk_fn)( libspectrum_snap *snap,
-					    int *compression,
+					    zxs_context *ctx,
 					    const libspectrum_byte **buffer,
 					    const libspectrum_byte *end,
 					    size_t data_length,
@@ -45,15 +53,15 @@ typedef libspectrum_error (*read_chunk_fn)( libspectrum_snap *snap,
 
 static libspectrum_error
 inflate_block( libspectrum_byte **uncompressed, size_t *uncompressed_length,
-	       const libspectrum_byte **compressed, size_t compressed_length )
+	       const libspectrum_byte **compressed, size_t compressed_length,
+	       libspectrum_zlib_codec *codec )
 {
 
 #ifdef HAVE_ZLIB_H
 
   libspectrum_dword header_length, expected_crc32, actual_crc32;
-  libspectrum_byte *zlib_buffer;
-  unsigned long actual_length;
-  int error;
+  size_t actual_length;
+  libspectrum_error error;
 
   /* First, look at the compression header */
   header_length = libspectrum_read_dword( compressed );
@@ -68,44 +76,24 @@ inflate_block( libspectrum_byte **uncompressed, size_t *uncompressed_length,
   expected_crc32 = libspectrum_read_dword( compressed );
   *uncompressed_length = libspectrum_read_dword( compressed );
 
-  /* Some space to put the zlib header for decompression */
-  zlib_buffer = libspectrum_new( libspectrum_byte, ( compressed_length + 6 ) );
-
-  /* zlib's header */
-  zlib_buffer[0] = 0x78; zlib_buffer[1] = 0xda;
-
-  memcpy( &zlib_buffer[2], *compressed, compressed_length );
-  *compressed += compressed_length;
-
-  *uncompressed = libspectrum_new( libspectrum_byte, *uncompressed_length );
-
+  /* The data is a raw deflate stream, with no zlib header or checksum */
   actual_length = *uncompressed_length;
-  error = uncompress( *uncompressed, &actual_length, zlib_buffer,
-		      compressed_length + 6 );
-
-  /* At this point, we expect to get a Z_DATA_ERROR, as we don't have
-     the Adler-32 checksum of the data. There is a 1 in 65521 chance
-     that the random bytes will match, so we might (very rarely) get
-     Z_OK */
-  if( error != Z_DATA_ERROR && error != Z_OK ) {
-    libspectrum_free( *uncompressed ); libspectrum_free( zlib_buffer );
-    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
-			     "zxs_inflate_block: unexpected zlib error" );
-    return LIBSPECTRUM_ERROR_CORRUPT;
-  }
+  error = libspectrum_zlib_codec_inflate( codec, *compressed,
+					  compressed_length, uncompressed,
+					  &actual_length );
+  *compressed += compressed_length;
+  if( error ) return error;
 
   if( *uncompressed_length != actual_length ) {
-    libspectrum_free( *uncompressed ); libspectrum_free( zlib_buffer );
+    libspectrum_free( *uncompressed );
     libspectrum_print_error(
       LIBSPECTRUM_ERROR_CORRUPT,
       "zxs_inflate_block: block expanded to 0x%04lx, not the expected 0x%04lx bytes",
-      actual_length, (unsigned long)*uncompressed_length
+      (unsigned long)actual_length, (unsigned long)*uncompressed_length
     );
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  libspectrum_free( zlib_buffer );
-
   actual_crc32 = crc32( 0, Z_NULL, 0 );
   actual_crc32 = crc32( actual_crc32, *uncompressed, *uncompressed_length );
 
@@ -131,7 +119,7 @@ inflate_block( libspectrum_byte **uncompressed, size_t *uncompressed_length,
 }
 
 static libspectrum_error
-read_riff_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
+read_riff_chunk( libspectrum_snap *snap, zxs_context *ctx,
 		 const libspectrum_byte **buffer, const libspectrum_byte *end,
 		 size_t data_length GCC_UNUSED, int parameter GCC_UNUSED)
 {
@@ -156,7 +144,7 @@ read_riff_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
   }
 
   while( *buffer < end ) {
-    error = read_chunk( snap, buffer, end );
+    error = read_chunk( snap, ctx, buffer, end );
     if( error ) return error;
   }
 
@@ -164,7 +152,7 @@ read_riff_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
 }
 
 static libspectrum_error
-read_fmtz_chunk( libspectrum_snap *snap, int *compression,
+read_fmtz_chunk( libspectrum_snap *snap, zxs_context *ctx,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED,
 		 size_t data_length, int parameter GCC_UNUSED )
@@ -214,20 +202,21 @@ read_fmtz_chunk( libspectrum_snap *snap, int *compression,
 
   *buffer += 2;			/* Skip hardware flags */
 
-  *compression = libspectrum_read_word( buffer );
+  ctx->compression = libspectrum_read_word( buffer );
 
-  switch( *compression ) {
+  switch( ctx->compression ) {
 
   case 0x0008:			/* Deflation */
-    *compression = 1; break;
+    ctx->compression = 1; break;
 
   case 0xffff:			/* Not compressed */
-    *compression = 0; break;
+    ctx->compression = 0; break;
 
   default:
     libspectrum_print_error(
       LIBSPECTRUM_ERROR_UNKNOWN,
-      "zxs_read_fmtz_chunk: unknown compression type 0x%04x", *compression
+      "zxs_read_fmtz_chunk: unknown compression type 0x%04x",
+      ctx->compression
     );
     return LIBSPECTRUM_ERROR_UNKNOWN;
   }
@@ -236,7 +225,7 @@ read_fmtz_chunk( libspectrum_snap *snap, int *compression,
 }
 
 static libspectrum_error
-read_rz80_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
+read_rz80_chunk( libspectrum_snap *snap, zxs_context *ctx GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED,
 		 size_t data_length, int parameter GCC_UNUSED )
@@ -277,7 +266,7 @@ read_rz80_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
 }
 
 static libspectrum_error
-read_r048_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
+read_r048_chunk( libspectrum_snap *snap, zxs_context *ctx GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED,
 		 size_t data_length, int parameter GCC_UNUSED )
@@ -298,7 +287,7 @@ read_r048_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
 }
 
 static libspectrum_error
-read_r128_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
+read_r128_chunk( libspectrum_snap *snap, zxs_context *ctx GCC_UNUSED,
 		 const libspectrum_byte **buffer,
 		 const libspectrum_byte *end GCC_UNUSED,
 		 size_t data_length, int parameter GCC_UNUSED )
@@ -323,7 +312,7 @@ read_r128_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
 }
 
 static libspectrum_error
-read_rplus3_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
+read_rplus3_chunk( libspectrum_snap *snap, zxs_context *ctx GCC_UNUSED,
 		   const libspectrum_byte **buffer,
 		   const libspectrum_byte *end GCC_UNUSED, size_t data_length,
 		   int parameter GCC_UNUSED )
@@ -341,7 +330,7 @@ read_rplus3_chunk( libspectrum_snap *snap, int *compression GCC_UNUSED,
 }
 
 static libspectrum_error
-read_ram_chunk( libspectrum_snap *snap, int *compression,
+read_ram_chunk( libspectrum_snap *snap, zxs_context *ctx,
 		const libspectrum_byte **buffer,
 		const libspectrum_byte *end GCC_UNUSED,
 		size_t data_length, int parameter )
@@ -350,10 +339,10 @@ read_ram_chunk( libspectrum_snap *snap, int *compression,
   libspectrum_byte *buffer2; size_t uncompressed_length;
   libspectrum_error error;
 
-  if( *compression ) {
+  if( ctx->compression ) {
 
     error = inflate_block( &buffer2, &uncompressed_length,
-			   buffer, data_length );
+			   buffer, data_length, ctx->codec );
     if( error ) return error;
 
     if( uncompressed_length != 0x4000 ) {
@@ -386,7 +375,7 @@ read_ram_chunk( libspectrum_snap *snap, int *compression,
 }
 
 static libspectrum_error
-skip_chunk( libspectrum_snap *snap GCC_UNUSED, int *compression GCC_UNUSED,
+skip_chunk( libspectrum_snap *snap GCC_UNUSED, zxs_context *ctx GCC_UNUSED,
 	    const libspectrum_byte **buffer,
 	    const libspectrum_byte *end GCC_UNUSED,
 	    size_t data_length, int parameter GCC_UNUSED )
@@ -445,14 +434,13 @@ read_chunk_header( char *id, libspectrum_dword *data_length,
 }
 
 static libspectrum_error
-read_chunk( libspectrum_snap *snap, const libspectrum_byte **buffer,
-	    const libspectrum_byte *end )
+read_chunk( libspectrum_snap *snap, zxs_context *ctx,
+	    const libspectrum_byte **buffer, const libspectrum_byte *end )
 {
   char id[5];
   libspectrum_dword data_length;
   libspectrum_error error;
   size_t i; int done;
-  int compression;
 
   error = read_chunk_header( id, &data_length, buffer, end );
   if( error ) return error;
@@ -470,7 +458,7 @@ read_chunk( libspectrum_snap *snap, const libspectrum_byte **buffer,
   for( i = 0; !done && i < ARRAY_SIZE( read_chunks ); i++ ) {
 
     if( !strcmp( id, read_chunks[i].id ) ) {
-      error = read_chunks[i].function( snap, &compression, buffer, end,
+      error = read_chunks[i].function( snap, ctx, buffer, end,
 				       data_length, read_chunks[i].parameter );
       if( error ) return error;
       done = 1;
@@ -494,11 +482,24 @@ libspectrum_zxs_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
 		      size_t length )
 {
   libspectrum_error error;
+  zxs_context ctx;
 
   /* Set machine type in case it's not set later */
   libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_48 );
 
-  error = read_chunk( snap, &buffer, buffer + length );
+  ctx.compression = 0;
+#ifdef HAVE_ZLIB_H
+  ctx.codec = libspectrum_zlib_codec_alloc( 0, 1 );
+#else				/* #ifdef HAVE_ZLIB_H */
+  ctx.codec = NULL;
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+  error = read_chunk( snap, &ctx, &buffer, buffer + length );
+
+#ifdef HAVE_ZLIB_H
+  libspectrum_zlib_codec_free( ctx.codec );
+#endif				/* #ifdef HAVE_ZLIB_H */
+
   if( error ) {
 
     /* Tidy up any RAM pages we may have allocated */